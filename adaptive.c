@@ -0,0 +1,325 @@
+#include "adaptive.h"
+#include "mem.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Score map work shared by the threads, rows are handed out in tiles */
+typedef struct
+{
+    const unsigned char *pixels;
+    const BmpInfo *bmp;
+    unsigned char *map;
+    int simd;
+    uint tiles;
+    uint next_tile;
+    pthread_mutex_t lock;
+} MapWork;
+
+/* Function Definitions */
+
+/* Sobel score of one byte, c is the distance to the same channel of the next pixel */
+static unsigned char sobel_byte(const unsigned char *up, const unsigned char *mid, const unsigned char *down, int x, int c)
+{
+    int ul = up[x - c] >> 1, u = up[x] >> 1, ur = up[x + c] >> 1;
+    int ml = mid[x - c] >> 1, mr = mid[x + c] >> 1;
+    int dl = down[x - c] >> 1, d = down[x] >> 1, dr = down[x + c] >> 1;
+
+    int gx = (ur + 2 * mr + dr) - (ul + 2 * ml + dl);
+    int gy = (dl + 2 * d + dr) - (ul + 2 * u + ur);
+    return (unsigned char)(((gx < 0 ? -gx : gx) + (gy < 0 ? -gy : gy)) >> 2);
+}
+
+#ifdef __SSE2__
+/* 7 high bits of 16 bytes */
+static inline __m128i high_bits(const unsigned char *p)
+{
+    return _mm_and_si128(_mm_srli_epi16(_mm_loadu_si128((const __m128i *)p), 1), _mm_set1_epi8(0x7F));
+}
+
+/* Scores of bytes x .. x + 15, same arithmetic as sobel_byte on 16 bit lanes */
+static void sobel_16(const unsigned char *up, const unsigned char *mid, const unsigned char *down, int x, int c,
+                     unsigned char *out)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i v[8] = {high_bits(up + x - c), high_bits(up + x), high_bits(up + x + c),
+                    high_bits(mid + x - c), high_bits(mid + x + c),
+                    high_bits(down + x - c), high_bits(down + x), high_bits(down + x + c)};
+    __m128i score[2];
+
+    for (int h = 0; h < 2; h++)
+    {
+        __m128i w[8];
+        for (int k = 0; k < 8; k++)
+        {
+            w[k] = h ? _mm_unpackhi_epi8(v[k], zero) : _mm_unpacklo_epi8(v[k], zero);
+        }
+        // w : 0 ul, 1 u, 2 ur, 3 ml, 4 mr, 5 dl, 6 d, 7 dr
+        __m128i gx = _mm_sub_epi16(_mm_add_epi16(_mm_add_epi16(w[2], _mm_slli_epi16(w[4], 1)), w[7]),
+                                   _mm_add_epi16(_mm_add_epi16(w[0], _mm_slli_epi16(w[3], 1)), w[5]));
+        __m128i gy = _mm_sub_epi16(_mm_add_epi16(_mm_add_epi16(w[5], _mm_slli_epi16(w[6], 1)), w[7]),
+                                   _mm_add_epi16(_mm_add_epi16(w[0], _mm_slli_epi16(w[1], 1)), w[2]));
+        gx = _mm_max_epi16(gx, _mm_sub_epi16(zero, gx));
+        gy = _mm_max_epi16(gy, _mm_sub_epi16(zero, gy));
+        score[h] = _mm_srli_epi16(_mm_add_epi16(gx, gy), 2);
+    }
+    _mm_storeu_si128((__m128i *)(out + x), _mm_packus_epi16(score[0], score[1]));
+}
+#endif
+
+/* Scores of one row, its first and last pixel are left at 0 */
+static void map_row(MapWork *work, uint y)
+{
+    const BmpInfo *bmp = work->bmp;
+    int c = bmp->bpp / 8;
+    int row_bytes = bmp->width * c;
+    unsigned char *out = work->map + (size_t)y * bmp->row_stride;
+
+    memset(out, 0, bmp->row_stride);
+    if (y == 0 || y + 1 >= bmp->height || bmp->width < 3)
+    {
+        return;
+    }
+    const unsigned char *up = work->pixels + (size_t)(y - 1) * bmp->row_stride;
+    const unsigned char *mid = up + bmp->row_stride;
+    const unsigned char *down = mid + bmp->row_stride;
+
+    int x = c;
+#ifdef __SSE2__
+    if (work->simd)
+    {
+        for (; x + 16 <= row_bytes - c; x += 16)
+        {
+            sobel_16(up, mid, down, x, c, out);
+        }
+    }
+#endif
+    for (; x < row_bytes - c; x++)
+    {
+        out[x] = sobel_byte(up, mid, down, x, c);
+    }
+}
+
+/* Thread body, takes tiles until none are left */
+static void *map_worker(void *arg)
+{
+    MapWork *work = arg;
+    for (;;)
+    {
+        pthread_mutex_lock(&work->lock);
+        uint t = work->next_tile++;
+        pthread_mutex_unlock(&work->lock);
+        if (t >= work->tiles)
+        {
+            return NULL;
+        }
+        uint end = (t + 1) * ADAPTIVE_TILE_ROWS;
+        for (uint y = t * ADAPTIVE_TILE_ROWS; y < end && y < work->bmp->height; y++)
+        {
+            map_row(work, y);
+        }
+    }
+}
+
+AdaptiveStatus adaptive_gradient_map(const unsigned char *pixels, const BmpInfo *bmp, unsigned char *map,
+                                     int threads, int simd)
+{
+    MapWork work = {.pixels = pixels,
+                    .bmp = bmp,
+                    .map = map,
+                    .simd = simd,
+                    .tiles = (bmp->height + ADAPTIVE_TILE_ROWS - 1) / ADAPTIVE_TILE_ROWS};
+
+    if (threads < 1)
+    {
+        threads = 1;
+    }
+    pthread_mutex_init(&work.lock, NULL);
+    pthread_t tid[threads];
+    int started = 0;
+    for (int t = 1; t < threads && (uint)t < work.tiles; t++)
+    {
+        if (pthread_create(&tid[started], NULL, map_worker, &work) == 0)
+        {
+            started++;
+        }
+    }
+    map_worker(&work);
+    for (int t = 0; t < started; t++)
+    {
+        pthread_join(tid[t], NULL);
+    }
+    pthread_mutex_destroy(&work.lock);
+    return ad_success;
+}
+
+/*
+ * Select the embedding bytes
+ * Description: The score map is built on all online CPUs, then walked
+ * twice, once to count the selected bytes and once to store them
+ */
+uint adaptive_select(const unsigned char *image, uint len, uint first, uint threshold, uint **positions)
+{
+    BmpInfo bmp;
+
+    *positions = NULL;
+    if (len < BMP_HEADER_SIZE || !bmp_parse_header(image, &bmp) || !bmp_pixels_fit(&bmp, len))
+    {
+        return 0;
+    }
+
+    // Step 1 : score map
+    size_t pixel_bytes = (size_t)bmp.row_stride * bmp.height;
+    unsigned char *map = mem_alloc(pixel_bytes + 1);
+    if (map == NULL)
+    {
+        return 0;
+    }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    adaptive_gradient_map(image + bmp.pixel_offset, &bmp, map, threads, 1);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    // Step 2 : count, then store the offsets of the selected bytes
+    size_t from = first > bmp.pixel_offset ? first - bmp.pixel_offset : 0;
+    uint count = 0;
+    for (size_t i = from; i < pixel_bytes; i++)
+    {
+        count += map[i] >= threshold;
+    }
+    *positions = mem_alloc(((size_t)count + 1) * sizeof(uint));
+    if (*positions == NULL)
+    {
+        mem_free(map);
+        return 0;
+    }
+    for (size_t i = from, n = 0; i < pixel_bytes; i++)
+    {
+        if (map[i] >= threshold)
+        {
+            (*positions)[n++] = bmp.pixel_offset + (uint)i;
+        }
+    }
+    mem_free(map);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("Gradient map : %.1f MB in %.3f s (%.1f MB/s, %d threads), %u of %zu bytes selected at threshold %u\n",
+           pixel_bytes / 1e6, seconds, seconds > 0 ? pixel_bytes / 1e6 / seconds : 0.0, threads,
+           count, pixel_bytes - from, threshold);
+    return count;
+}
+
+unsigned char *adaptive_read_image(FILE *fptr, uint *len)
+{
+    size_t size = 0, cap = 1 << 20;
+    unsigned char *image = mem_alloc(cap);
+
+    if (image == NULL || fseek(fptr, 0, SEEK_SET) != 0)
+    {
+        mem_free(image);
+        return NULL;
+    }
+    for (;;)
+    {
+        size += fread(image + size, 1, cap - size, fptr);
+        if (size < cap)
+        {
+            break;
+        }
+        unsigned char *grown = cap < (1u << 31) ? mem_realloc(image, cap * 2) : NULL;
+        if (grown == NULL)
+        {
+            mem_free(image);
+            return NULL;
+        }
+        image = grown;
+        cap *= 2;
+    }
+    *len = (uint)size;
+    return image;
+}
+
+/*
+ * Run --bench-adaptive
+ * Description: Times the score map scalar on one thread, SIMD on one
+ * thread and SIMD on all CPUs (best of a few runs each), and shows how
+ * much of the image the threshold keeps
+ */
+AdaptiveStatus do_bench_adaptive(char *argv[])
+{
+    if (argv[2] == NULL)
+    {
+        printf("Give the image --> ./a.out --bench-adaptive <image.bmp> [threshold]\n");
+        return ad_failure;
+    }
+    uint threshold = argv[3] != NULL ? (uint)atoi(argv[3]) : ADAPTIVE_DEFAULT_T;
+
+    FILE *fptr = fopen(argv[2], "rb");
+    if (fptr == NULL)
+    {
+        perror(argv[2]);
+        return ad_failure;
+    }
+    uint len;
+    unsigned char *image = adaptive_read_image(fptr, &len);
+    fclose(fptr);
+
+    BmpInfo bmp;
+    if (image == NULL || len < BMP_HEADER_SIZE || !bmp_parse_header(image, &bmp) || !bmp_pixels_fit(&bmp, len))
+    {
+        printf("%s is not a 24 / 32 bit BMP\n", argv[2]);
+        mem_free(image);
+        return ad_failure;
+    }
+    size_t pixel_bytes = (size_t)bmp.row_stride * bmp.height;
+    unsigned char *map = mem_alloc(pixel_bytes + 1);
+    if (map == NULL)
+    {
+        mem_free(image);
+        return ad_failure;
+    }
+
+    int cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    struct
+    {
+        const char *name;
+        int threads, simd;
+    } runs[] = {{"scalar", 1, 0}, {"simd", 1, 1}, {"simd", cpus, 1}};
+
+    for (int r = 0; r < 3; r++)
+    {
+        double best = 0;
+        for (int rep = 0; rep < 5; rep++)
+        {
+            struct timespec start, end;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            adaptive_gradient_map(image + bmp.pixel_offset, &bmp, map, runs[r].threads, runs[r].simd);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+            if (rep == 0 || seconds < best)
+            {
+                best = seconds;
+            }
+        }
+        printf("%-6s %2d thread(s) : %.1f MB in %.4f s (%.1f MB/s)\n", runs[r].name, runs[r].threads,
+               pixel_bytes / 1e6, best, best > 0 ? pixel_bytes / 1e6 / best : 0.0);
+    }
+
+    size_t selected = 0;
+    for (size_t i = 0; i < pixel_bytes; i++)
+    {
+        selected += map[i] >= threshold;
+    }
+    printf("Threshold %u keeps %zu of %zu bytes (%.1f%%)\n", threshold, selected, pixel_bytes,
+           100.0 * selected / pixel_bytes);
+
+    mem_free(map);
+    mem_free(image);
+    return ad_success;
+}
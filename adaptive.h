@@ -0,0 +1,43 @@
+#ifndef ADAPTIVE_H
+#define ADAPTIVE_H
+#include <stdio.h>
+
+#include "types.h" // Contains user defined types
+#include "bmp.h"   // Pixel array geometry
+
+/*
+ * Edge-adaptive embedding
+ * Every pixel array byte gets a Sobel gradient score computed from the
+ * 7 high bits of its channel and of the same channel of the 8 pixels
+ * around it. Payload bits only go to bytes whose score reaches the
+ * threshold, so flat regions stay untouched. Embedding only changes
+ * LSBs, so the decoder computes the same scores from the stego image.
+ */
+
+/* Threshold range, and the one used by a bare --adaptive */
+#define ADAPTIVE_MIN_T 1
+#define ADAPTIVE_MAX_T 255
+#define ADAPTIVE_DEFAULT_T 8
+
+/* Rows per tile handed to one worker thread */
+#define ADAPTIVE_TILE_ROWS 32
+
+/* Adaptive function prototype */
+
+/* Score map of the pixel array (row_stride * height bytes), border and padding bytes score 0 */
+AdaptiveStatus adaptive_gradient_map(const unsigned char *pixels, const BmpInfo *bmp, unsigned char *map,
+                                     int threads, int simd);
+
+/*
+ * Offsets into image of the bytes at or after first whose score reaches threshold,
+ * in file order. Returns the count, *positions is malloc'd (NULL on failure).
+ */
+uint adaptive_select(const unsigned char *image, uint len, uint first, uint threshold, uint **positions);
+
+/* Read a whole image from its start (forward reads only after the seek to 0) */
+unsigned char *adaptive_read_image(FILE *fptr, uint *len);
+
+/* Run --bench-adaptive <image.bmp> [threshold], throughput of the score map */
+AdaptiveStatus do_bench_adaptive(char *argv[]);
+
+#endif
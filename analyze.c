@@ -0,0 +1,638 @@
+#include "analyze.h"
+#include "mem.h"
+#include "bmp.h"
+#include "trace.h"
+#include "tune.h"
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * Counters of one row band
+ * hist    : byte histogram for the chi-square attack
+ * rs[0-3] : R_M, S_M, R_-M, S_-M of the image
+ * rs[4-7] : the same after flipping every LSB
+ */
+typedef struct _BandStats
+{
+    uint hist[256];
+    long rs[8];
+    long groups;
+} BandStats;
+
+/* Work shared by the threads of one image */
+typedef struct _ImageWork
+{
+    const unsigned char *pixels;
+    BmpInfo bmp;
+    BandStats band[ANALYZE_BANDS];
+    uint bands;
+    uint next_band;
+    int simd;
+    pthread_mutex_t lock;
+} ImageWork;
+
+/* Function Definitions */
+
+/* Regularized lower incomplete gamma P(a, x) by its series (x < a + 1) */
+static double gamma_p_series(double a, double x)
+{
+    double sum = 1.0 / a, term = sum;
+    for (int n = 1; n < 1000; n++)
+    {
+        term *= x / (a + n);
+        sum += term;
+        if (fabs(term) < fabs(sum) * 1e-12)
+        {
+            break;
+        }
+    }
+    return sum * exp(-x + a * log(x) - lgamma(a));
+}
+
+/* Regularized upper incomplete gamma Q(a, x) by continued fraction (x >= a + 1) */
+static double gamma_q_fraction(double a, double x)
+{
+    double b = x + 1.0 - a, c = 1e300, d = 1.0 / b, h = d;
+    for (int i = 1; i < 1000; i++)
+    {
+        double an = -i * (i - a);
+        b += 2.0;
+        d = an * d + b;
+        d = fabs(d) < 1e-300 ? 1e-300 : d;
+        c = b + an / c;
+        c = fabs(c) < 1e-300 ? 1e-300 : c;
+        d = 1.0 / d;
+        double delta = d * c;
+        h *= delta;
+        if (fabs(delta - 1.0) < 1e-12)
+        {
+            break;
+        }
+    }
+    return exp(-x + a * log(x) - lgamma(a)) * h;
+}
+
+double chi_square_p(double chi, int df)
+{
+    double a = df / 2.0, x = chi / 2.0;
+    if (df <= 0 || x <= 0.0)
+    {
+        return 1.0;
+    }
+    return x < a + 1.0 ? 1.0 - gamma_p_series(a, x) : gamma_q_fraction(a, x);
+}
+
+/* Smoothness of a group of 4 samples */
+static int rs_discrimination(int x0, int x1, int x2, int x3)
+{
+    return abs(x1 - x0) + abs(x2 - x1) + abs(x3 - x2);
+}
+
+/* Shifted LSB flip F-1 : 2k - 1 <-> 2k */
+static int flip_negative(int x)
+{
+    return ((x + 1) ^ 1) - 1;
+}
+
+#ifdef __SSE2__
+/* Smoothness of 8 groups on 16 bit lanes, same arithmetic as rs_discrimination */
+static inline __m128i rs_discrimination_8(__m128i x0, __m128i x1, __m128i x2, __m128i x3)
+{
+    __m128i d0 = _mm_sub_epi16(x1, x0), d1 = _mm_sub_epi16(x2, x1), d2 = _mm_sub_epi16(x3, x2);
+    const __m128i zero = _mm_setzero_si128();
+    d0 = _mm_max_epi16(d0, _mm_sub_epi16(zero, d0));
+    d1 = _mm_max_epi16(d1, _mm_sub_epi16(zero, d1));
+    d2 = _mm_max_epi16(d2, _mm_sub_epi16(zero, d2));
+    return _mm_add_epi16(_mm_add_epi16(d0, d1), d2);
+}
+
+/* Add the 16 bit lane counters to rs and clear them */
+static void rs_flush(__m128i acc[8], long rs[8])
+{
+    const __m128i ones = _mm_set1_epi16(1);
+    for (int k = 0; k < 8; k++)
+    {
+        int lanes[4];
+        _mm_storeu_si128((__m128i *)lanes, _mm_madd_epi16(acc[k], ones));
+        rs[k] += (long)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+        acc[k] = _mm_setzero_si128();
+    }
+}
+
+/*
+ * RS groups of one row, 16 bytes at a time
+ * Description: Loads at g, g + bpp, g + 2 bpp and g + 3 bpp put x0 .. x3
+ * of the group starting at byte i of g in lane i, so the lanes of the
+ * 3 colour channels of each group in the window count (2 groups for
+ * 24 bit, 1 for 32 bit). Returns the first pixel left to the scalar loop.
+ */
+static uint rs_row_sse2(const unsigned char *row, uint width, uint bytes_pp, long rs[8])
+{
+    uint span = 4 * bytes_pp, per_load = 16 / span + ((16 % span) >= 3);
+    uint row_bytes = width * bytes_pp;
+    unsigned short valid[16];
+    for (uint i = 0; i < 16; i++)
+    {
+        valid[i] = (i % span) < 3 && i / span < per_load ? 0xFFFF : 0;
+    }
+    const __m128i mask[2] = {_mm_loadu_si128((const __m128i *)valid), _mm_loadu_si128((const __m128i *)(valid + 8))};
+    const __m128i zero = _mm_setzero_si128(), one = _mm_set1_epi16(1);
+    __m128i acc[8];
+    for (int k = 0; k < 8; k++)
+    {
+        acc[k] = zero;
+    }
+
+    uint px = 0, pending = 0;
+    for (; (size_t)px * bytes_pp + 3 * bytes_pp + 16 <= row_bytes; px += 4 * per_load)
+    {
+        const unsigned char *g = row + (size_t)px * bytes_pp;
+        __m128i v[4] = {_mm_loadu_si128((const __m128i *)g), _mm_loadu_si128((const __m128i *)(g + bytes_pp)),
+                        _mm_loadu_si128((const __m128i *)(g + 2 * bytes_pp)),
+                        _mm_loadu_si128((const __m128i *)(g + 3 * bytes_pp))};
+        for (int h = 0; h < 2; h++)
+        {
+            __m128i x[4];
+            for (int k = 0; k < 4; k++)
+            {
+                x[k] = h ? _mm_unpackhi_epi8(v[k], zero) : _mm_unpacklo_epi8(v[k], zero);
+            }
+            for (int flipped = 0; flipped < 2; flipped++)
+            {
+                if (flipped)
+                {
+                    for (int k = 0; k < 4; k++)
+                    {
+                        x[k] = _mm_xor_si128(x[k], one);
+                    }
+                }
+                // F1 flips x1 and x2, F-1 is ((x + 1) ^ 1) - 1
+                __m128i f = rs_discrimination_8(x[0], x[1], x[2], x[3]);
+                __m128i fp = rs_discrimination_8(x[0], _mm_xor_si128(x[1], one), _mm_xor_si128(x[2], one), x[3]);
+                __m128i fn = rs_discrimination_8(
+                    x[0], _mm_sub_epi16(_mm_xor_si128(_mm_add_epi16(x[1], one), one), one),
+                    _mm_sub_epi16(_mm_xor_si128(_mm_add_epi16(x[2], one), one), one), x[3]);
+                __m128i *c = acc + 4 * flipped;
+                c[0] = _mm_sub_epi16(c[0], _mm_and_si128(_mm_cmpgt_epi16(fp, f), mask[h]));
+                c[1] = _mm_sub_epi16(c[1], _mm_and_si128(_mm_cmplt_epi16(fp, f), mask[h]));
+                c[2] = _mm_sub_epi16(c[2], _mm_and_si128(_mm_cmpgt_epi16(fn, f), mask[h]));
+                c[3] = _mm_sub_epi16(c[3], _mm_and_si128(_mm_cmplt_epi16(fn, f), mask[h]));
+            }
+        }
+        // a lane takes at most 2 per window, flush well before 32767
+        if (++pending == 8192)
+        {
+            rs_flush(acc, rs);
+            pending = 0;
+        }
+    }
+    rs_flush(acc, rs);
+    return px;
+}
+#endif
+
+/*
+ * Count one row band
+ * Description: Histogram uses 4 sub histograms so consecutive equal
+ * bytes do not stall on the same counter (it stays scalar, SSE2 has
+ * no scatter increment). RS groups are 4 pixels of one channel along
+ * a row with mask [0 1 1 0], counted by rs_row_sse2 when simd is set.
+ */
+static void analyze_band(ImageWork *work, uint b)
+{
+    BandStats *st = &work->band[b];
+    uint bytes_pp = work->bmp.bpp / 8;
+    uint row_bytes = work->bmp.width * bytes_pp;
+    uint row_first = (uint)((unsigned long)work->bmp.height * b / work->bands);
+    uint row_last = (uint)((unsigned long)work->bmp.height * (b + 1) / work->bands);
+    uint sub[4][256];
+
+    memset(st, 0, sizeof(*st));
+    memset(sub, 0, sizeof(sub));
+
+    for (uint r = row_first; r < row_last; r++)
+    {
+        const unsigned char *row = work->pixels + (size_t)r * work->bmp.row_stride;
+
+        // Step 1 : histogram
+        uint i = 0;
+        for (; i + 4 <= row_bytes; i += 4)
+        {
+            sub[0][row[i]]++;
+            sub[1][row[i + 1]]++;
+            sub[2][row[i + 2]]++;
+            sub[3][row[i + 3]]++;
+        }
+        for (; i < row_bytes; i++)
+        {
+            sub[0][row[i]]++;
+        }
+
+        // Step 2 : regular / singular groups for the 3 colour channels
+        uint px_first = 0;
+#ifdef __SSE2__
+        if (work->simd)
+        {
+            px_first = rs_row_sse2(row, work->bmp.width, bytes_pp, st->rs);
+            st->groups += 3 * (px_first / 4);
+        }
+#endif
+        for (uint ch = 0; ch < 3; ch++)
+        {
+            for (uint px = px_first; px + 4 <= work->bmp.width; px += 4)
+            {
+                const unsigned char *g = row + px * bytes_pp + ch;
+                int x0 = g[0], x1 = g[bytes_pp], x2 = g[2 * bytes_pp], x3 = g[3 * bytes_pp];
+
+                for (int flipped = 0; flipped < 2; flipped++)
+                {
+                    if (flipped)
+                    {
+                        x0 ^= 1; x1 ^= 1; x2 ^= 1; x3 ^= 1;
+                    }
+                    int f = rs_discrimination(x0, x1, x2, x3);
+                    int fp = rs_discrimination(x0, x1 ^ 1, x2 ^ 1, x3);
+                    int fn = rs_discrimination(x0, flip_negative(x1), flip_negative(x2), x3);
+                    long *c = st->rs + 4 * flipped;
+                    c[0] += fp > f;
+                    c[1] += fp < f;
+                    c[2] += fn > f;
+                    c[3] += fn < f;
+                }
+                st->groups++;
+            }
+        }
+    }
+
+    for (int v = 0; v < 256; v++)
+    {
+        st->hist[v] = sub[0][v] + sub[1][v] + sub[2][v] + sub[3][v];
+    }
+}
+
+/* Thread body, takes bands until none are left */
+static void *analyze_worker(void *arg)
+{
+    ImageWork *work = arg;
+    for (;;)
+    {
+        pthread_mutex_lock(&work->lock);
+        uint b = work->next_band++;
+        pthread_mutex_unlock(&work->lock);
+        if (b >= work->bands)
+        {
+            return NULL;
+        }
+        analyze_band(work, b);
+    }
+}
+
+/* Chi-square p value of pairs of values (2k, 2k + 1) */
+static double chi_square_pairs(const unsigned long *hist)
+{
+    double chi = 0.0;
+    int used = 0;
+    for (int k = 0; k < 128; k++)
+    {
+        double expected = (hist[2 * k] + hist[2 * k + 1]) / 2.0;
+        if (expected > 4.0)
+        {
+            double d = hist[2 * k] - expected;
+            chi += d * d / expected;
+            used++;
+        }
+    }
+    return chi_square_p(chi, used - 1);
+}
+
+/*
+ * RS estimate of the embedding rate
+ * Description: Solves 2(d1 + d0)z^2 + (d-0 - d-1 - d1 - 3 d0)z + d0 - d-0 = 0
+ * for the root of smallest magnitude, rate = z / (z - 1/2)
+ */
+static double rs_estimate(const long *rs, long groups)
+{
+    if (groups == 0)
+    {
+        return 0.0;
+    }
+    double d0 = (double)(rs[0] - rs[1]) / groups;
+    double dn0 = (double)(rs[2] - rs[3]) / groups;
+    double d1 = (double)(rs[4] - rs[5]) / groups;
+    double dn1 = (double)(rs[6] - rs[7]) / groups;
+
+    double a = 2.0 * (d1 + d0);
+    double b = dn0 - dn1 - d1 - 3.0 * d0;
+    double c = d0 - dn0;
+    double z;
+
+    if (fabs(a) < 1e-12)
+    {
+        z = fabs(b) < 1e-12 ? 0.0 : -c / b;
+    }
+    else
+    {
+        double disc = b * b - 4.0 * a * c;
+        if (disc < 0.0)
+        {
+            disc = 0.0;
+        }
+        double z1 = (-b + sqrt(disc)) / (2.0 * a);
+        double z2 = (-b - sqrt(disc)) / (2.0 * a);
+        z = fabs(z1) < fabs(z2) ? z1 : z2;
+    }
+
+    if (fabs(z - 0.5) < 1e-12)
+    {
+        return 1.0;
+    }
+    double rate = z / (z - 0.5);
+    return rate < 0.0 ? 0.0 : (rate > 1.0 ? 1.0 : rate);
+}
+
+/*
+ * Analyse one image
+ * Output: chi-square and RS statistics and a score in report
+ * Description: Sequential LSB embedding starts at the first row, so
+ * the chi-square p value is taken over growing prefixes of bands
+ */
+AnalyzeStatus analyze_image(const char *fname, int tile_threads, AnalyzeReport *report)
+{
+    report->image_fname = (char *)fname;
+    report->status = a_failure;
+
+    FILE *fptr = fopen(fname, "rb");
+    struct stat st;
+    if (fptr == NULL || fstat(fileno(fptr), &st) != 0)
+    {
+        if (fptr != NULL)
+        {
+            fclose(fptr);
+        }
+        return a_failure;
+    }
+    TraceSpan job;
+    trace_begin(&job, "analyze", fname);
+    AnalyzeStatus status = analyze_stream(fptr, fname, (unsigned long long)st.st_size, tile_threads, report);
+    trace_end(&job);
+    fclose(fptr);
+    return status;
+}
+
+/* Analyse an image read from an open stream (only forward seeks are used) */
+AnalyzeStatus analyze_stream(FILE *fptr, const char *fname, unsigned long long file_size, int tile_threads,
+                             AnalyzeReport *report)
+{
+    unsigned char header[BMP_HEADER_SIZE];
+    ImageWork *work;
+    TraceSpan stage;
+
+    report->image_fname = (char *)fname;
+    report->status = a_failure;
+
+    // Step 1 : read the header and the pixel array
+    trace_begin(&stage, "read_pixels", fname);
+    work = mem_calloc(1, sizeof(*work));
+    if (work == NULL || fread(header, 1, BMP_HEADER_SIZE, fptr) != BMP_HEADER_SIZE ||
+        !bmp_parse_header(header, &work->bmp) || !bmp_pixels_fit(&work->bmp, file_size))
+    {
+        mem_free(work);
+        trace_end(&stage);
+        return a_failure;
+    }
+
+    size_t pixel_bytes = (size_t)work->bmp.row_stride * work->bmp.height;
+    unsigned char *pixels = mem_alloc(pixel_bytes + 1);
+    fseek(fptr, work->bmp.pixel_offset, SEEK_SET);
+    if (pixels == NULL || fread(pixels, 1, pixel_bytes, fptr) != pixel_bytes)
+    {
+        mem_free(pixels);
+        mem_free(work);
+        trace_end(&stage);
+        return a_failure;
+    }
+    report->image_bytes = work->bmp.pixel_offset + pixel_bytes;
+
+    // Step 2 : count all bands on tile_threads threads
+    trace_stage(&stage, "band_counts", fname);
+    work->pixels = pixels;
+    work->simd = 1;
+    work->bands = work->bmp.height < ANALYZE_BANDS ? work->bmp.height : ANALYZE_BANDS;
+    pthread_mutex_init(&work->lock, NULL);
+
+    pthread_t tid[tile_threads > 1 ? tile_threads : 1];
+    int started = 0;
+    for (int t = 1; t < tile_threads; t++)
+    {
+        if (pthread_create(&tid[started], NULL, analyze_worker, work) == 0)
+        {
+            started++;
+        }
+    }
+    analyze_worker(work);
+    for (int t = 0; t < started; t++)
+    {
+        pthread_join(tid[t], NULL);
+    }
+    pthread_mutex_destroy(&work->lock);
+    mem_free(pixels);
+
+    // Step 3 : chi-square over growing prefixes
+    trace_stage(&stage, "score", fname);
+    unsigned long hist[256] = {0};
+    long rs[8] = {0}, groups = 0;
+    uint embedded_bands = 0;
+    report->chi_p = 0.0;
+    for (uint b = 0; b < work->bands; b++)
+    {
+        for (int v = 0; v < 256; v++)
+        {
+            hist[v] += work->band[b].hist[v];
+        }
+        for (int i = 0; i < 8; i++)
+        {
+            rs[i] += work->band[b].rs[i];
+        }
+        groups += work->band[b].groups;
+
+        double p = chi_square_pairs(hist);
+        if (b == 0)
+        {
+            report->chi_p = p;
+        }
+        if (p > 0.5 && embedded_bands == b)
+        {
+            embedded_bands = b + 1;
+        }
+    }
+    report->chi_fraction = work->bands ? (double)embedded_bands / work->bands : 0.0;
+
+    // Step 4 : RS over the whole image and the combined score
+    report->rs_rate = rs_estimate(rs, groups);
+    report->score = report->chi_p > report->rs_rate ? report->chi_p : report->rs_rate;
+    report->status = a_success;
+
+    mem_free(work);
+    trace_end(&stage);
+    return a_success;
+}
+
+void analyze_print_report(const AnalyzeReport *report)
+{
+    printf("%s : chi2_p=%.4f chi2_fraction=%.3f rs_rate=%.4f score=%.4f\n",
+           report->image_fname, report->chi_p, report->chi_fraction, report->rs_rate, report->score);
+}
+
+/* Work shared by the threads of a multi image run */
+typedef struct _CorpusWork
+{
+    AnalyzeReport *report;
+    char **fnames;
+    int count;
+    int next;
+    pthread_mutex_t lock;
+} CorpusWork;
+
+/* One image as a job, its pixel array is about the size of the file */
+static void corpus_image(const char *fname, int tile_threads, AnalyzeReport *report)
+{
+    struct stat st;
+    MemJob job;
+    mem_job_begin(&job, stat(fname, &st) == 0 ? (size_t)st.st_size : 0);
+    analyze_image(fname, tile_threads, report);
+    mem_job_end(&job);
+}
+
+/* Thread body, one whole image at a time */
+static void *corpus_worker(void *arg)
+{
+    CorpusWork *corpus = arg;
+    trace_thread_name("analyze worker");
+    for (;;)
+    {
+        pthread_mutex_lock(&corpus->lock);
+        int i = corpus->next++;
+        pthread_mutex_unlock(&corpus->lock);
+        if (i >= corpus->count)
+        {
+            return NULL;
+        }
+        corpus_image(corpus->fnames[i], 1, &corpus->report[i]);
+    }
+}
+
+/*
+ * Run --analyze
+ * Input: argv[2] onwards, image names and optional --threads=<n>
+ * (other "--" options belong to main, e.g. --trace)
+ * Description: With at least as many images as threads every thread
+ * takes whole images, otherwise the threads share the bands of each image
+ */
+AnalyzeStatus do_analyze(char *argv[])
+{
+    int threads = tune_threads();
+    CorpusWork corpus = {0};
+
+    // Step 1 : collect image names and options
+    for (int i = 2; argv[i] != NULL; i++)
+    {
+        if (strncmp(argv[i], "--threads=", 10) == 0)
+        {
+            threads = atoi(argv[i] + 10);
+        }
+        else if (strncmp(argv[i], "--", 2) != 0)
+        {
+            corpus.count++;
+        }
+    }
+    if (threads < 1)
+    {
+        threads = 1;
+    }
+    if (corpus.count == 0)
+    {
+        printf("No images given to analyze\n");
+        return a_failure;
+    }
+
+    corpus.fnames = mem_alloc(corpus.count * sizeof(char *));
+    corpus.report = mem_calloc(corpus.count, sizeof(AnalyzeReport));
+    if (corpus.fnames == NULL || corpus.report == NULL)
+    {
+        mem_free(corpus.fnames);
+        mem_free(corpus.report);
+        return a_failure;
+    }
+    for (int i = 2, n = 0; argv[i] != NULL; i++)
+    {
+        if (strncmp(argv[i], "--", 2) != 0)
+        {
+            corpus.fnames[n++] = argv[i];
+        }
+    }
+
+    // Step 2 : analyse, across images or across bands
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (corpus.count >= threads)
+    {
+        pthread_t tid[threads];
+        int started = 0;
+        pthread_mutex_init(&corpus.lock, NULL);
+        for (int t = 1; t < threads; t++)
+        {
+            if (pthread_create(&tid[started], NULL, corpus_worker, &corpus) == 0)
+            {
+                started++;
+            }
+        }
+        corpus_worker(&corpus);
+        for (int t = 0; t < started; t++)
+        {
+            pthread_join(tid[t], NULL);
+        }
+        pthread_mutex_destroy(&corpus.lock);
+    }
+    else
+    {
+        for (int i = 0; i < corpus.count; i++)
+        {
+            corpus_image(corpus.fnames[i], threads, &corpus.report[i]);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    // Step 3 : print one line per image and the throughput
+    long total_bytes = 0;
+    int failed = 0;
+    for (int i = 0; i < corpus.count; i++)
+    {
+        AnalyzeReport *r = &corpus.report[i];
+        if (r->status != a_success)
+        {
+            printf("%s : not a 24/32 bit BMP or unreadable\n", corpus.fnames[i]);
+            failed++;
+            continue;
+        }
+        total_bytes += r->image_bytes;
+        analyze_print_report(r);
+    }
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    char peak[16], job_peak[16];
+    printf("Analyzed %d images, %.1f MB in %.3f s (%.1f MB/s, %d threads), peak memory %s (largest job %s)\n",
+           corpus.count - failed, total_bytes / 1e6, seconds, seconds > 0 ? total_bytes / 1e6 / seconds : 0.0, threads,
+           mem_format(mem_peak(), peak), mem_format(mem_job_peak_max(), job_peak));
+
+    mem_free(corpus.fnames);
+    mem_free(corpus.report);
+    return failed ? a_failure : a_success;
+}
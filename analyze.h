@@ -0,0 +1,44 @@
+#ifndef ANALYZE_H
+#define ANALYZE_H
+#include <stdio.h>
+
+#include "types.h" // Contains user defined types
+
+/* Number of row bands an image is split into (tiles for the threads) */
+#define ANALYZE_BANDS 64
+
+/*
+ * Structure to store the result of analysing one image
+ * for LSB embedding done by any tool (no MAGIC_STRING needed)
+ */
+
+typedef struct _AnalyzeReport
+{
+    char *image_fname;   // To store the image name
+    long image_bytes;    // To store the size of the file
+    double chi_p;        // To store the chi-square p value of the first band
+    double chi_fraction; // To store the share of the image with chi-square p > 0.5
+    double rs_rate;      // To store the RS estimate of the embedding rate
+    double score;        // To store the probability that the image carries a payload
+    AnalyzeStatus status; // To store whether the image could be analysed
+} AnalyzeReport;
+
+/* Analysis function prototype */
+
+/* Run --analyze over the image names in argv[2] onwards */
+AnalyzeStatus do_analyze(char *argv[]);
+
+/* Analyse one image using tile_threads threads over its row bands */
+AnalyzeStatus analyze_image(const char *fname, int tile_threads, AnalyzeReport *report);
+
+/* Analyse one image of file_size bytes from an open stream */
+AnalyzeStatus analyze_stream(FILE *fptr, const char *fname, unsigned long long file_size, int tile_threads,
+                             AnalyzeReport *report);
+
+/* Print the result line of one image */
+void analyze_print_report(const AnalyzeReport *report);
+
+/* Upper tail of the chi-square distribution with df degrees of freedom */
+double chi_square_p(double chi, int df);
+
+#endif
@@ -0,0 +1,101 @@
+#include "bmp.h"
+#include "mem.h"
+#include "util.h"
+#include <stdint.h>
+#include <stdio.h>
+
+/* Function Definitions */
+
+/* Read a little endian 32 bit field */
+static uint32_t bmp_read32(const unsigned char *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/*
+ * Parse BMP header
+ * Input: first BMP_HEADER_SIZE bytes of the file
+ * Output: header fields in info
+ * Description: Height is negative for top-down images, only the
+ * number of rows matters here so its absolute value is kept. The
+ * geometry is untrusted: it is refused when empty or when the pixel
+ * array would not fit the 32 bit sizes of the format, so row_stride
+ * and row_stride * height can be used without overflow
+ */
+int bmp_parse_header(const unsigned char *header, BmpInfo *info)
+{
+    // Step 1 : check the "BM" signature
+    if (header[0] != 'B' || header[1] != 'M')
+    {
+        return 0;
+    }
+
+    // Step 2 : read the fields
+    info->file_size = bmp_read32(header + 2);
+    info->pixel_offset = bmp_read32(header + 10);
+    info->width = bmp_read32(header + 18);
+    int32_t height = (int32_t)bmp_read32(header + 22);
+    info->height = height < 0 ? 0u - (uint)height : (uint)height;
+    info->bpp = header[28] | (header[29] << 8);
+
+    // Step 3 : only uncompressed 24 / 32 bit images are supported
+    if ((info->bpp != 24 && info->bpp != 32) || info->pixel_offset < BMP_HEADER_SIZE)
+    {
+        return 0;
+    }
+
+    // Step 4 : rows are padded to a multiple of 4 bytes, the whole array must stay below 4 GB
+    uint64_t row_stride = ((uint64_t)info->width * (info->bpp / 8) + 3) & ~(uint64_t)3;
+    if (info->width == 0 || info->height == 0 ||
+        info->pixel_offset + row_stride * info->height > UINT32_MAX)
+    {
+        return 0;
+    }
+    info->row_stride = (uint)row_stride;
+    return 1;
+}
+
+int bmp_pixels_fit(const BmpInfo *info, unsigned long long file_size)
+{
+    return (unsigned long long)info->pixel_offset + (unsigned long long)info->row_stride * info->height <= file_size;
+}
+
+/*
+ * Write a synthetic carrier
+ * Description: 24 bit width x height BMP of xorshift noise from seed,
+ * so every LSB pattern is as likely as in a photo. It is written a row
+ * at a time, return 1 when the whole file was written
+ */
+int bmp_write_noise(const char *fname, uint width, uint height, uint seed)
+{
+    uint32_t row = (width * 3 + 3) & ~3u, size = BMP_HEADER_SIZE + row * height;
+    unsigned char header[BMP_HEADER_SIZE] = {'B', 'M'};
+    uint32_t fields[][2] = {{2, size}, {10, BMP_HEADER_SIZE}, {14, 40}, {18, width}, {22, height}, {34, row * height}};
+    for (size_t f = 0; f < sizeof(fields) / sizeof(fields[0]); f++)
+    {
+        for (int b = 0; b < 4; b++)
+        {
+            header[fields[f][0] + b] = (unsigned char)(fields[f][1] >> (8 * b));
+        }
+    }
+    header[26] = 1;  // planes
+    header[28] = 24; // bits per pixel
+
+    unsigned char *pixels = mem_alloc(row);
+    FILE *fptr = fopen(fname, "wb");
+    int ok = pixels != NULL && fptr != NULL && fwrite(header, 1, sizeof(header), fptr) == sizeof(header);
+    for (uint y = 0; ok && y < height; y++)
+    {
+        for (uint32_t x = 0; x < row; x++)
+        {
+            pixels[x] = (unsigned char)xorshift32(&seed);
+        }
+        ok = fwrite(pixels, 1, row, fptr) == row;
+    }
+    mem_free(pixels);
+    if (fptr != NULL && fclose(fptr) != 0)
+    {
+        ok = 0;
+    }
+    return ok;
+}
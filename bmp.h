@@ -0,0 +1,33 @@
+#ifndef BMP_H
+#define BMP_H
+
+#include "types.h" // Contains user defined types
+
+/* Size of the BITMAPFILEHEADER + BITMAPINFOHEADER this tool writes */
+#define BMP_HEADER_SIZE 54
+
+/*
+ * Structure to store the BMP header fields needed
+ * to walk the pixel array
+ */
+
+typedef struct _BmpInfo
+{
+    uint file_size;    // To store the size from offset 2
+    uint pixel_offset; // To store the start of the pixel array (offset 10)
+    uint width;        // To store the width (offset 18)
+    uint height;       // To store the absolute height (offset 22)
+    uint bpp;          // To store the bits per pixel (offset 28)
+    uint row_stride;   // To store the bytes per row including padding
+} BmpInfo;
+
+/* Parse the first BMP_HEADER_SIZE bytes, return 1 for a 24 / 32 bit BMP */
+int bmp_parse_header(const unsigned char *header, BmpInfo *info);
+
+/* Return 1 when the pixel array the header describes ends within file_size bytes */
+int bmp_pixels_fit(const BmpInfo *info, unsigned long long file_size);
+
+/* Write a 24 bit noise BMP of width x height from seed (--tune / --mem-check carriers), return 1 on success */
+int bmp_write_noise(const char *fname, uint width, uint height, uint seed);
+
+#endif
@@ -0,0 +1,377 @@
+#define _GNU_SOURCE // O_DIRECT, MAP_HUGETLB
+#include "bulkio.h"
+#include "mem.h"
+#include "bmp.h"
+#include "tune.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Pool of free buffers, all of them mmap'd so they are page aligned */
+static struct
+{
+    void *buffer;
+    size_t size;
+} io_pool[BULKIO_POOL_SLOTS];
+static pthread_mutex_t io_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Function Definitions */
+
+static size_t round_up(size_t value, size_t align)
+{
+    return (value + align - 1) / align * align;
+}
+
+const char *io_mode_name(IoMode mode)
+{
+    return mode == io_mmap ? "mmap" : (mode == io_direct ? "direct" : "buffered");
+}
+
+int io_mode_from_name(const char *name)
+{
+    if (strcmp(name, "buffered") == 0)
+        return io_buffered;
+    else if (strcmp(name, "mmap") == 0)
+        return io_mmap;
+    else if (strcmp(name, "direct") == 0)
+        return io_direct;
+    return -1;
+}
+
+/* Pool buffers are whole huge pages, or whole pages under --mem-limit so shrunk blocks stay small */
+static size_t io_buffer_round(size_t size)
+{
+    return round_up(size, mem_limit() ? BULKIO_ALIGN : BULKIO_HUGE_PAGE);
+}
+
+/*
+ * Get a pool buffer
+ * Description: Explicit huge pages (MAP_HUGETLB) are tried first,
+ * then normal pages with a transparent huge page hint. New mappings
+ * are charged to the memory budget until they are unmapped.
+ */
+void *io_buffer_get(size_t size)
+{
+    size = io_buffer_round(size);
+
+    // Step 1 : reuse a freed buffer of the same size
+    pthread_mutex_lock(&io_pool_lock);
+    for (int i = 0; i < BULKIO_POOL_SLOTS; i++)
+    {
+        if (io_pool[i].buffer != NULL && io_pool[i].size == size)
+        {
+            void *buffer = io_pool[i].buffer;
+            io_pool[i].buffer = NULL;
+            pthread_mutex_unlock(&io_pool_lock);
+            return buffer;
+        }
+    }
+    pthread_mutex_unlock(&io_pool_lock);
+
+    // Step 2 : new mapping
+    if (!mem_charge(size))
+    {
+        return NULL;
+    }
+    void *buffer = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (buffer == MAP_FAILED)
+    {
+        buffer = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buffer == MAP_FAILED)
+        {
+            mem_uncharge(size);
+            return NULL;
+        }
+        madvise(buffer, size, MADV_HUGEPAGE);
+    }
+    return buffer;
+}
+
+void io_buffer_put(void *buffer, size_t size)
+{
+    if (buffer == NULL)
+    {
+        return;
+    }
+    size = io_buffer_round(size);
+
+    pthread_mutex_lock(&io_pool_lock);
+    for (int i = 0; i < BULKIO_POOL_SLOTS; i++)
+    {
+        if (io_pool[i].buffer == NULL)
+        {
+            io_pool[i].buffer = buffer;
+            io_pool[i].size = size;
+            pthread_mutex_unlock(&io_pool_lock);
+            return;
+        }
+    }
+    pthread_mutex_unlock(&io_pool_lock);
+    munmap(buffer, size);
+    mem_uncharge(size);
+}
+
+size_t bulk_block_size(IoMode mode)
+{
+    size_t block = tune_profile()->block_size;
+    if (block == 0)
+    {
+        block = mode == io_direct ? BULKIO_BLOCK : BULKIO_STDIO_BLOCK;
+    }
+    block = mem_block_size(block);
+    return mode == io_direct ? round_up(block, BULKIO_ALIGN) : block;
+}
+
+/* Plain stdio copy of len bytes (or to EOF when len is -1) */
+static IoStatus copy_stdio(FILE *fptr_src, FILE *fptr_dest, long long len)
+{
+    size_t block = bulk_block_size(io_buffered);
+    if (len >= 0 && (unsigned long long)len < block)
+    {
+        block = len > 0 ? (size_t)len : 1;
+    }
+    char *buffer = mem_alloc(block);
+    if (buffer == NULL)
+    {
+        return io_failure;
+    }
+
+    IoStatus status = io_success;
+    while (len != 0)
+    {
+        size_t want = (len < 0 || len > (long long)block) ? block : (size_t)len;
+        size_t got = fread(buffer, 1, want, fptr_src);
+        if (got == 0)
+        {
+            break;
+        }
+        if (fwrite(buffer, 1, got, fptr_dest) != got)
+        {
+            status = io_failure;
+            break;
+        }
+        if (len > 0)
+        {
+            len -= got;
+        }
+    }
+    mem_free(buffer);
+    return status == io_success && len > 0 ? io_failure : status;
+}
+
+/* Map both files and copy with memcpy, dest is grown to the source size first */
+static IoStatus copy_mmap(FILE *fptr_src, FILE *fptr_dest, const char *dest_fname)
+{
+    struct stat st;
+    long pos = ftell(fptr_src);
+
+    if (fflush(fptr_dest) != 0 || fstat(fileno(fptr_src), &st) != 0)
+    {
+        return io_failure;
+    }
+    if (pos >= st.st_size)
+    {
+        return io_success;
+    }
+
+    // The stego stream is write only, a shared writable map needs O_RDWR
+    int src_fd = fileno(fptr_src), dest_fd = open(dest_fname, O_RDWR);
+    if (dest_fd < 0 || ftruncate(dest_fd, st.st_size) != 0)
+    {
+        if (dest_fd >= 0)
+            close(dest_fd);
+        return io_failure;
+    }
+    unsigned char *src = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, src_fd, 0);
+    unsigned char *dest = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, dest_fd, 0);
+    if (src == MAP_FAILED || dest == MAP_FAILED)
+    {
+        if (src != MAP_FAILED)
+            munmap(src, st.st_size);
+        if (dest != MAP_FAILED)
+            munmap(dest, st.st_size);
+        close(dest_fd);
+        return io_failure;
+    }
+
+    madvise(src + pos, st.st_size - pos, MADV_SEQUENTIAL);
+    memcpy(dest + pos, src + pos, st.st_size - pos);
+
+    munmap(src, st.st_size);
+    munmap(dest, st.st_size);
+    close(dest_fd);
+
+    // Keep both stdio positions at the end as after a normal copy
+    fseek(fptr_src, 0, SEEK_END);
+    fseek(fptr_dest, 0, SEEK_END);
+    return io_success;
+}
+
+/*
+ * O_DIRECT copy
+ * Description: The bytes up to the next BULKIO_ALIGN boundary (the 54
+ * byte header and the embedded payload end at odd offsets) go through
+ * stdio. From there whole aligned blocks are read and written with
+ * pread / pwrite on O_DIRECT descriptors. The short last block is
+ * written padded to the alignment and the file is truncated back.
+ */
+static IoStatus copy_direct(FILE *fptr_src, const char *src_fname, FILE *fptr_dest, const char *dest_fname)
+{
+    struct stat st;
+    long pos = ftell(fptr_src);
+
+    if (fstat(fileno(fptr_src), &st) != 0)
+    {
+        return io_failure;
+    }
+
+    // Step 1 : unaligned head through stdio
+    long long aligned = round_up(pos, BULKIO_ALIGN);
+    if (aligned > st.st_size)
+    {
+        aligned = st.st_size;
+    }
+    if (copy_stdio(fptr_src, fptr_dest, aligned - pos) != io_success || fflush(fptr_dest) != 0)
+    {
+        return io_failure;
+    }
+    if (aligned == st.st_size)
+    {
+        return io_success;
+    }
+
+    // Step 2 : O_DIRECT descriptors, file systems without it fall back to stdio
+    int src_fd = open(src_fname, O_RDONLY | O_DIRECT);
+    int dest_fd = open(dest_fname, O_WRONLY | O_DIRECT);
+    if (src_fd < 0 || dest_fd < 0)
+    {
+        if (src_fd >= 0)
+            close(src_fd);
+        if (dest_fd >= 0)
+            close(dest_fd);
+        printf("O_DIRECT not supported here (%s), using buffered copy\n", strerror(errno));
+        return copy_stdio(fptr_src, fptr_dest, -1);
+    }
+
+    size_t block = bulk_block_size(io_direct);
+    unsigned char *buffer = io_buffer_get(block);
+    IoStatus status = buffer != NULL ? io_success : io_failure;
+
+    // Step 3 : aligned blocks
+    for (off_t off = aligned; status == io_success && off < st.st_size;)
+    {
+        ssize_t got = pread(src_fd, buffer, block, off);
+        if (got <= 0)
+        {
+            status = io_failure;
+            break;
+        }
+        size_t len = round_up(got, BULKIO_ALIGN);
+        memset(buffer + got, 0, len - got);
+        if (pwrite(dest_fd, buffer, len, off) != (ssize_t)len)
+        {
+            status = io_failure;
+            break;
+        }
+        off += got;
+    }
+
+    // Step 4 : drop the tail padding
+    if (status == io_success && ftruncate(dest_fd, st.st_size) != 0)
+    {
+        status = io_failure;
+    }
+
+    io_buffer_put(buffer, block);
+    close(src_fd);
+    close(dest_fd);
+    fseek(fptr_src, 0, SEEK_END);
+    fseek(fptr_dest, 0, SEEK_END);
+    return status;
+}
+
+IoStatus bulk_copy(FILE *fptr_src, const char *src_fname, FILE *fptr_dest, const char *dest_fname, IoMode mode)
+{
+    struct stat st;
+
+    // Under --mem-limit the two whole file mappings of a carrier larger than the limit would pass it
+    if (mode == io_mmap && mem_limit() != 0 && fstat(fileno(fptr_src), &st) == 0 &&
+        2 * (unsigned long long)st.st_size > mem_limit())
+    {
+        mode = io_buffered;
+    }
+    if (mode == io_mmap)
+    {
+        return copy_mmap(fptr_src, fptr_dest, dest_fname);
+    }
+    else if (mode == io_direct)
+    {
+        return copy_direct(fptr_src, src_fname, fptr_dest, dest_fname);
+    }
+    return copy_stdio(fptr_src, fptr_dest, -1);
+}
+
+/*
+ * Run --bench-io
+ * Description: Copies the carrier the way an encode does (header, then
+ * the rest) with every mode. The source is dropped from the page cache
+ * before each run and the output is synced inside the timing, so
+ * buffered writes pay for their write back too.
+ */
+IoStatus do_bench_io(char *argv[])
+{
+    if (argv[2] == NULL)
+    {
+        printf("Give the carrier --> ./a.out --bench-io <carrier.bmp> [scratch.bmp]\n");
+        return io_failure;
+    }
+    const char *src_fname = argv[2];
+    const char *dest_fname = argv[3] != NULL ? argv[3] : "bench_io_scratch.bmp";
+
+    for (int mode = io_buffered; mode <= io_direct; mode++)
+    {
+        FILE *fptr_src = fopen(src_fname, "rb");
+        FILE *fptr_dest = fopen(dest_fname, "w+b");
+        if (fptr_src == NULL || fptr_dest == NULL)
+        {
+            perror(fptr_src == NULL ? src_fname : dest_fname);
+            if (fptr_src)
+                fclose(fptr_src);
+            if (fptr_dest)
+                fclose(fptr_dest);
+            return io_failure;
+        }
+        posix_fadvise(fileno(fptr_src), 0, 0, POSIX_FADV_DONTNEED);
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        IoStatus status = copy_stdio(fptr_src, fptr_dest, BMP_HEADER_SIZE);
+        if (status == io_success)
+        {
+            status = bulk_copy(fptr_src, src_fname, fptr_dest, dest_fname, mode);
+        }
+        fflush(fptr_dest);
+        fdatasync(fileno(fptr_dest));
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        long size = ftell(fptr_dest);
+        fclose(fptr_src);
+        fclose(fptr_dest);
+
+        double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        printf("%-8s : %s, %.1f MB in %.3f s (%.1f MB/s)\n", io_mode_name(mode),
+               status == io_success ? "ok" : "failed", size / 1e6, seconds,
+               seconds > 0 ? size / 1e6 / seconds : 0.0);
+    }
+
+    remove(dest_fname);
+    return io_success;
+}
@@ -0,0 +1,42 @@
+#ifndef BULKIO_H
+#define BULKIO_H
+#include <stddef.h>
+#include <stdio.h>
+
+#include "types.h" // Contains user defined types
+
+/* Offset / length alignment used for O_DIRECT */
+#define BULKIO_ALIGN 4096
+
+/* Bytes moved per O_DIRECT request (a multiple of the huge page size), unless the --tune profile sets one */
+#define BULKIO_BLOCK (4UL * 1024 * 1024)
+
+/* Huge page size assumed when rounding pool buffers */
+#define BULKIO_HUGE_PAGE (2UL * 1024 * 1024)
+
+/* Bytes per stdio copy request, unless the --tune profile sets one */
+#define BULKIO_STDIO_BLOCK (64UL * 1024)
+
+/* Freed buffers kept for reuse by later jobs */
+#define BULKIO_POOL_SLOTS 4
+
+/* Copy the rest of src (from its current offset) to the same offset of dest */
+IoStatus bulk_copy(FILE *fptr_src, const char *src_fname, FILE *fptr_dest, const char *dest_fname, IoMode mode);
+
+/* Bytes per copy request of a mode: the --tune profile block size, else the mode's default */
+size_t bulk_block_size(IoMode mode);
+
+/* Name of an I/O mode, and the mode for a name (-1 when unknown) */
+const char *io_mode_name(IoMode mode);
+int io_mode_from_name(const char *name);
+
+/* Aligned buffer from the pool, backed by huge pages when the system allows */
+void *io_buffer_get(size_t size);
+
+/* Give a buffer back to the pool */
+void io_buffer_put(void *buffer, size_t size);
+
+/* Run --bench-io <carrier.bmp> [scratch.bmp], comparing the modes */
+IoStatus do_bench_io(char *argv[]);
+
+#endif
@@ -0,0 +1,544 @@
+#include "catalog.h"
+#include "mem.h"
+#include "util.h"
+#include "common.h"
+#include "decode.h"
+#include "journal.h"
+#include "plan.h"
+#include "tune.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+/* FNV-1a offset basis, the path hash goes through journal_hash */
+#define CATALOG_HASH_BASIS 0xcbf29ce484222325ULL
+
+/* Names handed to a worker at a time */
+#define CATALOG_CHUNK 256
+
+/* What a refresh did with each name */
+enum
+{
+    cat_missing,    // could not be stat'ed, left out
+    cat_reused,     // unchanged, entry copied from the old index
+    cat_rescanned   // new or changed, header read again
+};
+
+/*
+ * Structure to store a build / refresh shared by the workers
+ */
+
+typedef struct _CatalogBuild
+{
+    char **names;            // To store the carrier paths
+    int count;
+    const Catalog *old;      // To store the previous index (NULL when there is none)
+    CatalogEntry *entries;   // To store the entry of names[i] at i
+    unsigned char *state;    // To store cat_missing / cat_reused / cat_rescanned of names[i]
+    int *matched;            // To store the number of names the old index knew, per worker
+    int next;                // To store the next name to hand out
+    pthread_mutex_t lock;
+} CatalogBuild;
+
+/* Function Definitions */
+
+static uint64_t catalog_hash(const char *path)
+{
+    return journal_hash(CATALOG_HASH_BASIS, path, strlen(path));
+}
+
+static int64_t catalog_mtime_ns(const struct stat *st)
+{
+    return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+/*
+ * Map an index
+ * Description: The sizes in the header must add up to the file size and
+ * every path offset must fall in the string area, so lookups on the
+ * mapping never go out of it
+ */
+CatalogStatus catalog_open(Catalog *catalog, const char *fname)
+{
+    struct stat st;
+
+    memset(catalog, 0, sizeof(*catalog));
+    int fd = open(fname, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        perror(fname);
+        return cat_failure;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(CatalogHeader))
+    {
+        printf("%s is not a carrier index\n", fname);
+        close(fd);
+        return cat_failure;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        perror(fname);
+        return cat_failure;
+    }
+
+    const CatalogHeader *header = map;
+    uint64_t size = st.st_size;
+    uint64_t entries_end = sizeof(CatalogHeader) + header->count * sizeof(CatalogEntry);
+    uint64_t table_end = entries_end + header->buckets * sizeof(uint32_t);
+    if (memcmp(header->magic, CATALOG_MAGIC, sizeof(header->magic)) != 0 || header->version != CATALOG_VERSION ||
+        header->entry_size != sizeof(CatalogEntry) || header->count > UINT32_MAX ||
+        header->buckets > size / sizeof(uint32_t) || (header->buckets & (header->buckets - 1)) != 0 ||
+        header->count >= header->buckets || header->count > size / sizeof(CatalogEntry) ||
+        header->strings_size > size || table_end + header->strings_size != size)
+    {
+        printf("%s is not a carrier index of this version, rebuild it with --index\n", fname);
+        munmap(map, st.st_size);
+        return cat_failure;
+    }
+
+    catalog->map = map;
+    catalog->map_size = st.st_size;
+    catalog->header = header;
+    catalog->entries = (const CatalogEntry *)((const char *)map + sizeof(CatalogHeader));
+    catalog->table = (const uint32_t *)((const char *)map + entries_end);
+    catalog->strings = (const char *)map + table_end;
+
+    for (uint64_t i = 0; i < header->count; i++)
+    {
+        if (catalog->entries[i].path >= header->strings_size)
+        {
+            printf("%s is damaged, rebuild it with --index\n", fname);
+            catalog_close(catalog);
+            return cat_failure;
+        }
+    }
+    if (header->strings_size > 0 && catalog->strings[header->strings_size - 1] != '\0')
+    {
+        printf("%s is damaged, rebuild it with --index\n", fname);
+        catalog_close(catalog);
+        return cat_failure;
+    }
+    return cat_success;
+}
+
+void catalog_close(Catalog *catalog)
+{
+    if (catalog->map != NULL)
+    {
+        munmap(catalog->map, catalog->map_size);
+    }
+    memset(catalog, 0, sizeof(*catalog));
+}
+
+int catalog_is_index(const char *fname)
+{
+    char magic[sizeof(((CatalogHeader *)0)->magic)];
+    int fd = open(fname, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return 0;
+    }
+    ssize_t got = pread(fd, magic, sizeof(magic), 0);
+    close(fd);
+    return got == (ssize_t)sizeof(magic) && memcmp(magic, CATALOG_MAGIC, sizeof(magic)) == 0;
+}
+
+const char *catalog_path(const Catalog *catalog, const CatalogEntry *entry)
+{
+    return catalog->strings + entry->path;
+}
+
+/* Linear probing from the hash, an empty slot ends the search */
+const CatalogEntry *catalog_lookup(const Catalog *catalog, const char *path)
+{
+    if (catalog->header == NULL || catalog->header->buckets == 0)
+    {
+        return NULL;
+    }
+    uint64_t hash = catalog_hash(path);
+    uint64_t mask = catalog->header->buckets - 1;
+    for (uint64_t slot = hash & mask;; slot = (slot + 1) & mask)
+    {
+        uint32_t index = catalog->table[slot];
+        if (index == 0 || index > catalog->header->count)
+        {
+            return NULL;
+        }
+        const CatalogEntry *entry = &catalog->entries[index - 1];
+        if (entry->hash == hash && strcmp(catalog_path(catalog, entry), path) == 0)
+        {
+            return entry;
+        }
+    }
+}
+
+int catalog_fresh(const CatalogEntry *entry, const struct stat *st)
+{
+    return entry->size == (int64_t)st->st_size && entry->mtime_ns == catalog_mtime_ns(st);
+}
+
+/*
+ * Describe one carrier
+ * Description: Only the header and the first 16 bytes after it are
+ * read. The encoder writes the magic string from byte BMP_HEADER_SIZE
+ * on, so those bytes tell whether the image already holds a stream.
+ */
+void catalog_probe(const char *path, const struct stat *st, CatalogEntry *entry)
+{
+    unsigned char probe[CATALOG_PROBE_BYTES];
+    BmpInfo bmp;
+
+    entry->size = st->st_size;
+    entry->mtime_ns = catalog_mtime_ns(st);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return;
+    }
+    ssize_t got = pread(fd, probe, sizeof(probe), 0);
+    close(fd);
+    if (got < BMP_HEADER_SIZE || !bmp_parse_header(probe, &bmp) ||
+        !bmp_pixels_fit(&bmp, (unsigned long long)st->st_size))
+    {
+        return;
+    }
+
+    uint64_t capacity = (uint64_t)bmp.width * bmp.height * 3;
+    entry->pixel_offset = bmp.pixel_offset;
+    entry->width = bmp.width;
+    entry->height = bmp.height;
+    entry->bpp = bmp.bpp;
+    entry->capacity = capacity > UINT32_MAX ? UINT32_MAX : (uint32_t)capacity;
+    entry->valid = 1;
+
+    if (got == (ssize_t)sizeof(probe))
+    {
+        char magic[3] = {0};
+        decode_byte_from_lsb(&magic[0], (char *)probe + BMP_HEADER_SIZE);
+        decode_byte_from_lsb(&magic[1], (char *)probe + BMP_HEADER_SIZE + 8);
+        entry->stego = strcmp(magic, MAGIC_STRING) == 0 || strcmp(magic, MAGIC_STRING_EXT) == 0 ||
+                       strcmp(magic, MAGIC_STRING_FEC) == 0;
+    }
+}
+
+/* Worker: stat a chunk of names, copy fresh entries, probe the others */
+static void *catalog_worker(void *arg)
+{
+    CatalogBuild *build = arg;
+    struct stat st;
+    int matched = 0;
+
+    while (1)
+    {
+        pthread_mutex_lock(&build->lock);
+        int first = build->next;
+        build->next += CATALOG_CHUNK;
+        pthread_mutex_unlock(&build->lock);
+        if (first >= build->count)
+        {
+            break;
+        }
+
+        int last = first + CATALOG_CHUNK < build->count ? first + CATALOG_CHUNK : build->count;
+        for (int i = first; i < last; i++)
+        {
+            if (stat(build->names[i], &st) != 0 || !S_ISREG(st.st_mode))
+            {
+                build->state[i] = cat_missing;
+                continue;
+            }
+            const CatalogEntry *old = build->old ? catalog_lookup(build->old, build->names[i]) : NULL;
+            matched += old != NULL;
+            if (old != NULL && catalog_fresh(old, &st))
+            {
+                build->entries[i] = *old;
+                build->state[i] = cat_reused;
+            }
+            else
+            {
+                memset(&build->entries[i], 0, sizeof(CatalogEntry));
+                catalog_probe(build->names[i], &st, &build->entries[i]);
+                build->state[i] = cat_rescanned;
+            }
+        }
+    }
+
+    pthread_mutex_lock(&build->lock);
+    *build->matched += matched;
+    pthread_mutex_unlock(&build->lock);
+    return NULL;
+}
+
+/*
+ * Write the index
+ * Description: Entries of the names that were found, then the hash table
+ * and the paths, to a temp file renamed over fname so readers never see
+ * a partial index
+ */
+static CatalogStatus catalog_write(const char *fname, CatalogBuild *build, uint64_t count)
+{
+    char tmp_fname[FILENAME_MAX];
+    CatalogHeader header = {0};
+
+    if (snprintf(tmp_fname, sizeof(tmp_fname), "%s.%d.tmp", fname, (int)getpid()) >= (int)sizeof(tmp_fname))
+    {
+        printf("Index name %s is too long\n", fname);
+        return cat_failure;
+    }
+
+    // Step 1 : table of at least twice the entries, a power of two
+    uint64_t buckets = 16;
+    while (buckets < 2 * count)
+    {
+        buckets *= 2;
+    }
+    uint32_t *table = mem_calloc(buckets, sizeof(uint32_t));
+    CatalogEntry *entries = mem_alloc((count ? count : 1) * sizeof(CatalogEntry));
+    if (table == NULL || entries == NULL)
+    {
+        mem_free(table);
+        mem_free(entries);
+        printf("Out of memory for %llu index entries\n", (unsigned long long)count);
+        return cat_failure;
+    }
+
+    // Step 2 : entries in name order, paths laid out one after the other
+    uint64_t n = 0, strings_size = 0;
+    for (int i = 0; i < build->count; i++)
+    {
+        if (build->state[i] == cat_missing)
+        {
+            continue;
+        }
+        CatalogEntry *entry = &entries[n];
+        *entry = build->entries[i];
+        entry->hash = catalog_hash(build->names[i]);
+        entry->path = strings_size;
+        strings_size += strlen(build->names[i]) + 1;
+
+        uint64_t slot = entry->hash & (buckets - 1);
+        while (table[slot] != 0)
+        {
+            slot = (slot + 1) & (buckets - 1);
+        }
+        table[slot] = (uint32_t)(n + 1);
+        n++;
+    }
+
+    memcpy(header.magic, CATALOG_MAGIC, sizeof(header.magic));
+    header.version = CATALOG_VERSION;
+    header.entry_size = sizeof(CatalogEntry);
+    header.count = n;
+    header.buckets = buckets;
+    header.strings_size = strings_size;
+    header.built = time(NULL);
+
+    // Step 3 : write and publish
+    CatalogStatus status = cat_success;
+    FILE *fptr_index = fopen(tmp_fname, "wb");
+    if (fptr_index == NULL)
+    {
+        perror(tmp_fname);
+        mem_free(table);
+        mem_free(entries);
+        return cat_failure;
+    }
+    if (fwrite(&header, sizeof(header), 1, fptr_index) != 1 ||
+        (n > 0 && fwrite(entries, sizeof(CatalogEntry), n, fptr_index) != n) ||
+        fwrite(table, sizeof(uint32_t), buckets, fptr_index) != buckets)
+    {
+        status = cat_failure;
+    }
+    for (int i = 0; i < build->count && status == cat_success; i++)
+    {
+        if (build->state[i] != cat_missing && fputs(build->names[i], fptr_index) == EOF)
+        {
+            status = cat_failure;
+        }
+        if (build->state[i] != cat_missing && fputc('\0', fptr_index) == EOF)
+        {
+            status = cat_failure;
+        }
+    }
+    if (fflush(fptr_index) != 0 || fsync(fileno(fptr_index)) != 0)
+    {
+        status = cat_failure;
+    }
+    if (fclose(fptr_index) != 0)
+    {
+        status = cat_failure;
+    }
+    mem_free(table);
+    mem_free(entries);
+
+    if (status != cat_success || rename(tmp_fname, fname) != 0)
+    {
+        perror(fname);
+        unlink(tmp_fname);
+        return cat_failure;
+    }
+    return cat_success;
+}
+
+/*
+ * Build or refresh an index
+ * Description: Every carrier is stat'ed, entries whose size and mtime
+ * did not change are copied from the old index and only the rest have
+ * their header read. Carriers that disappeared are dropped. Run it
+ * before each batch so --plan never trusts a stale entry.
+ */
+CatalogStatus do_index(char *argv[])
+{
+    CatalogBuild build = {0};
+    Catalog old = {0}, fresh;
+    int threads = tune_threads(), matched = 0;
+    struct timespec t0, t1, t2;
+
+    // Step 1 : arguments
+    if (argv[2] == NULL || argv[3] == NULL)
+    {
+        printf("Give arguments like this --> ./a.out --index <carrier dir | list> <index file> [--threads=<n>]\n");
+        return cat_failure;
+    }
+    const char *src = argv[2], *fname = argv[3];
+    for (int i = 4; argv[i] != NULL; i++)
+    {
+        if (strncmp(argv[i], "--threads=", 10) == 0)
+        {
+            threads = atoi(argv[i] + 10);
+        }
+    }
+    if (threads < 1)
+    {
+        threads = 1;
+    }
+
+    // Step 2 : previous index, a damaged or older one is rebuilt
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (access(fname, F_OK) == 0)
+    {
+        if (catalog_open(&old, fname) == cat_success)
+        {
+            build.old = &old;
+        }
+        else
+        {
+            printf("Rebuilding %s from scratch\n", fname);
+        }
+    }
+
+    // Step 3 : carrier names, the list itself is never an index
+    if (catalog_is_index(src))
+    {
+        printf("%s is an index, give the carrier directory or list it was built from\n", src);
+        catalog_close(&old);
+        return cat_failure;
+    }
+    build.names = plan_read_names(src, 1, &build.count);
+    if (build.count < 0 || (build.names == NULL && build.count == 0 && access(src, R_OK) != 0))
+    {
+        catalog_close(&old);
+        return cat_failure;
+    }
+    build.entries = mem_alloc((build.count ? build.count : 1) * sizeof(CatalogEntry));
+    build.state = mem_calloc(build.count ? build.count : 1, 1);
+    build.matched = &matched;
+    if (build.entries == NULL || build.state == NULL)
+    {
+        printf("Out of memory for %d carriers\n", build.count);
+        mem_free(build.entries);
+        mem_free(build.state);
+        for (int i = 0; i < build.count; i++)
+        {
+            mem_free(build.names[i]);
+        }
+        mem_free(build.names);
+        catalog_close(&old);
+        return cat_failure;
+    }
+
+    // Step 4 : stat / probe on the workers
+    pthread_mutex_init(&build.lock, NULL);
+    if (threads > build.count / CATALOG_CHUNK + 1)
+    {
+        threads = build.count / CATALOG_CHUNK + 1;
+    }
+    pthread_t *tids = mem_alloc(threads * sizeof(pthread_t));
+    int started = 0;
+    for (int t = 0; tids != NULL && t < threads; t++)
+    {
+        if (pthread_create(&tids[t], NULL, catalog_worker, &build) == 0)
+        {
+            started++;
+        }
+    }
+    if (started == 0)
+    {
+        catalog_worker(&build);
+    }
+    for (int t = 0; t < started; t++)
+    {
+        pthread_join(tids[t], NULL);
+    }
+    mem_free(tids);
+    pthread_mutex_destroy(&build.lock);
+
+    long reused = 0, rescanned = 0, missing = 0, valid = 0, stego = 0;
+    for (int i = 0; i < build.count; i++)
+    {
+        reused += build.state[i] == cat_reused;
+        rescanned += build.state[i] == cat_rescanned;
+        missing += build.state[i] == cat_missing;
+        valid += build.state[i] != cat_missing && build.entries[i].valid;
+        stego += build.state[i] != cat_missing && build.entries[i].stego;
+    }
+    long dropped = build.old ? (long)old.header->count - matched : 0;
+    catalog_close(&old);
+
+    // Step 5 : write the new index
+    CatalogStatus status = catalog_write(fname, &build, reused + rescanned);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    if (status == cat_success)
+    {
+        printf("Indexed %ld carriers in %.1f ms: %ld unchanged, %ld read, %ld dropped, %ld unreadable\n",
+               reused + rescanned, elapsed_ms(&t0, &t1), reused, rescanned, dropped, missing);
+        printf("%ld usable BMP carriers, %ld already hold a stream\n", valid, stego);
+
+        // Step 6 : lookup cost on the published index
+        if (catalog_open(&fresh, fname) == cat_success)
+        {
+            long found = 0;
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            for (int i = 0; i < build.count; i++)
+            {
+                found += catalog_lookup(&fresh, build.names[i]) != NULL;
+            }
+            clock_gettime(CLOCK_MONOTONIC, &t2);
+            if (build.count > 0)
+            {
+                printf("%d lookups (%ld hits) in %.2f ms, %.0f ns each\n", build.count, found,
+                       elapsed_ms(&t1, &t2), elapsed_ms(&t1, &t2) * 1e6 / build.count);
+            }
+            catalog_close(&fresh);
+        }
+    }
+
+    for (int i = 0; i < build.count; i++)
+    {
+        mem_free(build.names[i]);
+    }
+    mem_free(build.names);
+    mem_free(build.entries);
+    mem_free(build.state);
+    return status;
+}
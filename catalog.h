@@ -0,0 +1,98 @@
+#ifndef CATALOG_H
+#define CATALOG_H
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+#include "types.h" // Contains user defined types
+#include "bmp.h"   // BMP_HEADER_SIZE
+
+/*
+ * Carrier index (--index)
+ * A sidecar file describing a carrier library, mmap'd as is:
+ *     CatalogHeader
+ *     CatalogEntry[count]      one per carrier
+ *     uint32_t table[buckets]  open addressing on the path hash, entry index + 1 (0 empty)
+ *     char strings[]           the NUL terminated paths
+ * Lookups hash the path and probe the table, no file is opened. A
+ * refresh stats every carrier and only re-reads the header of those
+ * whose size or mtime changed, entries of the others are copied over.
+ * --plan takes an index in place of the carrier directory.
+ */
+
+#define CATALOG_MAGIC "STEGIDX1"
+#define CATALOG_VERSION 1
+
+/* Bytes read from a carrier that changed: the BMP header and a magic string */
+#define CATALOG_PROBE_BYTES (BMP_HEADER_SIZE + 16)
+
+/* Index file header */
+typedef struct _CatalogHeader
+{
+    char magic[8];           // To store CATALOG_MAGIC
+    uint32_t version;        // To store CATALOG_VERSION
+    uint32_t entry_size;     // To store sizeof(CatalogEntry), checked on open
+    uint64_t count;          // To store the number of entries
+    uint64_t buckets;        // To store the table size (a power of two, at least twice count)
+    uint64_t strings_size;   // To store the size of the path area
+    int64_t built;           // To store when the index was written
+} CatalogHeader;
+
+/* One carrier */
+typedef struct _CatalogEntry
+{
+    uint64_t hash;           // To store the FNV-1a hash of the path
+    uint64_t path;           // To store the offset of the path in the string area
+    int64_t size;            // To store the file size when indexed
+    int64_t mtime_ns;        // To store the modification time when indexed
+    uint32_t pixel_offset;   // To store the start of the pixel array
+    uint32_t width;          // To store the width
+    uint32_t height;         // To store the absolute height
+    uint32_t capacity;       // To store width * height * 3, as get_image_size_for_bmp (0 when not usable)
+    uint16_t bpp;            // To store the bits per pixel
+    uint8_t valid;           // To store whether it is a complete 24 / 32 bit BMP
+    uint8_t stego;           // To store whether its LSBs already start with a magic string
+    uint32_t reserved;
+} CatalogEntry;
+
+/*
+ * Structure to store an open index
+ */
+
+typedef struct _Catalog
+{
+    void *map;                   // To store the mapping of the file
+    size_t map_size;
+    const CatalogHeader *header;
+    const CatalogEntry *entries;
+    const uint32_t *table;
+    const char *strings;
+} Catalog;
+
+/* Catalog function prototype */
+
+/* Map an index and check its layout */
+CatalogStatus catalog_open(Catalog *catalog, const char *fname);
+
+/* Unmap it */
+void catalog_close(Catalog *catalog);
+
+/* Whether fname is an index file (by its magic) */
+int catalog_is_index(const char *fname);
+
+/* Entry of a path, NULL when it is not in the index */
+const CatalogEntry *catalog_lookup(const Catalog *catalog, const char *path);
+
+/* Path of an entry */
+const char *catalog_path(const Catalog *catalog, const CatalogEntry *entry);
+
+/* Whether an entry still describes the file stat'ed in st (same size and mtime) */
+int catalog_fresh(const CatalogEntry *entry, const struct stat *st);
+
+/* Fill entry from the header of the carrier stat'ed in st (valid stays 0 when it is not usable) */
+void catalog_probe(const char *path, const struct stat *st, CatalogEntry *entry);
+
+/* Run --index <carrier dir | list> <index file> [--threads=<n>], build or refresh the index */
+CatalogStatus do_index(char *argv[]);
+
+#endif
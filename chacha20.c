@@ -0,0 +1,140 @@
+#include "chacha20.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Function Definitions */
+
+/* Rotate a 32 bit word left by n bits */
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+/*
+ * Quarter round applied to all lanes at once
+ * Each x[i] is an array of CHACHA20_LANES words, one per block,
+ * so the compiler can keep every row in a single vector register
+ */
+#define QUARTER_ROUND(a, b, c, d)                        \
+    for (int l = 0; l < CHACHA20_LANES; l++)             \
+    {                                                    \
+        x[a][l] += x[b][l]; x[d][l] ^= x[a][l]; x[d][l] = ROTL32(x[d][l], 16); \
+        x[c][l] += x[d][l]; x[b][l] ^= x[c][l]; x[b][l] = ROTL32(x[b][l], 12); \
+        x[a][l] += x[b][l]; x[d][l] ^= x[a][l]; x[d][l] = ROTL32(x[d][l], 8);  \
+        x[c][l] += x[d][l]; x[b][l] ^= x[c][l]; x[b][l] = ROTL32(x[b][l], 7);  \
+    }
+
+/* Read a little endian 32 bit word */
+static uint32_t load32_le(const unsigned char *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/*
+ * Initialise ChaCha20 state
+ * Input: 32 byte key, 12 byte nonce, initial block counter
+ * Description: State layout follows RFC 8439, constants in
+ * words 0-3, key in 4-11, counter in 12 and nonce in 13-15
+ */
+void chacha20_init(ChaCha20Ctx *ctx, const unsigned char *key, const unsigned char *nonce, uint32_t counter)
+{
+    // "expand 32-byte k"
+    ctx->state[0] = 0x61707865;
+    ctx->state[1] = 0x3320646e;
+    ctx->state[2] = 0x79622d32;
+    ctx->state[3] = 0x6b206574;
+
+    for (int i = 0; i < 8; i++)
+    {
+        ctx->state[4 + i] = load32_le(key + 4 * i);
+    }
+
+    ctx->state[12] = counter;
+
+    for (int i = 0; i < 3; i++)
+    {
+        ctx->state[13 + i] = load32_le(nonce + 4 * i);
+    }
+
+    // Force a refill on the first byte requested
+    ctx->pos = CHACHA20_STRIDE;
+}
+
+/*
+ * Generate CHACHA20_LANES consecutive blocks of keystream
+ * Description: All lanes share the key and nonce and differ
+ * only in the block counter, so the 20 rounds run side by side
+ */
+void chacha20_keystream(ChaCha20Ctx *ctx)
+{
+    uint32_t x[16][CHACHA20_LANES];
+
+    // Step 1 : load the state into every lane with its own counter
+    for (int i = 0; i < 16; i++)
+    {
+        for (int l = 0; l < CHACHA20_LANES; l++)
+        {
+            x[i][l] = ctx->state[i];
+        }
+    }
+    for (int l = 0; l < CHACHA20_LANES; l++)
+    {
+        x[12][l] += l;
+    }
+
+    // Step 2 : 10 double rounds (column round + diagonal round)
+    for (int r = 0; r < 10; r++)
+    {
+        QUARTER_ROUND(0, 4, 8, 12);
+        QUARTER_ROUND(1, 5, 9, 13);
+        QUARTER_ROUND(2, 6, 10, 14);
+        QUARTER_ROUND(3, 7, 11, 15);
+        QUARTER_ROUND(0, 5, 10, 15);
+        QUARTER_ROUND(1, 6, 11, 12);
+        QUARTER_ROUND(2, 7, 8, 13);
+        QUARTER_ROUND(3, 4, 9, 14);
+    }
+
+    // Step 3 : add the input state and serialize each lane as one block
+    for (int l = 0; l < CHACHA20_LANES; l++)
+    {
+        unsigned char *block = ctx->keystream + 64 * l;
+        for (int i = 0; i < 16; i++)
+        {
+            uint32_t v = x[i][l] + ctx->state[i] + (i == 12 ? (uint32_t)l : 0);
+            block[4 * i] = v & 0xFF;
+            block[4 * i + 1] = (v >> 8) & 0xFF;
+            block[4 * i + 2] = (v >> 16) & 0xFF;
+            block[4 * i + 3] = (v >> 24) & 0xFF;
+        }
+    }
+
+    // Step 4 : advance the block counter past the lanes just used
+    ctx->state[12] += CHACHA20_LANES;
+    ctx->pos = 0;
+}
+
+/*
+ * Parse hex string into bytes
+ * Return Value: 1 on success, 0 on bad length or digit
+ */
+int chacha20_parse_hex(const char *hex, unsigned char *out, uint len)
+{
+    if (strlen(hex) != 2 * len)
+    {
+        return 0;
+    }
+
+    for (uint i = 0; i < len; i++)
+    {
+        unsigned int byte;
+        if (!isxdigit((unsigned char)hex[2 * i]) || !isxdigit((unsigned char)hex[2 * i + 1]))
+        {
+            return 0;
+        }
+        if (sscanf(hex + 2 * i, "%2x", &byte) != 1)
+        {
+            return 0;
+        }
+        out[i] = (unsigned char)byte;
+    }
+    return 1;
+}
@@ -0,0 +1,45 @@
+#ifndef CHACHA20_H
+#define CHACHA20_H
+#include <stdint.h>
+
+#include "types.h" // Contains user defined types
+
+/* Number of ChaCha20 blocks generated together (one per vector lane) */
+#define CHACHA20_LANES 4
+
+/* Bytes of keystream produced by one call of chacha20_keystream */
+#define CHACHA20_STRIDE (64 * CHACHA20_LANES)
+
+/*
+ * Structure to store the ChaCha20 cipher state
+ * The keystream is refilled CHACHA20_STRIDE bytes at a time
+ * so the embed / extract loops can XOR it byte by byte
+ */
+
+typedef struct _ChaCha20Ctx
+{
+    uint32_t state[16];                      // To store constants, key, counter and nonce
+    unsigned char keystream[CHACHA20_STRIDE]; // To store the current keystream blocks
+    uint pos;                                // To store the next unused keystream byte
+} ChaCha20Ctx;
+
+/* Initialise the cipher state with 256 bit key and 96 bit nonce */
+void chacha20_init(ChaCha20Ctx *ctx, const unsigned char *key, const unsigned char *nonce, uint32_t counter);
+
+/* Generate the next CHACHA20_STRIDE bytes of keystream */
+void chacha20_keystream(ChaCha20Ctx *ctx);
+
+/* Return the next keystream byte, refilling the blocks when used up */
+static inline unsigned char chacha20_next_byte(ChaCha20Ctx *ctx)
+{
+    if (ctx->pos == CHACHA20_STRIDE)
+    {
+        chacha20_keystream(ctx);
+    }
+    return ctx->keystream[ctx->pos++];
+}
+
+/* Convert a hex string of exactly 2 * len digits into bytes */
+int chacha20_parse_hex(const char *hex, unsigned char *out, uint len);
+
+#endif
@@ -0,0 +1,357 @@
+#include "channel.h"
+#include "mem.h"
+#include "util.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "encode.h"
+#include "decode.h"
+#include "adaptive.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define CHANNEL_HAVE_SSSE3 1
+#endif
+
+/* Function Definitions */
+
+static pthread_once_t channel_once = PTHREAD_ONCE_INIT;
+static int channel_use_ssse3;
+
+static void channel_init(void)
+{
+#ifdef CHANNEL_HAVE_SSSE3
+    channel_use_ssse3 = __builtin_cpu_supports("ssse3");
+#endif
+}
+
+uint channel_parse_mask(const char *name)
+{
+    uint mask = 0;
+    for (const char *p = name; *p; p++)
+    {
+        uint bit = *p == 'b' ? CHANNEL_B : *p == 'g' ? CHANNEL_G : *p == 'r' ? CHANNEL_R : 0;
+        if (bit == 0 || (mask & bit))
+        {
+            return 0;
+        }
+        mask |= bit;
+    }
+    return mask;
+}
+
+const char *channel_mask_name(uint mask, char *name)
+{
+    char *p = name;
+    if (mask & CHANNEL_B)
+        *p++ = 'b';
+    if (mask & CHANNEL_G)
+        *p++ = 'g';
+    if (mask & CHANNEL_R)
+        *p++ = 'r';
+    *p = '\0';
+    return name;
+}
+
+/*
+ * Build the schedule
+ * Description: Gathered byte g of a 16 pixel block is channel g % count
+ * of pixel g / count, i.e. image byte 3 * (g / count) + offset[g % count].
+ * Each pshufb control picks the bytes of one 16 byte image vector that
+ * land in one gathered vector (0x80 zeroes the others), and the scatter
+ * controls are the inverse mapping.
+ */
+void channel_schedule(ChannelSchedule *sched, uint mask, const BmpInfo *bmp)
+{
+    memset(sched, 0, sizeof(*sched));
+    sched->bmp = *bmp;
+    sched->mask = mask;
+    for (uint c = 0; c < 3; c++)
+    {
+        if (mask & (1u << c))
+        {
+            sched->offset[sched->count++] = c;
+        }
+    }
+
+    // Step 1 : gather controls, gathered vector j from image vector i
+    memset(sched->gather, 0x80, sizeof(sched->gather));
+    for (uint g = 0; g < CHANNEL_BLOCK_PIXELS * sched->count; g++)
+    {
+        uint src = 3 * (g / sched->count) + sched->offset[g % sched->count];
+        sched->gather[g / 16][src / 16][g % 16] = (unsigned char)(src % 16);
+    }
+
+    // Step 2 : scatter controls and the bytes kept, image vector i from gathered vector j
+    memset(sched->scatter, 0x80, sizeof(sched->scatter));
+    memset(sched->keep, 0xFF, sizeof(sched->keep));
+    for (uint g = 0; g < CHANNEL_BLOCK_PIXELS * sched->count; g++)
+    {
+        uint dst = 3 * (g / sched->count) + sched->offset[g % sched->count];
+        sched->scatter[dst / 16][g / 16][dst % 16] = (unsigned char)(g % 16);
+        sched->keep[dst / 16][dst % 16] = 0;
+    }
+}
+
+#ifdef CHANNEL_HAVE_SSSE3
+/* One 16 pixel block, 48 image bytes to 16 * count gathered bytes */
+__attribute__((target("ssse3")))
+static void channel_gather_block(const unsigned char *src, unsigned char *out, const ChannelSchedule *sched)
+{
+    __m128i in[3];
+    for (int i = 0; i < 3; i++)
+    {
+        in[i] = _mm_loadu_si128((const __m128i *)(src + 16 * i));
+    }
+    for (uint j = 0; j < sched->count; j++)
+    {
+        __m128i v = _mm_shuffle_epi8(in[0], _mm_loadu_si128((const __m128i *)sched->gather[j][0]));
+        v = _mm_or_si128(v, _mm_shuffle_epi8(in[1], _mm_loadu_si128((const __m128i *)sched->gather[j][1])));
+        v = _mm_or_si128(v, _mm_shuffle_epi8(in[2], _mm_loadu_si128((const __m128i *)sched->gather[j][2])));
+        _mm_storeu_si128((__m128i *)(out + 16 * j), v);
+    }
+}
+
+/* One 16 pixel block, 16 * count gathered bytes back into 48 image bytes */
+__attribute__((target("ssse3")))
+static void channel_scatter_block(unsigned char *dst, const unsigned char *in, const ChannelSchedule *sched)
+{
+    __m128i g[3];
+    for (uint j = 0; j < sched->count; j++)
+    {
+        g[j] = _mm_loadu_si128((const __m128i *)(in + 16 * j));
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        __m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i *)(dst + 16 * i)),
+                                  _mm_loadu_si128((const __m128i *)sched->keep[i]));
+        for (uint j = 0; j < sched->count; j++)
+        {
+            v = _mm_or_si128(v, _mm_shuffle_epi8(g[j], _mm_loadu_si128((const __m128i *)sched->scatter[i][j])));
+        }
+        _mm_storeu_si128((__m128i *)(dst + 16 * i), v);
+    }
+}
+#endif
+
+/*
+ * Walk the schedule
+ * Description: Row by row, the pixel holding first is done byte by
+ * byte (some of its channels may be before first), then whole 16 pixel
+ * blocks with pshufb while count allows, then single pixels through the
+ * offset table. Padding bytes at the end of each row are skipped.
+ */
+static uint channel_walk(unsigned char *image, uint len, uint first, const ChannelSchedule *sched,
+                         unsigned char *buffer, uint count, int scatter, int simd)
+{
+    const BmpInfo *bmp = &sched->bmp;
+    uint pb = bmp->bpp / 8, k = sched->count, n = 0;
+    const uint *offset = sched->offset;
+
+    pthread_once(&channel_once, channel_init);
+    int fast = simd && channel_use_ssse3 && pb == 3;
+
+    for (uint r = 0; r < bmp->height && n < count; r++)
+    {
+        size_t row = (size_t)bmp->pixel_offset + (size_t)r * bmp->row_stride;
+        size_t row_end = row + (size_t)bmp->width * pb;
+        if (row_end <= first)
+        {
+            continue;
+        }
+        if (row_end > len)
+        {
+            break;
+        }
+        unsigned char *px = image + row;
+        uint x = 0;
+
+        // Step 1 : the pixel holding first
+        if (first > row)
+        {
+            x = (uint)((first - row) / pb);
+            for (uint c = 0; c < k && n < count; c++)
+            {
+                if (row + (size_t)x * pb + offset[c] >= first)
+                {
+                    unsigned char *b = px + (size_t)x * pb + offset[c];
+                    if (scatter)
+                        *b = buffer[n++];
+                    else
+                        buffer[n++] = *b;
+                }
+            }
+            x++;
+        }
+
+        // Step 2 : whole blocks
+#ifdef CHANNEL_HAVE_SSSE3
+        if (fast)
+        {
+            uint step = CHANNEL_BLOCK_PIXELS * k;
+            for (; x + CHANNEL_BLOCK_PIXELS <= bmp->width && n + step <= count; x += CHANNEL_BLOCK_PIXELS, n += step)
+            {
+                if (scatter)
+                    channel_scatter_block(px + 3 * x, buffer + n, sched);
+                else
+                    channel_gather_block(px + 3 * x, buffer + n, sched);
+            }
+        }
+#endif
+
+        // Step 3 : single pixels, the last one may be cut short by count
+        uint whole = (count - n) / k < bmp->width - x ? (count - n) / k : bmp->width - x;
+        for (uint end = x + whole; x < end; x++, n += k)
+        {
+            unsigned char *p = px + (size_t)x * pb;
+            for (uint c = 0; c < k; c++)
+            {
+                if (scatter)
+                    p[offset[c]] = buffer[n + c];
+                else
+                    buffer[n + c] = p[offset[c]];
+            }
+        }
+        for (uint c = 0; x < bmp->width && c < k && n < count; c++)
+        {
+            unsigned char *b = px + (size_t)x * pb + offset[c];
+            if (scatter)
+                *b = buffer[n++];
+            else
+                buffer[n++] = *b;
+        }
+    }
+    return n;
+}
+
+uint channel_gather(const unsigned char *image, uint len, uint first, const ChannelSchedule *sched,
+                    unsigned char *out, uint count, int simd)
+{
+    return channel_walk((unsigned char *)image, len, first, sched, out, count, 0, simd);
+}
+
+uint channel_scatter(unsigned char *image, uint len, uint first, const ChannelSchedule *sched,
+                     const unsigned char *in, uint count, int simd)
+{
+    return channel_walk(image, len, first, sched, (unsigned char *)in, count, 1, simd);
+}
+
+/*
+ * Run --bench-channels
+ * Description: The same payload (what a single channel can hold) is
+ * embedded and extracted with every mask, best of a few runs each:
+ * all channels is the plain loop over consecutive bytes, the others
+ * add the gather before and the scatter after, scalar and with SIMD
+ */
+ChannelStatus do_bench_channels(char *argv[])
+{
+    if (argv[2] == NULL)
+    {
+        printf("Give the image --> ./a.out --bench-channels <image.bmp>\n");
+        return ch_failure;
+    }
+    FILE *fptr = fopen(argv[2], "rb");
+    if (fptr == NULL)
+    {
+        perror(argv[2]);
+        return ch_failure;
+    }
+    uint len;
+    unsigned char *image = adaptive_read_image(fptr, &len);
+    fclose(fptr);
+
+    BmpInfo bmp;
+    if (image == NULL || len < BMP_HEADER_SIZE || !bmp_parse_header(image, &bmp) || !bmp_pixels_fit(&bmp, len))
+    {
+        printf("%s is not a 24 / 32 bit BMP\n", argv[2]);
+        mem_free(image);
+        return ch_failure;
+    }
+
+    // payload of one channel, 8 carrier bytes per byte
+    uint size = (uint)((unsigned long long)bmp.width * bmp.height / 8);
+    uint need = 8 * size;
+    unsigned char *payload = mem_alloc(size + 1), *carrier = mem_alloc(need + 1), *out = mem_alloc(size + 1);
+    if (payload == NULL || carrier == NULL || out == NULL)
+    {
+        mem_free(payload);
+        mem_free(carrier);
+        mem_free(out);
+        mem_free(image);
+        return ch_failure;
+    }
+    for (uint i = 0; i < size; i++)
+    {
+        payload[i] = (unsigned char)(i * 131 + 7);
+    }
+    printf("Payload : %.2f MB (one channel of %ux%u)\n", size / 1e6, bmp.width, bmp.height);
+
+    static const uint masks[] = {CHANNEL_ALL, CHANNEL_B, CHANNEL_G, CHANNEL_R, CHANNEL_B | CHANNEL_G,
+                                 CHANNEL_B | CHANNEL_R, CHANNEL_G | CHANNEL_R};
+    ChannelStatus status = ch_success;
+    for (uint m = 0; m < sizeof(masks) / sizeof(masks[0]); m++)
+    {
+        ChannelSchedule sched;
+        channel_schedule(&sched, masks[m], &bmp);
+        int all = masks[m] == CHANNEL_ALL;
+
+        for (int simd = all ? 1 : 0; simd <= 1; simd++)
+        {
+            double embed = 0, extract = 0;
+            for (int rep = 0; rep < 10; rep++)
+            {
+                struct timespec t0, t1, t2;
+                unsigned char *bytes = all ? image + bmp.pixel_offset : carrier;
+
+                // embed : gather, plain LSB loop, scatter
+                clock_gettime(CLOCK_MONOTONIC, &t0);
+                if (!all)
+                {
+                    channel_gather(image, len, bmp.pixel_offset, &sched, carrier, need, simd);
+                }
+                for (uint i = 0; i < size; i++)
+                {
+                    encode_byte_to_lsb((char)payload[i], (char *)bytes + 8 * i);
+                }
+                if (!all)
+                {
+                    channel_scatter(image, len, bmp.pixel_offset, &sched, carrier, need, simd);
+                }
+
+                // extract : gather, plain LSB loop
+                clock_gettime(CLOCK_MONOTONIC, &t1);
+                if (!all)
+                {
+                    channel_gather(image, len, bmp.pixel_offset, &sched, carrier, need, simd);
+                }
+                for (uint i = 0; i < size; i++)
+                {
+                    decode_byte_from_lsb((char *)out + i, (char *)bytes + 8 * i);
+                }
+                clock_gettime(CLOCK_MONOTONIC, &t2);
+
+                if (rep == 0 || elapsed_s(&t0, &t1) < embed)
+                    embed = elapsed_s(&t0, &t1);
+                if (rep == 0 || elapsed_s(&t1, &t2) < extract)
+                    extract = elapsed_s(&t1, &t2);
+            }
+            if (memcmp(out, payload, size) != 0)
+            {
+                status = ch_failure;
+            }
+
+            char name[4];
+            printf("%-3s %-6s : embed %8.1f MB/s, extract %8.1f MB/s%s\n", channel_mask_name(masks[m], name),
+                   all ? "plain" : simd ? "simd" : "scalar", embed > 0 ? size / 1e6 / embed : 0.0,
+                   extract > 0 ? size / 1e6 / extract : 0.0, memcmp(out, payload, size) ? " (MISMATCH)" : "");
+        }
+    }
+
+    mem_free(payload);
+    mem_free(carrier);
+    mem_free(out);
+    mem_free(image);
+    return status;
+}
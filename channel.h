@@ -0,0 +1,72 @@
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+#include "types.h" // Contains user defined types
+#include "bmp.h"   // Pixel array geometry
+
+/*
+ * Channel-selective embedding (--channels=<mask>)
+ * Payload bits only go to the selected colour channels of each pixel,
+ * e.g. blue only or blue + green. The selected bytes of the pixel array
+ * are gathered into a contiguous carrier with a schedule computed once
+ * per mask: rows start at pixel_offset + r * row_stride (padding is
+ * never used) and each pixel gives the bytes at the channel offsets.
+ * For 24 bit images whole blocks of 16 pixels (3 vectors) are moved
+ * with pshufb, using shuffle controls built from the same offsets.
+ */
+
+/* Channel bits of the mask, in BMP byte order */
+#define CHANNEL_B 0x1
+#define CHANNEL_G 0x2
+#define CHANNEL_R 0x4
+#define CHANNEL_ALL 0x7
+
+/* Pixels per SIMD block, and its size in 24 bit image bytes */
+#define CHANNEL_BLOCK_PIXELS 16
+#define CHANNEL_BLOCK_BYTES (3 * CHANNEL_BLOCK_PIXELS)
+
+/*
+ * Structure to store the gather / scatter schedule
+ * of one mask over one image
+ */
+
+typedef struct _ChannelSchedule
+{
+    BmpInfo bmp;                   // To store the geometry of the image
+    uint mask;                     // To store the selected channels
+    uint count;                    // To store the channels per pixel (1 to 3)
+    uint offset[3];                // To store the byte offset of each selected channel in a pixel
+
+    /* 16 pixel blocks of 24 bit images: gathered vector j, image vector i */
+    unsigned char gather[3][3][16];  // To store the pshufb control taking image vector i into gathered vector j
+    unsigned char scatter[3][3][16]; // To store the pshufb control taking gathered vector j into image vector i
+    unsigned char keep[3][16];       // To store 0xFF for image bytes the mask leaves alone
+} ChannelSchedule;
+
+/* Channel function prototype */
+
+/* Mask from a name made of the letters b, g, r (e.g. "b", "bg"), 0 when invalid */
+uint channel_parse_mask(const char *name);
+
+/* Name of a mask, written to name (at least 4 bytes) */
+const char *channel_mask_name(uint mask, char *name);
+
+/* Build the schedule of a mask for the image described by bmp */
+void channel_schedule(ChannelSchedule *sched, uint mask, const BmpInfo *bmp);
+
+/*
+ * Copy the selected bytes at or after offset first of the image (len
+ * bytes, from its start) to out, at most count of them, in file order.
+ * Returns the number copied.
+ */
+uint channel_gather(const unsigned char *image, uint len, uint first, const ChannelSchedule *sched,
+                    unsigned char *out, uint count, int simd);
+
+/* Write count gathered bytes back to the positions channel_gather took them from */
+uint channel_scatter(unsigned char *image, uint len, uint first, const ChannelSchedule *sched,
+                     const unsigned char *in, uint count, int simd);
+
+/* Run --bench-channels <image.bmp>, embed / extract throughput per mask */
+ChannelStatus do_bench_channels(char *argv[]);
+
+#endif
@@ -4,4 +4,40 @@
 /* Magic string to identify whether stegged or not */
 #define MAGIC_STRING "#*"
 
+/* Magic string for stego images whose magic is followed by a 32 bit flags word */
+#define MAGIC_STRING_EXT "#+"
+
+/* Magic string of FEC streams, the flags word follows it 3 times (bitwise majority) */
+#define MAGIC_STRING_FEC "#="
+
+/* Stream header flags */
+#define STEG_FLAG_CHACHA20 0x01 // Secret data is XORed with a ChaCha20 keystream
+#define STEG_FLAG_RS       0x02 // Secret data is Reed-Solomon coded, size fields stored 3 times
+#define STEG_FLAG_MATRIX   0x04 // Secret data is matrix embedded with a Hamming code
+#define STEG_FLAG_ADAPTIVE 0x08 // Secret data only goes to bytes with a high gradient score
+#define STEG_FLAG_CHANNELS 0x10 // Secret data only goes to the selected colour channels
+
+/* Reed-Solomon parity symbols per codeword, kept in bits 8-15 of the flags */
+#define STEG_RS_NSYM(flags) (((flags) >> 8) & 0xFF)
+#define STEG_RS_FLAGS(nsym) (STEG_FLAG_RS | ((uint)(nsym) << 8))
+
+/* Matrix embedding parameter p, kept in bits 16-19 of the flags */
+#define STEG_MATRIX_P(flags) (((flags) >> 16) & 0x0F)
+#define STEG_MATRIX_FLAGS(p) (STEG_FLAG_MATRIX | ((uint)(p) << 16))
+
+/* Colour channel mask (bit 0 B, bit 1 G, bit 2 R), kept in bits 20-22 of the flags */
+#define STEG_CHANNEL_MASK(flags) (((flags) >> 20) & 0x07)
+#define STEG_CHANNEL_FLAGS(mask) (STEG_FLAG_CHANNELS | ((uint)(mask) << 20))
+
+/* Edge-adaptive score threshold, kept in bits 24-31 of the flags */
+#define STEG_ADAPTIVE_T(flags) (((flags) >> 24) & 0xFF)
+#define STEG_ADAPTIVE_FLAGS(t) (STEG_FLAG_ADAPTIVE | ((uint)(t) << 24))
+
+/* Number of copies of each size field (and of the flags word) for the given flags */
+#define STEG_SIZE_COPIES(flags) (((flags) & STEG_FLAG_RS) ? 3 : 1)
+
+/* Magic string and header bits of the flags word(s) of a stream */
+#define STEG_MAGIC(flags) (!(flags) ? MAGIC_STRING : (((flags) & STEG_FLAG_RS) ? MAGIC_STRING_FEC : MAGIC_STRING_EXT))
+#define STEG_FLAGS_BITS(flags) ((flags) ? 32 * STEG_SIZE_COPIES(flags) : 0)
+
 #endif
@@ -1,9 +1,17 @@
 #include "decode.h"
+#include "mem.h"
 #include "common.h"
 #include "types.h"
+#include "chacha20.h"
+#include "rs.h"
+#include "matrix.h"
+#include "adaptive.h"
+#include "channel.h"
+#include "trace.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 // Step 1: Read and validate command line arguments
 DecodeStatus read_and_validate_decode_args(char *argv[], DecodeInfo *decInfo)
@@ -43,12 +51,56 @@ DecodeStatus read_and_validate_decode_args(char *argv[], DecodeInfo *decInfo)
         decInfo->secret_fname = "decoded";
     }
 
+    // Step 3: Read the optional --key=<hex> / --nonce=<hex> arguments
+    return read_decode_options(argv, 4, decInfo);
+}
+
+// Step 1a: Read the decode options from argv[first] onwards
+DecodeStatus read_decode_options(char *argv[], int first, DecodeInfo *decInfo)
+{
+    for (int i = first; argv[i] != NULL; i++)
+    {
+        if (strncmp(argv[i], "--key=", 6) == 0)
+        {
+            if (!chacha20_parse_hex(argv[i] + 6, decInfo->key, sizeof(decInfo->key)))
+            {
+                printf("Key must be 64 hex digits\n");
+                return d_failure;
+            }
+            decInfo->flags |= STEG_FLAG_CHACHA20;
+        }
+        else if (strncmp(argv[i], "--nonce=", 8) == 0)
+        {
+            if (!chacha20_parse_hex(argv[i] + 8, decInfo->nonce, sizeof(decInfo->nonce)))
+            {
+                printf("Nonce must be 24 hex digits\n");
+                return d_failure;
+            }
+            decInfo->nonce_given = 1;
+        }
+        else if (strncmp(argv[i], "--range=", 8) == 0)
+        {
+            if (sscanf(argv[i] + 8, "%u:%u", &decInfo->range_offset, &decInfo->range_len) != 2 ||
+                decInfo->range_len == 0)
+            {
+                printf("Range must be <offset>:<length> in bytes of the secret file\n");
+                return d_failure;
+            }
+        }
+    }
+
     return d_success;
 }
 
 // Step 2: Open decode files
 DecodeStatus open_decode_files(DecodeInfo *decInfo)
 {
+    // Stream already opened by the caller (e.g. a tar member)
+    if (decInfo->fptr_stego_image != NULL)
+    {
+        return d_success;
+    }
+
     // Stego Image file
     decInfo->fptr_stego_image = fopen(decInfo->stego_image_fname, "rb");
     // Do Error handling
@@ -123,20 +175,72 @@ DecodeStatus decode_byte_from_lsb(char *data, char *image_buffer)
     return e_success;
 }
 
-// Step 6: Decode secret file extension size
-DecodeStatus decode_secret_file_extn_size(int *size, DecodeInfo *decInfo)
+// Step 5a: Decode stream header flags stored after MAGIC_STRING_EXT (once) or MAGIC_STRING_FEC (3 times)
+DecodeStatus decode_stream_flags(uint *flags, int copies, DecodeInfo *decInfo)
 {
     char imageBuffer[32];
+    int value[3];
 
-    // Read 32 bytes from stego image
-    fread(imageBuffer, sizeof(char), 32, decInfo->fptr_stego_image);
+    for (int copy = 0; copy < copies; copy++)
+    {
+        // Read 32 bytes from stego image
+        if (fread(imageBuffer, sizeof(char), 32, decInfo->fptr_stego_image) != 32)
+        {
+            return d_failure;
+        }
 
-    // Decode size from LSBs
-    decode_size_from_lsb(size, imageBuffer);
+        // Flags word is stored the same way as a size
+        decode_size_from_lsb(&value[copy], imageBuffer);
+    }
 
+    // Bitwise majority, a flipped LSB in one copy does not change the stream options
+    if (copies == 3)
+    {
+        *flags = (uint)((value[0] & value[1]) | (value[0] & value[2]) | (value[1] & value[2]));
+    }
+    else
+    {
+        *flags = (uint)value[0];
+    }
     return d_success;
 }
 
+// Step 5b: Decode a size field, taking the bitwise majority when it is stored 3 times
+static DecodeStatus decode_size_field(int *size, DecodeInfo *decInfo)
+{
+    char imageBuffer[32];
+    int value[3];
+    int copies = STEG_SIZE_COPIES(decInfo->flags);
+
+    for (int copy = 0; copy < copies; copy++)
+    {
+        // Read 32 bytes from stego image
+        if (fread(imageBuffer, sizeof(char), 32, decInfo->fptr_stego_image) != 32)
+        {
+            return d_failure;
+        }
+
+        // Decode size from LSBs
+        decode_size_from_lsb(&value[copy], imageBuffer);
+    }
+
+    if (copies == 3)
+    {
+        *size = (value[0] & value[1]) | (value[0] & value[2]) | (value[1] & value[2]);
+    }
+    else
+    {
+        *size = value[0];
+    }
+    return d_success;
+}
+
+// Step 6: Decode secret file extension size
+DecodeStatus decode_secret_file_extn_size(int *size, DecodeInfo *decInfo)
+{
+    return decode_size_field(size, decInfo);
+}
+
 // Step 7: Decode secret file extension
 DecodeStatus decode_secret_file_extn(char *file_extn, int size, DecodeInfo *decInfo)
 {
@@ -157,14 +261,7 @@ DecodeStatus decode_secret_file_extn(char *file_extn, int size, DecodeInfo *decI
 // Step 8: Decode secret file size
 DecodeStatus decode_secret_file_size(int *file_size, DecodeInfo *decInfo)
 {
-    char imageBuffer[32];
-
-    // Read 32 bytes from stego image
-    fread(imageBuffer, sizeof(char), 32, decInfo->fptr_stego_image);
-
-    // Decode size from LSBs
-    decode_size_from_lsb(file_size, imageBuffer);
-    return d_success;
+    return decode_size_field(file_size, decInfo);
 }
 
 // Step 9: Decode secret file data
@@ -172,6 +269,20 @@ DecodeStatus decode_secret_file_data(DecodeInfo *decInfo, int file_size)
 {
     char imageBuffer[8];
     char ch;
+    ChaCha20Ctx cipher;
+
+    // Coded / matrix / adaptive / channel-selective embedded payload is extracted in memory first
+    if (decInfo->flags & (STEG_FLAG_RS | STEG_FLAG_MATRIX | STEG_FLAG_ADAPTIVE | STEG_FLAG_CHANNELS))
+    {
+        return decode_secret_file_data_block(decInfo, file_size);
+    }
+
+    // Keystream is generated in blocks and consumed inside the extract loop
+    int decrypt = (decInfo->flags & STEG_FLAG_CHACHA20) != 0;
+    if (decrypt)
+    {
+        chacha20_init(&cipher, decInfo->key, decInfo->nonce, 1);
+    }
 
     // Open File secret_fname in write mode
     FILE *fptr_output = fopen(decInfo->secret_fname, "wb");
@@ -189,6 +300,12 @@ DecodeStatus decode_secret_file_data(DecodeInfo *decInfo, int file_size)
         // Decode data from LSBs
         decode_byte_from_lsb(&ch, imageBuffer);
 
+        // Decrypt the byte on the fly
+        if (decrypt)
+        {
+            ch ^= chacha20_next_byte(&cipher);
+        }
+
         // write 8 bytes from stego image
         fwrite(&ch, sizeof(char), 1, fptr_output);
     }
@@ -199,25 +316,351 @@ DecodeStatus decode_secret_file_data(DecodeInfo *decInfo, int file_size)
     return d_success;
 }
 
-// Step 10 : Do Decoding
-DecodeStatus do_decoding(DecodeInfo *decInfo)
+// Step 9a: Decode secret file data with the whole payload in memory (FEC / matrix embedding)
+DecodeStatus decode_secret_file_data_block(DecodeInfo *decInfo, int file_size)
 {
-    // Step 1 : open the files
-    if (open_decode_files(decInfo) == d_success)
+    uint stored_size = file_size;
+    if (decInfo->flags & STEG_FLAG_RS)
     {
-        // True print the prompt message
-        printf("All files opened success\n");
+        stored_size = rs_encoded_size(file_size, STEG_RS_NSYM(decInfo->flags));
+    }
+
+    unsigned char *stored = mem_calloc(stored_size + 1, 1);
+    unsigned char *data = mem_alloc(file_size + 1);
+    if (stored == NULL || data == NULL)
+    {
+        mem_free(stored);
+        mem_free(data);
+        return d_failure;
+    }
+
+    // Step 1: extract all stored bytes
+    if (decode_payload_from_lsb(stored, stored_size, decInfo) != d_success)
+    {
+        mem_free(stored);
+        mem_free(data);
+        return d_failure;
+    }
+
+    // Step 2: correct and de-interleave
+    if (decInfo->flags & STEG_FLAG_RS)
+    {
+        int corrected = rs_decode_interleaved(stored, file_size, STEG_RS_NSYM(decInfo->flags), data);
+        if (corrected < 0)
+        {
+            printf("FEC : too many errors to correct\n");
+            mem_free(stored);
+            mem_free(data);
+            return d_failure;
+        }
+        printf("FEC : %d symbols corrected\n", corrected);
     }
     else
     {
-        // False return d_failure
+        memcpy(data, stored, file_size);
+    }
+    mem_free(stored);
+
+    // Step 3: decrypt after correction
+    if (decInfo->flags & STEG_FLAG_CHACHA20)
+    {
+        ChaCha20Ctx cipher;
+        chacha20_init(&cipher, decInfo->key, decInfo->nonce, 1);
+        for (int i = 0; i < file_size; i++)
+        {
+            data[i] ^= chacha20_next_byte(&cipher);
+        }
+    }
+
+    // Step 4: write the output file
+    FILE *fptr_output = fopen(decInfo->secret_fname, "wb");
+    if (fptr_output == NULL)
+    {
+        mem_free(data);
+        return d_failure;
+    }
+    fwrite(data, 1, file_size, fptr_output);
+    fclose(fptr_output);
+    mem_free(data);
+
+    return d_success;
+}
+
+/*
+ * Extract from a carrier gathered in memory
+ * Description: need bytes of carrier are read as a contiguous image
+ * (plain or matrix), with flag (the selection that gathered them) off
+ */
+static DecodeStatus decode_payload_gathered(unsigned char *payload, uint size, DecodeInfo *decInfo, char *carrier,
+                                            uint need, uint flag)
+{
+    FILE *fptr_stego = decInfo->fptr_stego_image;
+    decInfo->fptr_stego_image = fmemopen(carrier, need + 1, "rb");
+    DecodeStatus status = d_failure;
+    if (decInfo->fptr_stego_image != NULL)
+    {
+        decInfo->flags &= ~flag;
+        status = decode_payload_from_lsb(payload, size, decInfo);
+        decInfo->flags |= flag;
+        fclose(decInfo->fptr_stego_image);
+    }
+    decInfo->fptr_stego_image = fptr_stego;
+    return status;
+}
+
+/*
+ * Step 9c: Edge-adaptive extraction
+ * Description: The gradient map is rebuilt from the stego image (only
+ * LSBs were changed, the scores use the high bits), the selected bytes
+ * are gathered and read back as a contiguous carrier
+ */
+static DecodeStatus decode_payload_adaptive(unsigned char *payload, uint size, DecodeInfo *decInfo)
+{
+    uint len, *positions;
+    long first = ftell(decInfo->fptr_stego_image);
+    unsigned char *image = adaptive_read_image(decInfo->fptr_stego_image, &len);
+    if (image == NULL)
+    {
+        return d_failure;
+    }
+
+    // Step 1: bytes selected by the gradient map
+    uint count = adaptive_select(image, len, first, STEG_ADAPTIVE_T(decInfo->flags), &positions);
+    uint need = 8 * size;
+    if (decInfo->flags & STEG_FLAG_MATRIX)
+    {
+        need = matrix_carrier_bytes(size, STEG_MATRIX_P(decInfo->flags));
+    }
+    char *carrier = mem_alloc(need + 1);
+    if (positions == NULL || count < need || carrier == NULL)
+    {
+        printf("Only %u image bytes pass the adaptive threshold, %u needed\n", count, need);
+        mem_free(positions);
+        mem_free(carrier);
+        mem_free(image);
+        return d_failure;
+    }
+    for (uint k = 0; k < need; k++)
+    {
+        carrier[k] = image[positions[k]];
+    }
+    mem_free(positions);
+    mem_free(image);
+
+    // Step 2: extract from the gathered bytes through a memory stream
+    DecodeStatus status = decode_payload_gathered(payload, size, decInfo, carrier, need, STEG_FLAG_ADAPTIVE);
+    mem_free(carrier);
+    return status;
+}
+
+/*
+ * Step 9f: Channel-selective extraction
+ * Description: The selected channels of the pixels past the stream
+ * header are gathered with the channel schedule of the mask in the
+ * flags and read back as a contiguous carrier
+ */
+static DecodeStatus decode_payload_channels(unsigned char *payload, uint size, DecodeInfo *decInfo)
+{
+    uint len;
+    long first = ftell(decInfo->fptr_stego_image);
+    unsigned char *image = adaptive_read_image(decInfo->fptr_stego_image, &len);
+    BmpInfo bmp;
+    if (image == NULL || len < BMP_HEADER_SIZE || !bmp_parse_header(image, &bmp) || !bmp_pixels_fit(&bmp, len))
+    {
+        mem_free(image);
+        return d_failure;
+    }
+
+    // Step 1: gather the selected channels
+    ChannelSchedule sched;
+    channel_schedule(&sched, STEG_CHANNEL_MASK(decInfo->flags), &bmp);
+    uint need = 8 * size;
+    if (decInfo->flags & STEG_FLAG_MATRIX)
+    {
+        need = matrix_carrier_bytes(size, STEG_MATRIX_P(decInfo->flags));
+    }
+    char *carrier = mem_alloc(need + 1);
+    uint count = carrier != NULL ? channel_gather(image, len, first, &sched, (unsigned char *)carrier, need, 1) : 0;
+    mem_free(image);
+    if (count < need)
+    {
+        printf("Only %u image bytes in the selected channels, %u needed\n", count, need);
+        mem_free(carrier);
+        return d_failure;
+    }
+
+    // Step 2: extract from the gathered bytes through a memory stream
+    DecodeStatus status = decode_payload_gathered(payload, size, decInfo, carrier, need, STEG_FLAG_CHANNELS);
+    mem_free(carrier);
+    return status;
+}
+
+// Step 9b: Extract a payload buffer (zeroed by the caller), plain LSB or matrix embedded
+DecodeStatus decode_payload_from_lsb(unsigned char *payload, uint size, DecodeInfo *decInfo)
+{
+    if (decInfo->flags & STEG_FLAG_ADAPTIVE)
+    {
+        return decode_payload_adaptive(payload, size, decInfo);
+    }
+    if (decInfo->flags & STEG_FLAG_CHANNELS)
+    {
+        return decode_payload_channels(payload, size, decInfo);
+    }
+    if (decInfo->flags & STEG_FLAG_MATRIX)
+    {
+        uint p = STEG_MATRIX_P(decInfo->flags);
+        uint n = MATRIX_BLOCK_LEN(p);
+        char block[MATRIX_BLOCK_LEN(MATRIX_MAX_P)];
+        unsigned long bits = 8UL * size;
+
+        for (unsigned long bitpos = 0; bitpos < bits; bitpos += p)
+        {
+            fread(block, sizeof(char), n, decInfo->fptr_stego_image);
+            matrix_put_bits(payload, size, bitpos, p, matrix_syndrome(block, p));
+        }
+    }
+    else
+    {
+        char imageBuffer[8];
+        for (uint i = 0; i < size; i++)
+        {
+            char ch;
+            fread(imageBuffer, sizeof(char), 8, decInfo->fptr_stego_image);
+            decode_byte_from_lsb(&ch, imageBuffer);
+            payload[i] = (unsigned char)ch;
+        }
+    }
+    return d_success;
+}
+
+/* Read n carrier bytes at pos, positioned when the stream has a descriptor (not for tar members) */
+static DecodeStatus read_carrier(FILE *fptr, long pos, void *buffer, size_t n)
+{
+    int fd = fileno(fptr);
+    if (fd >= 0)
+    {
+        return pread(fd, buffer, n, pos) == (ssize_t)n ? d_success : d_failure;
+    }
+    return fseek(fptr, pos, SEEK_SET) == 0 && fread(buffer, 1, n, fptr) == n ? d_success : d_failure;
+}
+
+/*
+ * Step 9d: Decode a byte range of the secret
+ * Input: stream positioned at the first data byte (after decode_stream_header)
+ * Description: Byte i of the secret is in the 8 carrier bytes at 8 * i,
+ * or with matrix embedding in the blocks holding bits 8 * i .. 8 * i + 7,
+ * so only those carrier bytes are read. The ChaCha20 block counter is
+ * set from the offset. FEC codewords are interleaved over the whole
+ * payload and the adaptive selection needs the whole image, so those
+ * streams have no random access, and channel-selective streams are
+ * read through the channel schedule of the whole payload.
+ */
+DecodeStatus decode_secret_range(DecodeInfo *decInfo, int file_size, uint offset, uint len, unsigned char *out)
+{
+    if (decInfo->flags & (STEG_FLAG_RS | STEG_FLAG_ADAPTIVE | STEG_FLAG_CHANNELS))
+    {
+        printf("Byte ranges cannot be decoded from FEC / adaptive / channel-selective streams, decode the whole secret\n");
         return d_failure;
     }
+    if (file_size < 0 || offset > (uint)file_size || len > (uint)file_size - offset)
+    {
+        printf("Range %u:%u is outside the %d byte secret\n", offset, len, file_size);
+        return d_failure;
+    }
+    long data_pos = ftell(decInfo->fptr_stego_image);
 
+    // Step 1: carrier bytes of the range
+    if (decInfo->flags & STEG_FLAG_MATRIX)
+    {
+        uint p = STEG_MATRIX_P(decInfo->flags);
+        uint n = MATRIX_BLOCK_LEN(p);
+        unsigned long first = 8UL * offset / p, last = (8UL * ((unsigned long)offset + len) + p - 1) / p;
+        unsigned long base_bit = first * p / 8 * 8; // first bit of the byte holding block first
+        uint span = (uint)((last * p - base_bit + 7) / 8);
+
+        char *carrier = mem_alloc((last - first) * n + 1);
+        unsigned char *bytes = mem_calloc(span + 1, 1);
+        if (carrier == NULL || bytes == NULL ||
+            read_carrier(decInfo->fptr_stego_image, data_pos + (long)(first * n), carrier, (last - first) * n) != d_success)
+        {
+            mem_free(carrier);
+            mem_free(bytes);
+            return d_failure;
+        }
+        for (unsigned long b = first; b < last; b++)
+        {
+            matrix_put_bits(bytes, span, b * p - base_bit, p, matrix_syndrome(carrier + (b - first) * n, p));
+        }
+        memcpy(out, bytes + (offset - base_bit / 8), len);
+        mem_free(carrier);
+        mem_free(bytes);
+    }
+    else
+    {
+        char *carrier = mem_alloc(8UL * len + 1);
+        if (carrier == NULL ||
+            read_carrier(decInfo->fptr_stego_image, data_pos + 8L * offset, carrier, 8UL * len) != d_success)
+        {
+            mem_free(carrier);
+            return d_failure;
+        }
+        for (uint i = 0; i < len; i++)
+        {
+            decode_byte_from_lsb((char *)&out[i], carrier + 8UL * i);
+        }
+        mem_free(carrier);
+    }
+
+    // Step 2: keystream from the block holding byte offset
+    if (decInfo->flags & STEG_FLAG_CHACHA20)
+    {
+        ChaCha20Ctx cipher;
+        chacha20_init(&cipher, decInfo->key, decInfo->nonce, 1 + offset / 64);
+        for (uint i = 0; i < offset % 64; i++)
+        {
+            chacha20_next_byte(&cipher);
+        }
+        for (uint i = 0; i < len; i++)
+        {
+            out[i] ^= chacha20_next_byte(&cipher);
+        }
+    }
+    return d_success;
+}
+
+/*
+ * Step 9e: Library call for a byte range
+ * Input: stego_image_fname (or an open fptr_stego_image), key / nonce when encrypted
+ * Output: len bytes of the secret from offset in out
+ */
+DecodeStatus decode_range(DecodeInfo *decInfo, uint offset, uint len, unsigned char *out)
+{
+    char file_extn[10];
+    int secret_file_size;
+
+    if (open_decode_files(decInfo) != d_success)
+    {
+        return d_failure;
+    }
+    DecodeStatus status = decode_stream_header(decInfo, file_extn, &secret_file_size);
+    if (status == d_success)
+    {
+        status = decode_secret_range(decInfo, secret_file_size, offset, len, out);
+    }
+    fclose(decInfo->fptr_stego_image);
+    decInfo->fptr_stego_image = NULL;
+    return status;
+}
+
+// Step 10 : Decode the stream header, the stream is left at the first data byte
+DecodeStatus decode_stream_header(DecodeInfo *decInfo, char *file_extn, int *secret_file_size)
+{
     // Step 2 : skip the header
     fseek(decInfo->fptr_stego_image, 54, SEEK_SET);
 
+    trace_stage(&decInfo->trace, "magic_string", decInfo->stego_image_fname);
     // Step 3 : decode_magic_string(MAGIC_STRING, decInfo) == d_success
+    uint stream_flags = 0;
     if (decode_magic_string(MAGIC_STRING, decInfo) == d_success)
     {
         // true print the prompt message
@@ -225,13 +668,77 @@ DecodeStatus do_decoding(DecodeInfo *decInfo)
     }
     else
     {
-        // false return d_failure
+        // Not a plain stream, retry for MAGIC_STRING_EXT followed by flags, then MAGIC_STRING_FEC and 3 copies
+        fseek(decInfo->fptr_stego_image, 54, SEEK_SET);
+        int ext = decode_magic_string(MAGIC_STRING_EXT, decInfo) == d_success;
+        if (!ext)
+        {
+            fseek(decInfo->fptr_stego_image, 54, SEEK_SET);
+        }
+        if ((ext || decode_magic_string(MAGIC_STRING_FEC, decInfo) == d_success) &&
+            decode_stream_flags(&stream_flags, ext ? 1 : 3, decInfo) == d_success)
+        {
+            printf("Magic string decoded, stream flags : 0x%x\n", stream_flags);
+        }
+        else
+        {
+            // false return d_failure
+            return d_failure;
+        }
+        if (!ext && !(stream_flags & STEG_FLAG_RS))
+        {
+            printf("Stream flags 0x%x do not match the FEC magic string\n", stream_flags);
+            return d_failure;
+        }
+    }
+
+    // Step 3a : check the options needed by the stream were given
+    if ((stream_flags & STEG_FLAG_CHACHA20) && (!(decInfo->flags & STEG_FLAG_CHACHA20) || !decInfo->nonce_given))
+    {
+        printf("Secret data is encrypted, give --key=<hex> and --nonce=<hex>\n");
+        return d_failure;
+    }
+    decInfo->flags = stream_flags;
+
+    // Step 3b : the flags word is untrusted input, its parameters must be ones the encoder can write
+    if ((stream_flags & STEG_FLAG_RS) &&
+        (STEG_RS_NSYM(stream_flags) < 2 || STEG_RS_NSYM(stream_flags) > RS_MAX_NSYM))
+    {
+        printf("Stream flags 0x%x give %u FEC parity symbols, not 2 to %d\n", stream_flags,
+               STEG_RS_NSYM(stream_flags), RS_MAX_NSYM);
+        return d_failure;
+    }
+    if ((stream_flags & STEG_FLAG_MATRIX) &&
+        (STEG_MATRIX_P(stream_flags) < MATRIX_MIN_P || STEG_MATRIX_P(stream_flags) > MATRIX_MAX_P))
+    {
+        printf("Stream flags 0x%x give matrix embedding p = %u, not %d to %d\n", stream_flags,
+               STEG_MATRIX_P(stream_flags), MATRIX_MIN_P, MATRIX_MAX_P);
+        return d_failure;
+    }
+    if ((stream_flags & STEG_FLAG_CHANNELS) &&
+        (STEG_CHANNEL_MASK(stream_flags) == 0 || STEG_CHANNEL_MASK(stream_flags) == CHANNEL_ALL))
+    {
+        printf("Stream flags 0x%x give channel mask %u, not a strict subset of b, g and r\n", stream_flags,
+               STEG_CHANNEL_MASK(stream_flags));
+        return d_failure;
+    }
+    if ((stream_flags & STEG_FLAG_ADAPTIVE) &&
+        (STEG_ADAPTIVE_T(stream_flags) < ADAPTIVE_MIN_T || STEG_ADAPTIVE_T(stream_flags) > ADAPTIVE_MAX_T))
+    {
+        printf("Stream flags 0x%x give adaptive threshold %u, not %d to %d\n", stream_flags,
+               STEG_ADAPTIVE_T(stream_flags), ADAPTIVE_MIN_T, ADAPTIVE_MAX_T);
+        return d_failure;
+    }
+    if ((stream_flags & STEG_FLAG_ADAPTIVE) && (stream_flags & STEG_FLAG_CHANNELS))
+    {
+        printf("Stream flags 0x%x mix adaptive and channel embedding\n", stream_flags);
         return d_failure;
     }
 
+    trace_stage(&decInfo->trace, "extn", decInfo->stego_image_fname);
     // Step 4: Decode the size of the secret file extension
     int extn_size;
-    if (decode_secret_file_extn_size(&extn_size, decInfo) == d_success)
+    if (decode_secret_file_extn_size(&extn_size, decInfo) == d_success && extn_size >= 0 && extn_size < 10)
     {
         printf("Secret file extension size decoded : %d\n", extn_size);
     }
@@ -241,7 +748,6 @@ DecodeStatus do_decoding(DecodeInfo *decInfo)
     }
 
     // Step 5: Decode the data of secret file extension
-    char file_extn[10];
     if (decode_secret_file_extn(file_extn, extn_size, decInfo) == d_success)
     {
         printf("Secret file extension decoded : %s\n", file_extn);
@@ -251,34 +757,111 @@ DecodeStatus do_decoding(DecodeInfo *decInfo)
         return d_failure;
     }
 
+    trace_stage(&decInfo->trace, "secret_size", decInfo->stego_image_fname);
     // Step 6: Decode the secret file size
-    int secret_file_size;
-    if (decode_secret_file_size(&secret_file_size, decInfo) == d_success)
+    if (decode_secret_file_size(secret_file_size, decInfo) == d_success)
     {
-        printf("Secret file size decoded : %d\n", secret_file_size);
+        printf("Secret file size decoded : %d\n", *secret_file_size);
     }
     else
     {
         return d_failure;
     }
 
+    // Step 6a: a damaged size field must not send the reads past the image
+    long data_pos = ftell(decInfo->fptr_stego_image);
+    fseek(decInfo->fptr_stego_image, 0, SEEK_END);
+    long image_left = ftell(decInfo->fptr_stego_image) - data_pos;
+    fseek(decInfo->fptr_stego_image, data_pos, SEEK_SET);
+
+    long stored_bytes = -1;
+    if (*secret_file_size >= 0)
+    {
+        uint stored_size = *secret_file_size;
+        if (decInfo->flags & STEG_FLAG_RS)
+        {
+            stored_size = rs_encoded_size(*secret_file_size, STEG_RS_NSYM(decInfo->flags));
+        }
+        stored_bytes = 8L * stored_size;
+        if (decInfo->flags & STEG_FLAG_MATRIX)
+        {
+            stored_bytes = matrix_carrier_bytes(stored_size, STEG_MATRIX_P(decInfo->flags));
+        }
+    }
+    if (stored_bytes < 0 || stored_bytes > image_left)
+    {
+        printf("Secret file size %d does not fit in the image\n", *secret_file_size);
+        return d_failure;
+    }
+
+    return d_success;
+
+}
+
+// Step 11 : Decoding steps, each one traced as a stage
+static DecodeStatus decode_steps(DecodeInfo *decInfo)
+{
+    trace_stage(&decInfo->trace, "open_files", decInfo->stego_image_fname);
+    // Step 1 : open the files
+    if (open_decode_files(decInfo) == d_success)
+    {
+        // True print the prompt message
+        printf("All files opened success\n");
+    }
+    else
+    {
+        // False return d_failure
+        return d_failure;
+    }
+
+    // Step 2 - 6 : magic string, flags, extension and size
+    char file_extn[10];
+    int secret_file_size;
+    if (decode_stream_header(decInfo, file_extn, &secret_file_size) != d_success)
+    {
+        return d_failure;
+    }
+
     // Step 7: Prepare output file name
     char *dot = strrchr(decInfo->secret_fname, '.');
-    if (dot != NULL)
+    char *slash = strrchr(decInfo->secret_fname, '/');
+    if (dot != NULL && (slash == NULL || dot > slash))
     {
         *dot = '\0'; // remove existing extension if any
     }
 
     // Now safely append decoded extension
-    sprintf(decInfo->extn_secret_file, "%s%s", decInfo->secret_fname, file_extn);
+    snprintf(decInfo->output_fname, sizeof(decInfo->output_fname), "%s%s", decInfo->secret_fname, file_extn);
 
     // Update pointer to new name
-    decInfo->secret_fname = decInfo->extn_secret_file;
+    decInfo->secret_fname = decInfo->output_fname;
 
     printf("Output file created: %s\n", decInfo->secret_fname);
 
-    // Step 8: Decode the secret file data
-    if (decode_secret_file_data(decInfo, secret_file_size) == d_success)
+    trace_stage(&decInfo->trace, "secret_data", decInfo->stego_image_fname);
+    // Step 8: Decode the secret file data (or only the --range slice of it)
+    if (decInfo->range_len > 0)
+    {
+        uint len = decInfo->range_len;
+        if (decInfo->range_offset < (uint)secret_file_size && len > (uint)secret_file_size - decInfo->range_offset)
+        {
+            len = secret_file_size - decInfo->range_offset; // clipped at the end like dd
+        }
+        unsigned char *slice = mem_alloc(len + 1);
+        FILE *fptr_output = NULL;
+        if (slice == NULL ||
+            decode_secret_range(decInfo, secret_file_size, decInfo->range_offset, len, slice) != d_success ||
+            (fptr_output = fopen(decInfo->secret_fname, "wb")) == NULL)
+        {
+            mem_free(slice);
+            return d_failure;
+        }
+        fwrite(slice, 1, len, fptr_output);
+        fclose(fptr_output);
+        mem_free(slice);
+        printf("Secret file bytes %u to %u decoded success\n", decInfo->range_offset, decInfo->range_offset + len);
+    }
+    else if (decode_secret_file_data(decInfo, secret_file_size) == d_success)
     {
         printf("Secret file data decoded success\n");
     }
@@ -288,6 +871,18 @@ DecodeStatus do_decoding(DecodeInfo *decInfo)
     }
 
     fclose(decInfo->fptr_stego_image);
+    decInfo->fptr_stego_image = NULL;
 
     return d_success;
 }
+
+// Step 12 : Do Decoding, one trace span for the job around the stage spans
+DecodeStatus do_decoding(DecodeInfo *decInfo)
+{
+    TraceSpan job;
+    trace_begin(&job, "decode", decInfo->stego_image_fname);
+    DecodeStatus status = decode_steps(decInfo);
+    trace_end(&decInfo->trace);
+    trace_end(&job);
+    return status;
+}
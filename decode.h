@@ -3,6 +3,7 @@
 #include <stdio.h>
 
 #include "types.h" // Contains user defined types
+#include "trace.h" // Stage spans of --trace
 
 /*
  * Structure to store information required for
@@ -27,7 +28,17 @@ typedef struct _DecodeInfo
 
     /* Stego Image Info */
     char *stego_image_fname; // To store the dest file name
-    FILE *fptr_stego_image;  // To store the address of stego image
+    FILE *fptr_stego_image;  // To store the address of stego image (NULL once closed)
+    char output_fname[FILENAME_MAX]; // To store the output name with the decoded extension
+
+    /* Stream Options */
+    uint flags;              // To store the STEG_FLAG_* bits of the stream header
+    unsigned char key[32];   // To store the ChaCha20 key
+    unsigned char nonce[12]; // To store the ChaCha20 nonce
+    int nonce_given;         // To store whether --nonce was given (encoding modes require it with --key)
+    uint range_offset;       // To store the first secret byte asked for with --range
+    uint range_len;          // To store the number of bytes asked for (0 for the whole secret)
+    TraceSpan trace;         // To store the open --trace stage
 
 } DecodeInfo;
 
@@ -36,6 +47,9 @@ typedef struct _DecodeInfo
 /* Read and validate Decode args from argv */
 DecodeStatus read_and_validate_decode_args(char *argv[], DecodeInfo *decInfo);
 
+/* Read decode options (--key / --nonce) from argv[first] onwards */
+DecodeStatus read_decode_options(char *argv[], int first, DecodeInfo *decInfo);
+
 /* Perform the decoding */
 DecodeStatus do_decoding(DecodeInfo *decInfo);
 
@@ -53,6 +67,9 @@ uint get_file_size(FILE *fptr);
 /* Store Magic String */
 DecodeStatus decode_magic_string(const char *magic_string, DecodeInfo *decInfo);
 
+/* Decode stream header flags, stored copies times */
+DecodeStatus decode_stream_flags(uint *flags, int copies, DecodeInfo *decInfo);
+
 /* Decode extension size */
 DecodeStatus decode_secret_file_extn_size(int *size, DecodeInfo *decInfo);
 
@@ -62,9 +79,24 @@ DecodeStatus (decode_secret_file_extn(char *file_extn, int extn_size, DecodeInfo
 /* Decode secret file size */
 DecodeStatus decode_secret_file_size(int *file_size, DecodeInfo *decInfo);
 
+/* Decode magic string, flags, extension and size, leave the stream at the data */
+DecodeStatus decode_stream_header(DecodeInfo *decInfo, char *file_extn, int *secret_file_size);
+
+/* Decode len bytes of the secret from offset, reading only the carrier bytes holding them */
+DecodeStatus decode_secret_range(DecodeInfo *decInfo, int file_size, uint offset, uint len, unsigned char *out);
+
+/* Open the stego image, decode its header and return a byte range of the secret */
+DecodeStatus decode_range(DecodeInfo *decInfo, uint offset, uint len, unsigned char *out);
+
 /* Decode secret file data*/
 DecodeStatus decode_secret_file_data(DecodeInfo *decInfo, int file_size);
 
+/* Decode secret file data held in memory (Reed-Solomon / matrix embedding) */
+DecodeStatus decode_secret_file_data_block(DecodeInfo *decInfo, int file_size);
+
+/* Extract a payload buffer with plain LSB or matrix embedding */
+DecodeStatus decode_payload_from_lsb(unsigned char *payload, uint size, DecodeInfo *decInfo);
+
 /* Decode a byte into LSB of image data array */
 DecodeStatus decode_byte_from_lsb(char *data, char *image_buffer);
 
@@ -1,9 +1,26 @@
+#define _GNU_SOURCE // O_TMPFILE, linkat
 #include "encode.h"
+#include "mem.h"
 #include "types.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "common.h"
+#include "chacha20.h"
+#include "rs.h"
+#include "matrix.h"
+#include "decode.h"
+#include "bulkio.h"
+#include "adaptive.h"
+#include "channel.h"
+#include "trace.h"
+#include "quality.h"
+#include "bmp.h"
+#include "tune.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 /* Function Definitions */
 
@@ -33,9 +50,101 @@ uint get_image_size_for_bmp(FILE *fptr_image)
 
 uint get_file_size(FILE *fptr)
 {
-    // Find the size of secret file data
-    fseek(fptr, 0, SEEK_END);
-    uint size = ftell(fptr);
+    // Find the size of secret file data (fstat, the stream is not moved)
+    struct stat st;
+    if (fstat(fileno(fptr), &st) != 0)
+    {
+        return 0;
+    }
+    return (uint)st.st_size;
+}
+
+/*
+ * --verify-inline checks
+ * Description: The stream bits of an image buffer that was just
+ * written are read back with the decoder kernels and compared with
+ * the value embedded, so a bad embed fails the job without reading
+ * the stego image again
+ */
+static EncodeStatus verify_inline_result(EncodeInfo *encInfo, int match, uint len)
+{
+    encInfo->verified_bytes += len;
+    if (!match)
+    {
+        long end = ftell(encInfo->fptr_stego_image);
+        printf("Inline verification failed : image bytes %ld to %ld do not hold the embedded value\n", end - len, end - 1);
+        return e_failure;
+    }
+    return e_success;
+}
+
+static EncodeStatus verify_inline_byte(EncodeInfo *encInfo, char expected, char *imageBuffer)
+{
+    char data;
+    if (!encInfo->verify_inline)
+    {
+        return e_success;
+    }
+    decode_byte_from_lsb(&data, imageBuffer);
+    return verify_inline_result(encInfo, data == expected, 8);
+}
+
+static EncodeStatus verify_inline_size(EncodeInfo *encInfo, int expected, char *imageBuffer)
+{
+    int size;
+    if (!encInfo->verify_inline)
+    {
+        return e_success;
+    }
+    decode_size_from_lsb(&size, imageBuffer);
+    return verify_inline_result(encInfo, size == expected, 32);
+}
+
+static EncodeStatus verify_inline_block(EncodeInfo *encInfo, uint expected, const char *block, uint p)
+{
+    if (!encInfo->verify_inline)
+    {
+        return e_success;
+    }
+    return verify_inline_result(encInfo, matrix_syndrome(block, p) == expected, MATRIX_BLOCK_LEN(p));
+}
+
+/*
+ * Adaptive / channel-selective embedding is verified on the image
+ * buffer after the scatter, through the decoder: it selects the
+ * carrier bytes again from that image (gradient map or channel
+ * schedule) and must give back the stored payload
+ */
+static EncodeStatus verify_inline_scattered(EncodeInfo *encInfo, unsigned char *image, uint len, long first,
+                                            const unsigned char *payload, uint size, uint need)
+{
+    if (!encInfo->verify_inline)
+    {
+        return e_success;
+    }
+    DecodeInfo decInfo;
+    memset(&decInfo, 0, sizeof(decInfo));
+    decInfo.flags = encInfo->flags;
+    decInfo.fptr_stego_image = fmemopen(image, len, "rb");
+    unsigned char *back = mem_calloc(size + 1, 1);
+    int match = 0;
+    if (decInfo.fptr_stego_image != NULL && back != NULL && fseek(decInfo.fptr_stego_image, first, SEEK_SET) == 0)
+    {
+        match = decode_payload_from_lsb(back, size, &decInfo) == d_success && memcmp(back, payload, size) == 0;
+    }
+    if (decInfo.fptr_stego_image != NULL)
+    {
+        fclose(decInfo.fptr_stego_image);
+    }
+    mem_free(back);
+
+    encInfo->verified_bytes += need;
+    if (!match)
+    {
+        printf("Inline verification failed : the %u image bytes selected from the scattered image do not hold the payload\n", need);
+        return e_failure;
+    }
+    return e_success;
 }
 
 /*
@@ -78,8 +187,8 @@ EncodeStatus read_and_validate_encode_args(char *argv[], EncodeInfo *encInfo)
         encInfo->secret_fname = argv[3];
     }
 
-    // Step 3 : check argv[4] is having NULL or not
-    if (argv[4] != NULL) 
+    // Step 3 : check argv[4] is having NULL (or an option) or not
+    if (argv[4] != NULL && strncmp(argv[4], "--", 2) != 0)
     {
         encInfo->stego_image_fname = argv[4];
         dot = strrchr(encInfo->stego_image_fname, '.'); // strstr() is not safe here
@@ -96,6 +205,110 @@ EncodeStatus read_and_validate_encode_args(char *argv[], EncodeInfo *encInfo)
         encInfo->stego_image_fname = "encoded.bmp";
     }
 
+    // Step 4 : read the optional --key=<hex> / --nonce=<hex> arguments (--io defaults to the --tune profile)
+    int have_key = 0, have_nonce = 0;
+    encInfo->io_mode = tune_profile()->io_mode;
+    for (int i = 4; argv[i] != NULL; i++)
+    {
+        if (strncmp(argv[i], "--key=", 6) == 0)
+        {
+            if (!chacha20_parse_hex(argv[i] + 6, encInfo->key, sizeof(encInfo->key)))
+            {
+                printf("Key must be 64 hex digits\n");
+                return e_failure;
+            }
+            have_key = 1;
+        }
+        else if (strncmp(argv[i], "--nonce=", 8) == 0)
+        {
+            if (!chacha20_parse_hex(argv[i] + 8, encInfo->nonce, sizeof(encInfo->nonce)))
+            {
+                printf("Nonce must be 24 hex digits\n");
+                return e_failure;
+            }
+            have_nonce = 1;
+        }
+        else if (strncmp(argv[i], "--fec=", 6) == 0)
+        {
+            int nsym = atoi(argv[i] + 6);
+            if (nsym < 2 || nsym > RS_MAX_NSYM)
+            {
+                printf("FEC parity symbols must be 2 to %d\n", RS_MAX_NSYM);
+                return e_failure;
+            }
+            encInfo->flags |= STEG_RS_FLAGS(nsym);
+        }
+        else if (strncmp(argv[i], "--matrix=", 9) == 0)
+        {
+            int p = atoi(argv[i] + 9);
+            if (p < MATRIX_MIN_P || p > MATRIX_MAX_P)
+            {
+                printf("Matrix embedding p must be %d to %d\n", MATRIX_MIN_P, MATRIX_MAX_P);
+                return e_failure;
+            }
+            encInfo->flags |= STEG_MATRIX_FLAGS(p);
+        }
+        else if (strcmp(argv[i], "--adaptive") == 0 || strncmp(argv[i], "--adaptive=", 11) == 0)
+        {
+            int t = argv[i][10] == '=' ? atoi(argv[i] + 11) : ADAPTIVE_DEFAULT_T;
+            if (t < ADAPTIVE_MIN_T || t > ADAPTIVE_MAX_T)
+            {
+                printf("Adaptive threshold must be %d to %d\n", ADAPTIVE_MIN_T, ADAPTIVE_MAX_T);
+                return e_failure;
+            }
+            encInfo->flags |= STEG_ADAPTIVE_FLAGS(t);
+        }
+        else if (strncmp(argv[i], "--channels=", 11) == 0)
+        {
+            uint mask = channel_parse_mask(argv[i] + 11);
+            if (mask == 0)
+            {
+                printf("Channels must be a mix of b, g and r (e.g. b, bg)\n");
+                return e_failure;
+            }
+            // all three channels is the plain stream
+            if (mask != CHANNEL_ALL)
+            {
+                encInfo->flags |= STEG_CHANNEL_FLAGS(mask);
+            }
+        }
+        else if (strcmp(argv[i], "--verify-inline") == 0)
+        {
+            encInfo->verify_inline = 1;
+        }
+        else if (strcmp(argv[i], "--quality") == 0)
+        {
+            encInfo->quality = 1;
+        }
+        else if (strncmp(argv[i], "--io=", 5) == 0)
+        {
+            int mode = io_mode_from_name(argv[i] + 5);
+            if (mode < 0)
+            {
+                printf("I/O mode must be buffered, mmap or direct\n");
+                return e_failure;
+            }
+            encInfo->io_mode = (IoMode)mode;
+        }
+    }
+
+    if ((encInfo->flags & STEG_FLAG_ADAPTIVE) && (encInfo->flags & STEG_FLAG_CHANNELS))
+    {
+        printf("--adaptive and --channels cannot be combined\n");
+        return e_failure;
+    }
+
+    if (have_key)
+    {
+        encInfo->flags |= STEG_FLAG_CHACHA20;
+        if (!have_nonce)
+        {
+            // A default nonce would give every image of a key the same keystream
+            printf("--key needs --nonce=<24 hex digits>, use a new nonce for every image\n");
+            return e_failure;
+        }
+    }
+
     return e_success;
 }
 
@@ -120,18 +333,164 @@ EncodeStatus open_files(EncodeInfo *encInfo)
         return e_failure;
     }
 
-    // Stego Image file
-    encInfo->fptr_stego_image = fopen(encInfo->stego_image_fname, "w");
-    // Do Error handling
+    // Stego Image file is only created once the capacity check passed (open_stego_output)
+
+    // No failure return e_success
+    return e_success;
+}
+
+void stego_partial_fname(const char *stego_fname, char *out, size_t len)
+{
+    const char *slash = strrchr(stego_fname, '/');
+    int dir_len = slash != NULL ? (int)(slash - stego_fname + 1) : 0;
+    snprintf(out, len, "%.*s.%s.part", dir_len, stego_fname, stego_fname + dir_len);
+}
+
+/* Hidden name next to the stego image, unique in the process : .<name>.<pid>.<n>.tmp */
+static void stego_temp_fname(EncodeInfo *encInfo)
+{
+    static unsigned long serial;
+    const char *fname = encInfo->stego_image_fname, *slash = strrchr(fname, '/');
+    int dir_len = slash != NULL ? (int)(slash - fname + 1) : 0;
+    snprintf(encInfo->stego_work_fname, sizeof(encInfo->stego_work_fname), "%.*s.%s.%ld.%lu.tmp", dir_len, fname,
+             fname + dir_len, (long)getpid(), __atomic_fetch_add(&serial, 1, __ATOMIC_RELAXED));
+}
+
+/*
+ * Step 2a : create the stego image
+ * Description: The output is an unnamed O_TMPFILE in the directory of
+ * the stego image, written through /proc/self/fd, so a job that fails
+ * leaves nothing behind. Where O_TMPFILE is not supported (or /proc is
+ * missing) it is a hidden temp file next to it instead. Journaled runs
+ * use a fixed hidden name, so a rerun finds the bytes already written.
+ */
+EncodeStatus open_stego_output(EncodeInfo *encInfo)
+{
+    int fd = -1;
+
+    // step 1 : journaled run, resume or restart its partial file
+    if (encInfo->journal != NULL)
+    {
+        stego_partial_fname(encInfo->stego_image_fname, encInfo->stego_work_fname, sizeof(encInfo->stego_work_fname));
+        fd = open(encInfo->stego_work_fname, encInfo->resume_offset > 0 ? O_RDWR : O_RDWR | O_CREAT | O_TRUNC, 0666);
+    }
+    else
+    {
+        // step 2 : unnamed file on the file system of the stego image
+#ifdef O_TMPFILE
+        char dir[FILENAME_MAX];
+        const char *slash = strrchr(encInfo->stego_image_fname, '/');
+        snprintf(dir, sizeof(dir), "%.*s", slash != NULL ? (int)(slash - encInfo->stego_image_fname + 1) : 1,
+                 slash != NULL ? encInfo->stego_image_fname : ".");
+        fd = open(dir, O_TMPFILE | O_RDWR, 0666);
+        if (fd >= 0)
+        {
+            snprintf(encInfo->stego_work_fname, sizeof(encInfo->stego_work_fname), "/proc/self/fd/%d", fd);
+            if (access(encInfo->stego_work_fname, F_OK) == 0)
+            {
+                encInfo->stego_anonymous = 1;
+            }
+            else
+            {
+                close(fd);
+                fd = -1;
+            }
+        }
+#endif
+
+        // step 3 : hidden temp file next to it
+        for (int tries = 0; fd < 0 && tries < 100; tries++)
+        {
+            stego_temp_fname(encInfo);
+            fd = open(encInfo->stego_work_fname, O_RDWR | O_CREAT | O_EXCL, 0666);
+            if (fd < 0 && errno != EEXIST)
+            {
+                break;
+            }
+        }
+    }
+    if (fd < 0)
+    {
+        perror(encInfo->stego_image_fname);
+        encInfo->stego_work_fname[0] = '\0';
+        return e_failure;
+    }
+
+    encInfo->fptr_stego_image = fdopen(fd, "w+");
     if (encInfo->fptr_stego_image == NULL)
     {
+        close(fd);
+        discard_stego_output(encInfo);
         return e_failure;
     }
+    return e_success;
+}
 
-    // No failure return e_success
+/*
+ * Step 11a : publish the stego image
+ * Description: An unnamed file is linked in under the stego name, or
+ * under a hidden name and renamed over it when the stego image already
+ * exists. A hidden temp file is renamed. Either way readers of the
+ * stego name see the old image or the complete new one.
+ */
+EncodeStatus publish_stego_output(EncodeInfo *encInfo)
+{
+    if (fflush(encInfo->fptr_stego_image) != 0)
+    {
+        return e_failure;
+    }
+    if (encInfo->stego_anonymous)
+    {
+        if (linkat(AT_FDCWD, encInfo->stego_work_fname, AT_FDCWD, encInfo->stego_image_fname, AT_SYMLINK_FOLLOW) == 0)
+        {
+            encInfo->stego_work_fname[0] = '\0';
+            return e_success;
+        }
+        if (errno != EEXIST)
+        {
+            perror(encInfo->stego_image_fname);
+            return e_failure;
+        }
+        // the stego image exists, link under a hidden name and rename that over it
+        char proc[64];
+        snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fileno(encInfo->fptr_stego_image));
+        int linked = 0;
+        for (int tries = 0; !linked && tries < 100; tries++)
+        {
+            stego_temp_fname(encInfo);
+            linked = linkat(AT_FDCWD, proc, AT_FDCWD, encInfo->stego_work_fname, AT_SYMLINK_FOLLOW) == 0;
+            if (!linked && errno != EEXIST)
+            {
+                break;
+            }
+        }
+        if (!linked)
+        {
+            perror(encInfo->stego_image_fname);
+            encInfo->stego_work_fname[0] = '\0';
+            return e_failure;
+        }
+        encInfo->stego_anonymous = 0;
+    }
+    if (rename(encInfo->stego_work_fname, encInfo->stego_image_fname) != 0)
+    {
+        perror(encInfo->stego_image_fname);
+        return e_failure;
+    }
+    encInfo->stego_work_fname[0] = '\0';
     return e_success;
 }
 
+void discard_stego_output(EncodeInfo *encInfo)
+{
+    // an unnamed file goes with its descriptor, a journaled run keeps its partial file
+    if (!encInfo->stego_anonymous && encInfo->journal == NULL && encInfo->stego_work_fname[0] != '\0')
+    {
+        unlink(encInfo->stego_work_fname);
+    }
+    encInfo->stego_work_fname[0] = '\0';
+}
+
 
 //Step 2 : check the capacity
 EncodeStatus check_capacity(EncodeInfo *encInfo)
@@ -144,8 +503,66 @@ EncodeStatus check_capacity(EncodeInfo *encInfo)
     encInfo->size_secret_file = get_file_size(encInfo->fptr_secret);
     // store into structure member
 
-    // check image_capacity > (8*(MAGIC_STRING) + 32(sizeof(file extn)) + 32(sizeof(extn)) + 32(sizeof(secret file)) +8 *(sizeof(file size)) ))
-    if (encInfo->image_capacity > (8 * strlen(MAGIC_STRING) + 32 + 32 + 32 + 8 * encInfo->size_secret_file))
+    // flags word follows the magic string only when some option is on
+    uint header_bits = STEG_FLAGS_BITS(encInfo->flags);
+
+    // size fields are repeated and the data grows by the parity with FEC
+    uint copies = STEG_SIZE_COPIES(encInfo->flags);
+    long data_size = encInfo->size_secret_file;
+    if (encInfo->flags & STEG_FLAG_RS)
+    {
+        data_size = rs_encoded_size(data_size, STEG_RS_NSYM(encInfo->flags));
+    }
+
+    // matrix embedding spends 2^p - 1 image bytes per p bits
+    long data_bytes = 8 * data_size;
+    if (encInfo->flags & STEG_FLAG_MATRIX)
+    {
+        data_bytes = matrix_carrier_bytes(data_size, STEG_MATRIX_P(encInfo->flags));
+    }
+
+    // only count of every 3 colour bytes carry data with a channel mask
+    if (encInfo->flags & STEG_FLAG_CHANNELS)
+    {
+        uint count = __builtin_popcount(STEG_CHANNEL_MASK(encInfo->flags));
+        data_bytes = (data_bytes * 3 + count - 1) / count;
+    }
+
+    // the pixel array the header describes must be in the file (fstat), or the copy would come up short
+    unsigned char header[BMP_HEADER_SIZE];
+    BmpInfo bmp;
+    struct stat st;
+    if (pread(fileno(encInfo->fptr_src_image), header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+        !bmp_parse_header(header, &bmp) || fstat(fileno(encInfo->fptr_src_image), &st) != 0 ||
+        !bmp_pixels_fit(&bmp, (unsigned long long)st.st_size))
+    {
+        printf("%s is not a complete 24 / 32 bit BMP\n", encInfo->src_image_fname);
+        return e_failure;
+    }
+
+    // check image_capacity > (8*(MAGIC_STRING) + 32(flags) + 32(sizeof(file extn)) + 32(sizeof(extn)) + 32(sizeof(secret file)) +8 *(sizeof(file size)) ))
+    long needed = 8 * strlen(MAGIC_STRING) + header_bits + 32 * copies + 32 + 32 * copies + data_bytes;
+    if (encInfo->image_capacity > needed && (encInfo->flags & STEG_FLAG_ADAPTIVE))
+    {
+        // edge-adaptive data only goes to the bytes past the stream header that pass the threshold,
+        // they are selected now (and kept for Step 8c) so a job that does not fit never creates its output
+        uint first = BMP_HEADER_SIZE + (uint)(needed - data_bytes);
+        encInfo->adaptive_image = adaptive_read_image(encInfo->fptr_src_image, &encInfo->adaptive_len);
+        if (encInfo->adaptive_image == NULL)
+        {
+            return e_failure;
+        }
+        encInfo->adaptive_count = adaptive_select(encInfo->adaptive_image, encInfo->adaptive_len, first,
+                                                  STEG_ADAPTIVE_T(encInfo->flags), &encInfo->adaptive_positions);
+        if (encInfo->adaptive_positions == NULL || encInfo->adaptive_count < data_bytes)
+        {
+            printf("Only %u image bytes pass the adaptive threshold, %ld needed\n", encInfo->adaptive_count,
+                   data_bytes);
+            return e_failure;
+        }
+        return e_success;
+    }
+    if (encInfo->image_capacity > needed)
     {
         // True return e_success
         return e_success;
@@ -153,6 +570,7 @@ EncodeStatus check_capacity(EncodeInfo *encInfo)
     else
     {
         // False return e_failure
+        printf("Secret needs %ld image bytes, %s has %u\n", needed, encInfo->src_image_fname, encInfo->image_capacity);
         return e_failure;
     }
 }
@@ -205,7 +623,12 @@ EncodeStatus encode_magic_string(const char *magic_string, EncodeInfo *encInfo)
         encode_byte_to_lsb(magic_string[i], imageBuffer);
 
         //step 5 : write the 8 bytes from imageBuffer to stego image
-        fwrite(imageBuffer, sizeof(char), 8, encInfo->fptr_stego_image);
+        //step 5a : read the byte back from the buffer just written (--verify-inline)
+        if (fwrite(imageBuffer, sizeof(char), 8, encInfo->fptr_stego_image) != 8 ||
+            verify_inline_byte(encInfo, magic_string[i], imageBuffer) != e_success)
+        {
+            return e_failure;
+        }
     }
 
     //step 6 : check the both fptr offset pointing to the same offset or not
@@ -223,20 +646,64 @@ EncodeStatus encode_magic_string(const char *magic_string, EncodeInfo *encInfo)
 }
 
 
+//Step 4a : encode the stream header flags after the magic string (3 copies with FEC, like the sizes)
+EncodeStatus encode_stream_flags(uint flags, EncodeInfo *encInfo)
+{
+    //Step 1 : char imageBuffer[32];
+    char imageBuffer[32];
+
+    for (int copy = 0; copy < STEG_SIZE_COPIES(flags); copy++)
+    {
+        //step 2 : Read 32 bytes from src image and store into imageBuffer
+        fread(imageBuffer, sizeof(char), 32, encInfo->fptr_src_image);
+
+        //step 3 : store the flags word same way as a size
+        encode_size_to_lsb(flags, imageBuffer);
+
+        //step 4 : write the imageBuffer to stego image
+        //step 4a : read the flags back from the buffer just written (--verify-inline)
+        if (fwrite(imageBuffer, sizeof(char), 32, encInfo->fptr_stego_image) != 32 ||
+            verify_inline_size(encInfo, flags, imageBuffer) != e_success)
+        {
+            return e_failure;
+        }
+    }
+
+    //step 5 : check the both fptr offset pointing to the same offset or not
+    if (ftell(encInfo->fptr_src_image) == ftell(encInfo->fptr_stego_image))
+    {
+        return e_success;
+    }
+    else
+    {
+        return e_failure;
+    }
+}
+
+
 //Step 5 : encode_secret_file_extn_size
 EncodeStatus encode_secret_file_extn_size(int size, EncodeInfo *encInfo)
 {
     //Step 1 : char imageBuffer[32];
     char imageBuffer[32];
-    
-    //step 2 : Read 32 bytes from src image and store into imageBuffer
-    fread(imageBuffer, sizeof(char), 32, encInfo->fptr_src_image);
 
-    //step 3 : call the encode_byte_to_lsb(size, *imageBuffer)
-    encode_size_to_lsb(size, imageBuffer);
+    //step 2 : repeat the field when the stream asks for redundancy
+    for (int copy = 0; copy < STEG_SIZE_COPIES(encInfo->flags); copy++)
+    {
+        //step 3 : Read 32 bytes from src image and store into imageBuffer
+        fread(imageBuffer, sizeof(char), 32, encInfo->fptr_src_image);
+
+        //step 4 : call the encode_byte_to_lsb(size, *imageBuffer)
+        encode_size_to_lsb(size, imageBuffer);
 
-    //step 4 : write the imageBuffer to stego image
-    fwrite(imageBuffer, sizeof(char), 32, encInfo->fptr_stego_image);
+        //step 5 : write the imageBuffer to stego image
+        //step 5a : read the size back from the buffer just written (--verify-inline)
+        if (fwrite(imageBuffer, sizeof(char), 32, encInfo->fptr_stego_image) != 32 ||
+            verify_inline_size(encInfo, size, imageBuffer) != e_success)
+        {
+            return e_failure;
+        }
+    }
 
     //step 5 : check the both fptr offset pointing to the same offset or not
     if (ftell(encInfo->fptr_src_image) == ftell(encInfo->fptr_stego_image))
@@ -268,7 +735,12 @@ EncodeStatus encode_secret_file_extn(const char *file_extn, EncodeInfo *encInfo)
         encode_byte_to_lsb(file_extn[i], imageBuffer);
 
         //step 5 : write the 8 bytes from imageBuffer to stego image
-        fwrite(imageBuffer, sizeof(char), 8, encInfo->fptr_stego_image);
+        //step 5a : read the byte back from the buffer just written (--verify-inline)
+        if (fwrite(imageBuffer, sizeof(char), 8, encInfo->fptr_stego_image) != 8 ||
+            verify_inline_byte(encInfo, file_extn[i], imageBuffer) != e_success)
+        {
+            return e_failure;
+        }
     }
 
     //step 6 : check the both fptr offset pointing to the same offset or not
@@ -290,15 +762,24 @@ EncodeStatus encode_secret_file_size(long file_size, EncodeInfo *encInfo)
 {
     //Step 1 : char imageBuffer[32];
     char imageBuffer[32];
-    
-    //step 2 : Read 32 bytes from src image and store into imageBuffer
-    fread(imageBuffer, sizeof(char), 32, encInfo->fptr_src_image);
 
-    //step 3 : call the encode_byte_to_lsb(file_size, *imageBuffer)
-    encode_size_to_lsb(file_size, imageBuffer);
+    //step 2 : repeat the field when the stream asks for redundancy
+    for (int copy = 0; copy < STEG_SIZE_COPIES(encInfo->flags); copy++)
+    {
+        //step 3 : Read 32 bytes from src image and store into imageBuffer
+        fread(imageBuffer, sizeof(char), 32, encInfo->fptr_src_image);
 
-    //step 4 : write the imageBuffer to stego image
-    fwrite(imageBuffer, sizeof(char), 32, encInfo->fptr_stego_image);
+        //step 4 : call the encode_byte_to_lsb(file_size, *imageBuffer)
+        encode_size_to_lsb(file_size, imageBuffer);
+
+        //step 5 : write the imageBuffer to stego image
+        //step 5a : read the size back from the buffer just written (--verify-inline)
+        if (fwrite(imageBuffer, sizeof(char), 32, encInfo->fptr_stego_image) != 32 ||
+            verify_inline_size(encInfo, file_size, imageBuffer) != e_success)
+        {
+            return e_failure;
+        }
+    }
 
     //step 5 : check the both fptr offset pointing to the same offset or not
     if (ftell(encInfo->fptr_src_image) == ftell(encInfo->fptr_stego_image))
@@ -319,23 +800,47 @@ EncodeStatus encode_secret_file_data(EncodeInfo *encInfo)
 {
     char imageBuffer[8];
     char data;
+    ChaCha20Ctx cipher;
+
+    // Coded / matrix / adaptive / channel-selective embedded payload is built in memory first
+    if (encInfo->flags & (STEG_FLAG_RS | STEG_FLAG_MATRIX | STEG_FLAG_ADAPTIVE | STEG_FLAG_CHANNELS))
+    {
+        return encode_secret_file_data_block(encInfo);
+    }
 
     // Rewind to start of secret file
     rewind(encInfo->fptr_secret);
 
+    // Keystream is generated in blocks and consumed inside the embed loop
+    int encrypt = (encInfo->flags & STEG_FLAG_CHACHA20) != 0;
+    if (encrypt)
+    {
+        chacha20_init(&cipher, encInfo->key, encInfo->nonce, 1);
+    }
+
     for (long i = 0; i < encInfo->size_secret_file; i++)
     {
         // Read one byte from secret file
         fread(&data, sizeof(char), 1, encInfo->fptr_secret);
 
+        // Encrypt the byte on the fly
+        if (encrypt)
+        {
+            data ^= chacha20_next_byte(&cipher);
+        }
+
         // Read 8 bytes from source image
         fread(imageBuffer, sizeof(char), 8, encInfo->fptr_src_image);
 
         // Encode this byte into the image bytes
         encode_byte_to_lsb(data, imageBuffer);
 
-        // Write encoded bytes to stego image
-        fwrite(imageBuffer, sizeof(char), 8, encInfo->fptr_stego_image);
+        // Write encoded bytes to stego image, and read the byte back from the buffer just written (--verify-inline)
+        if (fwrite(imageBuffer, sizeof(char), 8, encInfo->fptr_stego_image) != 8 ||
+            verify_inline_byte(encInfo, data, imageBuffer) != e_success)
+        {
+            return e_failure;
+        }
     }
 
     //step 10 : check the both fptr offset pointing to the same offset or not
@@ -352,18 +857,298 @@ EncodeStatus encode_secret_file_data(EncodeInfo *encInfo)
 }
 
 
-//Step 9 : copy remaining image bytes from src to stego image
-EncodeStatus copy_remaining_img_data(FILE *fptr_src, FILE *fptr_dest)
+//Step 8a : encode_secret_file_data with the whole payload in memory (FEC / matrix / adaptive / channel-selective embedding)
+EncodeStatus encode_secret_file_data_block(EncodeInfo *encInfo)
 {
-    //Declare variable
-    char ch;
+    uint size = encInfo->size_secret_file;
+    uint stored_size = size;
+    EncodeStatus status;
 
-    //Read byte by byte from src and write to dest until EOF
-    while (fread(&ch, sizeof(char), 1, fptr_src) > 0)
+    //step 1 : read the whole secret (the codewords are interleaved over all of it)
+    unsigned char *data = mem_alloc(size + 1);
+    if (data == NULL)
     {
-        fwrite(&ch, sizeof(char), 1, fptr_dest);
+        return e_failure;
     }
-    return e_success;
+    rewind(encInfo->fptr_secret);
+    if (fread(data, 1, size, encInfo->fptr_secret) != size)
+    {
+        mem_free(data);
+        return e_failure;
+    }
+
+    //step 2 : encrypt first so the parity covers the stored bytes
+    if (encInfo->flags & STEG_FLAG_CHACHA20)
+    {
+        ChaCha20Ctx cipher;
+        chacha20_init(&cipher, encInfo->key, encInfo->nonce, 1);
+        for (uint i = 0; i < size; i++)
+        {
+            data[i] ^= chacha20_next_byte(&cipher);
+        }
+    }
+
+    //step 3 : add parity and interleave
+    unsigned char *stored = data;
+    if (encInfo->flags & STEG_FLAG_RS)
+    {
+        uint nsym = STEG_RS_NSYM(encInfo->flags);
+        stored_size = rs_encoded_size(size, nsym);
+        stored = mem_alloc(stored_size + 1);
+        if (stored == NULL || rs_encode_interleaved(data, size, nsym, stored) != 0)
+        {
+            mem_free(stored);
+            mem_free(data);
+            return e_failure;
+        }
+        printf("FEC : %u codewords, %u parity symbols each, %u bytes stored\n",
+               rs_codeword_count(size, nsym), nsym, stored_size);
+    }
+
+    //step 4 : embed the stored bytes
+    status = encode_payload_to_lsb(stored, stored_size, encInfo);
+
+    if (stored != data)
+    {
+        mem_free(stored);
+    }
+    mem_free(data);
+    return status;
+}
+
+
+/*
+ * Embed into a carrier gathered in memory
+ * Description: The payload goes into need bytes of carrier as into a
+ * contiguous image (plain or matrix), the result lands in stego. flag
+ * (the selection that gathered the carrier) is off meanwhile, and so is
+ * --verify-inline: the caller verifies the image after the scatter.
+ */
+static EncodeStatus encode_payload_gathered(const unsigned char *payload, uint size, EncodeInfo *encInfo,
+                                            char *carrier, char *stego, uint need, uint flag)
+{
+    FILE *fptr_src = encInfo->fptr_src_image, *fptr_stego = encInfo->fptr_stego_image;
+    encInfo->fptr_src_image = fmemopen(carrier, need + 1, "rb");
+    encInfo->fptr_stego_image = fmemopen(stego, need + 1, "wb");
+    EncodeStatus status = e_failure;
+    if (encInfo->fptr_src_image != NULL && encInfo->fptr_stego_image != NULL)
+    {
+        int verify = encInfo->verify_inline;
+        encInfo->flags &= ~flag;
+        encInfo->verify_inline = 0;
+        status = encode_payload_to_lsb(payload, size, encInfo);
+        encInfo->verify_inline = verify;
+        encInfo->flags |= flag;
+    }
+    if (encInfo->fptr_src_image != NULL)
+        fclose(encInfo->fptr_src_image);
+    if (encInfo->fptr_stego_image != NULL)
+        fclose(encInfo->fptr_stego_image);
+    encInfo->fptr_src_image = fptr_src;
+    encInfo->fptr_stego_image = fptr_stego;
+    return status;
+}
+
+
+/*
+ * Shared tail of adaptive / channel-selective embedding
+ * Description: The payload goes into the need gathered carrier bytes,
+ * they are scattered back into the image through positions (adaptive)
+ * or sched (channels), read back (--verify-inline) and the image is
+ * written from the end of the stream header
+ */
+static EncodeStatus encode_payload_scatter(const unsigned char *payload, uint size, EncodeInfo *encInfo,
+                                           unsigned char *image, uint len, long first, char *carrier, uint need,
+                                           const uint *positions, const ChannelSchedule *sched)
+{
+    char *stego = mem_alloc(need + 1);
+    if (stego == NULL)
+    {
+        return e_failure;
+    }
+
+    //step 1 : embed into the gathered bytes through memory streams
+    FILE *fptr_stego = encInfo->fptr_stego_image, *fptr_src = encInfo->fptr_src_image;
+    uint flag = sched != NULL ? STEG_FLAG_CHANNELS : STEG_FLAG_ADAPTIVE;
+    EncodeStatus status = encode_payload_gathered(payload, size, encInfo, carrier, stego, need, flag);
+
+    //step 2 : scatter back, read it back (--verify-inline) and write the image from the end of the stream header
+    if (status == e_success)
+    {
+        if (sched != NULL)
+        {
+            channel_scatter(image, len, first, sched, (unsigned char *)stego, need, 1);
+        }
+        else
+        {
+            for (uint k = 0; k < need; k++)
+            {
+                image[positions[k]] = stego[k];
+            }
+        }
+        if (verify_inline_scattered(encInfo, image, len, first, payload, size, need) != e_success ||
+            fwrite(image + first, 1, len - first, fptr_stego) != (size_t)(len - first))
+        {
+            status = e_failure;
+        }
+        fseek(fptr_src, 0, SEEK_END);
+    }
+
+    mem_free(stego);
+    return status;
+}
+
+
+/*
+ * Step 8c : edge-adaptive embedding
+ * Description: The image bytes past the stream header that pass the
+ * gradient threshold (selected by check_capacity before the output
+ * existed) are gathered into a memory stream, the payload is
+ * embedded there as into a contiguous carrier (plain or matrix), and
+ * the bytes are scattered back before the rest of the image is written
+ */
+static EncodeStatus encode_payload_adaptive(const unsigned char *payload, uint size, EncodeInfo *encInfo)
+{
+    unsigned char *image = encInfo->adaptive_image;
+    uint len = encInfo->adaptive_len, *positions = encInfo->adaptive_positions;
+    long first = ftell(encInfo->fptr_src_image);
+
+    //step 1 : bytes selected by the gradient map in check_capacity
+    uint need = 8 * size;
+    if (encInfo->flags & STEG_FLAG_MATRIX)
+    {
+        need = matrix_carrier_bytes(size, STEG_MATRIX_P(encInfo->flags));
+    }
+    char *carrier = mem_alloc(need + 1);
+    if (image == NULL || positions == NULL || encInfo->adaptive_count < need || carrier == NULL ||
+        (need > 0 && positions[0] < first))
+    {
+        mem_free(carrier);
+        return e_failure;
+    }
+    for (uint k = 0; k < need; k++)
+    {
+        carrier[k] = image[positions[k]];
+    }
+
+    //step 2 : embed, scatter back and write
+    EncodeStatus status = encode_payload_scatter(payload, size, encInfo, image, len, first, carrier, need, positions, NULL);
+    mem_free(carrier);
+    return status;
+}
+
+
+/*
+ * Step 8d : channel-selective embedding
+ * Description: The selected channels of the pixels past the stream
+ * header are gathered with the channel schedule, the payload is
+ * embedded there as into a contiguous carrier (plain or matrix), and
+ * they are scattered back before the rest of the image is written
+ */
+static EncodeStatus encode_payload_channels(const unsigned char *payload, uint size, EncodeInfo *encInfo)
+{
+    uint len;
+    long first = ftell(encInfo->fptr_src_image);
+    unsigned char *image = adaptive_read_image(encInfo->fptr_src_image, &len);
+    BmpInfo bmp;
+    if (image == NULL || len < BMP_HEADER_SIZE || !bmp_parse_header(image, &bmp) || !bmp_pixels_fit(&bmp, len))
+    {
+        mem_free(image);
+        return e_failure;
+    }
+
+    //step 1 : gather the selected channels
+    ChannelSchedule sched;
+    channel_schedule(&sched, STEG_CHANNEL_MASK(encInfo->flags), &bmp);
+    uint need = 8 * size;
+    if (encInfo->flags & STEG_FLAG_MATRIX)
+    {
+        need = matrix_carrier_bytes(size, STEG_MATRIX_P(encInfo->flags));
+    }
+    char *carrier = mem_alloc(need + 1);
+    uint count = carrier != NULL ? channel_gather(image, len, first, &sched, (unsigned char *)carrier, need, 1) : 0;
+    if (count < need)
+    {
+        printf("Only %u image bytes in the selected channels, %u needed\n", count, need);
+        mem_free(carrier);
+        mem_free(image);
+        return e_failure;
+    }
+
+    //step 2 : embed, scatter back and write
+    EncodeStatus status = encode_payload_scatter(payload, size, encInfo, image, len, first, carrier, need, NULL, &sched);
+
+    mem_free(carrier);
+    mem_free(image);
+    return status;
+}
+
+
+//Step 8b : embed a payload buffer, one byte per 8 image bytes or p bits per matrix block
+EncodeStatus encode_payload_to_lsb(const unsigned char *payload, uint size, EncodeInfo *encInfo)
+{
+    if (encInfo->flags & STEG_FLAG_ADAPTIVE)
+    {
+        return encode_payload_adaptive(payload, size, encInfo);
+    }
+    if (encInfo->flags & STEG_FLAG_CHANNELS)
+    {
+        return encode_payload_channels(payload, size, encInfo);
+    }
+    if (encInfo->flags & STEG_FLAG_MATRIX)
+    {
+        uint p = STEG_MATRIX_P(encInfo->flags);
+        uint n = MATRIX_BLOCK_LEN(p);
+        char block[MATRIX_BLOCK_LEN(MATRIX_MAX_P)];
+        unsigned long bits = 8UL * size;
+        uint changed = 0, blocks = 0;
+
+        for (unsigned long bitpos = 0; bitpos < bits; bitpos += p)
+        {
+            fread(block, sizeof(char), n, encInfo->fptr_src_image);
+            uint value = matrix_get_bits(payload, size, bitpos, p);
+            changed += matrix_embed_bits(block, p, value);
+            if (fwrite(block, sizeof(char), n, encInfo->fptr_stego_image) != n ||
+                verify_inline_block(encInfo, value, block, p) != e_success)
+            {
+                return e_failure;
+            }
+            blocks++;
+        }
+        printf("Matrix embedding : %u blocks of %u bytes, %u bytes changed\n", blocks, n, changed);
+    }
+    else
+    {
+        char imageBuffer[8];
+        for (uint i = 0; i < size; i++)
+        {
+            fread(imageBuffer, sizeof(char), 8, encInfo->fptr_src_image);
+            encode_byte_to_lsb(payload[i], imageBuffer);
+            if (fwrite(imageBuffer, sizeof(char), 8, encInfo->fptr_stego_image) != 8 ||
+                verify_inline_byte(encInfo, payload[i], imageBuffer) != e_success)
+            {
+                return e_failure;
+            }
+        }
+    }
+
+    //step 5 : check the both fptr offset pointing to the same offset or not
+    if (ftell(encInfo->fptr_src_image) == ftell(encInfo->fptr_stego_image))
+    {
+        return e_success;
+    }
+    else
+    {
+        return e_failure;
+    }
+}
+
+
+//Step 9 : copy remaining image bytes from src to stego image
+EncodeStatus copy_remaining_img_data(FILE *fptr_src, FILE *fptr_dest)
+{
+    //Read in blocks from src and write to dest until EOF
+    return bulk_copy(fptr_src, NULL, fptr_dest, NULL, io_buffered) == io_success ? e_success : e_failure;
 }
 
 
@@ -397,9 +1182,10 @@ EncodeStatus encode_size_to_lsb(int size, char *imageBuffer)
 }
 
 
-//Step 12 : do_encoding
-EncodeStatus do_encoding(EncodeInfo *encInfo)
+//Step 12 : do_encoding steps, each one traced as a stage
+static EncodeStatus encode_steps(EncodeInfo *encInfo)
 {
+    trace_stage(&encInfo->trace, "open_files", encInfo->src_image_fname);
     // step 1 : call the open_files(encInfo) == e_success
     if (open_files(encInfo) == e_success)
     {
@@ -413,6 +1199,7 @@ EncodeStatus do_encoding(EncodeInfo *encInfo)
     }
 
 
+    trace_stage(&encInfo->trace, "check_capacity", encInfo->src_image_fname);
     // Step 2 : check the capacity
     if (check_capacity(encInfo) == e_success)
     {
@@ -426,6 +1213,15 @@ EncodeStatus do_encoding(EncodeInfo *encInfo)
     }
 
 
+    trace_stage(&encInfo->trace, "open_output", encInfo->src_image_fname);
+    // Step 2a : only now create the (unpublished) stego image
+    if (open_stego_output(encInfo) != e_success)
+    {
+        return e_failure;
+    }
+
+
+    trace_stage(&encInfo->trace, "copy_bmp_header", encInfo->src_image_fname);
     //step 3: call the bmp heder copy_bmp_header(fptr_src_image, fptr_stego_image) == e_success
     if (copy_bmp_header(encInfo->fptr_src_image, encInfo->fptr_stego_image) == e_success)
     {
@@ -437,11 +1233,14 @@ EncodeStatus do_encoding(EncodeInfo *encInfo)
         //false return e_failure 
         return e_failure;
     }
-    
+    // the stream is embedded from here on, --quality compares the bytes after it
+    long embed_start = ftell(encInfo->fptr_src_image);
     
 
+    trace_stage(&encInfo->trace, "magic_string", encInfo->src_image_fname);
     // step 4 : Encode Magic String(MAGIC_STRING, encInfo) == e_success
-    if (encode_magic_string(MAGIC_STRING, encInfo) == e_success)
+    // (MAGIC_STRING_EXT and a flags word when any stream option is on, MAGIC_STRING_FEC and 3 of them with FEC)
+    if (encode_magic_string(STEG_MAGIC(encInfo->flags), encInfo) == e_success)
     {
         // true print the prompt message
         printf("Magic string encoded  \n");
@@ -451,6 +1250,18 @@ EncodeStatus do_encoding(EncodeInfo *encInfo)
         // false return e_failure
         return e_failure;
     }
+
+    if (encInfo->flags)
+    {
+        if (encode_stream_flags(encInfo->flags, encInfo) == e_success)
+        {
+            printf("Stream flags encoded : 0x%x\n", encInfo->flags);
+        }
+        else
+        {
+            return e_failure;
+        }
+    }
     
     
     //step 5 : store the secret file extntion into  extn_secret_file(.txt)
@@ -460,6 +1271,7 @@ EncodeStatus do_encoding(EncodeInfo *encInfo)
     int size = strlen(encInfo->extn_secret_file);
 
 
+    trace_stage(&encInfo->trace, "extn", encInfo->src_image_fname);
     //step 7 : encode_secret_file_extn_size(size, encInfo) == e_success
     if (encode_secret_file_extn_size(size, encInfo) == e_success)
     {
@@ -484,6 +1296,7 @@ EncodeStatus do_encoding(EncodeInfo *encInfo)
         // false return e_failure
         return e_failure;
     }   
+    trace_stage(&encInfo->trace, "secret_size", encInfo->src_image_fname);
     // step 9 : encode_secret_file_size(size_secret_file, encInfo) == e_success
     if (encode_secret_file_size(encInfo->size_secret_file, encInfo) == e_success)
     {
@@ -497,11 +1310,16 @@ EncodeStatus do_encoding(EncodeInfo *encInfo)
     }
 
 
+    trace_stage(&encInfo->trace, "secret_data", encInfo->src_image_fname);
     // step 10 : encode_secret_file_data(encInfo) == e_success
     if (encode_secret_file_data(encInfo) == e_success)
     {
         // true print the prompt message
         printf("Secret file data encoded success\n");
+        if (encInfo->verify_inline)
+        {
+            printf("Inline verification : %ld image bytes read back, all match\n", encInfo->verified_bytes);
+        }
     }
     else
     {
@@ -510,17 +1328,61 @@ EncodeStatus do_encoding(EncodeInfo *encInfo)
     }
 
 
+    // step 10a : --quality, PSNR / SSIM of the bytes just embedded (still in the page cache)
+    if (encInfo->quality)
+    {
+        trace_stage(&encInfo->trace, "quality", encInfo->src_image_fname);
+        QualityInfo quality = {0};
+        fflush(encInfo->fptr_stego_image);
+        if (quality_measure(fileno(encInfo->fptr_src_image), fileno(encInfo->fptr_stego_image), embed_start,
+                            ftell(encInfo->fptr_src_image), (int)sysconf(_SC_NPROCESSORS_ONLN), 1, &quality) == q_success)
+        {
+            quality_print(&quality);
+        }
+    }
+
+
+    trace_stage(&encInfo->trace, "copy_remaining", encInfo->src_image_fname);
     // step 11 : copy_remaining_img_data(fptr_src_image, fptr_stego_image) == e_success
-    if (copy_remaining_img_data(encInfo->fptr_src_image, encInfo->fptr_stego_image) == e_success)
+    // (mmap / O_DIRECT copy for very large carriers when asked for, checkpointed copy in journaled runs)
+    if (encInfo->journal != NULL ?
+        journal_copy(encInfo->journal, encInfo->journal_job, encInfo->fptr_src_image, encInfo->fptr_stego_image,
+                     encInfo->resume_offset) == j_success :
+        encInfo->io_mode == io_buffered ?
+        copy_remaining_img_data(encInfo->fptr_src_image, encInfo->fptr_stego_image) == e_success :
+        bulk_copy(encInfo->fptr_src_image, encInfo->src_image_fname, encInfo->fptr_stego_image,
+                  encInfo->stego_work_fname, encInfo->io_mode) == io_success)
     {
         // true print the prompt message
         printf("Remaining image data copied success\n");
-        return e_success;
     }
     else
     {
         // false return e_failure
         return e_failure;
     }
-    return e_success;
+
+
+    trace_stage(&encInfo->trace, "publish", encInfo->src_image_fname);
+    // step 11a : the stego image appears under its name only now
+    return publish_stego_output(encInfo);
+}
+
+//Step 13 : do_encoding, one trace span for the job around the stage spans
+EncodeStatus do_encoding(EncodeInfo *encInfo)
+{
+    TraceSpan job;
+    trace_begin(&job, "encode", encInfo->src_image_fname);
+    EncodeStatus status = encode_steps(encInfo);
+    if (status != e_success)
+    {
+        discard_stego_output(encInfo);
+    }
+    mem_free(encInfo->adaptive_positions);
+    mem_free(encInfo->adaptive_image);
+    encInfo->adaptive_positions = NULL;
+    encInfo->adaptive_image = NULL;
+    trace_end(&encInfo->trace);
+    trace_end(&job);
+    return status;
 }
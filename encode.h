@@ -3,6 +3,8 @@
 #include <stdio.h>
 
 #include "types.h" // Contains user defined types
+#include "trace.h" // Stage spans of --trace
+#include "journal.h" // Checkpoints of journaled batch runs
 
 /*
  * Structure to store information required for
@@ -28,6 +30,27 @@ typedef struct _EncodeInfo
     /* Stego Image Info */
     char *stego_image_fname; // To store the dest file name
     FILE *fptr_stego_image;  // To store the address of stego image
+    char stego_work_fname[FILENAME_MAX]; // To store the path the output is written through until it is published
+    int stego_anonymous;     // To store whether the output is an unnamed O_TMPFILE (else a hidden temp file)
+
+    /* Stream Options */
+    uint flags;              // To store the STEG_FLAG_* bits of the stream header
+    unsigned char key[32];   // To store the ChaCha20 key
+    unsigned char nonce[12]; // To store the ChaCha20 nonce
+    IoMode io_mode;          // To store how the remaining image data is copied
+    TraceSpan trace;         // To store the open --trace stage
+    int quality;             // To store whether --quality PSNR / SSIM are reported
+    int verify_inline;       // To store whether --verify-inline reads back every buffer written
+    long verified_bytes;     // To store the image bytes read back
+    unsigned char *adaptive_image; // To store the whole source image of --adaptive, read by check_capacity
+    uint adaptive_len;             // To store its length
+    uint *adaptive_positions;      // To store the offsets of its bytes that pass the threshold
+    uint adaptive_count;           // To store how many there are
+
+    /* Journaled batch runs (NULL journal otherwise) */
+    Journal *journal;        // To store the journal the copy is checkpointed in
+    const char *journal_job; // To store the name of this job in the journal
+    long resume_offset;      // To store the stego image offset already durable from a previous run
 
 } EncodeInfo;
 
@@ -39,9 +62,21 @@ EncodeStatus read_and_validate_encode_args(char *argv[], EncodeInfo *encInfo);
 /* Perform the encoding */
 EncodeStatus do_encoding(EncodeInfo *encInfo);
 
-/* Get File pointers for i/p and o/p files */
+/* Get File pointers for the source image and the secret */
 EncodeStatus open_files(EncodeInfo *encInfo);
 
+/* Create the unpublished stego image, once the capacity check passed */
+EncodeStatus open_stego_output(EncodeInfo *encInfo);
+
+/* Give the finished stego image its name (linkat / rename) */
+EncodeStatus publish_stego_output(EncodeInfo *encInfo);
+
+/* Drop the output of a failed encode, nothing shows under the stego name */
+void discard_stego_output(EncodeInfo *encInfo);
+
+/* Hidden file a journaled run writes the stego image to, kept across crashes for resuming */
+void stego_partial_fname(const char *stego_fname, char *out, size_t len);
+
 /* check capacity */
 EncodeStatus check_capacity(EncodeInfo *encInfo);
 
@@ -57,6 +92,9 @@ EncodeStatus copy_bmp_header(FILE *fptr_src_image, FILE *fptr_dest_image);
 /* Store Magic String */
 EncodeStatus encode_magic_string(const char *magic_string, EncodeInfo *encInfo);
 
+/* Store stream header flags */
+EncodeStatus encode_stream_flags(uint flags, EncodeInfo *encInfo);
+
 /*Encode extension size*/
 EncodeStatus encode_secret_file_extn_size(int size, EncodeInfo *encInfo);
 
@@ -69,6 +107,12 @@ EncodeStatus encode_secret_file_size(long file_size, EncodeInfo *encInfo);
 /* Encode secret file data*/
 EncodeStatus encode_secret_file_data(EncodeInfo *encInfo);
 
+/* Encode secret file data held in memory (Reed-Solomon / matrix embedding) */
+EncodeStatus encode_secret_file_data_block(EncodeInfo *encInfo);
+
+/* Embed a payload buffer with plain LSB or matrix embedding */
+EncodeStatus encode_payload_to_lsb(const unsigned char *payload, uint size, EncodeInfo *encInfo);
+
 /* Encode a byte into LSB of image data array */
 EncodeStatus encode_byte_to_lsb(char data, char *image_buffer);
 
@@ -0,0 +1,340 @@
+#define _GNU_SOURCE // syncfs
+#include "journal.h"
+#include "mem.h"
+#include "util.h"
+#include "bulkio.h"
+#include "tune.h"
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Function Definitions */
+
+unsigned long long journal_hash(unsigned long long hash, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash = (hash ^ p[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static int cmp_record(const void *a, const void *b)
+{
+    return strcmp(((const JournalRecord *)a)->job, ((const JournalRecord *)b)->job);
+}
+
+/*
+ * Read back a previous run
+ * Description: Only complete lines count. Records of the same job are
+ * merged, done wins and the highest checkpoint is kept.
+ * Output: 1 when the journal holds a plan line, with its fingerprint,
+ * and the end of the last complete line in *valid_end
+ */
+static int journal_read(Journal *journal, FILE *fptr_journal, unsigned long long *fingerprint, long *valid_end)
+{
+    char line[JOURNAL_JOB_MAX + 64];
+    int cap = 0, have_plan = 0;
+
+    *valid_end = 0;
+    while (fgets(line, sizeof(line), fptr_journal) != NULL)
+    {
+        size_t len = strlen(line);
+        if (len == 0 || line[len - 1] != '\n')
+        {
+            // torn last line (or one too long to be ours)
+            continue;
+        }
+        *valid_end = ftell(fptr_journal);
+        line[len - 1] = '\0';
+
+        JournalRecord record = {0};
+        int n = 0;
+        if (sscanf(line, "plan %llx", fingerprint) == 1)
+        {
+            have_plan = 1;
+            continue;
+        }
+        else if (strncmp(line, "done ", 5) == 0)
+        {
+            record.done = 1;
+            n = 5;
+        }
+        else if (sscanf(line, "ckpt %ld %n", &record.offset, &n) != 1 || n == 0)
+        {
+            continue;
+        }
+        if (strlen(line + n) >= JOURNAL_JOB_MAX)
+        {
+            continue;
+        }
+        strcpy(record.job, line + n);
+
+        if (journal->record_count == cap)
+        {
+            cap = cap ? cap * 2 : 1024;
+            JournalRecord *grown = mem_realloc(journal->records, cap * sizeof(JournalRecord));
+            if (grown == NULL)
+            {
+                break;
+            }
+            journal->records = grown;
+        }
+        journal->records[journal->record_count++] = record;
+    }
+
+    // sort and merge the records of each job
+    qsort(journal->records, journal->record_count, sizeof(JournalRecord), cmp_record);
+    int kept = 0;
+    for (int i = 0; i < journal->record_count; i++)
+    {
+        JournalRecord *last = kept ? &journal->records[kept - 1] : NULL;
+        if (last != NULL && strcmp(last->job, journal->records[i].job) == 0)
+        {
+            last->done |= journal->records[i].done;
+            if (journal->records[i].offset > last->offset)
+            {
+                last->offset = journal->records[i].offset;
+            }
+        }
+        else
+        {
+            journal->records[kept++] = journal->records[i];
+        }
+    }
+    journal->record_count = kept;
+    return have_plan;
+}
+
+JournalStatus journal_open(Journal *journal, char *fname, unsigned long long fingerprint, const char *data_dir)
+{
+    journal->fname = fname;
+    journal->fingerprint = fingerprint;
+
+    // Step 1 : progress of a previous run of the same batch
+    unsigned long long previous = 0;
+    long valid_end = 0;
+    int have_plan = 0;
+    FILE *fptr_journal = fopen(fname, "r");
+    if (fptr_journal != NULL)
+    {
+        have_plan = journal_read(journal, fptr_journal, &previous, &valid_end);
+        fclose(fptr_journal);
+        if (have_plan && previous != fingerprint)
+        {
+            printf("%s is the journal of another batch (plan %016llx, this one is %016llx), remove it to start over\n",
+                   fname, previous, fingerprint);
+            mem_free(journal->records);
+            return j_failure;
+        }
+    }
+
+    // Step 2 : append after the last complete line, commits sync the file system of data_dir first
+    journal->fd = open(fname, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    journal->data_fd = open(data_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (journal->fd < 0 || journal->data_fd < 0)
+    {
+        perror(journal->fd < 0 ? fname : data_dir);
+        if (journal->fd >= 0)
+            close(journal->fd);
+        if (journal->data_fd >= 0)
+            close(journal->data_fd);
+        mem_free(journal->records);
+        return j_failure;
+    }
+    struct stat st;
+    if (fstat(journal->fd, &st) == 0 && st.st_size > valid_end && ftruncate(journal->fd, valid_end) != 0)
+    {
+        perror(fname);
+    }
+
+    pthread_mutex_init(&journal->lock, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &journal->last_sync);
+
+    // Step 3 : a new journal starts with the batch fingerprint, on disk at once
+    if (!have_plan)
+    {
+        char line[64];
+        int len = snprintf(line, sizeof(line), "plan %016llx\n", fingerprint);
+        if (write(journal->fd, line, len) != len || fsync(journal->fd) != 0)
+        {
+            perror(fname);
+            return j_failure;
+        }
+    }
+    else
+    {
+        int done = 0, partial = 0;
+        for (int i = 0; i < journal->record_count; i++)
+        {
+            done += journal->records[i].done;
+            partial += !journal->records[i].done && journal->records[i].offset > 0;
+        }
+        printf("Resuming from %s : %d jobs done, %d partly written\n", fname, done, partial);
+    }
+    return j_success;
+}
+
+int journal_lookup(const Journal *journal, const char *job, long *offset)
+{
+    JournalRecord key;
+    *offset = 0;
+    if (journal->record_count == 0 || strlen(job) >= JOURNAL_JOB_MAX)
+    {
+        return 0;
+    }
+    strcpy(key.job, job);
+    const JournalRecord *record = bsearch(&key, journal->records, journal->record_count, sizeof(JournalRecord),
+                                          cmp_record);
+    if (record == NULL)
+    {
+        return 0;
+    }
+    *offset = record->offset;
+    return record->done;
+}
+
+/*
+ * Group commit, called with the lock held
+ * Description: Writers flush the images a record describes before
+ * logging it, syncfs makes them durable, and only then are the
+ * pending records written and fsync'ed
+ */
+static JournalStatus journal_commit(Journal *journal)
+{
+    JournalStatus status = j_success;
+    if (journal->pending_len > 0)
+    {
+        if (syncfs(journal->data_fd) != 0 ||
+            write(journal->fd, journal->pending, journal->pending_len) != (ssize_t)journal->pending_len ||
+            fdatasync(journal->fd) != 0)
+        {
+            perror(journal->fname);
+            status = j_failure;
+        }
+        journal->syncs++;
+    }
+    journal->pending_len = 0;
+    journal->unsynced = 0;
+    clock_gettime(CLOCK_MONOTONIC, &journal->last_sync);
+    return status;
+}
+
+JournalStatus journal_append(Journal *journal, const char *format, ...)
+{
+    char line[JOURNAL_JOB_MAX + 64];
+    struct timespec t0, t1;
+    va_list args;
+
+    va_start(args, format);
+    int len = vsnprintf(line, sizeof(line) - 1, format, args);
+    va_end(args);
+    if (len < 0 || len >= (int)sizeof(line) - 1)
+    {
+        return j_failure;
+    }
+    line[len++] = '\n';
+
+    pthread_mutex_lock(&journal->lock);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (journal->pending_len + len > journal->pending_cap)
+    {
+        size_t cap = journal->pending_cap ? journal->pending_cap * 2 : 64 * 1024;
+        char *grown = mem_realloc(journal->pending, cap);
+        if (grown == NULL)
+        {
+            pthread_mutex_unlock(&journal->lock);
+            return j_failure;
+        }
+        journal->pending = grown;
+        journal->pending_cap = cap;
+    }
+    memcpy(journal->pending + journal->pending_len, line, len);
+    journal->pending_len += len;
+    journal->appended++;
+
+    JournalStatus status = j_success;
+    if (++journal->unsynced >= JOURNAL_SYNC_RECORDS || elapsed_ms(&journal->last_sync, &t0) >= JOURNAL_SYNC_MS)
+    {
+        status = journal_commit(journal);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    journal->ms += elapsed_ms(&t0, &t1);
+    pthread_mutex_unlock(&journal->lock);
+    return status;
+}
+
+JournalStatus journal_copy(Journal *journal, const char *job, FILE *fptr_src, FILE *fptr_dest, long resume)
+{
+    // Step 1 : skip what a previous run already made durable
+    if (resume > ftell(fptr_src))
+    {
+        if (fseek(fptr_src, resume, SEEK_SET) != 0 || fseek(fptr_dest, resume, SEEK_SET) != 0)
+        {
+            return j_failure;
+        }
+        printf("%s : resuming the copy at byte %ld\n", job, resume);
+    }
+
+    // Step 2 : copy, with a checkpoint every JOURNAL_CKPT_BYTES
+    size_t chunk = tune_profile()->block_size > 0 ? bulk_block_size(io_buffered) : mem_block_size(1 << 20);
+    char *buffer = mem_alloc(chunk);
+    if (buffer == NULL)
+    {
+        return j_failure;
+    }
+    JournalStatus status = j_success;
+    long since = 0;
+    size_t got;
+    while (status == j_success && (got = fread(buffer, 1, chunk, fptr_src)) > 0)
+    {
+        if (fwrite(buffer, 1, got, fptr_dest) != got)
+        {
+            status = j_failure;
+            break;
+        }
+        since += got;
+        if (since >= JOURNAL_CKPT_BYTES)
+        {
+            // flushed to the kernel here, durable once the record is committed
+            status = fflush(fptr_dest) == 0 ? journal_append(journal, "ckpt %ld %s", ftell(fptr_dest), job) : j_failure;
+            since = 0;
+        }
+    }
+    mem_free(buffer);
+    if (status != j_success || ferror(fptr_src))
+    {
+        return j_failure;
+    }
+
+    // Step 3 : the caller logs the job done once the image is closed
+    return fflush(fptr_dest) == 0 ? j_success : j_failure;
+}
+
+JournalStatus journal_close(Journal *journal, double work_ms)
+{
+    struct timespec t0, t1;
+
+    pthread_mutex_lock(&journal->lock);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    JournalStatus status = journal_commit(journal);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    journal->ms += elapsed_ms(&t0, &t1);
+    pthread_mutex_unlock(&journal->lock);
+
+    close(journal->fd);
+    close(journal->data_fd);
+    pthread_mutex_destroy(&journal->lock);
+    mem_free(journal->pending);
+    mem_free(journal->records);
+    journal->pending = NULL;
+    journal->records = NULL;
+
+    printf("Journal : %ld records, %ld commits, %.2f ms (%.2f%% of %.2f ms spent encoding)\n", journal->appended,
+           journal->syncs, journal->ms, work_ms > 0 ? 100.0 * journal->ms / work_ms : 0.0, work_ms);
+    return status;
+}
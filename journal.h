@@ -0,0 +1,94 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "types.h" // Contains user defined types
+
+/*
+ * Progress journal of a batch run (--journal=<file>)
+ * An append-only text log, one record per line:
+ *     plan <fingerprint>      first line, the batch the journal belongs to
+ *     ckpt <offset> <job>     stego image durable up to offset
+ *     done <job>              stego image complete and durable
+ * Records are group committed every JOURNAL_SYNC_RECORDS records or
+ * JOURNAL_SYNC_MS: the file system holding the images is synced first
+ * (syncfs), then the pending records are appended and the journal is
+ * fsync'ed, so a record never reaches the disk before the data it
+ * describes, and a crash only loses the work since the last commit.
+ * A torn last line is ignored when the journal is read back.
+ */
+
+/* Records / time between two commits */
+#define JOURNAL_SYNC_RECORDS 256
+#define JOURNAL_SYNC_MS 1000
+
+/* Carrier bytes copied between two checkpoints of one image */
+#define JOURNAL_CKPT_BYTES (64L << 20)
+
+/* Longest job name kept */
+#define JOURNAL_JOB_MAX 256
+
+/* Progress of one job read back from a previous run */
+typedef struct _JournalRecord
+{
+    char job[JOURNAL_JOB_MAX]; // To store the job name
+    long offset;               // To store the last checkpointed offset
+    int done;                  // To store whether the job completed
+} JournalRecord;
+
+/*
+ * Structure to store the open journal
+ */
+
+typedef struct _Journal
+{
+    char *fname;               // To store the journal file name
+    int fd;                    // To store the O_APPEND descriptor
+    unsigned long long fingerprint; // To store the fingerprint of the batch
+
+    /* Previous runs */
+    JournalRecord *records;    // To store the jobs seen, sorted by name
+    int record_count;
+
+    /* Writing */
+    int data_fd;               // To store a directory on the file system of the images
+    pthread_mutex_t lock;
+    char *pending;             // To store the records waiting for the next commit
+    size_t pending_len, pending_cap;
+    int unsynced;              // To store the records in pending
+    struct timespec last_sync; // To store when the journal was last committed
+
+    /* Overhead */
+    long appended;             // To store the records appended
+    long syncs;                // To store the commits
+    double ms;                 // To store the time spent appending and committing
+} Journal;
+
+/* Journal function prototype */
+
+/* Open or create the journal of the batch with this fingerprint, read back its progress, images go to data_dir */
+JournalStatus journal_open(Journal *journal, char *fname, unsigned long long fingerprint, const char *data_dir);
+
+/* Progress of a job: 1 when done, else 0 with the checkpointed offset in *offset (0 if none) */
+int journal_lookup(const Journal *journal, const char *job, long *offset);
+
+/* Append one record line (without the newline), committed periodically */
+JournalStatus journal_append(Journal *journal, const char *format, ...);
+
+/*
+ * Copy the rest of src to dest, checkpointing every JOURNAL_CKPT_BYTES.
+ * Copying starts at resume when it is past the current offset (the
+ * bytes before it are already in dest). dest is flushed on success and
+ * made durable by the commit that carries the records logged after it.
+ */
+JournalStatus journal_copy(Journal *journal, const char *job, FILE *fptr_src, FILE *fptr_dest, long resume);
+
+/* Commit and close the journal, print its overhead against work_ms (time spent encoding) */
+JournalStatus journal_close(Journal *journal, double work_ms);
+
+/* FNV-1a hash step, for batch fingerprints */
+unsigned long long journal_hash(unsigned long long hash, const void *data, size_t len);
+
+#endif
@@ -23,7 +23,10 @@ appearance of the image.
 
     The secret file’s extension, size, and content are encoded bit-by-bit into the LSBs of image pixels.
 
-    The modified image is saved as the stego image.
+    The modified image is saved as the stego image. The capacity is checked
+    before any output exists, the image is written to an unnamed O_TMPFILE
+    (or a hidden temp file) and linked in under its name only once complete,
+    so a failed job leaves nothing behind.
 
 2. Decoding Process
 
@@ -34,6 +37,113 @@ appearance of the image.
     The secret file’s extension, size, and data are extracted bit-by-bit from the LSBs.
 
     The recovered data is written into the decoded output file.
+
+3. Steganalysis (--analyze)
+
+    Any number of BMP images are checked for LSB embedding by any tool
+    with the chi-square attack and RS (regular/singular groups) analysis.
+
+4. Watch folder service (--watch)
+
+    New BMPs landing in a spool directory are decoded by a pool of workers
+    and moved to a processed (or failed) directory.
+
+5. Tar archives (--tar)
+
+    BMP members of a tar file (or stdin) are decoded or analysed in-stream,
+    without extracting the archive to disk.
+
+6. Large carriers (--io=mmap|direct, --bench-io)
+
+    The image data after the payload can be copied through mmap or O_DIRECT
+    with huge page buffers instead of stdio, and --bench-io compares the modes.
+
+7. Edge-adaptive embedding (--adaptive[=threshold], --bench-adaptive)
+
+    Secret data only goes to bytes on edges and texture, picked by a Sobel
+    gradient of the high bits that the decoder recomputes from the stego
+    image. The threshold travels in the stream flags.
+
+8. Video carriers (--y4m)
+
+    The frames of an uncompressed Y4M video are one long carrier for the
+    same stream, read, embedded and written frame by frame on a pool of
+    workers with a bounded number of frames in memory.
+
+9. In place updates (--update)
+
+    A new secret replaces the one in a stego image by rewriting only the
+    carrier bytes whose LSBs change, with positioned writes. An encrypted
+    secret is only replaced under a new --nonce, checked against the
+    current one given with --old-nonce.
+
+10. Carrier pools (--plan)
+
+    Many secrets are packed into a pool of carriers, first fit decreasing
+    on the capacities read from the BMP headers, and the carriers are
+    encoded on a pool of workers. A manifest tells which stego image,
+    offset and length (for -d --range) hold each secret.
+    With --journal=<file> finished images and copy checkpoints of large
+    ones go to an append-only log, and a rerun after a crash skips or
+    resumes them (images being written are kept as hidden .<name>.part
+    files until they are complete).
+
+11. Checking the stego image (--quality, --verify-inline)
+
+    The encoder reports the PSNR and SSIM of the stego image against the
+    carrier, comparing only the rows the stream went into, on a pool of
+    threads, right after embedding them. With --verify-inline every
+    buffer written is decoded back with the decoder kernels and any
+    mismatch fails the encode.
+
+12. Channel-selective embedding (--channels=<mask>, --bench-channels)
+
+    Secret data only goes to the chosen colour channels (e.g. blue only),
+    gathered and scattered row by row with SSSE3 shuffles. The mask
+    travels in the stream flags.
+
+13. Per machine tuning (--tune)
+
+    A short calibration encodes and decodes synthetic carriers in a
+    scratch directory, sweeping the copy block size, I/O mode and worker
+    count, and stores the fastest as a profile file ($STEG_TUNE_FILE or
+    ~/.steg_tune) that later runs take their defaults from.
+
+14. Carrier index (--index)
+
+    A sidecar file with the geometry, capacity and stego state of every
+    carrier of a library, mmap'd and looked up through a hash table, so
+    --plan over millions of carriers opens none of them. Refreshing it
+    only re-reads carriers whose size or mtime changed.
+
+15. Memory budget (--mem-limit=<size>, --mem-stats)
+
+    Every buffer is allocated through a tracked allocator that counts
+    the bytes in use, overall and per job. Under a limit allocations
+    past it fail, batch engines start a job only when its reservation
+    (the largest job peak seen so far) fits, and copy blocks and frame
+    rings shrink. The peak is printed at exit, sizes in powers of 1024
+    as the limit is given. --mem-check runs --analyze, --plan and --y4m
+    on synthetic carriers larger than the limit and fails when one of
+    them has an allocation refused or its resident size (VmHWM) grows
+    by more than the limit.
+
+16. Profiling (--trace=file.json, --trace-counters)
+
+    Every job and each of its stages is written as a Chrome trace event,
+    one track per worker thread. With --trace-counters each event also
+    carries cycles, instructions, cache misses and page faults from
+    perf_event_open (counters the kernel refuses are left out).
+
+17. Error correction (--fec=<nsym>, --bench-fec)
+
+    The stream is Reed-Solomon coded in interleaved codewords and its
+    flags word is stored three times, so damaged carrier bytes are
+    corrected on decoding. --bench-fec flips random LSBs of a synthetic
+    stego image at several bit error rates and reports the fraction
+    corrected and the encode / decode throughput.
+
+    Build: gcc *.c -lm -pthread
     */
 
 
@@ -41,6 +151,21 @@ appearance of the image.
 #include <string.h>
 #include "encode.h"
 #include "decode.h"
+#include "analyze.h"
+#include "watch.h"
+#include "tar.h"
+#include "bulkio.h"
+#include "adaptive.h"
+#include "y4m.h"
+#include "update.h"
+#include "plan.h"
+#include "channel.h"
+#include "tune.h"
+#include "catalog.h"
+#include "trace.h"
+#include "mem.h"
+#include "memcheck.h"
+#include "rs.h"
 #include "types.h"
 #include "common.h"
 
@@ -54,10 +179,34 @@ int main(int argc, char *argv[])
         printf("Insufficient Arguments Given\n\n");
         printf("  To Encode: ./a.out -e <source_image.bmp> <secret_file> <output_stego_image.bmp>\n");
         printf("  To Decode: ./a.out -d <stego_image.bmp> <output_file>\n");
+        printf("  Encrypt  : add --key=<64 hex digits> --nonce=<24 hex digits> to -e / -d\n");
+        printf("  FEC      : add --fec=<parity symbols per codeword> to -e, measure with ./a.out --bench-fec [nsym] [payload KB]\n");
+        printf("  Update   : ./a.out --update <stego_image.bmp> <new_secret_file> [--key=.. --nonce=<new> --old-nonce=<current>] (in place)\n");
+        printf("  Range    : add --range=<offset>:<length> to -d to decode only that slice of the secret\n");
+        printf("  Verify   : add --verify-inline to -e (each buffer written is decoded back and compared)\n");
+        printf("  Quality  : add --quality to -e (PSNR / SSIM of the stego image against the source)\n");
+        printf("  Matrix   : add --matrix=<p> to -e (p bits per 2^p - 1 image bytes)\n");
+        printf("  Analyze  : ./a.out --analyze <image.bmp>... [--threads=<n>]\n");
+        printf("  Watch    : ./a.out --watch <dir> [--out=<dir>] [--done=<dir>] [--threads=<n>] [--key=.. --nonce=..]\n");
+        printf("  Channels : add --channels=<b|g|r|bg|br|gr> to -e (those colour channels only), measure with ./a.out --bench-channels <image.bmp>\n");
+        printf("  Adaptive : add --adaptive[=<threshold>] to -e (edges only), measure with ./a.out --bench-adaptive <image.bmp> [threshold]\n");
+        printf("  I/O mode : add --io=buffered|mmap|direct to -e, compare with ./a.out --bench-io <carrier.bmp>\n");
+        printf("  Tar      : ./a.out --tar <archive.tar | -> [--out=<dir>] [--analyze] [--key=.. --nonce=..]\n");
+        printf("  Video    : ./a.out --y4m -e <src.y4m> <secret_file> <out.y4m> | --y4m -d <stego.y4m> [output_file] [--threads=<n>] [--key=.. --nonce=..]\n");
+        printf("  Plan     : ./a.out --plan <carrier dir | list | index> <secret dir | list> <out_dir> [--manifest=<file>] [--threads=<n>] [--dry-run] [--journal=<file>] [--key=.. --nonce=..]\n");
+        printf("  Tune     : ./a.out --tune [<scratch dir>] [--config=<file>] (block size, workers and I/O mode for this machine, loaded by later runs)\n");
+        printf("  Index    : ./a.out --index <carrier dir | list> <index file> [--threads=<n>] (build or refresh, then give the index to --plan)\n");
+        printf("  Memory   : add --mem-limit=<size>[K|M|G] and / or --mem-stats to any mode (peak use, batches throttled to the limit),\n"
+               "             check the bound with ./a.out --mem-check [<scratch dir>] --mem-limit=<size>\n");
+        printf("  Trace    : add --trace=<file.json> [--trace-counters] to any mode (chrome://tracing, Perfetto)\n");
         return e_failure;
     }
 
-    // Step 2: Check the operation type
+    // Step 2: Check the operation type, open the --trace file and set the memory limit if they are asked for
+    if (trace_init(argv) != tr_success || mem_init(argv) != m_success)
+    {
+        return e_failure;
+    }
     OperationType oprn_type = check_operation_type(argv[1]);
 
     // Step 3: Perform encoding
@@ -72,7 +221,7 @@ int main(int argc, char *argv[])
             return e_failure;
         }
 
-        EncodeInfo encInfo;
+        EncodeInfo encInfo = {0};
 
         //Read and validate arguments
         if (read_and_validate_encode_args(argv, &encInfo) == e_success)
@@ -105,7 +254,7 @@ int main(int argc, char *argv[])
             return e_failure;
         }
 
-        DecodeInfo decInfo;
+        DecodeInfo decInfo = {0};
 
         if (read_and_validate_decode_args(argv, &decInfo) == e_success)
         {
@@ -122,10 +271,88 @@ int main(int argc, char *argv[])
         return e_success;
     }
 
-    // Step 5: Unsupported operation
+    // Step 5: Steganalysis of one or more images
+    else if (oprn_type == e_analyze)
+    {
+        return do_analyze(argv) == a_success ? e_success : e_failure;
+    }
+
+    // Step 6: Decode images as they land in a directory
+    else if (oprn_type == e_watch)
+    {
+        return do_watch(argv) == w_success ? e_success : e_failure;
+    }
+
+    // Step 7: Decode / analyse the BMP members of a tar stream
+    else if (oprn_type == e_tar)
+    {
+        return do_tar(argv) == t_success ? e_success : e_failure;
+    }
+
+    // Step 8: Compare the bulk copy modes on a carrier
+    else if (oprn_type == e_bench_io)
+    {
+        return do_bench_io(argv) == io_success ? e_success : e_failure;
+    }
+
+    // Step 9: Throughput of the edge-adaptive selection pass
+    else if (oprn_type == e_bench_adaptive)
+    {
+        return do_bench_adaptive(argv) == ad_success ? e_success : e_failure;
+    }
+
+    // Step 10: Stream a secret through the frames of a Y4M video
+    else if (oprn_type == e_y4m)
+    {
+        return do_y4m(argv) == y4m_success ? e_success : e_failure;
+    }
+
+    // Step 11: Replace the secret of a stego image in place
+    else if (oprn_type == e_update)
+    {
+        return do_update(argv) == u_success ? e_success : e_failure;
+    }
+
+    // Step 12: Pack many secrets into a pool of carriers
+    else if (oprn_type == e_plan)
+    {
+        return do_plan(argv) == p_success ? e_success : e_failure;
+    }
+
+    // Step 13: Embed / extract throughput per channel mask
+    else if (oprn_type == e_bench_channels)
+    {
+        return do_bench_channels(argv) == ch_success ? e_success : e_failure;
+    }
+
+    // Step 14: Calibrate the defaults for this machine
+    else if (oprn_type == e_tune)
+    {
+        return do_tune(argv) == tn_success ? e_success : e_failure;
+    }
+
+    // Step 15: Build or refresh a carrier index
+    else if (oprn_type == e_index)
+    {
+        return do_index(argv) == cat_success ? e_success : e_failure;
+    }
+
+    // Step 16: Correction rate and throughput of the FEC under random LSB flips
+    else if (oprn_type == e_bench_fec)
+    {
+        return do_bench_fec(argv) == rs_success ? e_success : e_failure;
+    }
+
+    // Step 17: Run the engines on a synthetic batch under --mem-limit
+    else if (oprn_type == e_mem_check)
+    {
+        return do_mem_check(argv) == m_success ? e_success : e_failure;
+    }
+
+    // Step 18: Unsupported operation
     else
     {
-        printf("Unsupported operation Use -e for encoding or -d for decoding\n");
+        printf("Unsupported operation %s, run ./a.out without arguments to list the modes\n", argv[1]);
         return e_failure;
     }
 }
@@ -137,6 +364,32 @@ OperationType check_operation_type(char *symbol)
         return e_encode;
     else if (strcmp(symbol, "-d") == 0)
         return e_decode;
+    else if (strcmp(symbol, "--analyze") == 0)
+        return e_analyze;
+    else if (strcmp(symbol, "--watch") == 0)
+        return e_watch;
+    else if (strcmp(symbol, "--tar") == 0)
+        return e_tar;
+    else if (strcmp(symbol, "--bench-io") == 0)
+        return e_bench_io;
+    else if (strcmp(symbol, "--bench-adaptive") == 0)
+        return e_bench_adaptive;
+    else if (strcmp(symbol, "--y4m") == 0)
+        return e_y4m;
+    else if (strcmp(symbol, "--update") == 0)
+        return e_update;
+    else if (strcmp(symbol, "--plan") == 0)
+        return e_plan;
+    else if (strcmp(symbol, "--bench-channels") == 0)
+        return e_bench_channels;
+    else if (strcmp(symbol, "--tune") == 0)
+        return e_tune;
+    else if (strcmp(symbol, "--index") == 0)
+        return e_index;
+    else if (strcmp(symbol, "--bench-fec") == 0)
+        return e_bench_fec;
+    else if (strcmp(symbol, "--mem-check") == 0)
+        return e_mem_check;
     else
         return e_unsupported;
 }
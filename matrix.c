@@ -0,0 +1,107 @@
+#include "matrix.h"
+#include <stdint.h>
+#include <string.h>
+
+/* Function Definitions */
+
+uint matrix_carrier_bytes(uint size, uint p)
+{
+    unsigned long blocks = (8UL * size + p - 1) / p;
+    return (uint)(blocks * MATRIX_BLOCK_LEN(p));
+}
+
+/*
+ * Syndrome of one block
+ * Description: Column of image byte i is i + 1, so after putting a
+ * dummy zero bit at position 0 the LSBs form a 2^p bit vector where
+ * bit k of the syndrome is the parity of the positions having bit k
+ * set. The LSBs are packed 8 at a time into 64 bit words and every
+ * syndrome bit is one masked parity over those words.
+ */
+uint matrix_syndrome(const char *block, uint p)
+{
+    // Positions having bit k set, inside one 64 bit word (k < 6)
+    static const uint64_t pattern[6] = {
+        0xAAAAAAAAAAAAAAAAULL, 0xCCCCCCCCCCCCCCCCULL, 0xF0F0F0F0F0F0F0F0ULL,
+        0xFF00FF00FF00FF00ULL, 0xFFFF0000FFFF0000ULL, 0xFFFFFFFF00000000ULL};
+
+    unsigned char buf[(1u << MATRIX_MAX_P) + 8];
+    uint64_t word[(1u << MATRIX_MAX_P) / 64 + 1];
+    uint positions = 1u << p;
+    uint n = MATRIX_BLOCK_LEN(p);
+
+    // Step 1 : dummy position 0 followed by the block, zero padded
+    buf[0] = 0;
+    memcpy(buf + 1, block, n);
+    memset(buf + 1 + n, 0, 8);
+
+    // Step 2 : pack 8 LSBs per multiply into the words
+    uint words = positions > 64 ? positions / 64 : 1;
+    memset(word, 0, sizeof(word));
+    for (uint g = 0; g * 8 < positions; g++)
+    {
+        uint64_t lsb;
+        memcpy(&lsb, buf + 8 * g, 8);
+        lsb &= 0x0101010101010101ULL;
+        uint64_t mask = (lsb * 0x0102040810204080ULL) >> 56;
+        word[g / 8] |= mask << (8 * (g % 8));
+    }
+
+    // Step 3 : one parity per syndrome bit
+    uint syndrome = 0;
+    for (uint k = 0; k < p; k++)
+    {
+        uint parity = 0;
+        for (uint w = 0; w < words; w++)
+        {
+            if (k < 6)
+            {
+                parity ^= __builtin_parityll(word[w] & pattern[k]);
+            }
+            else if ((w >> (k - 6)) & 1)
+            {
+                parity ^= __builtin_parityll(word[w]);
+            }
+        }
+        syndrome |= parity << k;
+    }
+    return syndrome;
+}
+
+int matrix_embed_bits(char *block, uint p, uint bits)
+{
+    // Flipping the LSB of byte s - 1 adds column s to the syndrome
+    uint s = matrix_syndrome(block, p) ^ bits;
+    if (s == 0)
+    {
+        return 0;
+    }
+    block[s - 1] ^= 1;
+    return 1;
+}
+
+uint matrix_get_bits(const unsigned char *buf, uint size, unsigned long bitpos, uint p)
+{
+    uint bits = 0;
+    for (uint b = 0; b < p; b++)
+    {
+        unsigned long pos = bitpos + b;
+        if (pos < 8UL * size)
+        {
+            bits |= (uint)((buf[pos >> 3] >> (pos & 7)) & 1) << b;
+        }
+    }
+    return bits;
+}
+
+void matrix_put_bits(unsigned char *buf, uint size, unsigned long bitpos, uint p, uint bits)
+{
+    for (uint b = 0; b < p; b++)
+    {
+        unsigned long pos = bitpos + b;
+        if (pos < 8UL * size)
+        {
+            buf[pos >> 3] |= ((bits >> b) & 1) << (pos & 7);
+        }
+    }
+}
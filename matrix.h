@@ -0,0 +1,35 @@
+#ifndef MATRIX_H
+#define MATRIX_H
+
+#include "types.h" // Contains user defined types
+
+/*
+ * Matrix embedding with (1, 2^p - 1, p) Hamming codes
+ * p payload bits are carried by the LSBs of a block of 2^p - 1
+ * image bytes. The bits are the syndrome of the block LSBs, so
+ * at most one byte of the block is changed to embed them.
+ */
+
+/* Supported range of p */
+#define MATRIX_MIN_P 2
+#define MATRIX_MAX_P 8
+
+/* Image bytes in one block */
+#define MATRIX_BLOCK_LEN(p) ((1u << (p)) - 1)
+
+/* Image bytes needed to carry size payload bytes */
+uint matrix_carrier_bytes(uint size, uint p);
+
+/* Syndrome (the p embedded bits) of one block */
+uint matrix_syndrome(const char *block, uint p);
+
+/* Embed p bits into one block, return 1 if a byte was changed */
+int matrix_embed_bits(char *block, uint p, uint bits);
+
+/* Read p bits starting at bit bitpos (LSB first) of buf, zero past the end */
+uint matrix_get_bits(const unsigned char *buf, uint size, unsigned long bitpos, uint p);
+
+/* OR p bits into a zeroed buf at bit bitpos (LSB first), bits past the end are dropped */
+void matrix_put_bits(unsigned char *buf, uint size, unsigned long bitpos, uint p, uint bits);
+
+#endif
@@ -0,0 +1,405 @@
+#include "mem.h"
+#include <malloc.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Header in front of every block, keeps the block aligned as malloc's */
+typedef union _MemHeader
+{
+    struct
+    {
+        size_t size;                // To store the block size asked for
+        unsigned long long job;     // To store the id of the job that allocated it (0 outside jobs)
+    } h;
+    max_align_t align;
+} MemHeader;
+
+/* Process wide counters, current and peak are updated lock free */
+static size_t mem_current, mem_peak_bytes, mem_limit_bytes;
+static unsigned long long mem_next_id, mem_refused;
+static int mem_stats_asked;
+
+/* Admission of jobs under the limit */
+static pthread_mutex_t mem_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mem_room = PTHREAD_COND_INITIALIZER;
+static size_t mem_reserved, mem_job_peak;
+static long mem_jobs, mem_throttled;
+
+static __thread MemJob *mem_job;
+
+/* Function Definitions */
+
+static void mem_raise(size_t *peak, size_t value)
+{
+    size_t seen = __atomic_load_n(peak, __ATOMIC_RELAXED);
+    while (value > seen && !__atomic_compare_exchange_n(peak, &seen, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+    }
+}
+
+/* Take size bytes of the budget, 0 when the limit would be passed */
+static int mem_take(size_t size)
+{
+    size_t now = __atomic_add_fetch(&mem_current, size, __ATOMIC_RELAXED);
+    if (mem_limit_bytes != 0 && now > mem_limit_bytes)
+    {
+        __atomic_sub_fetch(&mem_current, size, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&mem_refused, 1, __ATOMIC_RELAXED);
+        char asked[16], used[16], limit[16];
+        printf("Memory limit of %s reached: %s asked with %s in use\n", mem_format(mem_limit_bytes, limit),
+               mem_format(size, asked), mem_format(now - size, used));
+        return 0;
+    }
+    mem_raise(&mem_peak_bytes, now);
+    return 1;
+}
+
+static void mem_give(size_t size)
+{
+    __atomic_sub_fetch(&mem_current, size, __ATOMIC_RELAXED);
+}
+
+/* Job counters, only for blocks of the job running on this thread */
+static void mem_job_add(unsigned long long id, size_t size)
+{
+    MemJob *job = mem_job;
+    if (job != NULL && job->id == id)
+    {
+        mem_raise(&job->peak, __atomic_add_fetch(&job->current, size, __ATOMIC_RELAXED));
+    }
+}
+
+static void mem_job_sub(unsigned long long id, size_t size)
+{
+    MemJob *job = mem_job;
+    if (job != NULL && job->id == id)
+    {
+        __atomic_sub_fetch(&job->current, size, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Parse a size
+ * Description: A number of bytes with an optional K, M or G suffix
+ * (powers of 1024), 0 when it is not one
+ */
+static size_t mem_parse_size(const char *text)
+{
+    char *end;
+    unsigned long long value = strtoull(text, &end, 10);
+    switch (*end)
+    {
+    case 'K': case 'k':
+        value <<= 10;
+        end++;
+        break;
+    case 'M': case 'm':
+        value <<= 20;
+        end++;
+        break;
+    case 'G': case 'g':
+        value <<= 30;
+        end++;
+        break;
+    }
+    return end == text || *end != '\0' ? 0 : (size_t)value;
+}
+
+MemStatus mem_init(char *argv[])
+{
+    for (int i = 1; argv[i] != NULL; i++)
+    {
+        if (strncmp(argv[i], "--mem-limit=", 12) == 0)
+        {
+            mem_limit_bytes = mem_parse_size(argv[i] + 12);
+            if (mem_limit_bytes == 0)
+            {
+                printf("--mem-limit takes a size like 512M or 2G, not %s\n", argv[i] + 12);
+                return m_failure;
+            }
+            mem_stats_asked = 1;
+
+            // A fixed threshold keeps large buffers mmap'd, so freeing them returns them to the system
+            // instead of leaving them in the arenas of the worker threads
+            mallopt(M_MMAP_THRESHOLD, MEM_MMAP_THRESHOLD);
+            mallopt(M_TRIM_THRESHOLD, MEM_MMAP_THRESHOLD);
+        }
+        else if (strcmp(argv[i], "--mem-stats") == 0)
+        {
+            mem_stats_asked = 1;
+        }
+    }
+    if (mem_stats_asked)
+    {
+        atexit(mem_report);
+    }
+    return m_success;
+}
+
+size_t mem_limit(void)
+{
+    return mem_limit_bytes;
+}
+
+void *mem_alloc(size_t size)
+{
+    if (size > (size_t)-1 - sizeof(MemHeader) || !mem_take(size))
+    {
+        return NULL;
+    }
+    MemHeader *header = malloc(sizeof(MemHeader) + size);
+    if (header == NULL)
+    {
+        mem_give(size);
+        return NULL;
+    }
+    header->h.size = size;
+    header->h.job = mem_job != NULL ? mem_job->id : 0;
+    mem_job_add(header->h.job, size);
+    return header + 1;
+}
+
+void *mem_calloc(size_t count, size_t size)
+{
+    if (size != 0 && count > (size_t)-1 / size)
+    {
+        return NULL;
+    }
+    void *ptr = mem_alloc(count * size);
+    if (ptr != NULL)
+    {
+        memset(ptr, 0, count * size);
+    }
+    return ptr;
+}
+
+/* A grown block takes the difference from the budget before it is grown */
+void *mem_realloc(void *ptr, size_t size)
+{
+    if (ptr == NULL)
+    {
+        return mem_alloc(size);
+    }
+    MemHeader *header = (MemHeader *)ptr - 1;
+    size_t old = header->h.size;
+    unsigned long long job = header->h.job;
+    if (size > (size_t)-1 - sizeof(MemHeader) || (size > old && !mem_take(size - old)))
+    {
+        return NULL;
+    }
+    MemHeader *grown = realloc(header, sizeof(MemHeader) + size);
+    if (grown == NULL)
+    {
+        if (size > old)
+        {
+            mem_give(size - old);
+        }
+        return NULL;
+    }
+    if (size > old)
+    {
+        mem_job_add(job, size - old);
+    }
+    else
+    {
+        mem_give(old - size);
+        mem_job_sub(job, old - size);
+    }
+    grown->h.size = size;
+    return grown + 1;
+}
+
+void mem_free(void *ptr)
+{
+    if (ptr == NULL)
+    {
+        return;
+    }
+    MemHeader *header = (MemHeader *)ptr - 1;
+    mem_give(header->h.size);
+    mem_job_sub(header->h.job, header->h.size);
+    free(header);
+}
+
+char *mem_strdup(const char *str)
+{
+    size_t len = strlen(str) + 1;
+    char *copy = mem_alloc(len);
+    if (copy != NULL)
+    {
+        memcpy(copy, str, len);
+    }
+    return copy;
+}
+
+int mem_charge(size_t size)
+{
+    if (!mem_take(size))
+    {
+        return 0;
+    }
+    mem_job_add(mem_job != NULL ? mem_job->id : 0, size);
+    return 1;
+}
+
+void mem_uncharge(size_t size)
+{
+    mem_give(size);
+    if (mem_job != NULL)
+    {
+        mem_job_sub(mem_job->id, size < mem_job->current ? size : mem_job->current);
+    }
+}
+
+/*
+ * Start a job
+ * Description: The reservation is the larger of the estimate and the
+ * largest job peak seen so far. A job waits while the reservations of
+ * the running ones leave no room for it, the first one always starts
+ * (its allocations are still held to the limit).
+ */
+void mem_job_begin(MemJob *job, size_t estimate)
+{
+    memset(job, 0, sizeof(*job));
+    job->id = __atomic_add_fetch(&mem_next_id, 1, __ATOMIC_RELAXED);
+    if (mem_limit_bytes != 0)
+    {
+        pthread_mutex_lock(&mem_lock);
+        size_t need = estimate > mem_job_peak ? estimate : mem_job_peak;
+        if (need > mem_limit_bytes)
+        {
+            need = mem_limit_bytes;
+        }
+        int waited = 0;
+        while (mem_reserved > 0 && mem_reserved + need > mem_limit_bytes)
+        {
+            waited = 1;
+            pthread_cond_wait(&mem_room, &mem_lock);
+        }
+        mem_reserved += need;
+        mem_throttled += waited;
+        job->reserve = need;
+        pthread_mutex_unlock(&mem_lock);
+    }
+    mem_job = job;
+}
+
+void mem_job_end(MemJob *job)
+{
+    mem_job = NULL;
+    pthread_mutex_lock(&mem_lock);
+    mem_jobs++;
+    if (job->peak > mem_job_peak)
+    {
+        mem_job_peak = job->peak;
+    }
+    if (job->reserve > 0)
+    {
+        mem_reserved -= job->reserve;
+        pthread_cond_broadcast(&mem_room);
+    }
+    pthread_mutex_unlock(&mem_lock);
+}
+
+MemJob *mem_job_current(void)
+{
+    return mem_job;
+}
+
+void mem_job_attach(MemJob *job)
+{
+    mem_job = job;
+}
+
+size_t mem_block_size(size_t block)
+{
+    if (mem_limit_bytes == 0)
+    {
+        return block;
+    }
+    size_t cap = mem_limit_bytes / MEM_BLOCK_SHARE / MEM_MIN_BLOCK * MEM_MIN_BLOCK;
+    if (cap < MEM_MIN_BLOCK)
+    {
+        cap = MEM_MIN_BLOCK;
+    }
+    return block < cap ? block : cap;
+}
+
+int mem_slots(size_t slot_bytes, int slots)
+{
+    if (mem_limit_bytes == 0 || slot_bytes == 0)
+    {
+        return slots;
+    }
+    size_t used = __atomic_load_n(&mem_current, __ATOMIC_RELAXED);
+    size_t fit = (mem_limit_bytes > used ? mem_limit_bytes - used : 0) / 2 / slot_bytes;
+    if (fit < 1)
+    {
+        fit = 1;
+    }
+    return fit < (size_t)slots ? (int)fit : slots;
+}
+
+size_t mem_peak(void)
+{
+    return __atomic_load_n(&mem_peak_bytes, __ATOMIC_RELAXED);
+}
+
+size_t mem_job_peak_max(void)
+{
+    pthread_mutex_lock(&mem_lock);
+    size_t peak = mem_job_peak;
+    pthread_mutex_unlock(&mem_lock);
+    return peak;
+}
+
+void mem_peak_reset(void)
+{
+    __atomic_store_n(&mem_peak_bytes, __atomic_load_n(&mem_current, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+}
+
+unsigned long long mem_refusals(void)
+{
+    return __atomic_load_n(&mem_refused, __ATOMIC_RELAXED);
+}
+
+/* Powers of 1024, the units --mem-limit is given in */
+const char *mem_format(size_t bytes, char *out)
+{
+    if (bytes < ((size_t)1 << 20))
+    {
+        snprintf(out, 16, "%.1f KB", bytes / 1024.0);
+    }
+    else if (bytes < ((size_t)1 << 30))
+    {
+        snprintf(out, 16, "%.1f MB", bytes / (1024.0 * 1024.0));
+    }
+    else
+    {
+        snprintf(out, 16, "%.2f GB", bytes / (1024.0 * 1024.0 * 1024.0));
+    }
+    return out;
+}
+
+void mem_report(void)
+{
+    char peak[16], limit[16], job[16];
+    printf("Memory : peak %s", mem_format(mem_peak(), peak));
+    if (mem_limit_bytes != 0)
+    {
+        printf(" of %s limit", mem_format(mem_limit_bytes, limit));
+    }
+    if (mem_jobs > 0)
+    {
+        printf(", largest job %s over %ld jobs", mem_format(mem_job_peak_max(), job), mem_jobs);
+    }
+    if (mem_limit_bytes != 0)
+    {
+        printf(", %ld jobs waited for room, %llu allocations refused", mem_throttled,
+               __atomic_load_n(&mem_refused, __ATOMIC_RELAXED));
+    }
+    printf("\n");
+}
@@ -0,0 +1,94 @@
+#ifndef MEM_H
+#define MEM_H
+#include <stddef.h>
+
+#include "types.h" // Contains user defined types
+
+/*
+ * Memory accounting (--mem-limit=<size>, --mem-stats)
+ * Every buffer of the tool comes from mem_alloc / mem_calloc /
+ * mem_realloc (and the mmap'd copy buffers are charged with
+ * mem_charge), so the bytes in use and their peak are known for the
+ * whole process and for each job of a batch. With a limit:
+ *     an allocation that would go over it fails (callers already
+ *     handle NULL), so the limit is never exceeded
+ *     batch engines admit a job only when its reservation (its
+ *     estimate, or the largest job seen so far) fits next to the
+ *     running ones, so fewer jobs run at once instead of failing
+ *     copy blocks and frame rings are shrunk to a share of the limit
+ */
+
+/* Smallest copy block under a limit, and the granularity of block sizes */
+#define MEM_MIN_BLOCK 4096
+
+/* Allocations from this size on are their own mappings under a limit */
+#define MEM_MMAP_THRESHOLD (128 * 1024)
+
+/* Share of the limit one copy block may take (1 / MEM_BLOCK_SHARE) */
+#define MEM_BLOCK_SHARE 16
+
+/*
+ * Structure to store the accounting of one job
+ * (one carrier of --plan, one image of --watch / --analyze, ...)
+ */
+
+typedef struct _MemJob
+{
+    unsigned long long id;   // To store the serial number, tags the job's blocks
+    size_t current;          // To store the bytes it holds
+    size_t peak;             // To store the most it held at once
+    size_t reserve;          // To store the bytes set aside for it under the limit
+} MemJob;
+
+/* Mem function prototype */
+
+/* Read --mem-limit=<n>[K|M|G] and --mem-stats from argv, the summary is printed at exit with either */
+MemStatus mem_init(char *argv[]);
+
+/* Limit in bytes, 0 when there is none */
+size_t mem_limit(void);
+
+/* Tracked malloc / calloc / realloc / free / strdup */
+void *mem_alloc(size_t size);
+void *mem_calloc(size_t count, size_t size);
+void *mem_realloc(void *ptr, size_t size);
+void mem_free(void *ptr);
+char *mem_strdup(const char *str);
+
+/* Account memory that does not come from mem_alloc (mmap'd buffers), 0 when it would go over the limit */
+int mem_charge(size_t size);
+void mem_uncharge(size_t size);
+
+/* Start a job on the calling thread, waits until its reservation fits under the limit */
+void mem_job_begin(MemJob *job, size_t estimate);
+
+/* End it, its peak sizes the reservation of later jobs */
+void mem_job_end(MemJob *job);
+
+/* Job of the calling thread (NULL outside one), and attach a helper thread to a job */
+MemJob *mem_job_current(void);
+void mem_job_attach(MemJob *job);
+
+/* Copy block size under the limit (block itself without one) */
+size_t mem_block_size(size_t block);
+
+/* How many buffers of slot_bytes fit in half of what the limit leaves, between 1 and slots */
+int mem_slots(size_t slot_bytes, int slots);
+
+/* Process peak and the largest job peak, in bytes */
+size_t mem_peak(void);
+size_t mem_job_peak_max(void);
+
+/* Restart the process peak from the bytes in use now */
+void mem_peak_reset(void);
+
+/* Allocations refused so far for the limit */
+unsigned long long mem_refusals(void);
+
+/* Bytes as "12.3 MB" in powers of 1024 (as --mem-limit), written to out (at least 16 bytes) */
+const char *mem_format(size_t bytes, char *out);
+
+/* Print the summary line: peak, limit, largest job, throttled jobs, refused allocations */
+void mem_report(void);
+
+#endif
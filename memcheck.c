@@ -0,0 +1,256 @@
+#define _GNU_SOURCE // nftw
+#include "memcheck.h"
+#include "mem.h"
+#include "util.h"
+#include "analyze.h"
+#include "plan.h"
+#include "y4m.h"
+#include "bmp.h"
+#include <fcntl.h>
+#include <ftw.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Function Definitions */
+
+/* Noise 4:2:0 video of MEMCHECK_FRAMES frames */
+static MemStatus memcheck_write_video(const char *fname, uint width, uint height, uint seed)
+{
+    size_t frame_len = (size_t)width * height * 3 / 2;
+    unsigned char *frame = mem_alloc(frame_len);
+    FILE *fptr = fopen(fname, "wb");
+    int ok = frame != NULL && fptr != NULL &&
+             fprintf(fptr, "YUV4MPEG2 W%u H%u F25:1 Ip A1:1 C420jpeg\n", width, height) > 0;
+    for (int f = 0; ok && f < MEMCHECK_FRAMES; f++)
+    {
+        for (size_t i = 0; i < frame_len; i++)
+        {
+            frame[i] = (unsigned char)xorshift32(&seed);
+        }
+        ok = fputs("FRAME\n", fptr) >= 0 && fwrite(frame, 1, frame_len, fptr) == frame_len;
+    }
+    mem_free(frame);
+    if (fptr != NULL && fclose(fptr) != 0)
+    {
+        ok = 0;
+    }
+    return ok ? m_success : m_failure;
+}
+
+static MemStatus memcheck_write_secret(const char *fname, uint size, int salt)
+{
+    FILE *fptr = fopen(fname, "w");
+    if (fptr == NULL)
+    {
+        return m_failure;
+    }
+    for (uint i = 0; i < size; i++)
+    {
+        fputc('a' + (i * 7 + salt) % 26, fptr);
+    }
+    return fclose(fptr) == 0 ? m_success : m_failure;
+}
+
+static int memcheck_remove(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    (void)st;
+    (void)type;
+    (void)ftw;
+    remove(path);
+    return 0;
+}
+
+/* A "Vm...:" field of /proc/self/status in bytes, 0 when it cannot be read */
+static size_t memcheck_vm_bytes(const char *field)
+{
+    char line[128];
+    unsigned long long kb = 0;
+    size_t len = strlen(field);
+    FILE *fptr = fopen("/proc/self/status", "r");
+    while (fptr != NULL && fgets(line, sizeof(line), fptr) != NULL)
+    {
+        if (strncmp(line, field, len) == 0 && sscanf(line + len, "%llu", &kb) == 1)
+        {
+            break;
+        }
+    }
+    if (fptr != NULL)
+    {
+        fclose(fptr);
+    }
+    return (size_t)kb * 1024;
+}
+
+/* Restart the resident peak (VmHWM) from the resident size now, return that size or 0 when it cannot be */
+static size_t memcheck_rss_reset(void)
+{
+    int fd = open("/proc/self/clear_refs", O_WRONLY);
+    int reset = fd >= 0 && write(fd, "5", 1) == 1;
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    return reset ? memcheck_vm_bytes("VmRSS:") : 0;
+}
+
+/*
+ * Result line of one engine
+ * Description: The tracked peak cannot pass the limit (the allocator
+ * refuses first), so it is only printed. The step fails when the
+ * engine failed, when an allocation was refused for the limit (engines
+ * are expected to wait or shrink their buffers instead) or when the
+ * resident size the kernel saw grew by more than the limit, which also
+ * catches memory the allocator never tracked
+ */
+static int memcheck_result(const char *step, int ok, unsigned long long refused_before, size_t rss_before,
+                           double seconds)
+{
+    char peak[16], limit[16], rss[16];
+    unsigned long long refused = mem_refusals() - refused_before;
+    size_t hwm = rss_before > 0 ? memcheck_vm_bytes("VmHWM:") : 0;
+    size_t grown = hwm > rss_before ? hwm - rss_before : 0;
+    int pass = ok && refused == 0 && grown <= mem_limit();
+    printf("  %-10s : %s, peak %s tracked, resident +%s of %s limit, %llu allocations refused, %.2f s\n", step,
+           pass ? "ok" : "FAILED", mem_format(mem_peak(), peak), hwm > 0 ? mem_format(grown, rss) : "? (unread)",
+           mem_format(mem_limit(), limit), refused, seconds);
+    return pass;
+}
+
+/*
+ * Run --mem-check
+ * Description: Step 1 writes the batch (carriers of about a third of
+ * the limit each, so together they are larger than it), Step 2 runs
+ * every engine with the process peak reset before it
+ */
+MemStatus do_mem_check(char *argv[])
+{
+    const char *scratch = ".";
+    for (int i = 2; argv[i] != NULL; i++)
+    {
+        if (strncmp(argv[i], "--", 2) != 0)
+        {
+            scratch = argv[i];
+        }
+    }
+    if (mem_limit() == 0)
+    {
+        printf("Give the limit to check --> ./a.out --mem-check [<scratch dir>] --mem-limit=<size>[K|M|G]\n");
+        return m_failure;
+    }
+
+    // Step 1 : geometry from the limit, 4:3 and even for the 4:2:0 video
+    double pixels = (double)mem_limit() / MEMCHECK_SHARE / 3;
+    uint height = (uint)sqrt(pixels * 3 / 4) & ~1u;
+    height = height < 64 ? 64 : height > 16384 ? 16384 : height;
+    uint width = ((uint)(pixels / height) & ~1u);
+    width = width < 64 ? 64 : width > 16384 ? 16384 : width;
+
+    // secrets of at most a quarter of a carrier, two or more share one
+    uint secret_bytes = width * height * 3 / 8 / 4;
+    secret_bytes = secret_bytes < MEMCHECK_SECRET_BYTES ? secret_bytes : MEMCHECK_SECRET_BYTES;
+
+    char dir[FILENAME_MAX], carriers[FILENAME_MAX], secrets[FILENAME_MAX], out[FILENAME_MAX];
+    char video[FILENAME_MAX], stego_video[FILENAME_MAX], decoded[FILENAME_MAX];
+    char carrier[MEMCHECK_CARRIERS][FILENAME_MAX], secret[FILENAME_MAX];
+    if (strlen(scratch) > sizeof(dir) - 64 ||
+        snprintf(dir, sizeof(dir), "%s/.steg_memcheck.%ld", scratch, (long)getpid()) >= (int)sizeof(dir) ||
+        snprintf(carriers, sizeof(carriers), "%s/carriers", dir) >= (int)sizeof(carriers) ||
+        snprintf(secrets, sizeof(secrets), "%s/secrets", dir) >= (int)sizeof(secrets) ||
+        snprintf(out, sizeof(out), "%s/out", dir) >= (int)sizeof(out) ||
+        snprintf(video, sizeof(video), "%s/video.y4m", dir) >= (int)sizeof(video) ||
+        snprintf(stego_video, sizeof(stego_video), "%s/stego.y4m", dir) >= (int)sizeof(stego_video) ||
+        snprintf(decoded, sizeof(decoded), "%s/decoded", dir) >= (int)sizeof(decoded))
+    {
+        printf("Scratch directory name too long\n");
+        return m_failure;
+    }
+    if (mkdir(dir, 0700) != 0 || mkdir(carriers, 0700) != 0 || mkdir(secrets, 0700) != 0)
+    {
+        perror(dir);
+        nftw(dir, memcheck_remove, 16, FTW_DEPTH | FTW_PHYS);
+        return m_failure;
+    }
+
+    MemStatus status = m_success;
+    for (int i = 0; status == m_success && i < MEMCHECK_CARRIERS; i++)
+    {
+        status = snprintf(carrier[i], sizeof(carrier[i]), "%s/carrier_%d.bmp", carriers, i) < (int)sizeof(carrier[i]) &&
+                         bmp_write_noise(carrier[i], width, height, 0x9E3779B9u * (i + 1))
+                     ? m_success
+                     : m_failure;
+    }
+    for (int i = 0; status == m_success && i < MEMCHECK_SECRETS; i++)
+    {
+        status = snprintf(secret, sizeof(secret), "%s/secret_%d.txt", secrets, i) < (int)sizeof(secret)
+                     ? memcheck_write_secret(secret, secret_bytes, i)
+                     : m_failure;
+    }
+    if (status == m_success)
+    {
+        status = memcheck_write_video(video, width, height, 0x85EBCA6Bu);
+    }
+    if (status != m_success)
+    {
+        printf("Cannot write the check batch to %s\n", dir);
+        nftw(dir, memcheck_remove, 16, FTW_DEPTH | FTW_PHYS);
+        return m_failure;
+    }
+
+    char limit[16], image[16];
+    printf("Checking under %s : %d carriers of %ux%u (%s each), %d secrets of %u bytes, %d frames of video\n",
+           mem_format(mem_limit(), limit), MEMCHECK_CARRIERS, width, height,
+           mem_format((size_t)((width * 3 + 3) & ~3u) * height, image), MEMCHECK_SECRETS, secret_bytes,
+           MEMCHECK_FRAMES);
+
+    // Step 2 : every engine on the batch
+    char *analyze_args[3 + MEMCHECK_CARRIERS] = {argv[0], "--analyze"};
+    for (int i = 0; i < MEMCHECK_CARRIERS; i++)
+    {
+        analyze_args[2 + i] = carrier[i];
+    }
+    char *plan_args[] = {argv[0], "--plan", carriers, secrets, out, NULL};
+    char *encode_args[] = {argv[0], "--y4m", "-e", video, secret, stego_video, NULL};
+    char *decode_args[] = {argv[0], "--y4m", "-d", stego_video, decoded, NULL};
+
+    for (int step = 0; step < 4; step++)
+    {
+        static const char *const names[] = {"--analyze", "--plan", "--y4m -e", "--y4m -d"};
+        struct timespec t0, t1;
+        unsigned long long refused = mem_refusals();
+        int ok = 0;
+
+        mem_peak_reset();
+        size_t rss = memcheck_rss_reset();
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        int saved = quiet_stdout(-1);
+        switch (step)
+        {
+        case 0:
+            ok = do_analyze(analyze_args) == a_success;
+            break;
+        case 1:
+            ok = do_plan(plan_args) == p_success;
+            break;
+        case 2:
+            ok = do_y4m(encode_args) == y4m_success;
+            break;
+        default:
+            ok = do_y4m(decode_args) == y4m_success;
+            break;
+        }
+        quiet_stdout(saved);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        if (!memcheck_result(names[step], ok, refused, rss, elapsed_s(&t0, &t1)))
+        {
+            status = m_failure;
+        }
+    }
+
+    nftw(dir, memcheck_remove, 16, FTW_DEPTH | FTW_PHYS);
+    printf("Memory check %s\n", status == m_success ? "passed" : "FAILED");
+    return status;
+}
@@ -0,0 +1,31 @@
+#ifndef MEMCHECK_H
+#define MEMCHECK_H
+
+#include "types.h" // Contains user defined types
+
+/*
+ * Memory bound check (--mem-check)
+ * Synthetic carriers, secrets and a video sized from the --mem-limit
+ * are written to a scratch directory, then --analyze, --plan and
+ * --y4m (encode and decode) run on them in process. Each engine must
+ * succeed with no allocation refused and its resident size (VmHWM)
+ * growing by no more than the limit, otherwise the check fails.
+ */
+
+/* Carriers (and secrets) of the synthetic batch */
+#define MEMCHECK_CARRIERS 4
+#define MEMCHECK_SECRETS 8
+#define MEMCHECK_SECRET_BYTES (4 * 1024) // at most, smaller when the carriers are
+
+/* Frames of the synthetic video */
+#define MEMCHECK_FRAMES 6
+
+/* Each carrier (and video frame) takes about 1 / MEMCHECK_SHARE of the limit */
+#define MEMCHECK_SHARE 3
+
+/* Mem check function prototype */
+
+/* Run --mem-check [<scratch dir>] --mem-limit=<size> */
+MemStatus do_mem_check(char *argv[]);
+
+#endif
@@ -0,0 +1,957 @@
+#include "plan.h"
+#include "mem.h"
+#include "util.h"
+#include "catalog.h"
+#include "encode.h"
+#include "bulkio.h"
+#include "common.h"
+#include "trace.h"
+#include "tune.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Function Definitions */
+
+/* Payload bytes of an image of capacity width * height * 3, for a .txt payload with the given flags */
+static uint plan_payload_capacity(unsigned long long capacity, uint flags)
+{
+    // magic string, flags word, extension size, ".txt", secret size
+    unsigned long long overhead = 8 * strlen(MAGIC_STRING) + STEG_FLAGS_BITS(flags) + 32 + 32 + 32;
+    if (capacity <= overhead)
+    {
+        return 0;
+    }
+    unsigned long long payload = (capacity - overhead - 1) / 8;
+    return payload > 0x7FFFFFFF ? 0x7FFFFFFF : (uint)payload;
+}
+
+/*
+ * Payload bytes a carrier can take
+ * Description: Same header read and limit as get_image_size_for_bmp and
+ * check_capacity (width * height * 3 must be greater than the stream
+ * bits), without the prints, for a .txt payload with the given flags
+ */
+static uint plan_carrier_capacity(const char *fname, uint flags)
+{
+    unsigned char header[26];
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0)
+    {
+        perror(fname);
+        return 0;
+    }
+    ssize_t got = pread(fd, header, sizeof(header), 0);
+    close(fd);
+    if (got != (ssize_t)sizeof(header) || header[0] != 'B' || header[1] != 'M')
+    {
+        printf("%s is not a BMP image, skipped\n", fname);
+        return 0;
+    }
+
+    uint width, height;
+    memcpy(&width, header + 18, sizeof(width));
+    memcpy(&height, header + 22, sizeof(height));
+    return plan_payload_capacity((unsigned long long)width * height * 3, flags);
+}
+
+/* Free an array of names */
+static void plan_free_names(char **names, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        mem_free(names[i]);
+    }
+    mem_free(names);
+}
+
+/*
+ * Append one name to a growing array
+ * Description: When memory runs out the whole array is freed, NULL is
+ * returned and count is set to -1 so callers tell it from no names
+ */
+static char **plan_push_name(char **names, int *count, int *cap, const char *name)
+{
+    char *copy = mem_strdup(name);
+    if (copy != NULL && *count == *cap)
+    {
+        char **grown = mem_realloc(names, (*cap ? *cap * 2 : 1024) * sizeof(char *));
+        if (grown == NULL)
+        {
+            mem_free(copy);
+            copy = NULL;
+        }
+        else
+        {
+            names = grown;
+            *cap = *cap ? *cap * 2 : 1024;
+        }
+    }
+    if (copy == NULL)
+    {
+        printf("Out of memory after %d names\n", *count);
+        plan_free_names(names, *count);
+        *count = -1;
+        return NULL;
+    }
+    names[(*count)++] = copy;
+    return names;
+}
+
+/*
+ * Read the input names
+ * Description: src is a directory (every regular, non hidden file in it,
+ * only .bmp ones when bmp_only) or a list file with one path per line
+ */
+char **plan_read_names(const char *src, int bmp_only, int *count)
+{
+    char **names = NULL, path[FILENAME_MAX];
+    int cap = 0;
+    struct stat st;
+
+    *count = 0;
+    if (stat(src, &st) != 0)
+    {
+        perror(src);
+        return NULL;
+    }
+
+    if (S_ISDIR(st.st_mode))
+    {
+        DIR *dir = opendir(src);
+        if (dir == NULL)
+        {
+            perror(src);
+            return NULL;
+        }
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL)
+        {
+            const char *dot = strrchr(entry->d_name, '.');
+            if (entry->d_name[0] == '.' || (bmp_only && (dot == NULL || strcmp(dot, ".bmp") != 0)) ||
+                snprintf(path, sizeof(path), "%s/%s", src, entry->d_name) >= (int)sizeof(path))
+            {
+                continue;
+            }
+            if ((names = plan_push_name(names, count, &cap, path)) == NULL)
+            {
+                break;
+            }
+        }
+        closedir(dir);
+        return names;
+    }
+
+    FILE *fptr_list = fopen(src, "r");
+    if (fptr_list == NULL)
+    {
+        perror(src);
+        return NULL;
+    }
+    while (fgets(path, sizeof(path), fptr_list) != NULL)
+    {
+        path[strcspn(path, "\r\n")] = '\0';
+        if (path[0] == '\0' || path[0] == '#')
+        {
+            continue;
+        }
+        if ((names = plan_push_name(names, count, &cap, path)) == NULL)
+        {
+            break;
+        }
+    }
+    fclose(fptr_list);
+    return names;
+}
+
+static const char *plan_basename(const char *fname)
+{
+    const char *slash = strrchr(fname, '/');
+    return slash ? slash + 1 : fname;
+}
+
+static int cmp_basename(const void *a, const void *b)
+{
+    return strcmp(plan_basename(*(char *const *)a), plan_basename(*(char *const *)b));
+}
+
+/* Usable carriers of an index that hold no stream yet, no image is opened */
+static char **plan_index_names(const Catalog *catalog, int *count)
+{
+    char **names = NULL;
+    int cap = 0;
+
+    *count = 0;
+    for (uint64_t i = 0; i < catalog->header->count; i++)
+    {
+        const CatalogEntry *entry = &catalog->entries[i];
+        if (!entry->valid || entry->stego)
+        {
+            continue;
+        }
+        if ((names = plan_push_name(names, count, &cap, catalog_path(catalog, entry))) == NULL)
+        {
+            break;
+        }
+    }
+    return names;
+}
+
+/*
+ * Capacity of an indexed carrier
+ * Description: The entry is only trusted while the file keeps the size
+ * and mtime it was indexed with (one stat), a carrier changed since is
+ * probed again and skipped when it is no longer usable or now holds a
+ * stream
+ */
+static uint plan_index_capacity(const Catalog *catalog, const char *fname, uint flags, int *stale)
+{
+    const CatalogEntry *entry = catalog_lookup(catalog, fname);
+    struct stat st;
+    if (entry == NULL || stat(fname, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        printf("%s is no longer there, skipped\n", fname);
+        return 0;
+    }
+    if (catalog_fresh(entry, &st))
+    {
+        return plan_payload_capacity(entry->capacity, flags);
+    }
+
+    CatalogEntry probed = {0};
+    catalog_probe(fname, &st, &probed);
+    (*stale)++;
+    if (!probed.valid || probed.stego)
+    {
+        printf("%s changed since it was indexed and is no longer a free carrier, skipped\n", fname);
+        return 0;
+    }
+    return plan_payload_capacity(probed.capacity, flags);
+}
+
+/*
+ * Carriers with their capacity, stego images are named after them so names must be distinct
+ * Description: With an index (built by --index) the capacities come from
+ * its entries (re-read for carriers changed since), otherwise from the
+ * header of each carrier
+ */
+static PlanStatus plan_load_carriers(PlanInfo *planInfo)
+{
+    Catalog catalog = {0};
+    int count, indexed = catalog_is_index(planInfo->carrier_src);
+    if (indexed && catalog_open(&catalog, planInfo->carrier_src) != cat_success)
+    {
+        return p_failure;
+    }
+    char **names = indexed ? plan_index_names(&catalog, &count) : plan_read_names(planInfo->carrier_src, 1, &count);
+    if (names == NULL || count == 0)
+    {
+        printf(count < 0 ? "Not enough memory to list the carriers of %s\n" : "No .bmp carriers in %s\n",
+               planInfo->carrier_src);
+        mem_free(names);
+        catalog_close(&catalog);
+        return p_failure;
+    }
+
+    qsort(names, count, sizeof(char *), cmp_basename);
+    for (int i = 1; i < count; i++)
+    {
+        if (strcmp(plan_basename(names[i - 1]), plan_basename(names[i])) == 0)
+        {
+            printf("Carriers %s and %s would give the same stego image name\n", names[i - 1], names[i]);
+            plan_free_names(names, count);
+            catalog_close(&catalog);
+            return p_failure;
+        }
+    }
+
+    planInfo->carriers = mem_calloc(count, sizeof(PlanCarrier));
+    if (planInfo->carriers == NULL)
+    {
+        plan_free_names(names, count);
+        catalog_close(&catalog);
+        return p_failure;
+    }
+    int stale = 0;
+    for (int i = 0; i < count; i++)
+    {
+        PlanCarrier *carrier = &planInfo->carriers[planInfo->carrier_count];
+        carrier->capacity = indexed ? plan_index_capacity(&catalog, names[i], planInfo->options.flags, &stale)
+                                    : plan_carrier_capacity(names[i], planInfo->options.flags);
+        if (carrier->capacity == 0)
+        {
+            mem_free(names[i]);
+            continue;
+        }
+        carrier->fname = names[i];
+        planInfo->carrier_count++;
+    }
+    if (stale > 0)
+    {
+        printf("%d carriers changed since %s was built and were read again, refresh it with --index\n", stale,
+               planInfo->carrier_src);
+    }
+    mem_free(names);
+    catalog_close(&catalog);
+    return planInfo->carrier_count > 0 ? p_success : p_failure;
+}
+
+/* Secrets with their size */
+static PlanStatus plan_load_secrets(PlanInfo *planInfo)
+{
+    int count;
+    char **names = plan_read_names(planInfo->secret_src, 0, &count);
+    if (names == NULL || count == 0)
+    {
+        printf(count < 0 ? "Not enough memory to list the secrets of %s\n" : "No secrets in %s\n",
+               planInfo->secret_src);
+        mem_free(names);
+        return p_failure;
+    }
+
+    planInfo->items = mem_calloc(count, sizeof(PlanItem));
+    if (planInfo->items == NULL)
+    {
+        plan_free_names(names, count);
+        return p_failure;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        struct stat st;
+        if (stat(names[i], &st) != 0 || !S_ISREG(st.st_mode) || st.st_size > 0x7FFFFFFF)
+        {
+            printf("%s skipped, not a regular file under 2 GB\n", names[i]);
+            mem_free(names[i]);
+            continue;
+        }
+        PlanItem *item = &planInfo->items[planInfo->item_count++];
+        item->fname = names[i];
+        item->size = (uint)st.st_size;
+        item->bin = -1;
+    }
+    mem_free(names);
+    return planInfo->item_count > 0 ? p_success : p_failure;
+}
+
+/* Ties are broken by name, so the same pools always give the same plan (--journal resumes rely on it) */
+static int cmp_carrier_desc(const void *a, const void *b)
+{
+    const PlanCarrier *x = a, *y = b;
+    if (x->capacity != y->capacity)
+    {
+        return x->capacity < y->capacity ? 1 : -1;
+    }
+    return strcmp(x->fname, y->fname);
+}
+
+static int cmp_item_desc(const void *a, const void *b)
+{
+    const PlanItem *x = a, *y = b;
+    if (x->size != y->size)
+    {
+        return x->size < y->size ? 1 : -1;
+    }
+    return strcmp(x->fname, y->fname);
+}
+
+static int cmp_bin_desc(const void *a, const void *b)
+{
+    uint x = (*(PlanBin *const *)a)->used, y = (*(PlanBin *const *)b)->used;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/* Unplaced items first, then by bin and offset */
+static int cmp_item_bin(const void *a, const void *b)
+{
+    const PlanItem *x = a, *y = b;
+    if (x->bin != y->bin)
+    {
+        return x->bin < y->bin ? -1 : 1;
+    }
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+/*
+ * Max segment tree over slots, for the leftmost slot
+ * holding at least a given value in O(log n)
+ */
+typedef struct
+{
+    uint *node;
+    int leaves;
+} PlanTree;
+
+static PlanStatus tree_init(PlanTree *tree, int n)
+{
+    tree->leaves = 1;
+    while (tree->leaves < n)
+    {
+        tree->leaves *= 2;
+    }
+    tree->node = mem_calloc(2 * tree->leaves, sizeof(uint));
+    return tree->node ? p_success : p_failure;
+}
+
+static void tree_set(PlanTree *tree, int slot, uint value)
+{
+    int i = tree->leaves + slot;
+    tree->node[i] = value;
+    for (i /= 2; i >= 1; i /= 2)
+    {
+        uint l = tree->node[2 * i], r = tree->node[2 * i + 1];
+        tree->node[i] = l > r ? l : r;
+    }
+}
+
+/* Leftmost slot with a value >= need, -1 when none */
+static int tree_leftmost(const PlanTree *tree, uint need)
+{
+    if (tree->node[1] < need)
+    {
+        return -1;
+    }
+    int i = 1;
+    while (i < tree->leaves)
+    {
+        i = tree->node[2 * i] >= need ? 2 * i : 2 * i + 1;
+    }
+    return i - tree->leaves;
+}
+
+/*
+ * Pack the items into the carriers
+ * Description: First fit decreasing. Items are taken largest first
+ * and go to the first open carrier with room, a new carrier (the
+ * largest unused) is opened only when none has room, so the number
+ * of carriers stays low. The segment tree of the room left makes
+ * each placement O(log carriers). The filled bins are then moved to
+ * the smallest carriers that still hold them, largest load first,
+ * which keeps the big carriers free.
+ */
+PlanStatus plan_pack(PlanInfo *planInfo)
+{
+    int n = planInfo->carrier_count;
+    PlanTree room, spare;
+
+    // Step 1 : largest first on both sides
+    qsort(planInfo->carriers, n, sizeof(PlanCarrier), cmp_carrier_desc);
+    qsort(planInfo->items, planInfo->item_count, sizeof(PlanItem), cmp_item_desc);
+
+    planInfo->bins = mem_calloc(n, sizeof(PlanBin));
+    if (planInfo->bins == NULL || tree_init(&room, n) != p_success)
+    {
+        return p_failure;
+    }
+
+    // Step 2 : first fit, bin b starts on carrier b
+    for (int i = 0; i < planInfo->item_count; i++)
+    {
+        PlanItem *item = &planInfo->items[i];
+        int b = tree_leftmost(&room, item->size);
+        if (b < 0 || b >= planInfo->bin_count)
+        {
+            if (planInfo->bin_count == n || planInfo->carriers[planInfo->bin_count].capacity < item->size)
+            {
+                continue;
+            }
+            b = planInfo->bin_count++;
+            planInfo->bins[b].carrier = b;
+        }
+        item->bin = b;
+        item->offset = planInfo->bins[b].used;
+        planInfo->bins[b].used += item->size;
+        tree_set(&room, b, planInfo->carriers[b].capacity - planInfo->bins[b].used);
+    }
+    mem_free(room.node);
+
+    // Step 3 : smallest carrier holding each bin, carriers in ascending order
+    PlanBin **order = mem_alloc((planInfo->bin_count + 1) * sizeof(PlanBin *));
+    if (order == NULL || tree_init(&spare, n) != p_success)
+    {
+        mem_free(order);
+        return p_failure;
+    }
+    for (int c = 0; c < n; c++)
+    {
+        tree_set(&spare, n - 1 - c, planInfo->carriers[c].capacity);
+    }
+    for (int b = 0; b < planInfo->bin_count; b++)
+    {
+        order[b] = &planInfo->bins[b];
+    }
+    qsort(order, planInfo->bin_count, sizeof(PlanBin *), cmp_bin_desc);
+    for (int k = 0; k < planInfo->bin_count; k++)
+    {
+        PlanBin *bin = order[k];
+        int slot = tree_leftmost(&spare, bin->used);
+        if (slot >= 0)
+        {
+            bin->carrier = n - 1 - slot;
+            tree_set(&spare, slot, 0);
+        }
+    }
+    mem_free(spare.node);
+    mem_free(order);
+
+    // Step 4 : items grouped by bin for the workers and the manifest
+    qsort(planInfo->items, planInfo->item_count, sizeof(PlanItem), cmp_item_bin);
+    for (int i = planInfo->item_count - 1; i >= 0; i--)
+    {
+        PlanItem *item = &planInfo->items[i];
+        if (item->bin >= 0)
+        {
+            planInfo->bins[item->bin].first = i;
+            planInfo->bins[item->bin].count++;
+        }
+    }
+    return p_success;
+}
+
+/* Nonce of one bin, the bin number is XORed into the last 4 bytes so no two carriers share a keystream */
+static void plan_bin_nonce(const PlanInfo *planInfo, int b, unsigned char nonce[12])
+{
+    memcpy(nonce, planInfo->options.nonce, 12);
+    for (int i = 0; i < 4; i++)
+    {
+        nonce[8 + i] ^= (unsigned char)((uint)b >> (8 * i));
+    }
+}
+
+static void plan_stego_fname(const PlanInfo *planInfo, const PlanBin *bin, char *out, size_t len)
+{
+    snprintf(out, len, "%s/%s", planInfo->output_dir, plan_basename(planInfo->carriers[bin->carrier].fname));
+}
+
+/*
+ * Write the manifest
+ * Description: One tab separated line per secret with the stego
+ * image, the offset and length to give to -d --range, and the nonce
+ * to decode it with when the secrets are encrypted
+ */
+PlanStatus plan_write_manifest(PlanInfo *planInfo)
+{
+    FILE *fptr_manifest = fopen(planInfo->manifest_fname, "w");
+    if (fptr_manifest == NULL)
+    {
+        perror(planInfo->manifest_fname);
+        return p_failure;
+    }
+
+    int encrypted = planInfo->options.flags & STEG_FLAG_CHACHA20;
+    char stego[FILENAME_MAX], nonce_hex[25] = "-";
+    fprintf(fptr_manifest, "# secret\tstego_image\toffset\tlength\tnonce\n");
+
+    // secrets that did not fit come first (sorted so), listed without an image
+    for (int i = 0; i < planInfo->item_count && planInfo->items[i].bin < 0; i++)
+    {
+        fprintf(fptr_manifest, "%s\t-\t-\t%u\t-\n", planInfo->items[i].fname, planInfo->items[i].size);
+    }
+    for (int b = 0; b < planInfo->bin_count; b++)
+    {
+        PlanBin *bin = &planInfo->bins[b];
+        plan_stego_fname(planInfo, bin, stego, sizeof(stego));
+        if (encrypted)
+        {
+            unsigned char nonce[12];
+            plan_bin_nonce(planInfo, b, nonce);
+            for (int i = 0; i < 12; i++)
+            {
+                sprintf(nonce_hex + 2 * i, "%02x", nonce[i]);
+            }
+        }
+        for (int i = bin->first; i < bin->first + bin->count; i++)
+        {
+            PlanItem *item = &planInfo->items[i];
+            fprintf(fptr_manifest, "%s\t%s\t%u\t%u\t%s\n", item->fname, stego, item->offset, item->size, nonce_hex);
+        }
+    }
+
+    if (fclose(fptr_manifest) != 0)
+    {
+        perror(planInfo->manifest_fname);
+        return p_failure;
+    }
+    return p_success;
+}
+
+/* Concatenate the secrets of a bin into its payload file */
+static PlanStatus plan_write_payload(PlanInfo *planInfo, PlanBin *bin, const char *payload_fname)
+{
+    FILE *fptr_payload = fopen(payload_fname, "wb");
+    if (fptr_payload == NULL)
+    {
+        perror(payload_fname);
+        return p_failure;
+    }
+
+    char buffer[64 * 1024];
+    PlanStatus status = p_success;
+    for (int i = bin->first; i < bin->first + bin->count && status == p_success; i++)
+    {
+        PlanItem *item = &planInfo->items[i];
+        FILE *fptr_secret = fopen(item->fname, "rb");
+        if (fptr_secret == NULL)
+        {
+            perror(item->fname);
+            status = p_failure;
+            break;
+        }
+        uint left = item->size;
+        while (left > 0)
+        {
+            size_t want = left < sizeof(buffer) ? left : sizeof(buffer);
+            size_t got = fread(buffer, 1, want, fptr_secret);
+            if (got == 0 || fwrite(buffer, 1, got, fptr_payload) != got)
+            {
+                // the secret shrank since it was planned, offsets after it would be wrong
+                printf("%s changed size since it was planned\n", item->fname);
+                status = p_failure;
+                break;
+            }
+            left -= got;
+        }
+        fclose(fptr_secret);
+    }
+
+    if (fclose(fptr_payload) != 0)
+    {
+        status = p_failure;
+    }
+    return status;
+}
+
+/* Fingerprint of a packing, a journal is only resumed by the batch that wrote it */
+static unsigned long long plan_fingerprint(const PlanInfo *planInfo)
+{
+    unsigned long long hash = 0xcbf29ce484222325ULL;
+    hash = journal_hash(hash, &planInfo->options.flags, sizeof(planInfo->options.flags));
+    hash = journal_hash(hash, planInfo->options.nonce, sizeof(planInfo->options.nonce));
+    for (int b = 0; b < planInfo->bin_count; b++)
+    {
+        const char *fname = planInfo->carriers[planInfo->bins[b].carrier].fname;
+        hash = journal_hash(hash, fname, strlen(fname) + 1);
+        for (int i = planInfo->bins[b].first; i < planInfo->bins[b].first + planInfo->bins[b].count; i++)
+        {
+            const PlanItem *item = &planInfo->items[i];
+            hash = journal_hash(hash, item->fname, strlen(item->fname) + 1);
+            hash = journal_hash(hash, &item->size, sizeof(item->size));
+        }
+    }
+    return hash;
+}
+
+/* Whether a previous run of a journaled batch finished the image of a bin */
+static int plan_bin_done(PlanInfo *planInfo, int b)
+{
+    char stego[FILENAME_MAX];
+    struct stat st;
+    long offset;
+
+    if (planInfo->journal_fname == NULL)
+    {
+        return 0;
+    }
+    plan_stego_fname(planInfo, &planInfo->bins[b], stego, sizeof(stego));
+    return journal_lookup(&planInfo->journal, plan_basename(stego), &offset) && stat(stego, &st) == 0;
+}
+
+/* Encode one bin into its carrier */
+static PlanStatus plan_encode_bin(PlanInfo *planInfo, int b)
+{
+    PlanBin *bin = &planInfo->bins[b];
+    char payload[FILENAME_MAX], stego[FILENAME_MAX], partial[FILENAME_MAX];
+    const char *job = plan_basename(planInfo->carriers[bin->carrier].fname);
+    long resume = 0;
+    struct stat st;
+
+    // Step 0 : with --journal, resume an image a previous run left partly written (in its hidden .part file)
+    plan_stego_fname(planInfo, bin, stego, sizeof(stego));
+    stego_partial_fname(stego, partial, sizeof(partial));
+    if (planInfo->journal_fname != NULL && !journal_lookup(&planInfo->journal, job, &resume) && resume > 0 &&
+        (stat(partial, &st) != 0 || st.st_size < resume))
+    {
+        resume = 0;
+    }
+
+    // Step 1 : payload file of the bin, a .txt as the encoder wants
+    if (snprintf(payload, sizeof(payload), "%s/.plan_%d.txt", planInfo->output_dir, b) >= (int)sizeof(payload) ||
+        plan_write_payload(planInfo, bin, payload) != p_success)
+    {
+        unlink(payload);
+        return p_failure;
+    }
+
+    // Step 2 : encode it with the shared options
+    EncodeInfo encInfo = {0};
+    encInfo.src_image_fname = planInfo->carriers[bin->carrier].fname;
+    encInfo.secret_fname = payload;
+    encInfo.stego_image_fname = stego;
+    encInfo.flags = planInfo->options.flags & STEG_FLAG_CHACHA20;
+    encInfo.io_mode = tune_profile()->io_mode;
+    memcpy(encInfo.key, planInfo->options.key, sizeof(encInfo.key));
+    plan_bin_nonce(planInfo, b, encInfo.nonce);
+    if (planInfo->journal_fname != NULL)
+    {
+        encInfo.journal = &planInfo->journal;
+        encInfo.journal_job = job;
+        encInfo.resume_offset = resume;
+    }
+
+    EncodeStatus status = do_encoding(&encInfo);
+    if (encInfo.fptr_src_image != NULL)
+    {
+        fclose(encInfo.fptr_src_image);
+    }
+    if (encInfo.fptr_secret != NULL)
+    {
+        fclose(encInfo.fptr_secret);
+    }
+    if (encInfo.fptr_stego_image != NULL && fclose(encInfo.fptr_stego_image) != 0)
+    {
+        status = e_failure;
+    }
+    unlink(payload);
+
+    // Step 3 : the image is durable (journal_copy synced it), record it done
+    if (status == e_success && encInfo.journal != NULL &&
+        journal_append(encInfo.journal, "done %s", job) != j_success)
+    {
+        status = e_failure;
+    }
+    return status == e_success ? p_success : p_failure;
+}
+
+/* Worker thread, takes bins until none are left */
+static void *plan_worker(void *arg)
+{
+    PlanInfo *planInfo = arg;
+
+    trace_thread_name("plan worker");
+    for (;;)
+    {
+        pthread_mutex_lock(&planInfo->lock);
+        int b = planInfo->next_bin < planInfo->bin_count ? planInfo->next_bin++ : -1;
+        pthread_mutex_unlock(&planInfo->lock);
+        if (b < 0)
+        {
+            return NULL;
+        }
+
+        if (plan_bin_done(planInfo, b))
+        {
+            pthread_mutex_lock(&planInfo->lock);
+            planInfo->skipped++;
+            pthread_mutex_unlock(&planInfo->lock);
+            continue;
+        }
+        // Under --mem-limit the bin waits until its reservation fits next to the running ones
+        MemJob job;
+        mem_job_begin(&job, 2 * (size_t)planInfo->bins[b].used + bulk_block_size(tune_profile()->io_mode));
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        PlanStatus status = plan_encode_bin(planInfo, b);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        mem_job_end(&job);
+
+        pthread_mutex_lock(&planInfo->lock);
+        planInfo->work_ms += elapsed_ms(&t0, &t1);
+        if (status == p_success)
+        {
+            planInfo->encoded++;
+        }
+        else
+        {
+            planInfo->failed++;
+            printf("plan : %s failed\n", planInfo->carriers[planInfo->bins[b].carrier].fname);
+        }
+        pthread_mutex_unlock(&planInfo->lock);
+    }
+}
+
+/* Encode every bin on the worker pool */
+static PlanStatus plan_run(PlanInfo *planInfo)
+{
+    struct timespec t0, t1;
+
+    if (planInfo->journal_fname != NULL &&
+        journal_open(&planInfo->journal, planInfo->journal_fname, plan_fingerprint(planInfo),
+                     planInfo->output_dir) != j_success)
+    {
+        return p_failure;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    pthread_mutex_init(&planInfo->lock, NULL);
+    pthread_t *tid = mem_alloc(planInfo->threads * sizeof(pthread_t));
+    int started = 0;
+    for (int t = 0; tid != NULL && t < planInfo->threads; t++)
+    {
+        if (pthread_create(&tid[started], NULL, plan_worker, planInfo) == 0)
+        {
+            started++;
+        }
+    }
+    for (int t = 0; t < started; t++)
+    {
+        pthread_join(tid[t], NULL);
+    }
+    mem_free(tid);
+    pthread_mutex_destroy(&planInfo->lock);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    char peak[16], job_peak[16];
+    printf("Plan done : %ld carriers encoded, %ld already done, %ld failed in %.2f ms, peak memory %s (largest job %s)\n",
+           planInfo->encoded, planInfo->skipped, planInfo->failed, elapsed_ms(&t0, &t1),
+           mem_format(mem_peak(), peak), mem_format(mem_job_peak_max(), job_peak));
+    PlanStatus status = started > 0 && planInfo->failed == 0 ? p_success : p_failure;
+    if (planInfo->journal_fname != NULL && journal_close(&planInfo->journal, planInfo->work_ms) != j_success)
+    {
+        status = p_failure;
+    }
+    return status;
+}
+
+/* Read the --plan arguments */
+static PlanStatus read_plan_args(char *argv[], PlanInfo *planInfo)
+{
+    static char default_manifest[FILENAME_MAX];
+
+    if (argv[2] == NULL || argv[3] == NULL || argv[4] == NULL)
+    {
+        printf("Give arguments like this --> ./a.out --plan <carrier dir | list | index> <secret dir | list> <output dir>\n");
+        return p_failure;
+    }
+    planInfo->carrier_src = argv[2];
+    planInfo->secret_src = argv[3];
+    planInfo->output_dir = argv[4];
+    planInfo->threads = tune_threads();
+
+    snprintf(default_manifest, sizeof(default_manifest), "%s/%s", planInfo->output_dir, PLAN_MANIFEST);
+    planInfo->manifest_fname = default_manifest;
+
+    for (int i = 5; argv[i] != NULL; i++)
+    {
+        if (strncmp(argv[i], "--manifest=", 11) == 0)
+        {
+            planInfo->manifest_fname = argv[i] + 11;
+        }
+        else if (strncmp(argv[i], "--threads=", 10) == 0)
+        {
+            planInfo->threads = atoi(argv[i] + 10);
+        }
+        else if (strcmp(argv[i], "--dry-run") == 0)
+        {
+            planInfo->dry_run = 1;
+        }
+        else if (strncmp(argv[i], "--journal=", 10) == 0)
+        {
+            planInfo->journal_fname = argv[i] + 10;
+        }
+    }
+    if (planInfo->threads < 1)
+    {
+        planInfo->threads = 1;
+    }
+
+    // --key / --nonce are shared with -e / -d
+    if (read_decode_options(argv, 5, &planInfo->options) != d_success)
+    {
+        return p_failure;
+    }
+    if ((planInfo->options.flags & STEG_FLAG_CHACHA20) && !planInfo->options.nonce_given)
+    {
+        printf("--key needs --nonce=<24 hex digits> (each carrier gets it with its bin number mixed in)\n");
+        return p_failure;
+    }
+
+    if (mkdir(planInfo->output_dir, 0755) != 0 && errno != EEXIST)
+    {
+        perror(planInfo->output_dir);
+        return p_failure;
+    }
+    return p_success;
+}
+
+static void plan_free(PlanInfo *planInfo)
+{
+    for (int i = 0; i < planInfo->item_count; i++)
+    {
+        mem_free(planInfo->items[i].fname);
+    }
+    for (int c = 0; c < planInfo->carrier_count; c++)
+    {
+        mem_free(planInfo->carriers[c].fname);
+    }
+    mem_free(planInfo->items);
+    mem_free(planInfo->carriers);
+    mem_free(planInfo->bins);
+}
+
+/*
+ * Plan and run the packing
+ * Description: Carrier capacities come from the BMP headers (or from
+ * an index, without touching the carriers) and secret sizes from stat, so planning reads no image or secret data.
+ * The manifest is written before any carrier is encoded.
+ */
+PlanStatus do_plan(char *argv[])
+{
+    PlanInfo planInfo = {0};
+    struct timespec t0, t1, t2;
+
+    // Step 1 : arguments
+    if (read_plan_args(argv, &planInfo) != p_success)
+    {
+        return p_failure;
+    }
+
+    // Step 2 : sizes of both pools
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (plan_load_carriers(&planInfo) != p_success || plan_load_secrets(&planInfo) != p_success)
+    {
+        plan_free(&planInfo);
+        return p_failure;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    // Step 3 : packing
+    if (plan_pack(&planInfo) != p_success)
+    {
+        plan_free(&planInfo);
+        return p_failure;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+
+    unsigned long long packed = 0, room = 0;
+    int unplaced = 0;
+    for (int i = 0; i < planInfo.item_count && planInfo.items[i].bin < 0; i++)
+    {
+        unplaced++;
+    }
+    for (int b = 0; b < planInfo.bin_count; b++)
+    {
+        packed += planInfo.bins[b].used;
+        room += planInfo.carriers[planInfo.bins[b].carrier].capacity;
+    }
+    printf("Planned %d secrets (%llu bytes) into %d of %d carriers, %.1f%% full, %d did not fit (listed in the manifest without an image)\n",
+           planInfo.item_count - unplaced, packed, planInfo.bin_count, planInfo.carrier_count,
+           room ? 100.0 * packed / room : 0.0, unplaced);
+    printf("Sizes read in %.3f ms, packing took %.3f ms\n", elapsed_ms(&t0, &t1), elapsed_ms(&t1, &t2));
+
+    // Step 4 : manifest, then the carriers unless this is a dry run
+    PlanStatus status = plan_write_manifest(&planInfo);
+    if (status == p_success)
+    {
+        printf("Manifest written to %s\n", planInfo.manifest_fname);
+        if (!planInfo.dry_run)
+        {
+            status = plan_run(&planInfo);
+        }
+    }
+    plan_free(&planInfo);
+    return status == p_success && unplaced == 0 ? p_success : p_failure;
+}
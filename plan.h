@@ -0,0 +1,91 @@
+#ifndef PLAN_H
+#define PLAN_H
+#include <pthread.h>
+
+#include "types.h"  // Contains user defined types
+#include "decode.h" // Key / nonce options
+#include "journal.h" // --journal progress log
+
+/*
+ * Packing many secrets into a pool of carriers
+ * The secrets given to one carrier are concatenated into its payload,
+ * and the manifest records the carrier, offset and length of each one,
+ * so any secret is read back with -d <stego> --range=<offset>:<length>
+ */
+
+/* Default manifest name inside the output directory */
+#define PLAN_MANIFEST "manifest.tsv"
+
+/* One secret */
+typedef struct _PlanItem
+{
+    char *fname;   // To store the secret file name
+    uint size;     // To store its size
+    int bin;       // To store the carrier bin it was packed into (-1 when it fits nowhere)
+    uint offset;   // To store its offset in the bin payload
+} PlanItem;
+
+/* One carrier */
+typedef struct _PlanCarrier
+{
+    char *fname;     // To store the carrier image name
+    uint capacity;   // To store the payload bytes it can take (check_capacity limit)
+} PlanCarrier;
+
+/* One carrier in use, with the load packed into it */
+typedef struct _PlanBin
+{
+    int carrier;     // To store the carrier index
+    uint used;       // To store the payload bytes packed
+    int first;       // To store the first of its items (items are sorted by bin, then offset)
+    int count;       // To store the number of its items
+} PlanBin;
+
+/*
+ * Structure to store information required for
+ * planning and running the packing
+ */
+
+typedef struct _PlanInfo
+{
+    /* Inputs */
+    char *carrier_src;        // To store the carrier directory or list file
+    char *secret_src;         // To store the secret directory or list file
+    char *output_dir;         // To store where stego images and the manifest go
+    char *manifest_fname;     // To store the manifest name
+    int dry_run;              // To store whether only the manifest is written
+    int threads;              // To store the number of encode workers
+    DecodeInfo options;       // To store the key / nonce given on the command line
+    char *journal_fname;      // To store the --journal file (NULL without one)
+    Journal journal;          // To store the open journal
+
+    /* Plan */
+    PlanItem *items;
+    int item_count;
+    PlanCarrier *carriers;
+    int carrier_count;
+    PlanBin *bins;
+    int bin_count;
+
+    /* Workers */
+    int next_bin;
+    long encoded, failed, skipped;
+    double work_ms;           // To store the time the workers spent encoding
+    pthread_mutex_t lock;
+} PlanInfo;
+
+/* Plan function prototype */
+
+/* Run --plan <carriers | index> <secrets> <out_dir> with the options in argv[5] onwards */
+PlanStatus do_plan(char *argv[]);
+
+/* Carrier / secret names of a directory or list file (.bmp only when bmp_only), count is -1 when memory ran out */
+char **plan_read_names(const char *src, int bmp_only, int *count);
+
+/* Pack the items into the carriers, first fit decreasing */
+PlanStatus plan_pack(PlanInfo *planInfo);
+
+/* Write the manifest of a packing */
+PlanStatus plan_write_manifest(PlanInfo *planInfo);
+
+#endif
@@ -0,0 +1,317 @@
+#include "quality.h"
+#include "mem.h"
+#include "util.h"
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* SSIM stabilising constants for 8 bit samples, (0.01 * 255)^2 and (0.03 * 255)^2 */
+#define QUALITY_C1 6.5025
+#define QUALITY_C2 58.5225
+
+/* Comparison work shared by the threads, band rows are handed out in tiles */
+typedef struct
+{
+    const unsigned char *orig;   // band of the carrier, row band_lo first
+    const unsigned char *stego;  // same band of the stego image
+    const BmpInfo *bmp;
+    uint band_lo, band_hi;       // pixel rows held in the band
+    uint win_lo, win_hi;         // window rows compared (y of the top row)
+    int simd;
+    uint tiles;
+    uint next_tile;
+    QualityInfo *quality;
+    MemJob *job;                 // job of the encode, the helper threads charge their planes to it
+    pthread_mutex_t lock;
+} QualityWork;
+
+/* Function Definitions */
+
+/* Sums of one window: x, y, x^2, y^2, xy over QUALITY_WIN rows of QUALITY_WIN samples */
+static void window_sums(const unsigned char *x, const unsigned char *y, size_t pitch, int simd, uint sums[5])
+{
+#ifdef __SSE2__
+    if (simd)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        __m128i sx = zero, sy = zero, sxx = zero, syy = zero, sxy = zero;
+        for (int r = 0; r < QUALITY_WIN; r++)
+        {
+            __m128i a = _mm_loadl_epi64((const __m128i *)(x + r * pitch));
+            __m128i b = _mm_loadl_epi64((const __m128i *)(y + r * pitch));
+            sx = _mm_add_epi64(sx, _mm_sad_epu8(a, zero));
+            sy = _mm_add_epi64(sy, _mm_sad_epu8(b, zero));
+            a = _mm_unpacklo_epi8(a, zero);
+            b = _mm_unpacklo_epi8(b, zero);
+            sxx = _mm_add_epi32(sxx, _mm_madd_epi16(a, a));
+            syy = _mm_add_epi32(syy, _mm_madd_epi16(b, b));
+            sxy = _mm_add_epi32(sxy, _mm_madd_epi16(a, b));
+        }
+        uint lanes[4];
+        sums[0] = (uint)_mm_cvtsi128_si32(sx);
+        sums[1] = (uint)_mm_cvtsi128_si32(sy);
+        _mm_storeu_si128((__m128i *)lanes, sxx);
+        sums[2] = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+        _mm_storeu_si128((__m128i *)lanes, syy);
+        sums[3] = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+        _mm_storeu_si128((__m128i *)lanes, sxy);
+        sums[4] = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+        return;
+    }
+#endif
+    memset(sums, 0, 5 * sizeof(uint));
+    for (int r = 0; r < QUALITY_WIN; r++)
+    {
+        for (int i = 0; i < QUALITY_WIN; i++)
+        {
+            uint a = x[r * pitch + i], b = y[r * pitch + i];
+            sums[0] += a;
+            sums[1] += b;
+            sums[2] += a * a;
+            sums[3] += b * b;
+            sums[4] += a * b;
+        }
+    }
+}
+
+/* SSIM of one window from its sums */
+static double window_ssim(const uint sums[5])
+{
+    const double n = QUALITY_WIN * QUALITY_WIN;
+    double mx = sums[0] / n, my = sums[1] / n;
+    double vx = sums[2] / n - mx * mx, vy = sums[3] / n - my * my;
+    double cxy = sums[4] / n - mx * my;
+    return ((2 * mx * my + QUALITY_C1) * (2 * cxy + QUALITY_C2)) /
+           ((mx * mx + my * my + QUALITY_C1) * (vx + vy + QUALITY_C2));
+}
+
+/*
+ * Compare one tile
+ * Description: The squared error is taken over the tile rows. The
+ * tile rows plus the QUALITY_WIN rows the last windows reach are split
+ * into one plane per colour channel, so each window row is 8
+ * contiguous samples for window_sums
+ */
+static void quality_tile(QualityWork *work, uint t, unsigned char *planes)
+{
+    const BmpInfo *bmp = work->bmp;
+    uint ch = bmp->bpp / 8, width = bmp->width;
+    uint row_lo = work->band_lo + t * QUALITY_TILE_ROWS;
+    uint row_hi = row_lo + QUALITY_TILE_ROWS < work->band_hi ? row_lo + QUALITY_TILE_ROWS : work->band_hi;
+    uint plane_hi = row_hi + QUALITY_WIN < work->band_hi ? row_hi + QUALITY_WIN : work->band_hi;
+    size_t plane_len = (size_t)(QUALITY_TILE_ROWS + QUALITY_WIN) * width;
+    unsigned long long sq_error = 0, windows = 0;
+    double ssim_sum = 0;
+
+    // Step 1 : squared error of the tile rows, planes of the rows the windows use
+    for (uint y = row_lo; y < plane_hi; y++)
+    {
+        size_t at = (size_t)(y - work->band_lo) * bmp->row_stride;
+        const unsigned char *a = work->orig + at, *b = work->stego + at;
+        for (uint x = 0; x < width; x++)
+        {
+            for (uint c = 0; c < 3; c++)
+            {
+                unsigned char va = a[x * ch + c], vb = b[x * ch + c];
+                if (y < row_hi)
+                {
+                    int d = (int)va - (int)vb;
+                    sq_error += d * d;
+                }
+                planes[(2 * c) * plane_len + (size_t)(y - row_lo) * width + x] = va;
+                planes[(2 * c + 1) * plane_len + (size_t)(y - row_lo) * width + x] = vb;
+            }
+        }
+    }
+
+    // Step 2 : windows whose top row is in the tile
+    for (uint y = row_lo; y < row_hi; y += QUALITY_STEP)
+    {
+        if (y < work->win_lo || y >= work->win_hi)
+        {
+            continue;
+        }
+        for (uint c = 0; c < 3; c++)
+        {
+            const unsigned char *pa = planes + (2 * c) * plane_len + (size_t)(y - row_lo) * width;
+            const unsigned char *pb = planes + (2 * c + 1) * plane_len + (size_t)(y - row_lo) * width;
+            for (uint x = 0; x + QUALITY_WIN <= width; x += QUALITY_STEP)
+            {
+                uint sums[5];
+                window_sums(pa + x, pb + x, width, work->simd, sums);
+                ssim_sum += window_ssim(sums);
+                windows++;
+            }
+        }
+    }
+
+    pthread_mutex_lock(&work->lock);
+    work->quality->sq_error += sq_error;
+    work->quality->ssim_sum += ssim_sum;
+    work->quality->windows += windows;
+    pthread_mutex_unlock(&work->lock);
+}
+
+/* Thread body, takes tiles until none are left */
+static void *quality_worker(void *arg)
+{
+    QualityWork *work = arg;
+    mem_job_attach(work->job);
+    unsigned char *planes = mem_alloc(6 * (size_t)(QUALITY_TILE_ROWS + QUALITY_WIN) * work->bmp->width + 1);
+    if (planes == NULL)
+    {
+        return NULL;
+    }
+    for (;;)
+    {
+        pthread_mutex_lock(&work->lock);
+        uint t = work->next_tile++;
+        pthread_mutex_unlock(&work->lock);
+        if (t >= work->tiles)
+        {
+            mem_free(planes);
+            return NULL;
+        }
+        quality_tile(work, t, planes);
+    }
+}
+
+/* Read len bytes at pos, pread may return less than asked */
+static int read_at(int fd, unsigned char *buffer, size_t len, long pos)
+{
+    while (len > 0)
+    {
+        ssize_t got = pread(fd, buffer, len, pos);
+        if (got <= 0)
+        {
+            return 0;
+        }
+        buffer += got;
+        len -= got;
+        pos += got;
+    }
+    return 1;
+}
+
+/*
+ * Measure the stego image quality
+ * Description: The rows holding changed bytes, widened to every
+ * window that touches them, are read from the carrier. The stego band
+ * is the same rows with the changed bytes read from the stego image.
+ * Both reads hit pages the encoder has just streamed.
+ */
+QualityStatus quality_measure(int src_fd, int stego_fd, long start, long end, int threads, int simd,
+                              QualityInfo *quality)
+{
+    unsigned char header[BMP_HEADER_SIZE];
+    struct timespec t0, t1;
+    BmpInfo *bmp = &quality->bmp;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    // Step 1 : geometry
+    if (!read_at(src_fd, header, sizeof(header), 0) || !bmp_parse_header(header, bmp))
+    {
+        printf("Quality needs an uncompressed 24 / 32 bit BMP\n");
+        return q_failure;
+    }
+    long pixels_end = bmp->pixel_offset + (long)bmp->row_stride * bmp->height;
+    quality->samples = 3ULL * bmp->width * bmp->height;
+    uint across = bmp->width >= QUALITY_WIN ? (bmp->width - QUALITY_WIN) / QUALITY_STEP + 1 : 0;
+    uint down = bmp->height >= QUALITY_WIN ? (bmp->height - QUALITY_WIN) / QUALITY_STEP + 1 : 0;
+    quality->all_windows = 3ULL * across * down;
+
+    // Step 2 : rows that changed, and the windows that see them
+    start = start > (long)bmp->pixel_offset ? start : (long)bmp->pixel_offset;
+    end = end < pixels_end ? end : pixels_end;
+    QualityWork work = {0};
+    work.bmp = bmp;
+    work.simd = simd;
+    work.quality = quality;
+    work.job = mem_job_current();
+    if (end > start && bmp->width > 0)
+    {
+        uint changed_lo = (start - bmp->pixel_offset) / bmp->row_stride;
+        uint changed_hi = (end - bmp->pixel_offset + bmp->row_stride - 1) / bmp->row_stride;
+        uint reach = changed_lo > QUALITY_WIN - 1 ? changed_lo - (QUALITY_WIN - 1) : 0;
+        work.win_lo = (reach + QUALITY_STEP - 1) / QUALITY_STEP * QUALITY_STEP;
+        work.win_hi = down ? changed_hi : 0;
+        if (down && work.win_hi > (down - 1) * QUALITY_STEP + 1)
+        {
+            work.win_hi = (down - 1) * QUALITY_STEP + 1;
+        }
+        work.band_lo = work.win_lo;
+        work.band_hi = work.win_hi + QUALITY_WIN > changed_hi ? work.win_hi + QUALITY_WIN : changed_hi;
+        if (work.band_hi > bmp->height)
+        {
+            work.band_hi = bmp->height;
+        }
+        work.tiles = (work.band_hi - work.band_lo + QUALITY_TILE_ROWS - 1) / QUALITY_TILE_ROWS;
+    }
+
+    // Step 3 : carrier band, stego band with the changed bytes
+    size_t band_len = (size_t)(work.band_hi - work.band_lo) * bmp->row_stride;
+    long band_pos = bmp->pixel_offset + (long)work.band_lo * bmp->row_stride;
+    unsigned char *orig = mem_alloc(band_len + 1), *stego = mem_alloc(band_len + 1);
+    if (orig == NULL || stego == NULL || !read_at(src_fd, orig, band_len, band_pos))
+    {
+        mem_free(orig);
+        mem_free(stego);
+        return q_failure;
+    }
+    memcpy(stego, orig, band_len);
+    if (end > start && !read_at(stego_fd, stego + (start - band_pos), end - start, start))
+    {
+        mem_free(orig);
+        mem_free(stego);
+        return q_failure;
+    }
+    work.orig = orig;
+    work.stego = stego;
+
+    // Step 4 : tiles on the worker threads
+    if (threads < 1)
+    {
+        threads = 1;
+    }
+    pthread_mutex_init(&work.lock, NULL);
+    pthread_t tid[threads];
+    int started = 0;
+    for (int t = 1; t < threads && (uint)t < work.tiles; t++)
+    {
+        if (pthread_create(&tid[started], NULL, quality_worker, &work) == 0)
+        {
+            started++;
+        }
+    }
+    quality_worker(&work);
+    for (int t = 0; t < started; t++)
+    {
+        pthread_join(tid[t], NULL);
+    }
+    pthread_mutex_destroy(&work.lock);
+    mem_free(orig);
+    mem_free(stego);
+
+    // Step 5 : windows not compared are identical, SSIM 1
+    double mse = quality->samples ? (double)quality->sq_error / quality->samples : 0;
+    quality->psnr = mse > 0 ? 10 * log10(255.0 * 255.0 / mse) : INFINITY;
+    quality->ssim = quality->all_windows ?
+                    (quality->ssim_sum + (double)(quality->all_windows - quality->windows)) / quality->all_windows : 1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    quality->ms = elapsed_ms(&t0, &t1);
+    return q_success;
+}
+
+void quality_print(const QualityInfo *quality)
+{
+    printf("Quality : PSNR %.4f dB, SSIM %.8f (%llu of %llu windows compared, %.2f ms)\n",
+           quality->psnr, quality->ssim, quality->windows, quality->all_windows, quality->ms);
+}
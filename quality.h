@@ -0,0 +1,51 @@
+#ifndef QUALITY_H
+#define QUALITY_H
+
+#include "types.h" // Contains user defined types
+#include "bmp.h"   // Pixel array geometry
+
+/*
+ * Stego image quality (--quality)
+ * PSNR over every colour byte of the pixel array, and SSIM as the mean
+ * of QUALITY_WIN x QUALITY_WIN windows, QUALITY_STEP apart, per colour
+ * channel. Embedding only changes the bytes between the end of the BMP
+ * header and the end of the stream, so only the rows around them are
+ * compared: every other window is identical (SSIM exactly 1) and every
+ * other byte adds nothing to the squared error.
+ */
+
+/* SSIM window size and the step between windows, in pixels */
+#define QUALITY_WIN 8
+#define QUALITY_STEP 4
+
+/* Pixel rows per tile handed to one worker thread (a multiple of QUALITY_STEP) */
+#define QUALITY_TILE_ROWS 32
+
+/* Quality figures of one stego image */
+typedef struct _QualityInfo
+{
+    BmpInfo bmp;                  // To store the geometry of the image
+    unsigned long long sq_error;  // To store the sum of squared byte differences
+    unsigned long long samples;   // To store the colour bytes in the image
+    double ssim_sum;              // To store the SSIM sum of the compared windows
+    unsigned long long windows;   // To store the windows compared
+    unsigned long long all_windows; // To store the windows in the image (all channels)
+    double psnr;                  // To store the PSNR in dB (infinite when identical)
+    double ssim;                  // To store the mean SSIM
+    double ms;                    // To store the time taken
+} QualityInfo;
+
+/* Quality function prototype */
+
+/*
+ * Compare the stego image with its carrier, the image bytes [start, end)
+ * are the only ones that may differ. src_fd is the carrier, stego_fd the
+ * stego image, which only needs to hold those bytes yet.
+ */
+QualityStatus quality_measure(int src_fd, int stego_fd, long start, long end, int threads, int simd,
+                              QualityInfo *quality);
+
+/* Print the figures in the encoder stats */
+void quality_print(const QualityInfo *quality);
+
+#endif
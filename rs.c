@@ -0,0 +1,627 @@
+#include "rs.h"
+#include "mem.h"
+#include "util.h"
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "encode.h"
+#include "decode.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define RS_HAVE_SSSE3 1
+#endif
+
+/* Function Definitions */
+
+/* GF(256) with primitive polynomial x^8 + x^4 + x^3 + x^2 + 1 */
+static unsigned char gf_exp[512];
+static unsigned char gf_log[256];
+static pthread_once_t gf_once = PTHREAD_ONCE_INIT;
+static int gf_use_ssse3;
+
+/* Build exp / log tables and pick the region kernel */
+static void gf_init(void)
+{
+    uint x = 1;
+    for (int i = 0; i < 255; i++)
+    {
+        gf_exp[i] = (unsigned char)x;
+        gf_log[x] = (unsigned char)i;
+        x <<= 1;
+        if (x & 0x100)
+        {
+            x ^= 0x11d;
+        }
+    }
+    // Doubled table so gf_exp[log a + log b] needs no modulo
+    for (int i = 255; i < 512; i++)
+    {
+        gf_exp[i] = gf_exp[i - 255];
+    }
+
+#ifdef RS_HAVE_SSSE3
+    gf_use_ssse3 = __builtin_cpu_supports("ssse3");
+#endif
+}
+
+static unsigned char gf_mul(unsigned char a, unsigned char b)
+{
+    if (a == 0 || b == 0)
+    {
+        return 0;
+    }
+    return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+static unsigned char gf_div(unsigned char a, unsigned char b)
+{
+    if (a == 0)
+    {
+        return 0;
+    }
+    return gf_exp[gf_log[a] + 255 - gf_log[b]];
+}
+
+/* alpha ^ p for any p >= 0 */
+static unsigned char gf_pow_alpha(uint p)
+{
+    return gf_exp[p % 255];
+}
+
+/*
+ * Split multiplication table
+ * Description: c * x == lo[x & 15] ^ hi[x >> 4], so a whole
+ * vector of bytes can be multiplied with two 16 entry lookups
+ */
+static void gf_split_tables(unsigned char c, unsigned char *lo, unsigned char *hi)
+{
+    for (int x = 0; x < 16; x++)
+    {
+        lo[x] = gf_mul(c, (unsigned char)x);
+        hi[x] = gf_mul(c, (unsigned char)(x << 4));
+    }
+}
+
+#ifdef RS_HAVE_SSSE3
+/* 16 bytes per step using pshufb as the table lookup, returns bytes done */
+__attribute__((target("ssse3")))
+static uint gf_region_ssse3(unsigned char *dst, const unsigned char *src, const unsigned char *lo,
+                            const unsigned char *hi, uint len, int accumulate)
+{
+    __m128i tlo = _mm_loadu_si128((const __m128i *)lo);
+    __m128i thi = _mm_loadu_si128((const __m128i *)hi);
+    __m128i mask = _mm_set1_epi8(0x0f);
+    uint i;
+
+    for (i = 0; i + 16 <= len; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i l = _mm_and_si128(v, mask);
+        __m128i h = _mm_and_si128(_mm_srli_epi64(v, 4), mask);
+        __m128i p = _mm_xor_si128(_mm_shuffle_epi8(tlo, l), _mm_shuffle_epi8(thi, h));
+        if (accumulate)
+        {
+            p = _mm_xor_si128(p, _mm_loadu_si128((const __m128i *)(dst + i)));
+        }
+        _mm_storeu_si128((__m128i *)(dst + i), p);
+    }
+    return i;
+}
+#endif
+
+/* Common body of gf_region_mul and gf_region_mul_xor */
+static void gf_region(unsigned char *dst, const unsigned char *src, unsigned char c, uint len, int accumulate)
+{
+    unsigned char lo[16], hi[16];
+    uint i = 0;
+
+    gf_split_tables(c, lo, hi);
+
+#ifdef RS_HAVE_SSSE3
+    if (gf_use_ssse3)
+    {
+        i = gf_region_ssse3(dst, src, lo, hi, len, accumulate);
+    }
+#endif
+
+    // Scalar tail (or whole region without SSSE3)
+    for (; i < len; i++)
+    {
+        unsigned char p = lo[src[i] & 0x0f] ^ hi[src[i] >> 4];
+        dst[i] = accumulate ? (unsigned char)(dst[i] ^ p) : p;
+    }
+}
+
+void gf_region_mul_xor(unsigned char *dst, const unsigned char *src, unsigned char c, uint len)
+{
+    pthread_once(&gf_once, gf_init);
+    gf_region(dst, src, c, len, 1);
+}
+
+void gf_region_mul(unsigned char *dst, const unsigned char *src, unsigned char c, uint len)
+{
+    pthread_once(&gf_once, gf_init);
+    gf_region(dst, src, c, len, 0);
+}
+
+/* Generator polynomial (x - a^0)(x - a^1)...(x - a^(nsym-1)), ascending powers */
+static void rs_generator(uint nsym, unsigned char *gen)
+{
+    memset(gen, 0, nsym + 1);
+    gen[0] = 1;
+    for (uint i = 0; i < nsym; i++)
+    {
+        unsigned char root = gf_pow_alpha(i);
+        for (uint j = i + 1; j > 0; j--)
+        {
+            gen[j] = gen[j - 1] ^ gf_mul(gen[j], root);
+        }
+        gen[0] = gf_mul(gen[0], root);
+    }
+}
+
+uint rs_codeword_count(uint data_size, uint nsym)
+{
+    uint k_max = RS_MAX_N - nsym;
+    return (data_size + k_max - 1) / k_max;
+}
+
+/* Data symbols per codeword, data is spread evenly over the codewords */
+static uint rs_data_per_codeword(uint data_size, uint count)
+{
+    return count ? (data_size + count - 1) / count : 0;
+}
+
+uint rs_encoded_size(uint data_size, uint nsym)
+{
+    uint count = rs_codeword_count(data_size, nsym);
+    return count * (rs_data_per_codeword(data_size, count) + nsym);
+}
+
+/*
+ * Encode all codewords side by side
+ * Description: The LFSR registers of every codeword are stored
+ * as rows of count bytes, so each register update is one GF
+ * region multiply over all codewords
+ */
+int rs_encode_interleaved(const unsigned char *data, uint data_size, uint nsym, unsigned char *out)
+{
+    uint count = rs_codeword_count(data_size, nsym);
+    uint k = rs_data_per_codeword(data_size, count);
+    unsigned char gen[RS_MAX_NSYM + 1];
+
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    pthread_once(&gf_once, gf_init);
+    rs_generator(nsym, gen);
+
+    unsigned char *parity = mem_calloc((size_t)nsym * count, 1);
+    unsigned char *feedback = mem_alloc(count);
+    if (parity == NULL || feedback == NULL)
+    {
+        mem_free(parity);
+        mem_free(feedback);
+        return -1;
+    }
+
+    for (uint j = 0; j < k; j++)
+    {
+        unsigned char *row = out + (size_t)j * count;
+
+        // Step 1 : gather symbol j of every codeword (zero padded)
+        for (uint c = 0; c < count; c++)
+        {
+            uint idx = c * k + j;
+            row[c] = idx < data_size ? data[idx] : 0;
+            feedback[c] = row[c] ^ parity[c];
+        }
+
+        // Step 2 : shift the registers and add feedback * generator
+        memmove(parity, parity + count, (size_t)(nsym - 1) * count);
+        memset(parity + (size_t)(nsym - 1) * count, 0, count);
+        for (uint i = 0; i < nsym; i++)
+        {
+            gf_region_mul_xor(parity + (size_t)i * count, feedback, gen[nsym - 1 - i], count);
+        }
+    }
+
+    // Step 3 : parity rows follow the data rows
+    memcpy(out + (size_t)k * count, parity, (size_t)nsym * count);
+
+    mem_free(parity);
+    mem_free(feedback);
+    return 0;
+}
+
+/*
+ * Correct one codeword from its syndromes
+ * Description: Berlekamp-Massey for the error locator, Chien
+ * search for the positions and Forney for the values
+ * Return Value: number of errors found, -1 if not correctable
+ */
+static int rs_correct_codeword(const unsigned char *syn, uint nsym, uint n, uint *err_pos, unsigned char *err_val)
+{
+    unsigned char lambda[RS_MAX_NSYM + 1] = {1};
+    unsigned char prev[RS_MAX_NSYM + 1] = {1};
+    unsigned char temp[RS_MAX_NSYM + 1];
+    uint L = 0, m = 1;
+    unsigned char b = 1;
+
+    // Step 1 : Berlekamp-Massey
+    for (uint r = 0; r < nsym; r++)
+    {
+        unsigned char d = syn[r];
+        for (uint i = 1; i <= L; i++)
+        {
+            d ^= gf_mul(lambda[i], syn[r - i]);
+        }
+
+        if (d == 0)
+        {
+            m++;
+            continue;
+        }
+
+        unsigned char coef = gf_div(d, b);
+        memcpy(temp, lambda, sizeof(temp));
+        for (uint i = 0; i + m <= nsym; i++)
+        {
+            lambda[i + m] ^= gf_mul(coef, prev[i]);
+        }
+
+        if (2 * L <= r)
+        {
+            L = r + 1 - L;
+            memcpy(prev, temp, sizeof(prev));
+            b = d;
+            m = 1;
+        }
+        else
+        {
+            m++;
+        }
+    }
+
+    if (L == 0 || 2 * L > nsym)
+    {
+        return -1;
+    }
+
+    // Step 2 : error evaluator omega = syn * lambda mod x^nsym
+    unsigned char omega[RS_MAX_NSYM];
+    for (uint i = 0; i < nsym; i++)
+    {
+        omega[i] = 0;
+        for (uint t = 0; t <= i && t <= L; t++)
+        {
+            omega[i] ^= gf_mul(syn[i - t], lambda[t]);
+        }
+    }
+
+    // Step 3 : Chien search over the (possibly shortened) codeword
+    uint found = 0;
+    for (uint j = 0; j < n; j++)
+    {
+        uint power = n - 1 - j;
+        unsigned char x_inv = gf_pow_alpha(255 - power);
+
+        unsigned char eval = 0, xp = 1;
+        for (uint i = 0; i <= L; i++)
+        {
+            eval ^= gf_mul(lambda[i], xp);
+            xp = gf_mul(xp, x_inv);
+        }
+        if (eval != 0)
+        {
+            continue;
+        }
+
+        // Step 4 : Forney, e = X * omega(X^-1) / lambda'(X^-1)
+        unsigned char num = 0, den = 0;
+        xp = 1;
+        for (uint i = 0; i < nsym; i++)
+        {
+            num ^= gf_mul(omega[i], xp);
+            if ((i & 1) && i <= L)
+            {
+                // Formal derivative keeps odd terms only
+                den ^= gf_mul(lambda[i], gf_mul(xp, gf_pow_alpha(power)));
+            }
+            xp = gf_mul(xp, x_inv);
+        }
+        if (den == 0)
+        {
+            return -1;
+        }
+
+        err_pos[found] = j;
+        err_val[found] = gf_mul(gf_pow_alpha(power), gf_div(num, den));
+        found++;
+    }
+
+    return found == L ? (int)L : -1;
+}
+
+int rs_decode_interleaved(unsigned char *in, uint data_size, uint nsym, unsigned char *data)
+{
+    uint count = rs_codeword_count(data_size, nsym);
+    uint k = rs_data_per_codeword(data_size, count);
+    uint n = k + nsym;
+    int corrected = 0;
+
+    // The syndrome and error arrays below hold at most RS_MAX_NSYM entries
+    if (nsym == 0 || nsym > RS_MAX_NSYM)
+    {
+        return -1;
+    }
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    pthread_once(&gf_once, gf_init);
+
+    // Step 1 : syndromes of all codewords, Horner rule one row at a time
+    unsigned char *syn = mem_calloc((size_t)nsym * count, 1);
+    if (syn == NULL)
+    {
+        return -1;
+    }
+    for (uint j = 0; j < n; j++)
+    {
+        const unsigned char *row = in + (size_t)j * count;
+        for (uint i = 0; i < nsym; i++)
+        {
+            unsigned char *s = syn + (size_t)i * count;
+            if (i != 0)
+            {
+                gf_region_mul(s, s, gf_pow_alpha(i), count);
+            }
+            for (uint c = 0; c < count; c++)
+            {
+                s[c] ^= row[c];
+            }
+        }
+    }
+
+    // Step 2 : correct only the codewords with a non zero syndrome
+    for (uint c = 0; c < count && corrected >= 0; c++)
+    {
+        unsigned char s[RS_MAX_NSYM];
+        int dirty = 0;
+        for (uint i = 0; i < nsym; i++)
+        {
+            s[i] = syn[(size_t)i * count + c];
+            dirty |= s[i];
+        }
+        if (!dirty)
+        {
+            continue;
+        }
+
+        uint err_pos[RS_MAX_NSYM];
+        unsigned char err_val[RS_MAX_NSYM];
+        int errors = rs_correct_codeword(s, nsym, n, err_pos, err_val);
+        if (errors < 0)
+        {
+            corrected = -1;
+            break;
+        }
+        for (int e = 0; e < errors; e++)
+        {
+            in[(size_t)err_pos[e] * count + c] ^= err_val[e];
+        }
+        corrected += errors;
+    }
+    mem_free(syn);
+
+    // Step 3 : de-interleave the data symbols
+    for (uint c = 0; c < count; c++)
+    {
+        for (uint j = 0; j < k; j++)
+        {
+            uint idx = c * k + j;
+            if (idx < data_size)
+            {
+                data[idx] = in[(size_t)j * count + c];
+            }
+        }
+    }
+
+    return corrected;
+}
+
+/* xorshift64, the same damage for the same seed on every run */
+static unsigned long long bench_rand(unsigned long long *state)
+{
+    unsigned long long x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+/* Flip the LSB of each carrier byte with probability rate, geometric gaps between flips */
+static uint bench_flip(unsigned char *carrier, size_t len, double rate, unsigned long long *state)
+{
+    uint flips = 0;
+    double scale = 1.0 / log1p(-rate);
+    for (size_t pos = 0;; pos++)
+    {
+        double u = ((bench_rand(state) >> 11) + 1) * (1.0 / 9007199254740992.0);
+        pos += (size_t)(log(u) * scale);
+        if (pos >= len)
+        {
+            return flips;
+        }
+        carrier[pos] ^= 1;
+        flips++;
+    }
+}
+
+/*
+ * Run --bench-fec
+ * Description: A synthetic payload is Reed-Solomon coded and embedded
+ * in the LSBs of a synthetic carrier, then for each bit error rate the
+ * carrier LSBs are flipped at random over several trials, the block is
+ * extracted and corrected. Printed per rate: the damaged symbols, the
+ * fraction of trials that came back exact, the fraction of damaged
+ * symbols corrected and the decode throughput (best trial), and per
+ * nsym the encode throughput (best of a few runs)
+ */
+RsStatus do_bench_fec(char *argv[])
+{
+    static const uint default_nsym[] = {16, 32, 64};
+    static const double rates[] = {0.0, 1e-4, 1e-3, 2e-3, 5e-3, 1e-2, 2e-2};
+    const int trials = 10;
+
+    uint nsym_count = 3;
+    uint nsym_list[3] = {default_nsym[0], default_nsym[1], default_nsym[2]};
+    if (argv[2] != NULL)
+    {
+        nsym_list[0] = (uint)atoi(argv[2]);
+        nsym_count = 1;
+        if (nsym_list[0] < 2 || nsym_list[0] > RS_MAX_NSYM)
+        {
+            printf("Give 2 to %d parity symbols --> ./a.out --bench-fec [nsym] [payload KB]\n", RS_MAX_NSYM);
+            return rs_failure;
+        }
+    }
+    uint size = (argv[2] != NULL && argv[3] != NULL ? (uint)atoi(argv[3]) : 256) * 1024;
+    if (size == 0 || size > (64u << 20))
+    {
+        printf("Give the payload in KB, 1 to 65536 --> ./a.out --bench-fec [nsym] [payload KB]\n");
+        return rs_failure;
+    }
+
+    unsigned char *payload = mem_alloc(size), *data = mem_alloc(size);
+    if (payload == NULL || data == NULL)
+    {
+        mem_free(payload);
+        mem_free(data);
+        return rs_failure;
+    }
+    unsigned long long state = 0x9e3779b97f4a7c15ULL;
+    for (uint i = 0; i < size; i++)
+    {
+        payload[i] = (unsigned char)bench_rand(&state);
+    }
+    printf("Payload : %.2f MB, %d trials per bit error rate\n", size / 1e6, trials);
+
+    RsStatus status = rs_success;
+    for (uint s = 0; s < nsym_count && status == rs_success; s++)
+    {
+        uint nsym = nsym_list[s];
+        uint stored = rs_encoded_size(size, nsym);
+        size_t carrier_len = (size_t)stored * 8;
+        unsigned char *block = mem_alloc(stored), *clean = mem_alloc(stored);
+        unsigned char *stego = mem_alloc(carrier_len), *noisy = mem_alloc(carrier_len);
+        if (block == NULL || clean == NULL || stego == NULL || noisy == NULL)
+        {
+            status = rs_failure;
+        }
+        else
+        {
+            // encode : best of a few runs
+            double encode = 0;
+            for (int rep = 0; rep < 5; rep++)
+            {
+                struct timespec t0, t1;
+                clock_gettime(CLOCK_MONOTONIC, &t0);
+                if (rs_encode_interleaved(payload, size, nsym, clean) != 0)
+                {
+                    status = rs_failure;
+                    break;
+                }
+                clock_gettime(CLOCK_MONOTONIC, &t1);
+                double t = elapsed_s(&t0, &t1);
+                encode = rep == 0 || t < encode ? t : encode;
+            }
+            if (status != rs_success)
+            {
+                mem_free(block);
+                mem_free(clean);
+                mem_free(stego);
+                mem_free(noisy);
+                break;
+            }
+
+            // synthetic stego image : random carrier bytes with the block in their LSBs
+            for (size_t i = 0; i < carrier_len; i++)
+            {
+                stego[i] = (unsigned char)bench_rand(&state);
+            }
+            for (uint i = 0; i < stored; i++)
+            {
+                encode_byte_to_lsb((char)clean[i], (char *)stego + 8 * (size_t)i);
+            }
+
+            uint count = rs_codeword_count(size, nsym);
+            printf("\nnsym %u : %u codewords of %u bytes, up to %u errors each, encode %.1f MB/s\n", nsym, count,
+                   stored / count, nsym / 2, size / 1e6 / encode);
+            printf("  bit error rate   bit flips   bad symbols   exact trials   symbols corrected   decode MB/s\n");
+
+            for (uint r = 0; r < sizeof(rates) / sizeof(rates[0]); r++)
+            {
+                unsigned long long flips = 0, damaged = 0, corrected = 0;
+                int exact = 0;
+                double decode = 0;
+                for (int t = 0; t < trials; t++)
+                {
+                    memcpy(noisy, stego, carrier_len);
+                    if (rates[r] > 0)
+                    {
+                        flips += bench_flip(noisy, carrier_len, rates[r], &state);
+                    }
+                    uint bad = 0;
+                    for (uint i = 0; i < stored; i++)
+                    {
+                        char byte = 0;
+                        decode_byte_from_lsb(&byte, (char *)noisy + 8 * (size_t)i);
+                        block[i] = (unsigned char)byte;
+                        bad += block[i] != clean[i];
+                    }
+                    damaged += bad;
+
+                    struct timespec t0, t1;
+                    clock_gettime(CLOCK_MONOTONIC, &t0);
+                    int fixed = rs_decode_interleaved(block, size, nsym, data);
+                    clock_gettime(CLOCK_MONOTONIC, &t1);
+                    double took = elapsed_s(&t0, &t1);
+                    decode = t == 0 || took < decode ? took : decode;
+
+                    if (fixed >= 0 && memcmp(data, payload, size) == 0)
+                    {
+                        exact++;
+                        corrected += (uint)fixed;
+                    }
+                }
+                printf("  %14.4f%%   %9.1f   %11.1f   %8d / %d   %16.1f%%   %11.1f\n", rates[r] * 100,
+                       (double)flips / trials, (double)damaged / trials, exact, trials,
+                       damaged ? 100.0 * corrected / damaged : 100.0, size / 1e6 / decode);
+
+                // an undamaged block must always come back
+                if (rates[r] == 0 && exact != trials)
+                {
+                    printf("ERROR: nsym %u does not round trip without errors\n", nsym);
+                    status = rs_failure;
+                }
+            }
+        }
+        mem_free(block);
+        mem_free(clean);
+        mem_free(stego);
+        mem_free(noisy);
+    }
+
+    mem_free(payload);
+    mem_free(data);
+    return status;
+}
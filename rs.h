@@ -0,0 +1,45 @@
+#ifndef RS_H
+#define RS_H
+
+#include "types.h" // Contains user defined types
+
+/* Largest codeword length of Reed-Solomon over GF(256) */
+#define RS_MAX_N 255
+
+/* Largest number of parity symbols accepted for one codeword */
+#define RS_MAX_NSYM 128
+
+/*
+ * Payload layout used with STEG_FLAG_RS:
+ * the data is split evenly into C codewords of k data symbols
+ * followed by nsym parity symbols. Symbol j of codeword c is
+ * stored at offset j * C + c, so a burst of damaged carrier
+ * bytes is spread over many codewords.
+ */
+
+/* Number of codewords used for data_size bytes */
+uint rs_codeword_count(uint data_size, uint nsym);
+
+/* Total bytes stored in the image for data_size bytes of payload */
+uint rs_encoded_size(uint data_size, uint nsym);
+
+/* Encode data into the interleaved layout, out holds rs_encoded_size bytes, -1 when out of memory */
+int rs_encode_interleaved(const unsigned char *data, uint data_size, uint nsym, unsigned char *out);
+
+/*
+ * Correct the interleaved block in place and copy the data out
+ * Return Value: number of corrected symbols, -1 if some codeword
+ * has more errors than nsym / 2
+ */
+int rs_decode_interleaved(unsigned char *in, uint data_size, uint nsym, unsigned char *data);
+
+/* dst[i] ^= c * src[i] over GF(256) */
+void gf_region_mul_xor(unsigned char *dst, const unsigned char *src, unsigned char c, uint len);
+
+/* dst[i] = c * src[i] over GF(256), dst may equal src */
+void gf_region_mul(unsigned char *dst, const unsigned char *src, unsigned char c, uint len);
+
+/* Run --bench-fec [nsym] [payload KB], corrected fraction and throughput under random LSB flips */
+RsStatus do_bench_fec(char *argv[]);
+
+#endif
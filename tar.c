@@ -0,0 +1,494 @@
+#define _GNU_SOURCE // fopencookie
+#include "tar.h"
+#include "mem.h"
+#include "analyze.h"
+#include "tune.h"
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * State of one member opened as a FILE
+ * Description: The decoder reads through stdio, seeks back a little
+ * (magic string retry) and asks for the end (size check). Bytes in the
+ * first TAR_WINDOW are kept so those seeks work on a pipe; anything
+ * else only moves forward, and seeks are lazy so the end of the member
+ * is never read just to find its size.
+ */
+typedef struct _MemberStream
+{
+    TarInfo *tarInfo;
+    unsigned long long size;     // member size
+    unsigned long long consumed; // member bytes taken from the archive
+    unsigned long long pos;      // position seen by the reader
+    unsigned char window[TAR_WINDOW];
+} MemberStream;
+
+/* Function Definitions */
+
+/* Octal field, or base-256 when the high bit of the first byte is set */
+static unsigned long long tar_number(const unsigned char *field, int len)
+{
+    unsigned long long value = 0;
+    if (field[0] & 0x80)
+    {
+        value = field[0] & 0x7f;
+        for (int i = 1; i < len; i++)
+        {
+            value = (value << 8) | field[i];
+        }
+        return value;
+    }
+
+    int i = 0;
+    while (i < len && field[i] == ' ')
+    {
+        i++;
+    }
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; i++)
+    {
+        value = (value << 3) | (field[i] - '0');
+    }
+    return value;
+}
+
+/* Header checksum, chksum field counted as spaces */
+static int tar_checksum_ok(const unsigned char *block)
+{
+    unsigned long sum = 0;
+    for (int i = 0; i < TAR_BLOCK; i++)
+    {
+        sum += (i >= 148 && i < 156) ? ' ' : block[i];
+    }
+    return sum == tar_number(block + 148, 8);
+}
+
+static unsigned long long tar_padded(unsigned long long size)
+{
+    return (size + TAR_BLOCK - 1) & ~(unsigned long long)(TAR_BLOCK - 1);
+}
+
+TarStatus tar_skip(TarInfo *tarInfo, unsigned long long bytes)
+{
+    char buffer[64 * 1024];
+
+    if (bytes == 0)
+    {
+        return t_success;
+    }
+    if (tarInfo->seekable && fseeko(tarInfo->fptr_tar, (off_t)bytes, SEEK_CUR) == 0)
+    {
+        return t_success;
+    }
+    while (bytes > 0)
+    {
+        size_t n = bytes < sizeof(buffer) ? (size_t)bytes : sizeof(buffer);
+        if (fread(buffer, 1, n, tarInfo->fptr_tar) != n)
+        {
+            return t_failure;
+        }
+        bytes -= n;
+    }
+    return t_success;
+}
+
+/* Read a small member body (long name / pax header) into text, NUL terminated */
+static TarStatus tar_read_text(TarInfo *tarInfo, unsigned long long size, char *text, size_t text_len)
+{
+    size_t keep = size < text_len - 1 ? (size_t)size : text_len - 1;
+    if (fread(text, 1, keep, tarInfo->fptr_tar) != keep)
+    {
+        return t_failure;
+    }
+    text[keep] = '\0';
+    return tar_skip(tarInfo, tar_padded(size) - keep);
+}
+
+/* Take the path record out of a pax extended header */
+static void tar_pax_path(const char *pax, char *name, size_t name_len)
+{
+    const char *p = pax;
+    while (*p != '\0')
+    {
+        char *end;
+        long len = strtol(p, &end, 10);
+        if (len <= 0 || *end != ' ')
+        {
+            return;
+        }
+        if (strncmp(end + 1, "path=", 5) == 0)
+        {
+            const char *value = end + 6;
+            size_t value_len = (size_t)(p + len - 1 - value);
+            if (value_len < name_len)
+            {
+                memcpy(name, value, value_len);
+                name[value_len] = '\0';
+            }
+        }
+        if ((size_t)len > strlen(p))
+        {
+            return;
+        }
+        p += len;
+    }
+}
+
+TarStatus tar_next_member(TarInfo *tarInfo, TarMember *member)
+{
+    unsigned char block[TAR_BLOCK];
+    char long_name[FILENAME_MAX] = "";
+    static char pax[64 * 1024];
+
+    for (;;)
+    {
+        // Step 1 : header block, all zero marks the end of the archive
+        if (fread(block, 1, TAR_BLOCK, tarInfo->fptr_tar) != TAR_BLOCK)
+        {
+            return t_failure;
+        }
+        int zero = 1;
+        for (int i = 0; i < TAR_BLOCK && zero; i++)
+        {
+            zero = block[i] == 0;
+        }
+        if (zero || !tar_checksum_ok(block))
+        {
+            return t_failure;
+        }
+
+        member->size = tar_number(block + 124, 12);
+        member->type = (char)block[156];
+
+        // Step 2 : GNU long name and pax headers describe the next member
+        if (member->type == 'L')
+        {
+            if (tar_read_text(tarInfo, member->size, long_name, sizeof(long_name)) != t_success)
+            {
+                return t_failure;
+            }
+            continue;
+        }
+        if (member->type == 'x' || member->type == 'g')
+        {
+            if (tar_read_text(tarInfo, member->size, pax, sizeof(pax)) != t_success)
+            {
+                return t_failure;
+            }
+            if (member->type == 'x')
+            {
+                tar_pax_path(pax, long_name, sizeof(long_name));
+            }
+            continue;
+        }
+
+        // Step 3 : name, with the ustar prefix when present
+        if (long_name[0] != '\0')
+        {
+            strcpy(member->name, long_name);
+        }
+        else if (memcmp(block + 257, "ustar", 5) == 0 && block[345] != '\0')
+        {
+            snprintf(member->name, sizeof(member->name), "%.155s/%.100s", (char *)block + 345, (char *)block);
+        }
+        else
+        {
+            snprintf(member->name, sizeof(member->name), "%.100s", (char *)block);
+        }
+        return t_success;
+    }
+}
+
+static ssize_t member_read(void *cookie, char *buf, size_t n)
+{
+    MemberStream *ms = cookie;
+
+    if (ms->pos >= ms->size)
+    {
+        return 0;
+    }
+    if (n > ms->size - ms->pos)
+    {
+        n = (size_t)(ms->size - ms->pos);
+    }
+
+    // Step 1 : already read, only possible inside the window
+    if (ms->pos < ms->consumed)
+    {
+        unsigned long long kept = ms->consumed < TAR_WINDOW ? ms->consumed : TAR_WINDOW;
+        if (ms->pos >= kept)
+        {
+            errno = ESPIPE;
+            return -1;
+        }
+        if (n > kept - ms->pos)
+        {
+            n = (size_t)(kept - ms->pos);
+        }
+        memcpy(buf, ms->window + ms->pos, n);
+        ms->pos += n;
+        return (ssize_t)n;
+    }
+
+    // Step 2 : close the gap left by a forward seek
+    while (ms->consumed < ms->pos)
+    {
+        unsigned long long gap = ms->pos - ms->consumed;
+        if (ms->consumed < TAR_WINDOW)
+        {
+            size_t fill = gap < TAR_WINDOW - ms->consumed ? (size_t)gap : (size_t)(TAR_WINDOW - ms->consumed);
+            if (fread(ms->window + ms->consumed, 1, fill, ms->tarInfo->fptr_tar) != fill)
+            {
+                return -1;
+            }
+            ms->consumed += fill;
+        }
+        else
+        {
+            if (tar_skip(ms->tarInfo, gap) != t_success)
+            {
+                return -1;
+            }
+            ms->consumed += gap;
+        }
+    }
+
+    // Step 3 : new bytes, copied into the window while inside it
+    size_t got = fread(buf, 1, n, ms->tarInfo->fptr_tar);
+    if (ms->consumed < TAR_WINDOW)
+    {
+        size_t keep = got < TAR_WINDOW - ms->consumed ? got : (size_t)(TAR_WINDOW - ms->consumed);
+        memcpy(ms->window + ms->consumed, buf, keep);
+    }
+    ms->consumed += got;
+    ms->pos += got;
+    return (ssize_t)got;
+}
+
+static int member_seek(void *cookie, off64_t *offset, int whence)
+{
+    MemberStream *ms = cookie;
+    long long base = whence == SEEK_SET ? 0 : (whence == SEEK_CUR ? (long long)ms->pos : (long long)ms->size);
+
+    if (base + *offset < 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    ms->pos = base + *offset;
+    *offset = ms->pos;
+    return 0;
+}
+
+static int member_close(void *cookie)
+{
+    // The MemberStream is owned by the caller, which still needs consumed
+    (void)cookie;
+    return 0;
+}
+
+/*
+ * Output name of a member
+ * Description: Leading "/" and "./" are dropped and the directories are
+ * flattened into one name so nothing escapes output_dir. The escape is
+ * reversible, '/' is written "__", '_' is written "_-" and a leading
+ * '.' is written "_." (so no output is hidden), two members never get
+ * the same output name. Return 0 for an empty name (or "." / "..")
+ * and for one that does not fit.
+ */
+static int tar_output_name(const char *output_dir, const char *member, char *out, size_t size)
+{
+    while (member[0] == '/' || (member[0] == '.' && member[1] == '/'))
+    {
+        member += member[0] == '/' ? 1 : 2;
+    }
+    if (member[0] == '\0' || strcmp(member, ".") == 0 || strcmp(member, "..") == 0)
+    {
+        return 0;
+    }
+
+    int len = snprintf(out, size, "%s/", output_dir);
+    if (len < 0 || (size_t)len >= size)
+    {
+        return 0;
+    }
+    size_t pos = len;
+    if (member[0] == '.')
+    {
+        out[pos++] = '_';
+    }
+    for (; *member != '\0'; member++)
+    {
+        if (pos + 3 > size)
+        {
+            return 0;
+        }
+        if (*member == '/')
+        {
+            out[pos++] = '_';
+            out[pos++] = '_';
+        }
+        else if (*member == '_')
+        {
+            out[pos++] = '_';
+            out[pos++] = '-';
+        }
+        else
+        {
+            out[pos++] = *member;
+        }
+    }
+    out[pos] = '\0';
+    return 1;
+}
+
+/* Decode or analyse one BMP member */
+static void tar_process_member(TarInfo *tarInfo, TarMember *member, MemberStream *ms, int threads)
+{
+    cookie_io_functions_t io = {member_read, NULL, member_seek, member_close};
+    FILE *fptr = fopencookie(ms, "rb", io);
+    if (fptr == NULL)
+    {
+        tarInfo->skipped++;
+        return;
+    }
+    setvbuf(fptr, NULL, _IOFBF, TAR_STREAM_BUFFER);
+
+    if (tarInfo->analyze)
+    {
+        AnalyzeReport report;
+        if (analyze_stream(fptr, member->name, member->size, threads, &report) == a_success)
+        {
+            analyze_print_report(&report);
+            tarInfo->decoded++;
+        }
+        else
+        {
+            tarInfo->skipped++;
+        }
+        fclose(fptr);
+        return;
+    }
+
+    // Output keyed by member name, directories flattened so nothing escapes output_dir
+    char out[FILENAME_MAX];
+    if (!tar_output_name(tarInfo->output_dir, member->name, out, sizeof(out)))
+    {
+        printf("tar : %s has no usable output name, skipped\n", member->name);
+        tarInfo->skipped++;
+        fclose(fptr);
+        return;
+    }
+
+    DecodeInfo decInfo = tarInfo->options;
+    decInfo.stego_image_fname = member->name;
+    decInfo.fptr_stego_image = fptr;
+    decInfo.secret_fname = out;
+
+    if (do_decoding(&decInfo) == d_success)
+    {
+        printf("tar : %s -> %s\n", member->name, decInfo.secret_fname);
+        tarInfo->decoded++;
+    }
+    else
+    {
+        printf("tar : %s not decoded, skipped\n", member->name);
+        tarInfo->skipped++;
+    }
+    if (decInfo.fptr_stego_image != NULL)
+    {
+        fclose(decInfo.fptr_stego_image);
+    }
+}
+
+/*
+ * Run --tar
+ * Input: argv[2] archive name or "-" for stdin, then --out=<dir>,
+ * --analyze, --threads=<n> and the decode options
+ */
+TarStatus do_tar(char *argv[])
+{
+    TarInfo tarInfo = {0};
+    TarMember member;
+    int threads = tune_threads();
+
+    // Step 1 : arguments
+    if (argv[2] == NULL)
+    {
+        printf("Give the archive --> ./a.out --tar <archive.tar | ->\n");
+        return t_failure;
+    }
+    tarInfo.tar_fname = argv[2];
+    tarInfo.output_dir = ".";
+    for (int i = 3; argv[i] != NULL; i++)
+    {
+        if (strncmp(argv[i], "--out=", 6) == 0)
+        {
+            tarInfo.output_dir = argv[i] + 6;
+        }
+        else if (strcmp(argv[i], "--analyze") == 0)
+        {
+            tarInfo.analyze = 1;
+        }
+        else if (strncmp(argv[i], "--threads=", 10) == 0)
+        {
+            threads = atoi(argv[i] + 10);
+        }
+    }
+    if (read_decode_options(argv, 3, &tarInfo.options) != d_success)
+    {
+        return t_failure;
+    }
+
+    // Step 2 : open the archive, regular files can be seeked over
+    tarInfo.fptr_tar = strcmp(tarInfo.tar_fname, "-") == 0 ? stdin : fopen(tarInfo.tar_fname, "rb");
+    if (tarInfo.fptr_tar == NULL)
+    {
+        perror(tarInfo.tar_fname);
+        return t_failure;
+    }
+    struct stat st;
+    tarInfo.seekable = fstat(fileno(tarInfo.fptr_tar), &st) == 0 && S_ISREG(st.st_mode);
+
+    // Step 3 : walk the members
+    MemberStream *ms = mem_alloc(sizeof(MemberStream));
+    while (ms != NULL && tar_next_member(&tarInfo, &member) == t_success)
+    {
+        const char *dot = strrchr(member.name, '.');
+        int is_bmp = (member.type == '0' || member.type == '\0') && dot != NULL && strcmp(dot, ".bmp") == 0;
+
+        tarInfo.members++;
+        memset(ms, 0, offsetof(MemberStream, window));
+        ms->tarInfo = &tarInfo;
+        ms->size = member.size;
+
+        if (is_bmp)
+        {
+            MemJob job;
+            mem_job_begin(&job, member.size);
+            tar_process_member(&tarInfo, &member, ms, threads);
+            mem_job_end(&job);
+        }
+
+        // Step 4 : whatever was not read of the member is skipped
+        if (tar_skip(&tarInfo, tar_padded(member.size) - ms->consumed) != t_success)
+        {
+            printf("tar : archive ends inside %s\n", member.name);
+            break;
+        }
+    }
+    mem_free(ms);
+
+    char peak[16], job_peak[16];
+    printf("tar : %ld members, %ld %s, %ld skipped, peak memory %s (largest job %s)\n", tarInfo.members,
+           tarInfo.decoded, tarInfo.analyze ? "analyzed" : "decoded", tarInfo.skipped, mem_format(mem_peak(), peak),
+           mem_format(mem_job_peak_max(), job_peak));
+    if (tarInfo.fptr_tar != stdin)
+    {
+        fclose(tarInfo.fptr_tar);
+    }
+    return t_success;
+}
@@ -0,0 +1,53 @@
+#ifndef TAR_H
+#define TAR_H
+#include <stdio.h>
+
+#include "types.h"  // Contains user defined types
+#include "decode.h" // Decode options shared by every member
+
+/* Tar block size */
+#define TAR_BLOCK 512
+
+/* Start of a member kept in memory so the decoder can seek back in it */
+#define TAR_WINDOW (64 * 1024)
+
+/* stdio buffer of a member stream, kept well below TAR_WINDOW so read-ahead stays inside it */
+#define TAR_STREAM_BUFFER 4096
+
+/* One member of the archive */
+typedef struct _TarMember
+{
+    char name[FILENAME_MAX];   // To store the member path
+    unsigned long long size;   // To store the member size
+    char type;                 // To store the ustar typeflag
+} TarMember;
+
+/*
+ * Structure to store information required for
+ * decoding (or analysing) the BMP members of a tar stream
+ */
+
+typedef struct _TarInfo
+{
+    char *tar_fname;         // To store the archive name ("-" for stdin)
+    FILE *fptr_tar;          // To store the archive stream
+    int seekable;            // To store whether skipped data can be seeked over
+    char *output_dir;        // To store where decoded secrets are written
+    int analyze;             // To store whether members are analysed instead of decoded
+    DecodeInfo options;      // To store the key / nonce given on the command line
+
+    long members, decoded, skipped; // To store the counts for the summary
+} TarInfo;
+
+/* Tar function prototype */
+
+/* Run --tar <archive|-> with the options in argv[3] onwards */
+TarStatus do_tar(char *argv[]);
+
+/* Read the header(s) of the next member, t_failure at the end of the archive */
+TarStatus tar_next_member(TarInfo *tarInfo, TarMember *member);
+
+/* Move forward over bytes of the archive, by seeking when possible */
+TarStatus tar_skip(TarInfo *tarInfo, unsigned long long bytes);
+
+#endif
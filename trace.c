@@ -0,0 +1,225 @@
+#define _GNU_SOURCE // gettid
+#include "trace.h"
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Trace file shared by all threads */
+static FILE *trace_fptr;
+static int trace_events;
+static int trace_counters;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Counter descriptors of the calling thread, opened on first use */
+static __thread int counter_fd[TRACE_COUNTERS];
+static __thread int counter_ready;
+
+static const char *counter_name[TRACE_COUNTERS] = {"cycles", "instructions", "cache_misses", "page_faults"};
+
+/* Function Definitions */
+
+static long long now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/* Write s as a JSON string body */
+static void trace_write_escaped(const char *s)
+{
+    for (; s != NULL && *s != '\0'; s++)
+    {
+        if (*s == '"' || *s == '\\')
+        {
+            fputc('\\', trace_fptr);
+            fputc(*s, trace_fptr);
+        }
+        else if ((unsigned char)*s < 0x20)
+        {
+            fprintf(trace_fptr, "\\u%04x", *s);
+        }
+        else
+        {
+            fputc(*s, trace_fptr);
+        }
+    }
+}
+
+/* Start a new event line, caller holds trace_lock */
+static void trace_next_event(void)
+{
+    fputs(trace_events++ ? ",\n" : "\n", trace_fptr);
+}
+
+static void trace_close(void)
+{
+    if (trace_fptr != NULL)
+    {
+        fputs("\n]\n", trace_fptr);
+        fclose(trace_fptr);
+        trace_fptr = NULL;
+    }
+}
+
+/*
+ * Open the counters of the calling thread
+ * Description: Each counter is opened alone, so a VM without hardware
+ * counters still reports page faults. A counter that cannot be opened
+ * (perf_event_paranoid, no PMU) is left out of the events.
+ */
+static void counters_open(void)
+{
+    static const struct
+    {
+        unsigned int type;
+        unsigned long long config;
+    } event[TRACE_COUNTERS] = {
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+        {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+    };
+
+    for (int i = 0; i < TRACE_COUNTERS; i++)
+    {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = event[i].type;
+        attr.config = event[i].config;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        counter_fd[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+    counter_ready = 1;
+}
+
+static void counters_read(long long *values)
+{
+    if (!counter_ready)
+    {
+        counters_open();
+    }
+    for (int i = 0; i < TRACE_COUNTERS; i++)
+    {
+        values[i] = -1;
+        if (counter_fd[i] >= 0 && read(counter_fd[i], &values[i], sizeof(values[i])) != sizeof(values[i]))
+        {
+            values[i] = -1;
+        }
+    }
+}
+
+TraceStatus trace_init(char *argv[])
+{
+    const char *fname = NULL;
+
+    for (int i = 1; argv[i] != NULL; i++)
+    {
+        if (strncmp(argv[i], "--trace=", 8) == 0)
+        {
+            fname = argv[i] + 8;
+        }
+        else if (strcmp(argv[i], "--trace-counters") == 0)
+        {
+            trace_counters = 1;
+        }
+    }
+    if (fname == NULL)
+    {
+        return tr_success;
+    }
+
+    trace_fptr = fopen(fname, "w");
+    if (trace_fptr == NULL)
+    {
+        perror(fname);
+        return tr_failure;
+    }
+    fputs("[", trace_fptr);
+    atexit(trace_close);
+    trace_thread_name("main");
+    return tr_success;
+}
+
+int trace_enabled(void)
+{
+    return trace_fptr != NULL;
+}
+
+void trace_begin(TraceSpan *span, const char *name, const char *job)
+{
+    span->active = 0;
+    if (trace_fptr == NULL)
+    {
+        return;
+    }
+    span->name = name;
+    span->job = job;
+    span->active = 1;
+    if (trace_counters)
+    {
+        counters_read(span->counters);
+    }
+    // Time taken last so the counter reads are not inside the span
+    span->start_us = now_us();
+}
+
+void trace_end(TraceSpan *span)
+{
+    if (!span->active || trace_fptr == NULL)
+    {
+        return;
+    }
+    long long end_us = now_us();
+    long long counters[TRACE_COUNTERS];
+    if (trace_counters)
+    {
+        counters_read(counters);
+    }
+    span->active = 0;
+
+    pthread_mutex_lock(&trace_lock);
+    trace_next_event();
+    fprintf(trace_fptr, "{\"name\":\"%s\",\"cat\":\"steg\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":%d,\"tid\":%d,\"args\":{\"job\":\"",
+            span->name, span->start_us, end_us - span->start_us, (int)getpid(), (int)gettid());
+    trace_write_escaped(span->job);
+    fputc('"', trace_fptr);
+    for (int i = 0; trace_counters && i < TRACE_COUNTERS; i++)
+    {
+        if (span->counters[i] >= 0 && counters[i] >= 0)
+        {
+            fprintf(trace_fptr, ",\"%s\":%lld", counter_name[i], counters[i] - span->counters[i]);
+        }
+    }
+    fputs("}}", trace_fptr);
+    pthread_mutex_unlock(&trace_lock);
+}
+
+void trace_stage(TraceSpan *span, const char *name, const char *job)
+{
+    trace_end(span);
+    trace_begin(span, name, job);
+}
+
+void trace_thread_name(const char *name)
+{
+    if (trace_fptr == NULL)
+    {
+        return;
+    }
+    pthread_mutex_lock(&trace_lock);
+    trace_next_event();
+    fprintf(trace_fptr, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"",
+            (int)getpid(), (int)gettid());
+    trace_write_escaped(name);
+    fputs("\"}}", trace_fptr);
+    pthread_mutex_unlock(&trace_lock);
+}
@@ -0,0 +1,43 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "types.h" // Contains user defined types
+
+/* Hardware / software counters recorded per span with --trace-counters */
+#define TRACE_COUNTERS 4
+
+/*
+ * One open span of the trace (a whole job or one stage of it)
+ * Spans are written as Chrome trace-event "X" (complete) events
+ */
+
+typedef struct _TraceSpan
+{
+    const char *name;                  // To store the stage name
+    const char *job;                   // To store the image the stage works on
+    long long start_us;                // To store the start time
+    long long counters[TRACE_COUNTERS]; // To store the counter values at the start
+    int active;                        // To store whether the span is open
+} TraceSpan;
+
+/* Trace function prototype */
+
+/* Read --trace=<file.json> and --trace-counters from argv, open the file */
+TraceStatus trace_init(char *argv[]);
+
+/* Whether a trace file is open */
+int trace_enabled(void);
+
+/* Open a span */
+void trace_begin(TraceSpan *span, const char *name, const char *job);
+
+/* Close a span and write its event */
+void trace_end(TraceSpan *span);
+
+/* Close the current stage span (if any) and open the next one */
+void trace_stage(TraceSpan *span, const char *name, const char *job);
+
+/* Name the calling thread in the trace */
+void trace_thread_name(const char *name);
+
+#endif
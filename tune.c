@@ -0,0 +1,459 @@
+#include "tune.h"
+#include "mem.h"
+#include "util.h"
+#include "encode.h"
+#include "decode.h"
+#include "bulkio.h"
+#include "bmp.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Profile in use, loaded from the profile file on first use */
+static TuneProfile tune_active = {0, 0, io_buffered};
+static pthread_once_t tune_once = PTHREAD_ONCE_INIT;
+
+/* Synthetic batch shared by the calibration workers */
+typedef struct
+{
+    char dir[FILENAME_MAX];                    // scratch directory of this run
+    char carrier[TUNE_CARRIERS][FILENAME_MAX]; // synthetic carriers
+    char secret[FILENAME_MAX];                 // secret embedded in each of them
+    int threads;
+    int next;
+    int failed;
+    pthread_mutex_t lock;
+} TuneBatch;
+
+/* Function Definitions */
+
+const char *tune_profile_fname(char *out, size_t len)
+{
+    const char *env = getenv(TUNE_ENV), *home = getenv("HOME");
+    if (env != NULL && env[0] != '\0')
+    {
+        snprintf(out, len, "%s", env);
+    }
+    else if (home != NULL)
+    {
+        snprintf(out, len, "%s/%s", home, TUNE_DEFAULT_FILE);
+    }
+    else
+    {
+        return NULL;
+    }
+    return out;
+}
+
+static void tune_init(void)
+{
+    char fname[FILENAME_MAX];
+    if (tune_profile_fname(fname, sizeof(fname)) != NULL && access(fname, R_OK) == 0)
+    {
+        tune_load(fname, &tune_active);
+    }
+}
+
+const TuneProfile *tune_profile(void)
+{
+    pthread_once(&tune_once, tune_init);
+    return &tune_active;
+}
+
+int tune_threads(void)
+{
+    int threads = tune_profile()->threads;
+    return threads > 0 ? threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+TuneStatus tune_load(const char *fname, TuneProfile *profile)
+{
+    FILE *fptr = fopen(fname, "r");
+    if (fptr == NULL)
+    {
+        return tn_failure;
+    }
+
+    char line[512], key[64], value[256];
+    int lineno = 0;
+    while (fgets(line, sizeof(line), fptr) != NULL)
+    {
+        lineno++;
+        if (line[0] == '#' || line[0] == '\n')
+        {
+            continue;
+        }
+        int ok = sscanf(line, " %63[^= ] = %255s", key, value) == 2;
+        if (ok && strcmp(key, "block_size") == 0)
+        {
+            unsigned long long size = strtoull(value, NULL, 10);
+            ok = size == 0 || (size >= BULKIO_ALIGN && size <= (1ULL << 30));
+            if (ok)
+                profile->block_size = (size_t)size;
+        }
+        else if (ok && strcmp(key, "threads") == 0)
+        {
+            int threads = atoi(value);
+            ok = threads >= 0 && threads <= 1024;
+            if (ok)
+                profile->threads = threads;
+        }
+        else if (ok && strcmp(key, "io") == 0)
+        {
+            int mode = io_mode_from_name(value);
+            ok = mode >= 0;
+            if (ok)
+                profile->io_mode = (IoMode)mode;
+        }
+        if (!ok)
+        {
+            printf("%s:%d : ignored, not a valid profile setting\n", fname, lineno);
+        }
+    }
+    fclose(fptr);
+    return tn_success;
+}
+
+TuneStatus tune_save(const char *fname, const TuneProfile *profile, const char *comment)
+{
+    char tmp[FILENAME_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", fname, (long)getpid()) >= (int)sizeof(tmp))
+    {
+        return tn_failure;
+    }
+    FILE *fptr = fopen(tmp, "w");
+    if (fptr == NULL)
+    {
+        perror(tmp);
+        return tn_failure;
+    }
+    fprintf(fptr, "# %s\n", comment);
+    fprintf(fptr, "block_size=%zu\nthreads=%d\nio=%s\n", profile->block_size, profile->threads,
+            io_mode_name(profile->io_mode));
+    if (fclose(fptr) != 0 || rename(tmp, fname) != 0)
+    {
+        perror(fname);
+        unlink(tmp);
+        return tn_failure;
+    }
+    return tn_success;
+}
+
+/* Worker, encodes then decodes carriers until none are left */
+static void *tune_worker(void *arg)
+{
+    TuneBatch *batch = arg;
+    char stego[FILENAME_MAX], out[FILENAME_MAX];
+
+    for (;;)
+    {
+        pthread_mutex_lock(&batch->lock);
+        int i = batch->next < TUNE_CARRIERS ? batch->next++ : -1;
+        pthread_mutex_unlock(&batch->lock);
+        if (i < 0)
+        {
+            return NULL;
+        }
+
+        // Step 1 : encode with the profile defaults, durable as in --bench-io
+        EncodeInfo encInfo = {0};
+        int ok = snprintf(stego, sizeof(stego), "%s/stego_%d.bmp", batch->dir, i) < (int)sizeof(stego) &&
+                 snprintf(out, sizeof(out), "%s/secret_%d", batch->dir, i) < (int)sizeof(out);
+        encInfo.src_image_fname = batch->carrier[i];
+        encInfo.secret_fname = batch->secret;
+        encInfo.stego_image_fname = stego;
+        encInfo.io_mode = tune_profile()->io_mode;
+        ok = ok && do_encoding(&encInfo) == e_success && fdatasync(fileno(encInfo.fptr_stego_image)) == 0;
+        if (encInfo.fptr_src_image != NULL)
+            fclose(encInfo.fptr_src_image);
+        if (encInfo.fptr_secret != NULL)
+            fclose(encInfo.fptr_secret);
+        if (encInfo.fptr_stego_image != NULL)
+            fclose(encInfo.fptr_stego_image);
+
+        // Step 2 : decode it back
+        if (ok)
+        {
+            DecodeInfo decInfo = {0};
+            decInfo.stego_image_fname = stego;
+            decInfo.secret_fname = out;
+            struct stat st;
+            ok = do_decoding(&decInfo) == d_success && stat(decInfo.output_fname, &st) == 0 &&
+                 st.st_size == TUNE_SECRET_BYTES;
+            if (decInfo.fptr_stego_image != NULL)
+                fclose(decInfo.fptr_stego_image);
+            unlink(decInfo.output_fname);
+        }
+        unlink(stego);
+
+        if (!ok)
+        {
+            pthread_mutex_lock(&batch->lock);
+            batch->failed++;
+            pthread_mutex_unlock(&batch->lock);
+        }
+    }
+}
+
+/*
+ * Time one profile
+ * Description: The profile is made the active one, the carriers are
+ * dropped from the page cache and the batch is run on the profile's
+ * worker count. Returns the best time in seconds, or -1 when a job failed.
+ */
+static double tune_measure(TuneBatch *batch, const TuneProfile *profile, int repeats)
+{
+    TuneProfile saved = *tune_profile();
+    double best = -1;
+
+    tune_active = *profile;
+    int quiet = quiet_stdout(-1);
+    for (int rep = 0; rep < repeats; rep++)
+    {
+        for (int i = 0; i < TUNE_CARRIERS; i++)
+        {
+            int fd = open(batch->carrier[i], O_RDONLY);
+            if (fd >= 0)
+            {
+                posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+                close(fd);
+            }
+        }
+        batch->next = 0;
+        batch->failed = 0;
+        batch->threads = tune_threads();
+
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        pthread_t tid[1024];
+        int started = 0;
+        for (int t = 0; t < batch->threads && t < 1024; t++)
+        {
+            if (pthread_create(&tid[started], NULL, tune_worker, batch) == 0)
+            {
+                started++;
+            }
+        }
+        for (int t = 0; t < started; t++)
+        {
+            pthread_join(tid[t], NULL);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+
+        if (started == 0 || batch->failed > 0)
+        {
+            best = -1;
+            break;
+        }
+        if (best < 0 || elapsed_s(&t0, &t1) < best)
+        {
+            best = elapsed_s(&t0, &t1);
+        }
+    }
+    quiet_stdout(quiet);
+    tune_active = saved;
+    return best;
+}
+
+static const char *tune_describe(const TuneProfile *profile, char *out, size_t len)
+{
+    char block[32] = "default";
+    if (profile->block_size > 0)
+    {
+        snprintf(block, sizeof(block), "%zu KB", profile->block_size >> 10);
+    }
+    snprintf(out, len, "io %-8s block %-8s threads %d%s", io_mode_name(profile->io_mode), block,
+             profile->threads > 0 ? profile->threads : (int)sysconf(_SC_NPROCESSORS_ONLN),
+             profile->threads > 0 ? "" : " (per CPU)");
+    return out;
+}
+
+/* Time a profile, print its line, keep it when it beats *best */
+static void tune_try(TuneBatch *batch, const TuneProfile *profile, TuneProfile *best, double *best_s, double mb)
+{
+    char name[128];
+    double seconds = tune_measure(batch, profile, TUNE_REPEATS);
+    if (seconds < 0)
+    {
+        printf("  %s : failed\n", tune_describe(profile, name, sizeof(name)));
+        return;
+    }
+    printf("  %s : %8.1f MB/s\n", tune_describe(profile, name, sizeof(name)), mb / seconds);
+    if (*best_s < 0 || seconds < *best_s)
+    {
+        *best = *profile;
+        *best_s = seconds;
+    }
+}
+
+/*
+ * Run --tune
+ * Description: Writes TUNE_CARRIERS noise carriers and a secret to a
+ * scratch directory, then times encode + decode of the batch:
+ * first every I/O mode with a few block sizes on the default worker
+ * count, then worker counts with the best of those, and last the
+ * defaults against the winner, interleaved, for the report. The winner
+ * goes to the profile file.
+ */
+TuneStatus do_tune(char *argv[])
+{
+    const char *scratch = ".";
+    char config[FILENAME_MAX] = "";
+    for (int i = 2; argv[i] != NULL; i++)
+    {
+        if (strncmp(argv[i], "--config=", 9) == 0)
+        {
+            snprintf(config, sizeof(config), "%s", argv[i] + 9);
+        }
+        else
+        {
+            scratch = argv[i];
+        }
+    }
+    if (config[0] == '\0' && tune_profile_fname(config, sizeof(config)) == NULL)
+    {
+        printf("No profile file, give one with --config=<file> or %s\n", TUNE_ENV);
+        return tn_failure;
+    }
+    tune_profile();
+
+    // Step 1 : synthetic batch in a private scratch directory
+    TuneBatch batch = {0};
+    pthread_mutex_init(&batch.lock, NULL);
+    if (strlen(scratch) > sizeof(batch.dir) - 64)
+    {
+        printf("Scratch directory name too long\n");
+        return tn_failure;
+    }
+    snprintf(batch.dir, sizeof(batch.dir), "%s/.steg_tune.%ld", scratch, (long)getpid());
+    if (mkdir(batch.dir, 0700) != 0)
+    {
+        perror(batch.dir);
+        return tn_failure;
+    }
+    TuneStatus status = tn_success;
+    for (int i = 0; status == tn_success && i < TUNE_CARRIERS; i++)
+    {
+        if (snprintf(batch.carrier[i], sizeof(batch.carrier[i]), "%s/carrier_%d.bmp", batch.dir, i) <
+            (int)sizeof(batch.carrier[i]))
+        {
+            status = bmp_write_noise(batch.carrier[i], TUNE_WIDTH, TUNE_HEIGHT, 0x9E3779B9u * (i + 1)) ? tn_success
+                                                                                                     : tn_failure;
+        }
+    }
+    FILE *fptr_secret = NULL;
+    if (snprintf(batch.secret, sizeof(batch.secret), "%s/secret.txt", batch.dir) < (int)sizeof(batch.secret))
+    {
+        fptr_secret = fopen(batch.secret, "w");
+    }
+    if (fptr_secret != NULL)
+    {
+        for (int i = 0; i < TUNE_SECRET_BYTES; i++)
+        {
+            fputc('a' + (i * 7) % 26, fptr_secret);
+        }
+        status = fclose(fptr_secret) == 0 ? status : tn_failure;
+    }
+    if (status != tn_success || fptr_secret == NULL)
+    {
+        printf("Cannot write the calibration carriers to %s\n", batch.dir);
+        status = tn_failure;
+    }
+
+    // encode reads and writes each carrier once, decode reads the stego image
+    struct stat st;
+    double mb = stat(batch.carrier[0], &st) == 0 ? 3.0 * st.st_size * TUNE_CARRIERS / 1e6 : 0;
+    const TuneProfile defaults = {0, 0, io_buffered};
+    TuneProfile best = defaults;
+    double best_s = -1;
+    static const size_t blocks[] = {64 << 10, 256 << 10, 1 << 20, 4 << 20};
+
+    if (status == tn_success)
+    {
+        printf("Calibrating in %s : %d carriers of %dx%d, %d KB secret each\n", scratch, TUNE_CARRIERS, TUNE_WIDTH,
+               TUNE_HEIGHT, TUNE_SECRET_BYTES >> 10);
+
+        // Step 2 : I/O mode and block size, default worker count
+        printf("I/O mode and block size :\n");
+        tune_try(&batch, &defaults, &best, &best_s, mb);
+        for (int mode = io_buffered; mode <= io_direct; mode++)
+        {
+            for (size_t b = 0; b < sizeof(blocks) / sizeof(blocks[0]); b++)
+            {
+                // mmap copies in one go, the block size does not apply
+                if (mode == io_mmap && b > 0)
+                {
+                    break;
+                }
+                TuneProfile profile = {mode == io_mmap ? 0 : blocks[b], 0, (IoMode)mode};
+                tune_try(&batch, &profile, &best, &best_s, mb);
+            }
+        }
+
+        // Step 3 : worker count with the best I/O settings
+        printf("Workers :\n");
+        int cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        for (int threads = 1; threads <= TUNE_CARRIERS && threads <= 2 * cpus; threads *= 2)
+        {
+            TuneProfile profile = best;
+            profile.threads = threads;
+            tune_try(&batch, &profile, &best, &best_s, mb);
+        }
+    }
+
+    // Step 4 : defaults against the winner, interleaved so both see the same machine state
+    double default_s = -1, tuned_s = -1;
+    for (int rep = 0; status == tn_success && best_s > 0 && rep < 3; rep++)
+    {
+        double d = tune_measure(&batch, &defaults, 1), t = tune_measure(&batch, &best, 1);
+        if (d > 0 && (default_s < 0 || d < default_s))
+            default_s = d;
+        if (t > 0 && (tuned_s < 0 || t < tuned_s))
+            tuned_s = t;
+    }
+    if (status == tn_success && (best_s < 0 || default_s < 0 || tuned_s < 0))
+    {
+        printf("Calibration jobs failed, no profile written\n");
+        status = tn_failure;
+    }
+
+    for (int i = 0; i < TUNE_CARRIERS; i++)
+    {
+        unlink(batch.carrier[i]);
+    }
+    unlink(batch.secret);
+    rmdir(batch.dir);
+    pthread_mutex_destroy(&batch.lock);
+    if (status != tn_success)
+    {
+        return tn_failure;
+    }
+
+    // Step 5 : report and store the profile (the defaults when nothing beat them)
+    char name[128], comment[FILENAME_MAX + 128];
+    if (tuned_s >= default_s)
+    {
+        best = defaults;
+        tuned_s = default_s;
+    }
+    printf("Defaults : %s : %8.1f MB/s\n", tune_describe(&defaults, name, sizeof(name)), mb / default_s);
+    printf("Tuned    : %s : %8.1f MB/s (%.2fx the defaults)\n", tune_describe(&best, name, sizeof(name)),
+           mb / tuned_s, default_s / tuned_s);
+
+    time_t now = time(NULL);
+    char date[32];
+    strftime(date, sizeof(date), "%Y-%m-%d %H:%M", localtime(&now));
+    snprintf(comment, sizeof(comment), "written by --tune on %s, calibrated in %s (%.2fx the defaults)", date,
+             scratch, default_s / tuned_s);
+    if (tune_save(config, &best, comment) != tn_success)
+    {
+        return tn_failure;
+    }
+    printf("Profile written to %s, later runs load it\n", config);
+    return tn_success;
+}
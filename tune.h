@@ -0,0 +1,65 @@
+#ifndef TUNE_H
+#define TUNE_H
+#include <stddef.h>
+#include <stdio.h>
+
+#include "types.h" // Contains user defined types
+
+/*
+ * Per machine tuning (--tune)
+ * A calibration run encodes and decodes a batch of synthetic carriers
+ * in a scratch directory (on the storage to tune for), sweeping the
+ * copy block size and I/O mode, then the worker count, and stores the
+ * fastest combination as a profile file of key=value lines:
+ *     block_size=<bytes>    copy request size (0: default of each mode)
+ *     threads=<n>           workers of --plan / --watch / --analyze / --tar / --y4m (0: one per CPU)
+ *     io=buffered|mmap|direct
+ * Every later run loads the profile as its defaults, options given on
+ * the command line still win.
+ */
+
+/* Profile file: $STEG_TUNE_FILE, else $HOME/TUNE_DEFAULT_FILE */
+#define TUNE_ENV "STEG_TUNE_FILE"
+#define TUNE_DEFAULT_FILE ".steg_tune"
+
+/* Synthetic batch of a calibration run */
+#define TUNE_CARRIERS 8
+#define TUNE_WIDTH 2048
+#define TUNE_HEIGHT 1536
+#define TUNE_SECRET_BYTES (64 * 1024)
+
+/* Runs per setting, the best one counts */
+#define TUNE_REPEATS 2
+
+/*
+ * Structure to store the tunable defaults
+ */
+
+typedef struct _TuneProfile
+{
+    size_t block_size;   // To store the bytes per copy request (0 for the default of each I/O mode)
+    int threads;         // To store the default worker count (0 for one per CPU)
+    IoMode io_mode;      // To store the default I/O mode of the bulk copy
+} TuneProfile;
+
+/* Tune function prototype */
+
+/* Profile in use: the profile file when there is one, else the built in defaults */
+const TuneProfile *tune_profile(void);
+
+/* Default worker count of the profile (one per CPU unless tuned) */
+int tune_threads(void);
+
+/* Name of the profile file, written to out */
+const char *tune_profile_fname(char *out, size_t len);
+
+/* Read a profile file over the values in profile, unknown keys are ignored */
+TuneStatus tune_load(const char *fname, TuneProfile *profile);
+
+/* Write a profile file (through a temp file renamed over it) */
+TuneStatus tune_save(const char *fname, const TuneProfile *profile, const char *comment);
+
+/* Run --tune [<scratch dir>] [--config=<file>] */
+TuneStatus do_tune(char *argv[]);
+
+#endif
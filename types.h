@@ -17,10 +17,127 @@ typedef enum
     d_success
 }DecodeStatus;
 
+typedef enum
+{
+    a_failure,
+    a_success
+} AnalyzeStatus;
+
+typedef enum
+{
+    w_failure,
+    w_success
+} WatchStatus;
+
+typedef enum
+{
+    t_failure,
+    t_success
+} TarStatus;
+
+typedef enum
+{
+    io_failure,
+    io_success
+} IoStatus;
+
+typedef enum
+{
+    tr_failure,
+    tr_success
+} TraceStatus;
+
+typedef enum
+{
+    ad_failure,
+    ad_success
+} AdaptiveStatus;
+
+typedef enum
+{
+    y4m_failure,
+    y4m_success
+} Y4mStatus;
+
+typedef enum
+{
+    u_failure,
+    u_success
+} UpdateStatus;
+
+typedef enum
+{
+    p_failure,
+    p_success
+} PlanStatus;
+
+typedef enum
+{
+    q_failure,
+    q_success
+} QualityStatus;
+
+typedef enum
+{
+    j_failure,
+    j_success
+} JournalStatus;
+
+typedef enum
+{
+    ch_failure,
+    ch_success
+} ChannelStatus;
+
+typedef enum
+{
+    tn_failure,
+    tn_success
+} TuneStatus;
+
+typedef enum
+{
+    cat_failure,
+    cat_success
+} CatalogStatus;
+
+typedef enum
+{
+    m_failure,
+    m_success
+} MemStatus;
+
+typedef enum
+{
+    rs_failure,
+    rs_success
+} RsStatus;
+
+/* How the bulk of the carrier is copied to the stego image */
+typedef enum
+{
+    io_buffered,
+    io_mmap,
+    io_direct
+} IoMode;
+
 typedef enum
 {
     e_encode,
     e_decode,
+    e_analyze,
+    e_watch,
+    e_tar,
+    e_bench_io,
+    e_bench_adaptive,
+    e_y4m,
+    e_update,
+    e_plan,
+    e_bench_channels,
+    e_tune,
+    e_index,
+    e_bench_fec,
+    e_mem_check,
     e_unsupported
 } OperationType;
 
@@ -0,0 +1,334 @@
+#include "update.h"
+#include "mem.h"
+#include "encode.h"
+#include "common.h"
+#include "chacha20.h"
+#include "rs.h"
+#include "matrix.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <unistd.h>
+
+/* Function Definitions */
+
+/* Carrier bytes holding size secret bytes with the stream options in flags */
+static long carrier_bytes(uint flags, uint size)
+{
+    if (flags & STEG_FLAG_RS)
+    {
+        size = rs_encoded_size(size, STEG_RS_NSYM(flags));
+    }
+    if (flags & STEG_FLAG_MATRIX)
+    {
+        return matrix_carrier_bytes(size, STEG_MATRIX_P(flags));
+    }
+    return 8L * size;
+}
+
+/*
+ * Write the changed bytes
+ * Description: Changed bytes closer than UPDATE_MERGE_GAP are written
+ * with one pwrite, clean bytes in between are written back unchanged
+ */
+UpdateStatus update_write_changes(int fd, long pos, const char *orig, const char *region, long len,
+                                  UpdateInfo *updInfo)
+{
+    long i = 0;
+    while (i < len)
+    {
+        // Step 1 : next changed byte
+        while (i < len && orig[i] == region[i])
+        {
+            i++;
+        }
+        if (i == len)
+        {
+            break;
+        }
+
+        // Step 2 : extend the run while the gaps stay short
+        long start = i, end = i + 1;
+        for (long j = i + 1; j < len && j - end < UPDATE_MERGE_GAP; j++)
+        {
+            if (orig[j] != region[j])
+            {
+                end = j + 1;
+            }
+        }
+        for (long j = start; j < end; j++)
+        {
+            updInfo->changed += orig[j] != region[j];
+        }
+
+        // Step 3 : positioned write of the run
+        if (pwrite(fd, region + start, end - start, pos + start) != end - start)
+        {
+            perror(updInfo->stego_image_fname);
+            return u_failure;
+        }
+        updInfo->written += end - start;
+        updInfo->writes++;
+        i = end;
+    }
+    return u_success;
+}
+
+/* New stored payload: secret read, encrypted and Reed-Solomon coded like the encoder does */
+static unsigned char *update_build_payload(UpdateInfo *updInfo, uint *size, uint *stored_size)
+{
+    FILE *fptr_secret = fopen(updInfo->secret_fname, "rb");
+    if (fptr_secret == NULL)
+    {
+        perror(updInfo->secret_fname);
+        return NULL;
+    }
+    *size = get_file_size(fptr_secret);
+    rewind(fptr_secret);
+
+    unsigned char *data = mem_alloc(*size + 1);
+    if (data == NULL || fread(data, 1, *size, fptr_secret) != *size)
+    {
+        fclose(fptr_secret);
+        mem_free(data);
+        return NULL;
+    }
+    fclose(fptr_secret);
+
+    uint flags = updInfo->stream.flags;
+    if (flags & STEG_FLAG_CHACHA20)
+    {
+        ChaCha20Ctx cipher;
+        chacha20_init(&cipher, updInfo->stream.key, updInfo->stream.nonce, 1);
+        for (uint i = 0; i < *size; i++)
+        {
+            data[i] ^= chacha20_next_byte(&cipher);
+        }
+    }
+
+    *stored_size = *size;
+    if (flags & STEG_FLAG_RS)
+    {
+        *stored_size = rs_encoded_size(*size, STEG_RS_NSYM(flags));
+        unsigned char *stored = mem_alloc(*stored_size + 1);
+        if (stored != NULL && rs_encode_interleaved(data, *size, STEG_RS_NSYM(flags), stored) != 0)
+        {
+            mem_free(stored);
+            stored = NULL;
+        }
+        mem_free(data);
+        data = stored;
+    }
+    return data;
+}
+
+/* Embed the stored payload into the carrier region in memory, plain or matrix */
+static void update_embed(uint flags, const unsigned char *stored, uint stored_size, char *region)
+{
+    if (flags & STEG_FLAG_MATRIX)
+    {
+        uint p = STEG_MATRIX_P(flags);
+        uint n = MATRIX_BLOCK_LEN(p);
+        unsigned long bits = 8UL * stored_size;
+        for (unsigned long bitpos = 0, block = 0; bitpos < bits; bitpos += p, block++)
+        {
+            matrix_embed_bits(region + block * n, p, matrix_get_bits(stored, stored_size, bitpos, p));
+        }
+    }
+    else
+    {
+        for (uint i = 0; i < stored_size; i++)
+        {
+            encode_byte_to_lsb(stored[i], region + 8UL * i);
+        }
+    }
+}
+
+/*
+ * Update the secret in place
+ * Description: The stream header of the image gives the options and
+ * where the size field and the data are. The new payload is embedded
+ * into a copy of the carrier bytes read from the image, the LSBs the
+ * old secret used past the end of the new one are replaced with random
+ * bits, and only the bytes that differ are written back.
+ */
+static UpdateStatus update_in_place(UpdateInfo *updInfo)
+{
+    DecodeInfo *stream = &updInfo->stream;
+    char file_extn[10];
+    int old_size;
+
+    // Step 1 : stream header of the existing image
+    if (decode_stream_header(stream, file_extn, &old_size) != d_success)
+    {
+        printf("%s does not hold a secret to update\n", updInfo->stego_image_fname);
+        return u_failure;
+    }
+    if (stream->flags & (STEG_FLAG_ADAPTIVE | STEG_FLAG_CHANNELS))
+    {
+        printf("Adaptive / channel-selective streams cannot be updated in place, encode the image again\n");
+        return u_failure;
+    }
+
+    // Step 1a : only the size field and data are rewritten, so the extension stored must already be right
+    const char *new_extn = strrchr(updInfo->secret_fname, '.');
+    if (new_extn == NULL || strchr(new_extn, '/') != NULL || strcmp(new_extn, file_extn) != 0)
+    {
+        printf("%s holds a %s secret, the new one must have the same extension\n", updInfo->stego_image_fname,
+               file_extn);
+        return u_failure;
+    }
+
+    // Step 1b : the same key and nonce over two secrets leaks old XOR new, so the nonce must be a new one
+    if (stream->flags & STEG_FLAG_CHACHA20)
+    {
+        if (!stream->nonce_given)
+        {
+            printf("The secret is encrypted, give a new --nonce=<24 hex digits> for the new one\n");
+            return u_failure;
+        }
+        if (!updInfo->reuse_nonce && !updInfo->old_nonce_given)
+        {
+            printf("Give the nonce of the current secret with --old-nonce=<24 hex digits> so the new one can be "
+                   "checked to differ (or --reuse-nonce to reuse it anyway)\n");
+            return u_failure;
+        }
+        if (!updInfo->reuse_nonce &&
+            memcmp(updInfo->old_nonce, stream->nonce, sizeof(updInfo->old_nonce)) == 0)
+        {
+            printf("--nonce is the nonce of the current secret, reusing it leaks old XOR new (--reuse-nonce to force)\n");
+            return u_failure;
+        }
+    }
+    updInfo->data_pos = ftell(stream->fptr_stego_image);
+    updInfo->size_pos = updInfo->data_pos - 32L * STEG_SIZE_COPIES(stream->flags);
+    updInfo->old_bytes = carrier_bytes(stream->flags, old_size);
+    fseek(stream->fptr_stego_image, 0, SEEK_END);
+    long image_size = ftell(stream->fptr_stego_image);
+
+    // Step 2 : new payload, which must fit where the old one started
+    uint size, stored_size;
+    unsigned char *stored = update_build_payload(updInfo, &size, &stored_size);
+    if (stored == NULL)
+    {
+        return u_failure;
+    }
+    updInfo->new_bytes = carrier_bytes(stream->flags, size);
+    if (updInfo->data_pos + updInfo->new_bytes > image_size)
+    {
+        printf("New secret needs %ld image bytes, %ld are left\n", updInfo->new_bytes, image_size - updInfo->data_pos);
+        mem_free(stored);
+        return u_failure;
+    }
+
+    // Step 3 : carrier bytes from the size field to the end of the longer payload
+    long len = (updInfo->data_pos - updInfo->size_pos) +
+               (updInfo->new_bytes > updInfo->old_bytes ? updInfo->new_bytes : updInfo->old_bytes);
+    char *orig = mem_alloc(len + 1), *region = mem_alloc(len + 1);
+    int fd = fileno(stream->fptr_stego_image);
+    if (orig == NULL || region == NULL || pread(fd, orig, len, updInfo->size_pos) != len)
+    {
+        mem_free(orig);
+        mem_free(region);
+        mem_free(stored);
+        return u_failure;
+    }
+    memcpy(region, orig, len);
+
+    // Step 4 : size field copies, payload, random LSBs over the old tail
+    char *data = region + (updInfo->data_pos - updInfo->size_pos);
+    for (int copy = 0; copy < STEG_SIZE_COPIES(stream->flags); copy++)
+    {
+        encode_size_to_lsb(size, region + 32 * copy);
+    }
+    update_embed(stream->flags, stored, stored_size, data);
+    unsigned char noise = 0;
+    for (long i = updInfo->new_bytes; i < updInfo->old_bytes; i++)
+    {
+        if (i == updInfo->new_bytes || i % 8 == 0)
+        {
+            if (getrandom(&noise, 1, 0) != 1)
+            {
+                noise = (unsigned char)rand();
+            }
+        }
+        data[i] = (data[i] & 0xFE) | ((noise >> (i % 8)) & 1);
+    }
+    mem_free(stored);
+
+    // Step 5 : write only what changed and make it durable
+    UpdateStatus status = update_write_changes(fd, updInfo->size_pos, orig, region, len, updInfo);
+    if (status == u_success && fdatasync(fd) != 0)
+    {
+        status = u_failure;
+    }
+    mem_free(orig);
+    mem_free(region);
+
+    if (status == u_success)
+    {
+        printf("Secret updated : %d -> %u bytes, %ld carrier bytes changed, %ld bytes written in %d writes (image is %ld bytes)\n",
+               old_size, size, updInfo->changed, updInfo->written, updInfo->writes, image_size);
+    }
+    return status;
+}
+
+/* Read the arguments of --update */
+static UpdateStatus read_update_args(char *argv[], UpdateInfo *updInfo)
+{
+    if (argv[2] == NULL || argv[3] == NULL)
+    {
+        printf("Give arguments like this --> ./a.out --update stego_image.bmp new_secret_file "
+               "[--key=.. --nonce=<new> --old-nonce=<current> | --reuse-nonce]\n");
+        return u_failure;
+    }
+    updInfo->stego_image_fname = argv[2];
+    updInfo->secret_fname = argv[3];
+
+    char *dot = strrchr(updInfo->stego_image_fname, '.');
+    if (dot == NULL || strcmp(dot, ".bmp") != 0)
+    {
+        printf("Stego image file must have .bmp extension.\n");
+        return u_failure;
+    }
+    for (int i = 4; argv[i] != NULL; i++)
+    {
+        if (strncmp(argv[i], "--old-nonce=", 12) == 0)
+        {
+            if (!chacha20_parse_hex(argv[i] + 12, updInfo->old_nonce, sizeof(updInfo->old_nonce)))
+            {
+                printf("Nonce must be 24 hex digits\n");
+                return u_failure;
+            }
+            updInfo->old_nonce_given = 1;
+        }
+        else if (strcmp(argv[i], "--reuse-nonce") == 0)
+        {
+            updInfo->reuse_nonce = 1;
+        }
+    }
+    return read_decode_options(argv, 4, &updInfo->stream) == d_success ? u_success : u_failure;
+}
+
+UpdateStatus do_update(char *argv[])
+{
+    UpdateInfo updInfo = {0};
+
+    if (read_update_args(argv, &updInfo) != u_success)
+    {
+        return u_failure;
+    }
+
+    updInfo.stream.stego_image_fname = updInfo.stego_image_fname;
+    updInfo.stream.fptr_stego_image = fopen(updInfo.stego_image_fname, "r+b");
+    if (updInfo.stream.fptr_stego_image == NULL)
+    {
+        perror(updInfo.stego_image_fname);
+        return u_failure;
+    }
+
+    UpdateStatus status = update_in_place(&updInfo);
+    fclose(updInfo.stream.fptr_stego_image);
+    return status;
+}
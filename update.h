@@ -0,0 +1,43 @@
+#ifndef UPDATE_H
+#define UPDATE_H
+
+#include "types.h"  // Contains user defined types
+#include "decode.h" // Stream header of the existing stego image
+
+/* Clean carrier bytes allowed between two changed ones before a new pwrite is started */
+#define UPDATE_MERGE_GAP 64
+
+/*
+ * Structure to store information required for
+ * updating the secret of a stego image in place
+ */
+
+typedef struct _UpdateInfo
+{
+    char *stego_image_fname;  // To store the stego image rewritten in place
+    char *secret_fname;       // To store the new secret file name
+    DecodeInfo stream;        // To store the stream header of the image and the key / nonce
+    unsigned char old_nonce[12]; // To store the nonce the current secret was encrypted with (--old-nonce)
+    int old_nonce_given;      // To store whether --old-nonce was given
+    int reuse_nonce;          // To store --reuse-nonce, encrypting the new secret with the old nonce anyway
+
+    long size_pos;            // To store the offset of the secret size field(s)
+    long data_pos;            // To store the offset of the first data carrier byte
+    long old_bytes;           // To store the carrier bytes used by the old secret
+    long new_bytes;           // To store the carrier bytes used by the new secret
+
+    long changed;             // To store the carrier bytes whose LSB changed
+    long written;             // To store the bytes written
+    int writes;               // To store the number of pwrite calls
+} UpdateInfo;
+
+/* Update function prototype */
+
+/* Run --update <stego.bmp> <new_secret.txt> with the options in argv[4] onwards */
+UpdateStatus do_update(char *argv[]);
+
+/* Write the bytes of region that differ from orig (same offset pos in the file) */
+UpdateStatus update_write_changes(int fd, long pos, const char *orig, const char *region, long len,
+                                  UpdateInfo *updInfo);
+
+#endif
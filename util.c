@@ -0,0 +1,44 @@
+#include "util.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+/* Function Definitions */
+
+double elapsed_s(const struct timespec *from, const struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+double elapsed_ms(const struct timespec *from, const struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) * 1e3 + (to->tv_nsec - from->tv_nsec) / 1e6;
+}
+
+/* The engines print per image / frame lines, they go to /dev/null while a table is measured */
+int quiet_stdout(int saved)
+{
+    fflush(stdout);
+    if (saved < 0)
+    {
+        int null_fd = open("/dev/null", O_WRONLY);
+        saved = dup(STDOUT_FILENO);
+        if (null_fd >= 0)
+        {
+            dup2(null_fd, STDOUT_FILENO);
+            close(null_fd);
+        }
+        return saved;
+    }
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    return -1;
+}
+
+uint xorshift32(uint *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
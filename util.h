@@ -0,0 +1,25 @@
+#ifndef UTIL_H
+#define UTIL_H
+
+#include <time.h>
+
+#include "types.h" // Contains user defined types
+
+/*
+ * Helpers shared by the benchmarks and self checks
+ * (--bench-*, --tune, --mem-check and the per job timings)
+ */
+
+/* Util function prototype */
+
+/* Time from one CLOCK_MONOTONIC reading to a later one, in seconds / milliseconds */
+double elapsed_s(const struct timespec *from, const struct timespec *to);
+double elapsed_ms(const struct timespec *from, const struct timespec *to);
+
+/* With saved < 0 send stdout to /dev/null and return the saved descriptor, else restore it and return -1 */
+int quiet_stdout(int saved);
+
+/* Next value of a xorshift32 generator (state must not be 0) */
+uint xorshift32(uint *state);
+
+#endif
@@ -0,0 +1,355 @@
+#include "watch.h"
+#include "mem.h"
+#include "util.h"
+#include "trace.h"
+#include "tune.h"
+#include <dirent.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Set by SIGINT / SIGTERM to stop the service */
+static volatile sig_atomic_t watch_stop;
+
+static void watch_signal(int sig)
+{
+    (void)sig;
+    watch_stop = 1;
+}
+
+/* Function Definitions */
+
+/* Only .bmp files that are not hidden are decoded */
+static int watch_wanted(const char *name)
+{
+    const char *dot = strrchr(name, '.');
+    return name[0] != '.' && dot != NULL && strcmp(dot, ".bmp") == 0;
+}
+
+/* Create a directory unless it already exists */
+static WatchStatus watch_make_dir(const char *path)
+{
+    if (mkdir(path, 0755) != 0 && errno != EEXIST)
+    {
+        perror(path);
+        return w_failure;
+    }
+    return w_success;
+}
+
+WatchStatus watch_enqueue(WatchInfo *watchInfo, const char *name)
+{
+    if (!watch_wanted(name) || strlen(name) > NAME_MAX)
+    {
+        return w_failure;
+    }
+
+    pthread_mutex_lock(&watchInfo->lock);
+    while (watchInfo->count == WATCH_QUEUE_LEN && !watchInfo->closed)
+    {
+        pthread_cond_wait(&watchInfo->not_full, &watchInfo->lock);
+    }
+    if (watchInfo->closed)
+    {
+        pthread_mutex_unlock(&watchInfo->lock);
+        return w_failure;
+    }
+
+    WatchJob *job = &watchInfo->queue[(watchInfo->head + watchInfo->count) % WATCH_QUEUE_LEN];
+    strcpy(job->name, name);
+    clock_gettime(CLOCK_MONOTONIC, &job->queued);
+    watchInfo->count++;
+
+    pthread_cond_signal(&watchInfo->not_empty);
+    pthread_mutex_unlock(&watchInfo->lock);
+    return w_success;
+}
+
+WatchStatus watch_scan_dir(WatchInfo *watchInfo)
+{
+    DIR *dir = opendir(watchInfo->watch_dir);
+    if (dir == NULL)
+    {
+        perror(watchInfo->watch_dir);
+        return w_failure;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL && !watch_stop)
+    {
+        // A file queued twice is only decoded by the worker that claims it
+        watch_enqueue(watchInfo, entry->d_name);
+    }
+    closedir(dir);
+    return w_success;
+}
+
+/*
+ * Decode one queued image
+ * Description: The image is first renamed into processing_dir, so an
+ * image queued twice (event + rescan) is decoded only once, and a
+ * half handled image is never left in the spool directory
+ */
+static void watch_decode(WatchInfo *watchInfo, WatchJob *job)
+{
+    char src[FILENAME_MAX], work[FILENAME_MAX], dest[FILENAME_MAX], out[FILENAME_MAX];
+
+    // Step 1 : claim the image
+    if (snprintf(src, sizeof(src), "%s/%s", watchInfo->watch_dir, job->name) >= (int)sizeof(src) ||
+        snprintf(work, sizeof(work), "%s/%s", watchInfo->processing_dir, job->name) >= (int)sizeof(work) ||
+        rename(src, work) != 0)
+    {
+        return;
+    }
+
+    // Step 2 : decode with the shared options, output keyed by image name
+    DecodeInfo decInfo = watchInfo->options;
+    snprintf(out, sizeof(out), "%s/%s", watchInfo->output_dir, job->name);
+    decInfo.stego_image_fname = work;
+    decInfo.secret_fname = out;
+
+    // The secret takes at most an eighth of the image, decoded and decrypted copies of it
+    struct stat st;
+    MemJob job_mem;
+    mem_job_begin(&job_mem, stat(work, &st) == 0 ? (size_t)st.st_size / 4 : 0);
+    DecodeStatus status = do_decoding(&decInfo);
+    if (decInfo.fptr_stego_image != NULL)
+    {
+        fclose(decInfo.fptr_stego_image);
+    }
+    mem_job_end(&job_mem);
+
+    // Step 3 : publish the image as done or failed
+    if (snprintf(dest, sizeof(dest), "%s/%s",
+                 status == d_success ? watchInfo->done_dir : watchInfo->failed_dir, job->name) >= (int)sizeof(dest) ||
+        rename(work, dest) != 0)
+    {
+        perror(dest);
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double ms = elapsed_ms(&job->queued, &now);
+
+    pthread_mutex_lock(&watchInfo->lock);
+    if (status == d_success)
+    {
+        watchInfo->decoded++;
+    }
+    else
+    {
+        watchInfo->failed++;
+    }
+    watchInfo->total_ms += ms;
+    if (ms > watchInfo->max_ms)
+    {
+        watchInfo->max_ms = ms;
+    }
+    printf("watch : %s %s, latency %.2f ms\n", job->name,
+           status == d_success ? "decoded" : "failed", ms);
+    pthread_mutex_unlock(&watchInfo->lock);
+}
+
+/* Worker thread, runs until the queue is closed and drained */
+static void *watch_worker(void *arg)
+{
+    WatchInfo *watchInfo = arg;
+    WatchJob job;
+
+    trace_thread_name("watch worker");
+    for (;;)
+    {
+        pthread_mutex_lock(&watchInfo->lock);
+        while (watchInfo->count == 0 && !watchInfo->closed)
+        {
+            pthread_cond_wait(&watchInfo->not_empty, &watchInfo->lock);
+        }
+        if (watchInfo->count == 0)
+        {
+            pthread_mutex_unlock(&watchInfo->lock);
+            return NULL;
+        }
+        job = watchInfo->queue[watchInfo->head];
+        watchInfo->head = (watchInfo->head + 1) % WATCH_QUEUE_LEN;
+        watchInfo->count--;
+        pthread_cond_signal(&watchInfo->not_full);
+        pthread_mutex_unlock(&watchInfo->lock);
+
+        watch_decode(watchInfo, &job);
+    }
+}
+
+/* Read the --watch arguments */
+static WatchStatus read_watch_args(char *argv[], WatchInfo *watchInfo)
+{
+    static char default_out[FILENAME_MAX], default_done[FILENAME_MAX];
+
+    if (argv[2] == NULL || strncmp(argv[2], "--", 2) == 0)
+    {
+        printf("Give the directory to watch --> ./a.out --watch <dir>\n");
+        return w_failure;
+    }
+    watchInfo->watch_dir = argv[2];
+    watchInfo->threads = tune_threads();
+
+    snprintf(default_out, sizeof(default_out), "%s/decoded", watchInfo->watch_dir);
+    snprintf(default_done, sizeof(default_done), "%s/processed", watchInfo->watch_dir);
+    snprintf(watchInfo->failed_dir, sizeof(watchInfo->failed_dir), "%s/failed", watchInfo->watch_dir);
+    snprintf(watchInfo->processing_dir, sizeof(watchInfo->processing_dir), "%s/.processing", watchInfo->watch_dir);
+    watchInfo->output_dir = default_out;
+    watchInfo->done_dir = default_done;
+
+    for (int i = 3; argv[i] != NULL; i++)
+    {
+        if (strncmp(argv[i], "--out=", 6) == 0)
+        {
+            watchInfo->output_dir = argv[i] + 6;
+        }
+        else if (strncmp(argv[i], "--done=", 7) == 0)
+        {
+            watchInfo->done_dir = argv[i] + 7;
+        }
+        else if (strncmp(argv[i], "--threads=", 10) == 0)
+        {
+            watchInfo->threads = atoi(argv[i] + 10);
+        }
+    }
+    if (watchInfo->threads < 1)
+    {
+        watchInfo->threads = 1;
+    }
+
+    // --key / --nonce are shared with -d
+    if (read_decode_options(argv, 3, &watchInfo->options) != d_success)
+    {
+        return w_failure;
+    }
+
+    if (watch_make_dir(watchInfo->output_dir) != w_success || watch_make_dir(watchInfo->done_dir) != w_success ||
+        watch_make_dir(watchInfo->failed_dir) != w_success || watch_make_dir(watchInfo->processing_dir) != w_success)
+    {
+        return w_failure;
+    }
+    return w_success;
+}
+
+/*
+ * Run the watch folder service
+ * Description: inotify reports images closed after writing or moved
+ * into the directory. Memory stays bounded by the job queue: when it
+ * is full the reader waits, and if the kernel event queue overflows
+ * meanwhile the directory is rescanned instead.
+ */
+WatchStatus do_watch(char *argv[])
+{
+    WatchInfo *watchInfo = mem_calloc(1, sizeof(WatchInfo));
+    if (watchInfo == NULL)
+    {
+        return w_failure;
+    }
+
+    // Step 1 : arguments and directories
+    if (read_watch_args(argv, watchInfo) != w_success)
+    {
+        mem_free(watchInfo);
+        return w_failure;
+    }
+
+    // Step 2 : inotify watch (set up before the first scan so nothing is missed)
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0 || inotify_add_watch(fd, watchInfo->watch_dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+    {
+        perror("inotify");
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        mem_free(watchInfo);
+        return w_failure;
+    }
+
+    // Step 3 : stop cleanly on SIGINT / SIGTERM (no SA_RESTART, read() returns EINTR)
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = watch_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    // Step 4 : start the workers
+    pthread_mutex_init(&watchInfo->lock, NULL);
+    pthread_cond_init(&watchInfo->not_empty, NULL);
+    pthread_cond_init(&watchInfo->not_full, NULL);
+
+    pthread_t *tid = mem_alloc(watchInfo->threads * sizeof(pthread_t));
+    int started = 0;
+    for (int t = 0; tid != NULL && t < watchInfo->threads; t++)
+    {
+        if (pthread_create(&tid[started], NULL, watch_worker, watchInfo) == 0)
+        {
+            started++;
+        }
+    }
+    printf("Watching %s with %d workers, output in %s\n", watchInfo->watch_dir, started, watchInfo->output_dir);
+
+    // Step 5 : images already waiting, then events
+    watch_scan_dir(watchInfo);
+
+    char events[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (!watch_stop && started > 0)
+    {
+        ssize_t len = read(fd, events, sizeof(events));
+        if (len <= 0)
+        {
+            if (len < 0 && errno != EINTR)
+            {
+                perror("read");
+                break;
+            }
+            continue;
+        }
+
+        for (char *p = events; p < events + len;)
+        {
+            struct inotify_event *event = (struct inotify_event *)p;
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                watch_scan_dir(watchInfo);
+            }
+            else if (event->len > 0)
+            {
+                watch_enqueue(watchInfo, event->name);
+            }
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+
+    // Step 6 : drain the queue and stop the workers
+    pthread_mutex_lock(&watchInfo->lock);
+    watchInfo->closed = 1;
+    pthread_cond_broadcast(&watchInfo->not_empty);
+    pthread_cond_broadcast(&watchInfo->not_full);
+    pthread_mutex_unlock(&watchInfo->lock);
+    for (int t = 0; t < started; t++)
+    {
+        pthread_join(tid[t], NULL);
+    }
+    close(fd);
+
+    long total = watchInfo->decoded + watchInfo->failed;
+    char peak[16], job_peak[16];
+    printf("Watch stopped : %ld decoded, %ld failed, latency mean %.2f ms max %.2f ms, peak memory %s (largest job %s)\n",
+           watchInfo->decoded, watchInfo->failed, total ? watchInfo->total_ms / total : 0.0, watchInfo->max_ms,
+           mem_format(mem_peak(), peak), mem_format(mem_job_peak_max(), job_peak));
+
+    pthread_mutex_destroy(&watchInfo->lock);
+    pthread_cond_destroy(&watchInfo->not_empty);
+    pthread_cond_destroy(&watchInfo->not_full);
+    mem_free(tid);
+    mem_free(watchInfo);
+    return started > 0 ? w_success : w_failure;
+}
@@ -0,0 +1,62 @@
+#ifndef WATCH_H
+#define WATCH_H
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "types.h"  // Contains user defined types
+#include "decode.h" // Decode options shared by every image
+
+/* Images waiting for a worker, the inotify reader blocks when full */
+#define WATCH_QUEUE_LEN 1024
+
+/* One image waiting to be decoded */
+typedef struct _WatchJob
+{
+    char name[NAME_MAX + 1]; // To store the file name inside the watched dir
+    struct timespec queued;  // To store when the image was seen
+} WatchJob;
+
+/*
+ * Structure to store the watch folder service state
+ * Images are claimed by renaming them into processing_dir,
+ * and moved to done_dir or failed_dir when decoded
+ */
+
+typedef struct _WatchInfo
+{
+    /* Directories */
+    char *watch_dir;                      // To store the spool directory
+    char *output_dir;                     // To store where decoded secrets are written
+    char *done_dir;                       // To store where decoded images are moved
+    char failed_dir[FILENAME_MAX];        // To store where undecodable images are moved
+    char processing_dir[FILENAME_MAX];    // To store images being decoded
+
+    /* Workers */
+    int threads;            // To store the number of decode workers
+    DecodeInfo options;     // To store the key / nonce given on the command line
+
+    /* Bounded job queue */
+    WatchJob queue[WATCH_QUEUE_LEN];
+    uint head, count;
+    int closed;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty, not_full;
+
+    /* Statistics */
+    long decoded, failed;
+    double total_ms, max_ms;
+} WatchInfo;
+
+/* Watch function prototype */
+
+/* Run --watch <dir> with the options in argv[3] onwards */
+WatchStatus do_watch(char *argv[]);
+
+/* Queue one image name, blocks while the queue is full */
+WatchStatus watch_enqueue(WatchInfo *watchInfo, const char *name);
+
+/* Queue every .bmp already in the watched directory */
+WatchStatus watch_scan_dir(WatchInfo *watchInfo);
+
+#endif
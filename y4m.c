@@ -0,0 +1,730 @@
+#include "y4m.h"
+#include "mem.h"
+#include "encode.h"
+#include "common.h"
+#include "tune.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Function Definitions */
+
+static void put_le32(unsigned char *p, uint value)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        p[i] = (unsigned char)(value >> (8 * i));
+    }
+}
+
+static uint get_le32(const unsigned char *p)
+{
+    return (uint)p[0] | ((uint)p[1] << 8) | ((uint)p[2] << 16) | ((uint)p[3] << 24);
+}
+
+/*
+ * Parse the stream header line
+ * Description: W and H give the luma plane, C the chroma layout
+ * (4:2:0 when missing). Only the frame size matters here, the
+ * header is written back unchanged.
+ */
+Y4mStatus y4m_read_header(Y4mInfo *y4mInfo)
+{
+    char tokens[Y4M_LINE_MAX];
+    const char *chroma = "420";
+
+    if (fgets(y4mInfo->header, sizeof(y4mInfo->header), y4mInfo->fptr_src) == NULL ||
+        strncmp(y4mInfo->header, "YUV4MPEG2 ", 10) != 0 || strchr(y4mInfo->header, '\n') == NULL)
+    {
+        printf("%s is not a YUV4MPEG2 video\n", y4mInfo->src_fname);
+        return y4m_failure;
+    }
+
+    strcpy(tokens, y4mInfo->header);
+    for (char *tok = strtok(tokens + 10, " \n"); tok != NULL; tok = strtok(NULL, " \n"))
+    {
+        if (tok[0] == 'W')
+            y4mInfo->width = (uint)atoi(tok + 1);
+        else if (tok[0] == 'H')
+            y4mInfo->height = (uint)atoi(tok + 1);
+        else if (tok[0] == 'C')
+            chroma = y4mInfo->header + 10 + (tok + 1 - (tokens + 10));
+    }
+
+    size_t luma = (size_t)y4mInfo->width * y4mInfo->height;
+    size_t half_w = (y4mInfo->width + 1) / 2, half_h = (y4mInfo->height + 1) / 2;
+    if (strncmp(chroma, "420", 3) == 0)
+        y4mInfo->frame_len = luma + 2 * half_w * half_h;
+    else if (strncmp(chroma, "422", 3) == 0)
+        y4mInfo->frame_len = luma + 2 * half_w * y4mInfo->height;
+    else if (strncmp(chroma, "444alpha", 8) == 0)
+        y4mInfo->frame_len = 4 * luma;
+    else if (strncmp(chroma, "444", 3) == 0)
+        y4mInfo->frame_len = 3 * luma;
+    else if (strncmp(chroma, "mono", 4) == 0)
+        y4mInfo->frame_len = luma;
+    else
+        y4mInfo->frame_len = 0;
+
+    if (y4mInfo->frame_len == 0)
+    {
+        printf("Unsupported Y4M frame format : %s", y4mInfo->header);
+        return y4m_failure;
+    }
+    return y4m_success;
+}
+
+Y4mStatus y4m_read_frame(Y4mInfo *y4mInfo, Y4mFrame *frame)
+{
+    if (fgets(frame->line, sizeof(frame->line), y4mInfo->fptr_src) == NULL)
+    {
+        return y4m_failure;
+    }
+    if (strncmp(frame->line, "FRAME", 5) != 0 || strchr(frame->line, '\n') == NULL)
+    {
+        printf("Bad FRAME header after frame %llu, stopping there\n", y4mInfo->frames);
+        return y4m_failure;
+    }
+    if (fread(frame->data, 1, y4mInfo->frame_len, y4mInfo->fptr_src) != y4mInfo->frame_len)
+    {
+        printf("Frame %llu is truncated, stopping there\n", y4mInfo->frames);
+        return y4m_failure;
+    }
+    return y4m_success;
+}
+
+/* Stream byte range [first, end) touched by the carrier bytes of a frame */
+static void frame_stream_range(const Y4mInfo *y4mInfo, const Y4mFrame *frame,
+                               unsigned long long *first, unsigned long long *end)
+{
+    *first = frame->carrier_pos / 8;
+    *end = (frame->carrier_pos + y4mInfo->frame_len + 7) / 8;
+}
+
+/*
+ * Encode : produce the stream bytes of the next frame (main thread)
+ * Description: Bytes come from the stream header, then from the secret
+ * file, encrypted in order. A byte split between two frames is produced
+ * once and kept in pending for the second frame.
+ */
+static Y4mStatus y4m_fill_stream(Y4mInfo *y4mInfo, Y4mFrame *frame)
+{
+    unsigned long long first, end;
+    frame_stream_range(y4mInfo, frame, &first, &end);
+    if (end > y4mInfo->stream_len)
+    {
+        end = y4mInfo->stream_len;
+    }
+    frame->stream_pos = first;
+    frame->stream_len = 0;
+    if (first >= end)
+    {
+        return y4m_success;
+    }
+
+    unsigned long long pos = first;
+    size_t k = 0;
+    if (pos < y4mInfo->stream_next)
+    {
+        frame->stream[k++] = y4mInfo->pending;
+        pos++;
+    }
+    for (; pos < end && pos < y4mInfo->head_len; pos++)
+    {
+        frame->stream[k++] = y4mInfo->head[pos];
+    }
+    if (pos < end)
+    {
+        size_t n = end - pos;
+        if (fread(frame->stream + k, 1, n, y4mInfo->fptr_secret) != n)
+        {
+            printf("Secret file ended early\n");
+            return y4m_failure;
+        }
+        if (y4mInfo->options.flags & STEG_FLAG_CHACHA20)
+        {
+            for (size_t i = 0; i < n; i++)
+            {
+                frame->stream[k + i] ^= chacha20_next_byte(&y4mInfo->cipher);
+            }
+        }
+        k += n;
+    }
+
+    frame->stream_len = k;
+    y4mInfo->stream_next = end;
+    y4mInfo->pending = frame->stream[k - 1];
+    return y4m_success;
+}
+
+/* Embed (or extract) the stream bits of one frame, one bit per frame byte LSB */
+static void y4m_process_frame(Y4mInfo *y4mInfo, Y4mFrame *frame)
+{
+    unsigned long long base = frame->carrier_pos;
+    unsigned long long k = base, end = base + y4mInfo->frame_len;
+    char *data = (char *)frame->data;
+    unsigned char *stream = frame->stream;
+
+    if (!y4mInfo->decode)
+    {
+        unsigned long long first = frame->stream_pos;
+        unsigned long long stop = (first + frame->stream_len) * 8;
+        end = stop < end ? stop : end;
+
+        // bits of a byte started in the previous frame, whole bytes, bits of a byte ending in the next one
+        for (; k < end && k % 8 != 0; k++)
+        {
+            data[k - base] = (data[k - base] & 0xFE) | ((stream[k / 8 - first] >> (k % 8)) & 1);
+        }
+        for (; k + 8 <= end; k += 8)
+        {
+            encode_byte_to_lsb(stream[k / 8 - first], data + (k - base));
+        }
+        for (; k < end; k++)
+        {
+            data[k - base] = (data[k - base] & 0xFE) | ((stream[k / 8 - first] >> (k % 8)) & 1);
+        }
+    }
+    else
+    {
+        unsigned long long first, last;
+        frame_stream_range(y4mInfo, frame, &first, &last);
+        frame->stream_pos = first;
+        frame->stream_len = last - first;
+        memset(stream, 0, frame->stream_len);
+
+        for (; k < end && k % 8 != 0; k++)
+        {
+            stream[k / 8 - first] |= (data[k - base] & 1) << (k % 8);
+        }
+        for (; k + 8 <= end; k += 8)
+        {
+            decode_byte_from_lsb((char *)&stream[k / 8 - first], data + (k - base));
+        }
+        for (; k < end; k++)
+        {
+            stream[k / 8 - first] |= (data[k - base] & 1) << (k % 8);
+        }
+    }
+}
+
+/* Worker thread, runs until the queue is closed and drained */
+static void *y4m_worker(void *arg)
+{
+    Y4mInfo *y4mInfo = arg;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&y4mInfo->lock);
+        while (y4mInfo->queue_count == 0 && !y4mInfo->closed)
+        {
+            pthread_cond_wait(&y4mInfo->work, &y4mInfo->lock);
+        }
+        if (y4mInfo->queue_count == 0)
+        {
+            pthread_mutex_unlock(&y4mInfo->lock);
+            return NULL;
+        }
+        Y4mFrame *frame = &y4mInfo->frame[y4mInfo->queue[y4mInfo->queue_head]];
+        y4mInfo->queue_head = (y4mInfo->queue_head + 1) % Y4M_MAX_SLOTS;
+        y4mInfo->queue_count--;
+        pthread_mutex_unlock(&y4mInfo->lock);
+
+        y4m_process_frame(y4mInfo, frame);
+
+        pthread_mutex_lock(&y4mInfo->lock);
+        frame->busy = 0;
+        pthread_cond_broadcast(&y4mInfo->done);
+        pthread_mutex_unlock(&y4mInfo->lock);
+    }
+}
+
+/* Decode : open the output once the stream header is complete */
+static Y4mStatus y4m_open_output(Y4mInfo *y4mInfo, uint flags, const unsigned char *extn, uint extn_size)
+{
+    char file_extn[10];
+    memcpy(file_extn, extn, extn_size);
+    file_extn[extn_size] = '\0';
+
+    // Existing extension of the given name is replaced by the decoded one
+    char base[FILENAME_MAX];
+    snprintf(base, sizeof(base), "%s", y4mInfo->secret_fname);
+    char *dot = strrchr(base, '.');
+    char *slash = strrchr(base, '/');
+    if (dot != NULL && (slash == NULL || dot > slash))
+    {
+        *dot = '\0';
+    }
+    if (snprintf(y4mInfo->output_fname, sizeof(y4mInfo->output_fname), "%s%s", base, file_extn) >=
+        (int)sizeof(y4mInfo->output_fname))
+    {
+        printf("Output file name is too long\n");
+        return y4m_failure;
+    }
+
+    y4mInfo->fptr_secret = fopen(y4mInfo->output_fname, "wb");
+    if (y4mInfo->fptr_secret == NULL)
+    {
+        perror(y4mInfo->output_fname);
+        return y4m_failure;
+    }
+    if (flags & STEG_FLAG_CHACHA20)
+    {
+        chacha20_init(&y4mInfo->cipher, y4mInfo->options.key, y4mInfo->options.nonce, 1);
+    }
+    printf("Output file created: %s, %ld bytes to decode\n", y4mInfo->output_fname, y4mInfo->data_left);
+    return y4m_success;
+}
+
+/*
+ * Decode : take the complete stream bytes of a frame (main thread)
+ * Description: The stream header is collected byte by byte and checked
+ * as soon as each field is known, then data bytes are decrypted and
+ * written until the secret size is reached
+ */
+static Y4mStatus y4m_take_stream(Y4mInfo *y4mInfo, const unsigned char *stream, size_t len)
+{
+    size_t i = 0;
+
+    // Step 1 : stream header
+    while (y4mInfo->head_len < y4mInfo->head_need && i < len)
+    {
+        unsigned char *head = y4mInfo->head;
+        head[y4mInfo->head_len++] = stream[i++];
+
+        uint fixed = memcmp(head, MAGIC_STRING_EXT, 2) == 0 ? 6 : 2;
+        if (y4mInfo->head_len == 2)
+        {
+            if (memcmp(head, MAGIC_STRING, 2) != 0 && memcmp(head, MAGIC_STRING_EXT, 2) != 0)
+            {
+                printf("Magic string not found, nothing is hidden in %s\n", y4mInfo->src_fname);
+                return y4m_failure;
+            }
+            y4mInfo->head_need = fixed + 4;
+        }
+        else if (y4mInfo->head_len == 6 && fixed == 6)
+        {
+            uint flags = get_le32(head + 2);
+            if (flags & ~(uint)STEG_FLAG_CHACHA20)
+            {
+                printf("Stream flags 0x%x are not supported in video\n", flags);
+                return y4m_failure;
+            }
+            if (!(y4mInfo->options.flags & STEG_FLAG_CHACHA20) || !y4mInfo->options.nonce_given)
+            {
+                printf("Secret data is encrypted, give --key=<hex> and --nonce=<hex>\n");
+                return y4m_failure;
+            }
+        }
+        else if (y4mInfo->head_len == fixed + 4)
+        {
+            uint extn_size = get_le32(head + fixed);
+            if (extn_size >= 10)
+            {
+                printf("Secret file extension size %u is not valid\n", extn_size);
+                return y4m_failure;
+            }
+            y4mInfo->head_need = fixed + 4 + extn_size + 4;
+        }
+        else if (y4mInfo->head_len == y4mInfo->head_need)
+        {
+            uint extn_size = y4mInfo->head_need - fixed - 8;
+            y4mInfo->data_left = get_le32(head + fixed + 4 + extn_size);
+            if (y4m_open_output(y4mInfo, fixed == 6 ? STEG_FLAG_CHACHA20 : 0,
+                                head + fixed + 4, extn_size) != y4m_success)
+            {
+                return y4m_failure;
+            }
+        }
+    }
+
+    // Step 2 : data bytes
+    if (y4mInfo->head_len == y4mInfo->head_need && i < len && y4mInfo->data_left > 0)
+    {
+        size_t n = len - i < (size_t)y4mInfo->data_left ? len - i : (size_t)y4mInfo->data_left;
+        unsigned char *data = (unsigned char *)stream + i;
+        if (memcmp(y4mInfo->head, MAGIC_STRING_EXT, 2) == 0)
+        {
+            for (size_t j = 0; j < n; j++)
+            {
+                data[j] ^= chacha20_next_byte(&y4mInfo->cipher);
+            }
+        }
+        if (fwrite(data, 1, n, y4mInfo->fptr_secret) != n)
+        {
+            return y4m_failure;
+        }
+        y4mInfo->data_left -= n;
+    }
+    return y4m_success;
+}
+
+/* Decode : complete a frame's stream bytes with the byte split across frames */
+static Y4mStatus y4m_consume_frame(Y4mInfo *y4mInfo, Y4mFrame *frame)
+{
+    unsigned char *stream = frame->stream;
+    size_t len = frame->stream_len;
+
+    if (frame->carrier_pos % 8 != 0)
+    {
+        stream[0] |= y4mInfo->pending;
+    }
+    if ((frame->carrier_pos + y4mInfo->frame_len) % 8 != 0)
+    {
+        y4mInfo->pending = stream[--len];
+    }
+    return y4m_take_stream(y4mInfo, stream, len);
+}
+
+/* Whether the decoder has written the whole secret */
+static int y4m_decode_done(const Y4mInfo *y4mInfo)
+{
+    return y4mInfo->decode && y4mInfo->head_len == y4mInfo->head_need && y4mInfo->data_left == 0;
+}
+
+/*
+ * Frame pipeline
+ * Description: The main thread reads frames into free slots of the
+ * ring (producing their stream bytes when encoding) and queues them,
+ * workers embed / extract, and the main thread writes (or consumes)
+ * the oldest slot once its worker is done, so frames leave in order
+ * and at most slots frames are in memory
+ */
+static Y4mStatus y4m_run(Y4mInfo *y4mInfo)
+{
+    Y4mStatus status = y4m_success;
+    unsigned long long carrier_pos = 0;
+    int oldest = 0, in_flight = 0, eof = 0;
+
+    pthread_mutex_init(&y4mInfo->lock, NULL);
+    pthread_cond_init(&y4mInfo->work, NULL);
+    pthread_cond_init(&y4mInfo->done, NULL);
+
+    pthread_t tid[Y4M_MAX_SLOTS];
+    int started = 0;
+    for (int t = 0; t < y4mInfo->threads; t++)
+    {
+        if (pthread_create(&tid[started], NULL, y4m_worker, y4mInfo) == 0)
+        {
+            started++;
+        }
+    }
+    if (started == 0)
+    {
+        status = y4m_failure;
+    }
+
+    while (status == y4m_success)
+    {
+        // Step 1 : fill the free slots
+        while (!eof && in_flight < y4mInfo->slots && !y4m_decode_done(y4mInfo))
+        {
+            Y4mFrame *frame = &y4mInfo->frame[(oldest + in_flight) % y4mInfo->slots];
+            if (y4m_read_frame(y4mInfo, frame) != y4m_success)
+            {
+                eof = 1;
+                break;
+            }
+            frame->carrier_pos = carrier_pos;
+            carrier_pos += y4mInfo->frame_len;
+            if (!y4mInfo->decode && y4m_fill_stream(y4mInfo, frame) != y4m_success)
+            {
+                status = y4m_failure;
+                break;
+            }
+
+            pthread_mutex_lock(&y4mInfo->lock);
+            frame->busy = 1;
+            y4mInfo->queue[(y4mInfo->queue_head + y4mInfo->queue_count) % Y4M_MAX_SLOTS] =
+                (int)(frame - y4mInfo->frame);
+            y4mInfo->queue_count++;
+            pthread_cond_signal(&y4mInfo->work);
+            pthread_mutex_unlock(&y4mInfo->lock);
+            in_flight++;
+        }
+        if (in_flight == 0)
+        {
+            break;
+        }
+
+        // Step 2 : wait for the oldest frame and pass it on
+        Y4mFrame *frame = &y4mInfo->frame[oldest];
+        pthread_mutex_lock(&y4mInfo->lock);
+        while (frame->busy)
+        {
+            pthread_cond_wait(&y4mInfo->done, &y4mInfo->lock);
+        }
+        pthread_mutex_unlock(&y4mInfo->lock);
+
+        if (!y4mInfo->decode)
+        {
+            if (fputs(frame->line, y4mInfo->fptr_dest) == EOF ||
+                fwrite(frame->data, 1, y4mInfo->frame_len, y4mInfo->fptr_dest) != y4mInfo->frame_len)
+            {
+                status = y4m_failure;
+            }
+        }
+        else if (!y4m_decode_done(y4mInfo))
+        {
+            if (y4m_consume_frame(y4mInfo, frame) != y4m_success)
+            {
+                status = y4m_failure;
+            }
+            y4mInfo->data_frames++;
+        }
+        y4mInfo->frames++;
+        oldest = (oldest + 1) % y4mInfo->slots;
+        in_flight--;
+    }
+
+    // Step 3 : let the workers finish what is queued and stop
+    pthread_mutex_lock(&y4mInfo->lock);
+    y4mInfo->closed = 1;
+    pthread_cond_broadcast(&y4mInfo->work);
+    pthread_mutex_unlock(&y4mInfo->lock);
+    for (int t = 0; t < started; t++)
+    {
+        pthread_join(tid[t], NULL);
+    }
+    pthread_mutex_destroy(&y4mInfo->lock);
+    pthread_cond_destroy(&y4mInfo->work);
+    pthread_cond_destroy(&y4mInfo->done);
+    return status;
+}
+
+/* Encode : stream header, and a capacity check when the video size is known */
+static Y4mStatus y4m_prepare_encode(Y4mInfo *y4mInfo)
+{
+    struct stat st;
+    if (fstat(fileno(y4mInfo->fptr_secret), &st) != 0 || st.st_size > 0xFFFFFFFFLL)
+    {
+        printf("Secret file size must fit in 32 bits\n");
+        return y4m_failure;
+    }
+    uint size = (uint)st.st_size;
+
+    // Extension of the secret, kept when it fits the decoder's field
+    const char *extn = strrchr(y4mInfo->secret_fname, '.');
+    const char *slash = strrchr(y4mInfo->secret_fname, '/');
+    if (extn == NULL || (slash != NULL && extn < slash) || strlen(extn) >= 10)
+    {
+        extn = "";
+    }
+    uint extn_size = strlen(extn);
+
+    // Same field order as a BMP stream
+    uint flags = y4mInfo->options.flags & STEG_FLAG_CHACHA20;
+    unsigned char *head = y4mInfo->head;
+    memcpy(head, flags ? MAGIC_STRING_EXT : MAGIC_STRING, 2);
+    uint n = 2;
+    if (flags)
+    {
+        put_le32(head + n, flags);
+        n += 4;
+        chacha20_init(&y4mInfo->cipher, y4mInfo->options.key, y4mInfo->options.nonce, 1);
+    }
+    put_le32(head + n, extn_size);
+    n += 4;
+    memcpy(head + n, extn, extn_size);
+    n += extn_size;
+    put_le32(head + n, size);
+    n += 4;
+    y4mInfo->head_len = y4mInfo->head_need = n;
+    y4mInfo->stream_len = (unsigned long long)n + size;
+
+    if (fstat(fileno(y4mInfo->fptr_src), &st) == 0 && S_ISREG(st.st_mode))
+    {
+        unsigned long long frames = (st.st_size - strlen(y4mInfo->header)) / (y4mInfo->frame_len + 6);
+        unsigned long long capacity = frames * y4mInfo->frame_len / 8;
+        if (capacity < y4mInfo->stream_len)
+        {
+            printf("Video holds %llu bytes, %llu needed\n", capacity, y4mInfo->stream_len);
+            return y4m_failure;
+        }
+    }
+    printf("Video %ux%u, %zu bytes per frame, %llu frames needed\n", y4mInfo->width, y4mInfo->height,
+           y4mInfo->frame_len, (y4mInfo->stream_len * 8 + y4mInfo->frame_len - 1) / y4mInfo->frame_len);
+    return y4m_success;
+}
+
+/* Read the arguments of --y4m, argv[2] is -e or -d */
+static Y4mStatus read_y4m_args(char *argv[], Y4mInfo *y4mInfo)
+{
+    int first;
+
+    y4mInfo->decode = argv[2] != NULL && strcmp(argv[2], "-d") == 0;
+    if (argv[2] == NULL || (!y4mInfo->decode && strcmp(argv[2], "-e") != 0) || argv[3] == NULL)
+    {
+        printf("Give arguments like this --> ./a.out --y4m -e src.y4m secret_file out.y4m\n");
+        printf("                          or ./a.out --y4m -d stego.y4m [output_file]\n");
+        return y4m_failure;
+    }
+    y4mInfo->src_fname = argv[3];
+    if (!y4mInfo->decode)
+    {
+        if (argv[4] == NULL || argv[5] == NULL || strncmp(argv[5], "--", 2) == 0)
+        {
+            printf("Missing secret file or output video\n");
+            return y4m_failure;
+        }
+        y4mInfo->secret_fname = argv[4];
+        y4mInfo->dest_fname = argv[5];
+        first = 6;
+    }
+    else
+    {
+        int named = argv[4] != NULL && strncmp(argv[4], "--", 2) != 0;
+        y4mInfo->secret_fname = named ? argv[4] : "decoded";
+        first = named ? 5 : 4;
+    }
+
+    y4mInfo->threads = tune_threads();
+    for (int i = first; argv[i] != NULL; i++)
+    {
+        if (strncmp(argv[i], "--threads=", 10) == 0)
+        {
+            y4mInfo->threads = atoi(argv[i] + 10);
+        }
+    }
+    if (y4mInfo->threads < 1)
+        y4mInfo->threads = 1;
+    if (y4mInfo->threads > Y4M_MAX_SLOTS / 2)
+        y4mInfo->threads = Y4M_MAX_SLOTS / 2;
+    y4mInfo->slots = 2 * y4mInfo->threads;
+
+    if (read_decode_options(argv, first, &y4mInfo->options) != d_success)
+    {
+        return y4m_failure;
+    }
+    if (y4mInfo->decode && y4mInfo->options.range_len > 0)
+    {
+        printf("Byte ranges cannot be decoded from video, decode the whole secret\n");
+        return y4m_failure;
+    }
+    if (!y4mInfo->decode && (y4mInfo->options.flags & STEG_FLAG_CHACHA20) && !y4mInfo->options.nonce_given)
+    {
+        printf("--key needs --nonce=<24 hex digits>, use a new nonce for every video\n");
+        return y4m_failure;
+    }
+    return y4m_success;
+}
+
+/* Open the files and the frame ring, then stream the frames */
+static Y4mStatus y4m_open_and_run(Y4mInfo *y4mInfo)
+{
+    // Step 1 : open the source video (and the secret / stego video when encoding)
+    y4mInfo->fptr_src = strcmp(y4mInfo->src_fname, "-") == 0 ? stdin : fopen(y4mInfo->src_fname, "rb");
+    if (y4mInfo->fptr_src == NULL)
+    {
+        perror(y4mInfo->src_fname);
+        return y4m_failure;
+    }
+    if (y4m_read_header(y4mInfo) != y4m_success)
+    {
+        return y4m_failure;
+    }
+    if (!y4mInfo->decode)
+    {
+        y4mInfo->fptr_secret = fopen(y4mInfo->secret_fname, "rb");
+        if (y4mInfo->fptr_secret == NULL)
+        {
+            perror(y4mInfo->secret_fname);
+            return y4m_failure;
+        }
+        if (y4m_prepare_encode(y4mInfo) != y4m_success)
+        {
+            return y4m_failure;
+        }
+        y4mInfo->fptr_dest = fopen(y4mInfo->dest_fname, "wb");
+        if (y4mInfo->fptr_dest == NULL || fputs(y4mInfo->header, y4mInfo->fptr_dest) == EOF)
+        {
+            perror(y4mInfo->dest_fname);
+            return y4m_failure;
+        }
+    }
+    else
+    {
+        y4mInfo->head_need = 2;
+    }
+
+    // Step 2 : frame buffers of the ring, fewer of them (and workers) when --mem-limit leaves no room
+    int slots = mem_slots(y4mInfo->frame_len + y4mInfo->frame_len / 8 + 2, y4mInfo->slots);
+    if (slots < y4mInfo->slots)
+    {
+        printf("Memory limit: %d frames in flight instead of %d\n", slots, y4mInfo->slots);
+        y4mInfo->slots = slots;
+        if (y4mInfo->threads > slots)
+        {
+            y4mInfo->threads = slots;
+        }
+    }
+    for (int i = 0; i < y4mInfo->slots; i++)
+    {
+        y4mInfo->frame[i].data = mem_alloc(y4mInfo->frame_len);
+        y4mInfo->frame[i].stream = mem_alloc(y4mInfo->frame_len / 8 + 2);
+        if (y4mInfo->frame[i].data == NULL || y4mInfo->frame[i].stream == NULL)
+        {
+            return y4m_failure;
+        }
+    }
+
+    // Step 3 : stream the frames
+    if (y4m_run(y4mInfo) != y4m_success)
+    {
+        return y4m_failure;
+    }
+    if (!y4mInfo->decode && y4mInfo->stream_next < y4mInfo->stream_len)
+    {
+        printf("Video too short, %llu of %llu bytes embedded\n", y4mInfo->stream_next, y4mInfo->stream_len);
+        return y4m_failure;
+    }
+    if (y4mInfo->decode && !y4m_decode_done(y4mInfo))
+    {
+        printf("Video ended before the whole secret was decoded\n");
+        return y4m_failure;
+    }
+    printf("%s %llu frames\n", y4mInfo->decode ? "Decoded from" : "Embedded across",
+           y4mInfo->decode ? y4mInfo->data_frames : y4mInfo->frames);
+    return y4m_success;
+}
+
+/*
+ * Run --y4m
+ * Description: Memory use depends on the frame size and thread count,
+ * never on the length of the video or of the secret
+ */
+Y4mStatus do_y4m(char *argv[])
+{
+    Y4mInfo *y4mInfo = mem_calloc(1, sizeof(Y4mInfo));
+
+    if (y4mInfo == NULL || read_y4m_args(argv, y4mInfo) != y4m_success)
+    {
+        mem_free(y4mInfo);
+        return y4m_failure;
+    }
+
+    Y4mStatus status = y4m_open_and_run(y4mInfo);
+    int dest_created = y4mInfo->fptr_dest != NULL;
+    int output_created = y4mInfo->decode && y4mInfo->fptr_secret != NULL;
+
+    for (int i = 0; i < y4mInfo->slots; i++)
+    {
+        mem_free(y4mInfo->frame[i].data);
+        mem_free(y4mInfo->frame[i].stream);
+    }
+    if (y4mInfo->fptr_src != NULL && y4mInfo->fptr_src != stdin)
+        fclose(y4mInfo->fptr_src);
+    if (y4mInfo->fptr_secret != NULL)
+        fclose(y4mInfo->fptr_secret);
+    if (y4mInfo->fptr_dest != NULL && fclose(y4mInfo->fptr_dest) != 0)
+        status = y4m_failure;
+
+    // A truncated stego video or partial secret is not left behind
+    if (status != y4m_success && dest_created)
+        unlink(y4mInfo->dest_fname);
+    if (status != y4m_success && output_created)
+        unlink(y4mInfo->output_fname);
+    mem_free(y4mInfo);
+    return status;
+}
@@ -0,0 +1,96 @@
+#ifndef Y4M_H
+#define Y4M_H
+#include <pthread.h>
+#include <stdio.h>
+
+#include "types.h"  // Contains user defined types
+#include "decode.h" // Key / nonce options
+#include "chacha20.h" // Keystream of encrypted data
+
+/*
+ * Y4M (YUV4MPEG2) video carrier
+ * The frame bytes of the video, taken in order as one long carrier,
+ * hold the same stream as a BMP pixel array: magic string (and flags),
+ * extension size, extension, secret size, secret data, one stream bit
+ * per carrier byte LSB. Frames are read, embedded / extracted by a
+ * worker pool and written in order, with at most Y4M_MAX_SLOTS frames
+ * in memory.
+ */
+
+/* Longest stream header / FRAME line kept */
+#define Y4M_LINE_MAX 1024
+
+/* Frames in flight, the ring is 2 per worker up to this */
+#define Y4M_MAX_SLOTS 16
+
+/* Stream header bytes before the data: magic, flags, extension size, extension, size */
+#define Y4M_HEAD_MAX (2 + 4 + 4 + 10 + 4)
+
+/* One frame of the ring */
+typedef struct _Y4mFrame
+{
+    char line[Y4M_LINE_MAX];         // To store the FRAME line with its parameters
+    unsigned char *data;             // To store the frame bytes
+    unsigned long long carrier_pos;  // To store the carrier index of data[0]
+    unsigned char *stream;           // To store the stream bytes covering the frame
+    unsigned long long stream_pos;   // To store the stream index of stream[0]
+    size_t stream_len;               // To store the number of bytes in stream
+    int busy;                        // To store whether a worker still owns the frame
+} Y4mFrame;
+
+/*
+ * Structure to store information required for
+ * streaming a secret file through a Y4M video
+ */
+
+typedef struct _Y4mInfo
+{
+    /* Files */
+    char *src_fname;          // To store the source video name ("-" for stdin)
+    FILE *fptr_src;           // To store the source video
+    char *secret_fname;       // To store the secret (encode) or output (decode) name
+    FILE *fptr_secret;        // To store the secret / output file
+    char *dest_fname;         // To store the stego video name (encode)
+    FILE *fptr_dest;          // To store the stego video
+    char output_fname[FILENAME_MAX]; // To store the output name with the decoded extension
+
+    /* Video */
+    char header[Y4M_LINE_MAX];      // To store the YUV4MPEG2 header line
+    uint width, height;             // To store the frame size
+    size_t frame_len;               // To store the bytes per frame
+    unsigned long long frames;      // To store the frames done
+    unsigned long long data_frames; // To store the frames that held stream bytes (decode)
+
+    /* Stream */
+    int decode;                          // To store the direction
+    DecodeInfo options;                  // To store the key / nonce and STEG_FLAG_* bits
+    unsigned char head[Y4M_HEAD_MAX];    // To store the stream header bytes
+    uint head_len, head_need;            // To store how many of them are known / needed
+    unsigned char pending;               // To store the stream byte split between two frames
+    ChaCha20Ctx cipher;                  // To store the keystream position of the data
+    unsigned long long stream_len;       // To store the stream length (header + data)
+    unsigned long long stream_next;      // To store the next stream byte to produce / consume
+    long data_left;                      // To store the secret bytes still to write (decode)
+
+    /* Workers */
+    int threads;
+    int slots;
+    Y4mFrame frame[Y4M_MAX_SLOTS];
+    int queue[Y4M_MAX_SLOTS];
+    int queue_head, queue_count, closed;
+    pthread_mutex_t lock;
+    pthread_cond_t work, done;
+} Y4mInfo;
+
+/* Y4M function prototype */
+
+/* Run --y4m -e <src.y4m> <secret> <out.y4m> / --y4m -d <stego.y4m> [output] with options */
+Y4mStatus do_y4m(char *argv[]);
+
+/* Read and parse the YUV4MPEG2 header line, set the frame size */
+Y4mStatus y4m_read_header(Y4mInfo *y4mInfo);
+
+/* Read the next FRAME line and frame bytes, y4m_failure at the end of the video */
+Y4mStatus y4m_read_frame(Y4mInfo *y4mInfo, Y4mFrame *frame);
+
+#endif